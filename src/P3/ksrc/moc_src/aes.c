@@ -27,6 +27,8 @@
 #include "debug_console.h"
 #include "aesalgo.h"
 #include "aes.h"
+#include "../p3kaesni.h"
+#include "../p3kbsaes.h"
 #ifdef __ENABLE_MOCANA_FIPS_MODULE__
 #include "fips.h"
 #endif
@@ -52,6 +54,10 @@ CreateAESCtx(MOC_SYM(hwAccelDescr hwAccelCtx) ubyte* keyMaterial, sbyte4 keyLeng
         {
             p3free(ctx);  ctx = NULL;
         }
+        else
+        {
+            p3aesni_key(ctx->rk, ctx->Nr, ctx->nk);
+        }
     }
 
     return ctx;
@@ -93,6 +99,24 @@ DoAES(MOC_SYM(hwAccelDescr hwAccelCtx) BulkCtx ctx, ubyte* data, sbyte4 dataLeng
         goto exit;
     }
 
+    /* Use the AES instructions if they are available and usable now */
+    if (p3aesni_on && pAesContext->mode == MODE_CBC &&
+        (0 != encrypt) == (0 != pAesContext->encrypt) &&
+        0 == p3aesni_cbc(pAesContext->nk, pAesContext->Nr, data, dataLength, encrypt, iv))
+    {
+        status = OK;
+        goto exit;
+    }
+
+    /* Otherwise use the constant time code if it is turned on */
+    if (p3bsaes_on && pAesContext->mode == MODE_CBC &&
+        (0 != encrypt) == (0 != pAesContext->encrypt) &&
+        0 == p3bsaes_cbc(pAesContext->nk, pAesContext->Nr, data, dataLength, encrypt, iv))
+    {
+        status = OK;
+        goto exit;
+    }
+
     if (encrypt)
         status = AESALGO_blockEncrypt(pAesContext, iv, data, 8 * dataLength, data, &retLength);
     else
@@ -52,6 +52,7 @@ typedef struct
     sbyte4              Nr;                             /* key-length-dependent number of rounds */
     ubyte4              rk[4*(AES_MAXNR + 1)];          /* key schedule */
     ubyte4              ek[4*(AES_MAXNR + 1)];          /* CFB1 key schedule (encryption only) */
+    ubyte               nk[16*(AES_MAXNR + 1)];         /* rk in byte order for the AES instructions */
 
 } aesCipherContext;
 
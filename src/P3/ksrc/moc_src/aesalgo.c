@@ -1312,6 +1312,82 @@ aesDecrypt(ubyte4 rk[/*4*(Nr + 1)*/], sbyte4 Nr, ubyte ct[16], ubyte pt[16])
 }
 
 
+/*------------------------------------------------------------------*/
+
+#ifndef __ENABLE_LLA_CAVIUM_HWXL__
+
+/* one full decryption round of a state (s) into (t) with round key (k) */
+#define AES_DROUND(t0, t1, t2, t3, s0, s1, s2, s3, k) \
+    t0 = Td0[(s0 >> 24)] ^ Td1[(s3 >> 16) & 0xff] ^ Td2[(s2 >> 8) & 0xff] ^ Td3[s1 & 0xff] ^ (k)[0]; \
+    t1 = Td0[(s1 >> 24)] ^ Td1[(s0 >> 16) & 0xff] ^ Td2[(s3 >> 8) & 0xff] ^ Td3[s2 & 0xff] ^ (k)[1]; \
+    t2 = Td0[(s2 >> 24)] ^ Td1[(s1 >> 16) & 0xff] ^ Td2[(s0 >> 8) & 0xff] ^ Td3[s3 & 0xff] ^ (k)[2]; \
+    t3 = Td0[(s3 >> 24)] ^ Td1[(s2 >> 16) & 0xff] ^ Td2[(s1 >> 8) & 0xff] ^ Td3[s0 & 0xff] ^ (k)[3]
+
+/* last decryption round of a state (t) with round key (k), one output word */
+#define AES_DLAST(t0, t1, t2, t3, k) \
+    ((Td4[(t0 >> 24)       ] & 0xff000000L) ^ \
+     (Td4[(t1 >> 16) & 0xff] & 0x00ff0000L) ^ \
+     (Td4[(t2 >>  8) & 0xff] & 0x0000ff00L) ^ \
+     (Td4[(t3      ) & 0xff] & 0x000000ffL) ^ (k))
+
+/*
+ * Decrypt two consecutive blocks.  The rounds of the two blocks are
+ * interleaved so the table lookups of one block overlap those of the
+ * other, which CBC decryption allows because the blocks do not depend
+ * on each other.
+ */
+static void
+aesDecrypt2(ubyte4 rk[/*4*(Nr + 1)*/], sbyte4 Nr, ubyte ct[32], ubyte pt[32])
+{
+    ubyte4 s0, s1, s2, s3, t0, t1, t2, t3;
+    ubyte4 u0, u1, u2, u3, v0, v1, v2, v3;
+    sbyte4 r;
+
+    s0 = GETU32(ct     ) ^ rk[0];
+    s1 = GETU32(ct +  4) ^ rk[1];
+    s2 = GETU32(ct +  8) ^ rk[2];
+    s3 = GETU32(ct + 12) ^ rk[3];
+    u0 = GETU32(ct + 16) ^ rk[0];
+    u1 = GETU32(ct + 20) ^ rk[1];
+    u2 = GETU32(ct + 24) ^ rk[2];
+    u3 = GETU32(ct + 28) ^ rk[3];
+
+    r = Nr >> 1;
+    for (;;)
+    {
+        AES_DROUND(t0, t1, t2, t3, s0, s1, s2, s3, rk + 4);
+        AES_DROUND(v0, v1, v2, v3, u0, u1, u2, u3, rk + 4);
+
+        rk += 8;
+        if (--r == 0) {
+            break;
+        }
+
+        AES_DROUND(s0, s1, s2, s3, t0, t1, t2, t3, rk);
+        AES_DROUND(u0, u1, u2, u3, v0, v1, v2, v3, rk);
+    }
+
+    s0 = AES_DLAST(t0, t3, t2, t1, rk[0]);
+    s1 = AES_DLAST(t1, t0, t3, t2, rk[1]);
+    s2 = AES_DLAST(t2, t1, t0, t3, rk[2]);
+    s3 = AES_DLAST(t3, t2, t1, t0, rk[3]);
+    u0 = AES_DLAST(v0, v3, v2, v1, rk[0]);
+    u1 = AES_DLAST(v1, v0, v3, v2, rk[1]);
+    u2 = AES_DLAST(v2, v1, v0, v3, rk[2]);
+    u3 = AES_DLAST(v3, v2, v1, v0, rk[3]);
+    PUTU32(pt     , s0);
+    PUTU32(pt +  4, s1);
+    PUTU32(pt +  8, s2);
+    PUTU32(pt + 12, s3);
+    PUTU32(pt + 16, u0);
+    PUTU32(pt + 20, u1);
+    PUTU32(pt + 24, u2);
+    PUTU32(pt + 28, u3);
+}
+
+#endif /* __ENABLE_LLA_CAVIUM_HWXL__ */
+
+
 /*------------------------------------------------------------------*/
 
 extern MSTATUS
@@ -1487,6 +1563,7 @@ AESALGO_blockDecrypt(aesCipherContext *pAesContext, ubyte* iv,
 {
     sbyte4  i, numBlocks;
     ubyte4  block[AES_BLOCK_SIZE/4];  /* use a ubyte4[] for alignment */
+    ubyte4  block2[AES_BLOCK_SIZE/2]; /* two blocks */
     MSTATUS status = OK;
 
     if ((NULL == pAesContext) || (NULL == input))
@@ -1526,9 +1603,29 @@ AESALGO_blockDecrypt(aesCipherContext *pAesContext, ubyte* iv,
 
         case MODE_CBC:
         {
+            i = numBlocks;
+#ifndef __ENABLE_LLA_CAVIUM_HWXL__
+            /* decrypt two blocks at a time, the output is written after
+               both cipher blocks are used so it can be in place */
+            for (; i >= 2; i -= 2)
+            {
+                sbyte4 j;
+
+                aesDecrypt2(pAesContext->rk, pAesContext->Nr, input, (ubyte*)block2);
+                for (j = 0; j < AES_BLOCK_SIZE; ++j)
+                {
+                    ((ubyte*)block2)[j] ^= iv[j];
+                    ((ubyte*)block2)[j + AES_BLOCK_SIZE] ^= input[j];
+                }
+                memcpy(iv, input + AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+                memcpy(outBuffer, block2, 2 * AES_BLOCK_SIZE);
+                input += 2 * AES_BLOCK_SIZE;
+                outBuffer += 2 * AES_BLOCK_SIZE;
+            }
+#endif
             if ( ((ubyte4) iv) & 3)
             {
-                for (i = numBlocks; i > 0; i--)
+                for (; i > 0; i--)
                 {
                     sbyte4 j;
 
@@ -1545,7 +1642,7 @@ AESALGO_blockDecrypt(aesCipherContext *pAesContext, ubyte* iv,
             }
             else
             {
-                for (i = numBlocks; i > 0; i--)
+                for (; i > 0; i--)
                 {
                     aesDecrypt(pAesContext->rk, pAesContext->Nr, input, (ubyte*) block);
 
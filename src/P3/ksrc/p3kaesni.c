@@ -0,0 +1,876 @@
+/**
+ * \file p3kaesni.c
+ * <h3>Protected Point to Point AES instruction file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * The AES instruction functions replace the AES table code for CBC
+ * encryption and decryption on x86 processors with the AES instructions.
+ * On ARM processors with the ARMv8 Crypto Extensions, CBC and CTR mode
+ * are passed to the ARM AES instruction functions.  The table code is
+ * still used on other processors, when the AES instructions are turned
+ * off, and when the FPU or NEON registers cannot be used in the current
+ * context.
+ *
+ * The AES instructions use the same round keys as the table code, in
+ * byte order.  The decryption key schedule of the table code is already
+ * in the form used by the AESDEC instruction (reversed, with the inverse
+ * MixColumns transform applied to the middle round keys).
+ *
+ * CBC encryption is serial within a buffer, so several buffers with
+ * independent keys can be encrypted together: one block of each buffer
+ * is in the AES unit at the same time, which hides the latency of the
+ * AES instructions.
+ *
+ * CTR mode counter blocks are independent, so p3AESNI_WAYS blocks of
+ * one buffer are encrypted together.
+ *
+ * On x86_64 processors that also have the PCLMULQDQ instruction, the
+ * AES-GCM data blocks are handled in one pass: the GHASH multiplication
+ * of one block is interleaved with the AES rounds of the next counter
+ * block, so the AES and carry-less multiply units work in parallel.
+ */
+
+#include "p3kbase.h"
+#include "p3kaesni.h"
+#include "p3karm.h"
+
+#ifdef CONFIG_X86
+#include <asm/cpufeature.h>
+#include <asm/i387.h>
+#endif
+
+/** Set when the AES instructions are used by DoAES */
+int p3aesni_on = 0;
+
+/** Set when the AES and PCLMULQDQ instructions are used for AES-GCM */
+int p3aesni_gcm_on = 0;
+
+static int p3aesni = 1;
+module_param(p3aesni, int, 0444);
+MODULE_PARM_DESC(p3aesni, "Use the AES instructions if the CPU has them (1 = on)");
+
+/**
+ * \par Function:
+ * p3aesni_detect
+ *
+ * \par Description:
+ * Determine if the AES instructions can be used.  This only checks
+ * the CPU features.  The caller enables the instructions by setting
+ * p3aesni_on after testing them.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - int: 1 if the AES instructions can be used, else 0
+ */
+
+int p3aesni_detect(void)
+{
+#ifdef CONFIG_X86
+	if (p3aesni && boot_cpu_has(X86_FEATURE_AES))
+		return (1);
+#else
+	if (p3aesni && p3karm_detect())
+		return (1);
+#endif
+	return (0);
+} /* end p3aesni_detect */
+
+/**
+ * \par Function:
+ * p3aesni_clmul
+ *
+ * \par Description:
+ * Determine if the AES-GCM function can be used.  This requires the AES
+ * and PCLMULQDQ instructions, and the 16 SSE registers of x86_64.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - int: 1 if the AES-GCM function can be used, else 0
+ */
+
+int p3aesni_clmul(void)
+{
+#ifdef CONFIG_X86_64
+	if (p3aesni && boot_cpu_has(X86_FEATURE_AES) &&
+			boot_cpu_has(X86_FEATURE_PCLMULQDQ))
+		return (1);
+#endif
+	return (0);
+} /* end p3aesni_clmul */
+
+/**
+ * \par Function:
+ * p3aesni_key
+ *
+ * \par Description:
+ * Convert a key schedule of the AES table code to the byte order used
+ * by the AES instructions.
+ *
+ * \par Inputs:
+ * - rk: The table code key schedule (4 * (nr + 1) words)
+ * - nr: The number of rounds
+ * - nk: The key schedule to be set (p3AESNI_KSIZE bytes)
+ *
+ * \par Outputs:
+ * - None
+ */
+
+void p3aesni_key(const unsigned int *rk, int nr, unsigned char *nk)
+{
+	int i;
+
+	for (i=0; i < 4 * (nr + 1); i++, nk += 4) {
+		nk[0] = (unsigned char) (rk[i] >> 24);
+		nk[1] = (unsigned char) (rk[i] >> 16);
+		nk[2] = (unsigned char) (rk[i] >> 8);
+		nk[3] = (unsigned char) rk[i];
+	}
+} /* end p3aesni_key */
+
+#ifdef CONFIG_X86
+/*
+ * p3AESNI_WAYS blocks are handled together, with the state of each
+ * block in xmm0 - xmm(p3AESNI_WAYS - 1), the round key or data in the
+ * next register and the CBC chain in the one after it.  For several
+ * buffers, the pointers are kept in memory, so the function does not
+ * need more general registers on i386 than on x86_64.
+ */
+#ifdef CONFIG_X86_64
+#define p3MB_EACH(M)	M(0) M(1) M(2) M(3) M(4) M(5) M(6) M(7)
+#define p3MB_CHAIN(M)	M(1, 0) M(2, 1) M(3, 2) M(4, 3) M(5, 4) M(6, 5) M(7, 6)
+#define p3MB_TMP		"%%xmm8"
+#define p3MB_IV			"%%xmm9"
+#define p3MB_LASTB		"7"
+#define p3MB_PSZ		"8"
+#define p3MB_KP			"+64"
+#define p3MB_SP			"+128"
+#define p3MB_IVP		"+192"
+#else
+#define p3MB_EACH(M)	M(0) M(1) M(2) M(3)
+#define p3MB_CHAIN(M)	M(1, 0) M(2, 1) M(3, 2)
+#define p3MB_TMP		"%%xmm4"
+#define p3MB_IV			"%%xmm5"
+#define p3MB_LASTB		"3"
+#define p3MB_PSZ		"4"
+#define p3MB_KP			"+16"
+#define p3MB_SP			"+32"
+#define p3MB_IVP		"+48"
+#endif
+
+#define p3DB_LOAD(i) \
+	"movdqu " #i "*16(%[data]), %%xmm" #i "\n\t" \
+	"pxor " p3MB_TMP ", %%xmm" #i "\n\t"
+#define p3DB_DEC(i) \
+	"aesdec " p3MB_TMP ", %%xmm" #i "\n\t"
+#define p3DB_LAST(i) \
+	"aesdeclast " p3MB_TMP ", %%xmm" #i "\n\t"
+#define p3DB_CHAIN(i, prev) \
+	"movdqu " #prev "*16(%[data]), " p3MB_IV "\n\t" \
+	"pxor " p3MB_IV ", %%xmm" #i "\n\t"
+#define p3DB_STORE(i) \
+	"movdqu %%xmm" #i ", " #i "*16(%[data])\n\t"
+
+/*
+ * CBC decrypt grps groups of p3AESNI_WAYS blocks of one buffer.  The
+ * cipher blocks of a group are read before the group is written, so
+ * the buffer is decrypted in place.  The FPU registers must be usable.
+ */
+static inline void p3aesni_cbc_dec(const unsigned char *nk, long nr,
+		unsigned char *data, long grps, unsigned char *iv)
+{
+	const unsigned char *k;
+	long n;
+
+	asm volatile(
+		"movdqu (%[iv]), " p3MB_IV "\n\t"
+		"1:\n\t"
+		"movdqu (%[nk]), " p3MB_TMP "\n\t"
+		p3MB_EACH(p3DB_LOAD)
+		"mov %[nk], %[k]\n\t"
+		"mov %[nr], %[n]\n\t"
+		"2:\n\t"
+		"add $16, %[k]\n\t"
+		"movdqu (%[k]), " p3MB_TMP "\n\t"
+		"dec %[n]\n\t"
+		"jz 3f\n\t"
+		p3MB_EACH(p3DB_DEC)
+		"jmp 2b\n\t"
+		"3:\n\t"
+		p3MB_EACH(p3DB_LAST)
+		"pxor " p3MB_IV ", %%xmm0\n\t"
+		p3MB_CHAIN(p3DB_CHAIN)
+		"movdqu " p3MB_LASTB "*16(%[data]), " p3MB_IV "\n\t"
+		p3MB_EACH(p3DB_STORE)
+		"add $(" p3MB_PSZ "*16), %[data]\n\t"
+		"dec %[grps]\n\t"
+		"jnz 1b\n\t"
+		"movdqu " p3MB_IV ", (%[iv])\n\t"
+		: [data] "+r" (data), [grps] "+r" (grps), [k] "=&r" (k),
+		  [n] "=&r" (n)
+		: [nk] "r" (nk), [nr] "rm" (nr), [iv] "r" (iv)
+		: "cc", "memory");
+} /* end p3aesni_cbc_dec */
+
+/*
+ * CBC encrypt blks blocks of one buffer.  The FPU registers must be
+ * usable.
+ */
+static inline void p3aesni_cbc_enc(const unsigned char *nk, long nr,
+		unsigned char *data, long blks, unsigned char *iv)
+{
+	const unsigned char *k;
+	long n;
+
+	// xmm0: chained state, xmm1: round key
+	asm volatile(
+		"movdqu (%[iv]), %%xmm0\n\t"
+		"1:\n\t"
+		"movdqu (%[data]), %%xmm1\n\t"
+		"pxor %%xmm1, %%xmm0\n\t"
+		"movdqu (%[nk]), %%xmm1\n\t"
+		"pxor %%xmm1, %%xmm0\n\t"
+		"mov %[nk], %[k]\n\t"
+		"mov %[nr], %[n]\n\t"
+		"2:\n\t"
+		"add $16, %[k]\n\t"
+		"movdqu (%[k]), %%xmm1\n\t"
+		"dec %[n]\n\t"
+		"jz 3f\n\t"
+		"aesenc %%xmm1, %%xmm0\n\t"
+		"jmp 2b\n\t"
+		"3:\n\t"
+		"aesenclast %%xmm1, %%xmm0\n\t"
+		"movdqu %%xmm0, (%[data])\n\t"
+		"add $16, %[data]\n\t"
+		"dec %[blks]\n\t"
+		"jnz 1b\n\t"
+		"movdqu %%xmm0, (%[iv])\n\t"
+		: [data] "+r" (data), [blks] "+r" (blks), [k] "=&r" (k),
+		  [n] "=&r" (n)
+		: [nk] "r" (nk), [nr] "rm" (nr), [iv] "r" (iv)
+		: "cc", "memory");
+} /* end p3aesni_cbc_enc */
+#endif
+
+/**
+ * \par Function:
+ * p3aesni_cbc
+ *
+ * \par Description:
+ * Encrypt or decrypt a buffer in place in CBC mode with the AES
+ * instructions.  As with the table code, the IV is set to the last
+ * cipher block.
+ *
+ * \par Inputs:
+ * - nk: The key schedule set by p3aesni_key
+ * - nr: The number of rounds
+ * - data: The buffer to be encrypted or decrypted
+ * - len: The size of the buffer, which must be a multiple of 16
+ * - encrypt: 1 to encrypt, 0 to decrypt
+ * - iv: The 16 byte IV
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0 = OK
+ *   - <0 = The AES instructions cannot be used, use the table code
+ */
+
+int p3aesni_cbc(const unsigned char *nk, int nr, unsigned char *data, int len,
+		int encrypt, unsigned char *iv)
+{
+#ifdef CONFIG_X86
+	long blks = len >> 4, grps;
+	const unsigned char *k;
+	long n;
+
+	if (blks <= 0 || !irq_fpu_usable())
+		return (-1);
+
+	kernel_fpu_begin();
+	if (encrypt) {
+		p3aesni_cbc_enc(nk, (long) nr, data, blks, iv);
+	} else if ((grps = blks / p3AESNI_WAYS) > 0) {
+		// Cipher blocks do not depend on each other, so decrypt them in groups
+		p3aesni_cbc_dec(nk, (long) nr, data, grps, iv);
+		data += grps * p3AESNI_WAYS * 16;
+		blks -= grps * p3AESNI_WAYS;
+	}
+	if (!encrypt && blks > 0) {
+		// xmm0: state, xmm1: round key, xmm2: previous and xmm3: current cipher block
+		asm volatile(
+			"movdqu (%[iv]), %%xmm2\n\t"
+			"1:\n\t"
+			"movdqu (%[data]), %%xmm3\n\t"
+			"movdqu (%[nk]), %%xmm1\n\t"
+			"movdqa %%xmm3, %%xmm0\n\t"
+			"pxor %%xmm1, %%xmm0\n\t"
+			"mov %[nk], %[k]\n\t"
+			"mov %[nr], %[n]\n\t"
+			"2:\n\t"
+			"add $16, %[k]\n\t"
+			"movdqu (%[k]), %%xmm1\n\t"
+			"dec %[n]\n\t"
+			"jz 3f\n\t"
+			"aesdec %%xmm1, %%xmm0\n\t"
+			"jmp 2b\n\t"
+			"3:\n\t"
+			"aesdeclast %%xmm1, %%xmm0\n\t"
+			"pxor %%xmm2, %%xmm0\n\t"
+			"movdqu %%xmm0, (%[data])\n\t"
+			"movdqa %%xmm3, %%xmm2\n\t"
+			"add $16, %[data]\n\t"
+			"dec %[blks]\n\t"
+			"jnz 1b\n\t"
+			"movdqu %%xmm2, (%[iv])\n\t"
+			: [data] "+r" (data), [blks] "+r" (blks), [k] "=&r" (k),
+			  [n] "=&r" (n)
+			: [nk] "r" (nk), [nr] "rm" ((long) nr), [iv] "r" (iv)
+			: "cc", "memory");
+	}
+	kernel_fpu_end();
+	return (0);
+#else
+	return (p3karm_cbc(nk, nr, data, len, encrypt, iv));
+#endif
+} /* end p3aesni_cbc */
+
+#ifdef CONFIG_X86
+/* Stream pointers: data, key schedule, data step and IV of each buffer */
+struct p3aesni_ways {
+	unsigned char		*data[p3AESNI_WAYS];
+	const unsigned char	*nk[p3AESNI_WAYS];
+	unsigned long		step[p3AESNI_WAYS];
+	unsigned char		*iv[p3AESNI_WAYS];
+};
+
+#define p3MB_IVLD(i) \
+	"mov " #i "*" p3MB_PSZ p3MB_IVP "(%[w]), %[p]\n\t" \
+	"movdqu (%[p]), %%xmm" #i "\n\t"
+#define p3MB_LOAD(i) \
+	"mov " #i "*" p3MB_PSZ "(%[w]), %[p]\n\t" \
+	"movdqu (%[p]), " p3MB_TMP "\n\t" \
+	"pxor " p3MB_TMP ", %%xmm" #i "\n\t" \
+	"mov " #i "*" p3MB_PSZ p3MB_KP "(%[w]), %[p]\n\t" \
+	"movdqu (%[p]), " p3MB_TMP "\n\t" \
+	"pxor " p3MB_TMP ", %%xmm" #i "\n\t"
+#define p3MB_ENC(i) \
+	"mov " #i "*" p3MB_PSZ p3MB_KP "(%[w]), %[p]\n\t" \
+	"movdqu (%[p],%[k]), " p3MB_TMP "\n\t" \
+	"aesenc " p3MB_TMP ", %%xmm" #i "\n\t"
+#define p3MB_LAST(i) \
+	"mov " #i "*" p3MB_PSZ p3MB_KP "(%[w]), %[p]\n\t" \
+	"movdqu (%[p],%[k]), " p3MB_TMP "\n\t" \
+	"aesenclast " p3MB_TMP ", %%xmm" #i "\n\t"
+#define p3MB_STORE(i) \
+	"mov " #i "*" p3MB_PSZ "(%[w]), %[p]\n\t" \
+	"movdqu %%xmm" #i ", (%[p])\n\t" \
+	"add " #i "*" p3MB_PSZ p3MB_SP "(%[w]), %[p]\n\t" \
+	"mov %[p], " #i "*" p3MB_PSZ "(%[w])\n\t"
+#define p3MB_IVST(i) \
+	"mov " #i "*" p3MB_PSZ p3MB_IVP "(%[w]), %[p]\n\t" \
+	"movdqu %%xmm" #i ", (%[p])\n\t"
+
+/*
+ * CBC encrypt blks blocks of each of the p3AESNI_WAYS buffers.  The
+ * buffers use the same number of rounds.  The FPU registers must be
+ * usable.
+ */
+static inline void p3aesni_cbc_ways(struct p3aesni_ways *w, long nr,
+		long blks)
+{
+	unsigned long p, k;
+	long n;
+
+	asm volatile(
+		p3MB_EACH(p3MB_IVLD)
+		"1:\n\t"
+		p3MB_EACH(p3MB_LOAD)
+		"mov $16, %[k]\n\t"
+		"mov %[nr], %[n]\n\t"
+		"dec %[n]\n\t"
+		"2:\n\t"
+		p3MB_EACH(p3MB_ENC)
+		"add $16, %[k]\n\t"
+		"dec %[n]\n\t"
+		"jnz 2b\n\t"
+		p3MB_EACH(p3MB_LAST)
+		p3MB_EACH(p3MB_STORE)
+		"dec %[blks]\n\t"
+		"jnz 1b\n\t"
+		p3MB_EACH(p3MB_IVST)
+		: [blks] "+rm" (blks), [p] "=&r" (p), [k] "=&r" (k), [n] "=&r" (n)
+		: [w] "r" (w), [nr] "rm" (nr)
+		: "cc", "memory");
+} /* end p3aesni_cbc_ways */
+#endif
+
+/**
+ * \par Function:
+ * p3aesni_cbc_multi
+ *
+ * \par Description:
+ * Encrypt several buffers in place in CBC mode with the AES
+ * instructions.  Up to p3AESNI_WAYS buffers with the same number of
+ * rounds are encrypted together, until the shortest of them is done.
+ * The IV of each buffer is set to its last cipher block.
+ *
+ * \par Inputs:
+ * - streams: The buffers, which are changed by this function
+ * - count: The number of buffers
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0 = OK
+ *   - <0 = The AES instructions cannot be used, use the table code
+ */
+
+int p3aesni_cbc_multi(p3aesni_stream *streams, int count)
+{
+#ifdef CONFIG_X86
+	struct p3aesni_ways w;
+	p3aesni_stream *way[p3AESNI_WAYS];
+	unsigned char pad[16], padiv[16];
+	long blks;
+	int i, j, n, nr;
+
+	if (count <= 0 || !irq_fpu_usable())
+		return (-1);
+
+	memset(pad, 0, sizeof(pad));
+	memset(padiv, 0, sizeof(padiv));
+	kernel_fpu_begin();
+	for (i=0; i < count; i++) {
+		while (streams[i].len >= 16) {
+			// Take the buffers with the same number of rounds
+			nr = streams[i].nr;
+			blks = streams[i].len >> 4;
+			way[0] = &streams[i];
+			for (j=i + 1, n=1; j < count && n < p3AESNI_WAYS; j++) {
+				if (streams[j].nr != nr || streams[j].len < 16)
+					continue;
+				way[n++] = &streams[j];
+				if ((streams[j].len >> 4) < blks)
+					blks = streams[j].len >> 4;
+			}
+			if (n == 1) {
+				p3aesni_cbc_enc(streams[i].nk, (long) nr, streams[i].data,
+						blks, streams[i].iv);
+				streams[i].len = 0;
+				break;
+			}
+			// Unused ways encrypt one pad block again and again
+			for (j=0; j < p3AESNI_WAYS; j++) {
+				if (j < n) {
+					w.data[j] = way[j]->data;
+					w.nk[j] = way[j]->nk;
+					w.step[j] = 16;
+					w.iv[j] = way[j]->iv;
+				} else {
+					w.data[j] = pad;
+					w.nk[j] = way[0]->nk;
+					w.step[j] = 0;
+					w.iv[j] = padiv;
+				}
+			}
+			p3aesni_cbc_ways(&w, (long) nr, blks);
+			for (j=0; j < n; j++) {
+				way[j]->data += blks << 4;
+				way[j]->len -= blks << 4;
+			}
+		}
+	}
+	kernel_fpu_end();
+	// The pad block was encrypted with a session key
+	memset(pad, 0, sizeof(pad));
+	memset(padiv, 0, sizeof(padiv));
+	return (0);
+#else
+	return (-1);
+#endif
+} /* end p3aesni_cbc_multi */
+
+#ifdef CONFIG_X86
+#define p3CT_LOAD(i) \
+	"movdqu " #i "*16(%[ctrs]), %%xmm" #i "\n\t" \
+	"pxor " p3MB_TMP ", %%xmm" #i "\n\t"
+#define p3CT_ENC(i) \
+	"aesenc " p3MB_TMP ", %%xmm" #i "\n\t"
+#define p3CT_LAST(i) \
+	"aesenclast " p3MB_TMP ", %%xmm" #i "\n\t"
+#define p3CT_XOR(i) \
+	"movdqu " #i "*16(%[data]), " p3MB_TMP "\n\t" \
+	"pxor " p3MB_TMP ", %%xmm" #i "\n\t" \
+	"movdqu %%xmm" #i ", " #i "*16(%[data])\n\t"
+
+/*
+ * Encrypt p3AESNI_WAYS counter blocks and xor them into the data.  The
+ * FPU registers must be usable.
+ */
+static inline void p3aesni_ctr_ways(const unsigned char *nk, long nr,
+		const unsigned char *ctrs, unsigned char *data)
+{
+	const unsigned char *k;
+	long n;
+
+	asm volatile(
+		"movdqu (%[nk]), " p3MB_TMP "\n\t"
+		p3MB_EACH(p3CT_LOAD)
+		"mov %[nk], %[k]\n\t"
+		"mov %[nr], %[n]\n\t"
+		"1:\n\t"
+		"add $16, %[k]\n\t"
+		"movdqu (%[k]), " p3MB_TMP "\n\t"
+		"dec %[n]\n\t"
+		"jz 2f\n\t"
+		p3MB_EACH(p3CT_ENC)
+		"jmp 1b\n\t"
+		"2:\n\t"
+		p3MB_EACH(p3CT_LAST)
+		p3MB_EACH(p3CT_XOR)
+		: [k] "=&r" (k), [n] "=&r" (n)
+		: [nk] "r" (nk), [nr] "rm" (nr), [ctrs] "r" (ctrs),
+		  [data] "r" (data)
+		: "cc", "memory");
+} /* end p3aesni_ctr_ways */
+#endif
+
+/**
+ * \par Function:
+ * p3aesni_ctr
+ *
+ * \par Description:
+ * Encrypt or decrypt a buffer of any size in place in CTR mode with the
+ * AES instructions.  The counter blocks do not depend on each other, so
+ * p3AESNI_WAYS blocks are encrypted together.  The last 4 bytes of the
+ * counter block are a big endian block counter, which is set to the
+ * next counter on return.
+ *
+ * \par Inputs:
+ * - nk: The encryption key schedule set by p3aesni_key
+ * - nr: The number of rounds
+ * - data: The buffer to be encrypted or decrypted
+ * - len: The size of the buffer
+ * - ctr: The 16 byte counter block
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0 = OK
+ *   - <0 = The AES instructions cannot be used, use the table code
+ */
+
+int p3aesni_ctr(const unsigned char *nk, int nr, unsigned char *data, int len,
+		unsigned char *ctr)
+{
+#ifdef CONFIG_X86
+	unsigned char ctrs[p3AESNI_WAYS][16], ks[p3AESNI_WAYS * 16];
+	unsigned int c;
+	int i, n;
+
+	if (len <= 0 || !irq_fpu_usable())
+		return (-1);
+
+	c = (ctr[12] << 24) | (ctr[13] << 16) | (ctr[14] << 8) | ctr[15];
+	kernel_fpu_begin();
+	while (len > 0) {
+		for (i=0; i < p3AESNI_WAYS; i++, c++) {
+			memcpy(ctrs[i], ctr, 12);
+			ctrs[i][12] = (unsigned char) (c >> 24);
+			ctrs[i][13] = (unsigned char) (c >> 16);
+			ctrs[i][14] = (unsigned char) (c >> 8);
+			ctrs[i][15] = (unsigned char) c;
+		}
+		if (len >= sizeof(ks)) {
+			p3aesni_ctr_ways(nk, (long) nr, ctrs[0], data);
+			data += sizeof(ks);
+			len -= sizeof(ks);
+			continue;
+		}
+		// The key stream of the last group is made in a work buffer
+		memset(ks, 0, sizeof(ks));
+		p3aesni_ctr_ways(nk, (long) nr, ctrs[0], ks);
+		for (i=0; i < len; i++)
+			data[i] ^= ks[i];
+		// Counters of unused blocks are not consumed
+		n = p3AESNI_WAYS - ((len + 15) >> 4);
+		c -= n;
+		len = 0;
+	}
+	kernel_fpu_end();
+	memset(ks, 0, sizeof(ks));
+	ctr[12] = (unsigned char) (c >> 24);
+	ctr[13] = (unsigned char) (c >> 16);
+	ctr[14] = (unsigned char) (c >> 8);
+	ctr[15] = (unsigned char) c;
+	return (0);
+#else
+	return (p3karm_ctr(nk, nr, data, len, ctr));
+#endif
+} /* end p3aesni_ctr */
+
+#ifdef CONFIG_X86_64
+/* Byte reversal mask and counter increment for the AES-GCM function */
+static const unsigned char p3aesni_bswap[16] = {
+	15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0
+};
+static const unsigned int p3aesni_one[4] = { 1, 0, 0, 0 };
+
+/*
+ * GHASH multiplication of xmm2 by xmm3 in the byte reversed form, with
+ * the result in xmm2 (carry-less multiply, shift for the reflected bit
+ * order and reduction modulo x^128 + x^7 + x^2 + x + 1).  It is split in
+ * four parts to be interleaved with AES rounds, and uses xmm7 - xmm14.
+ */
+#define p3GF_MUL1 \
+	"movdqa %%xmm2, %%xmm8\n\t" \
+	"pclmulqdq $0x00, %%xmm3, %%xmm8\n\t" \
+	"movdqa %%xmm2, %%xmm9\n\t" \
+	"pclmulqdq $0x10, %%xmm3, %%xmm9\n\t" \
+	"movdqa %%xmm2, %%xmm10\n\t" \
+	"pclmulqdq $0x01, %%xmm3, %%xmm10\n\t" \
+	"movdqa %%xmm2, %%xmm11\n\t" \
+	"pclmulqdq $0x11, %%xmm3, %%xmm11\n\t"
+#define p3GF_MUL2 \
+	"pxor %%xmm10, %%xmm9\n\t" \
+	"movdqa %%xmm9, %%xmm10\n\t" \
+	"pslldq $8, %%xmm10\n\t" \
+	"psrldq $8, %%xmm9\n\t" \
+	"pxor %%xmm10, %%xmm8\n\t" \
+	"pxor %%xmm9, %%xmm11\n\t" \
+	"movdqa %%xmm8, %%xmm12\n\t" \
+	"psrld $31, %%xmm12\n\t" \
+	"movdqa %%xmm11, %%xmm13\n\t" \
+	"psrld $31, %%xmm13\n\t" \
+	"pslld $1, %%xmm8\n\t" \
+	"pslld $1, %%xmm11\n\t" \
+	"movdqa %%xmm12, %%xmm14\n\t" \
+	"psrldq $12, %%xmm14\n\t" \
+	"pslldq $4, %%xmm13\n\t" \
+	"pslldq $4, %%xmm12\n\t" \
+	"por %%xmm12, %%xmm8\n\t" \
+	"por %%xmm13, %%xmm11\n\t" \
+	"por %%xmm14, %%xmm11\n\t"
+#define p3GF_MUL3 \
+	"movdqa %%xmm8, %%xmm12\n\t" \
+	"pslld $31, %%xmm12\n\t" \
+	"movdqa %%xmm8, %%xmm13\n\t" \
+	"pslld $30, %%xmm13\n\t" \
+	"movdqa %%xmm8, %%xmm14\n\t" \
+	"pslld $25, %%xmm14\n\t" \
+	"pxor %%xmm13, %%xmm12\n\t" \
+	"pxor %%xmm14, %%xmm12\n\t" \
+	"movdqa %%xmm12, %%xmm13\n\t" \
+	"psrldq $4, %%xmm13\n\t" \
+	"pslldq $12, %%xmm12\n\t" \
+	"pxor %%xmm12, %%xmm8\n\t"
+#define p3GF_MUL4 \
+	"movdqa %%xmm8, %%xmm7\n\t" \
+	"psrld $1, %%xmm7\n\t" \
+	"movdqa %%xmm8, %%xmm9\n\t" \
+	"psrld $2, %%xmm9\n\t" \
+	"movdqa %%xmm8, %%xmm10\n\t" \
+	"psrld $7, %%xmm10\n\t" \
+	"pxor %%xmm9, %%xmm7\n\t" \
+	"pxor %%xmm10, %%xmm7\n\t" \
+	"pxor %%xmm13, %%xmm7\n\t" \
+	"pxor %%xmm7, %%xmm8\n\t" \
+	"pxor %%xmm8, %%xmm11\n\t" \
+	"movdqa %%xmm11, %%xmm2\n\t"
+
+/*
+ * Start the AES encryption of the counter block in xmm4 (byte reversed)
+ * into xmm0, and increment the counter.
+ */
+#define p3GCM_CTR \
+	"movdqa %%xmm4, %%xmm0\n\t" \
+	"pshufb %%xmm5, %%xmm0\n\t" \
+	"paddd %%xmm15, %%xmm4\n\t" \
+	"movdqu (%[nk]), %%xmm1\n\t" \
+	"pxor %%xmm1, %%xmm0\n\t"
+
+/* Load the byte reversed hash key, hash state and counter */
+#define p3GCM_LOAD \
+	"movdqu (%[bs]), %%xmm5\n\t" \
+	"movdqu (%[one]), %%xmm15\n\t" \
+	"movdqu (%[hk]), %%xmm3\n\t" \
+	"pshufb %%xmm5, %%xmm3\n\t" \
+	"movdqu (%[x]), %%xmm2\n\t" \
+	"pshufb %%xmm5, %%xmm2\n\t" \
+	"movdqu (%[ctr]), %%xmm4\n\t" \
+	"pshufb %%xmm5, %%xmm4\n\t"
+
+/* Store the hash state and counter */
+#define p3GCM_STORE \
+	"pshufb %%xmm5, %%xmm2\n\t" \
+	"movdqu %%xmm2, (%[x])\n\t" \
+	"pshufb %%xmm5, %%xmm4\n\t" \
+	"movdqu %%xmm4, (%[ctr])\n\t"
+#endif
+
+/**
+ * \par Function:
+ * p3aesni_gcm
+ *
+ * \par Description:
+ * Encrypt or decrypt whole blocks of a buffer in place in AES-GCM mode,
+ * and add the cipher blocks to the GHASH state.  The counter and the
+ * GHASH state are in the byte order of the GCM specification, and are
+ * only changed if the function succeeds.
+ *
+ * \par Inputs:
+ * - nk: The encryption key schedule set by p3aesni_key
+ * - nr: The number of rounds
+ * - hk: The 16 byte hash key
+ * - data: The buffer to be encrypted or decrypted
+ * - len: The size of the buffer, which must be a multiple of 16
+ * - encrypt: 1 to encrypt, 0 to decrypt
+ * - ctr: The 16 byte counter block of the first data block
+ * - x: The 16 byte GHASH state
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0 = OK
+ *   - <0 = The instructions cannot be used, use the table code
+ */
+
+int p3aesni_gcm(const unsigned char *nk, int nr, const unsigned char *hk,
+		unsigned char *data, int len, int encrypt, unsigned char *ctr,
+		unsigned char *x)
+{
+#ifdef CONFIG_X86_64
+	long blks = len >> 4;
+	const unsigned char *k;
+	long n;
+
+	if (blks <= 0 || !irq_fpu_usable())
+		return (-1);
+
+	kernel_fpu_begin();
+	if (encrypt) {
+		// xmm0: counter block, xmm1: round key, xmm2: GHASH state,
+		// xmm3: hash key, xmm4: counter, xmm5: byte reversal mask.
+		// The first block is encrypted on its own, then the GHASH of
+		// each cipher block is done during the AES rounds of the next.
+		asm volatile(
+			p3GCM_LOAD
+			p3GCM_CTR
+			"mov %[nk], %[k]\n\t"
+			"mov %[nr], %[n]\n\t"
+			"1:\n\t"
+			"add $16, %[k]\n\t"
+			"movdqu (%[k]), %%xmm1\n\t"
+			"dec %[n]\n\t"
+			"jz 2f\n\t"
+			"aesenc %%xmm1, %%xmm0\n\t"
+			"jmp 1b\n\t"
+			"2:\n\t"
+			"aesenclast %%xmm1, %%xmm0\n\t"
+			"movdqu (%[data]), %%xmm1\n\t"
+			"pxor %%xmm1, %%xmm0\n\t"
+			"movdqu %%xmm0, (%[data])\n\t"
+			"add $16, %[data]\n\t"
+			"pshufb %%xmm5, %%xmm0\n\t"
+			"pxor %%xmm0, %%xmm2\n\t"
+			"dec %[blks]\n\t"
+			"jz 6f\n\t"
+			"3:\n\t"
+			p3GCM_CTR
+			"movdqu 16(%[nk]), %%xmm1\n\t"
+			p3GF_MUL1
+			"aesenc %%xmm1, %%xmm0\n\t"
+			"movdqu 32(%[nk]), %%xmm1\n\t"
+			p3GF_MUL2
+			"aesenc %%xmm1, %%xmm0\n\t"
+			"movdqu 48(%[nk]), %%xmm1\n\t"
+			p3GF_MUL3
+			"aesenc %%xmm1, %%xmm0\n\t"
+			p3GF_MUL4
+			"lea 48(%[nk]), %[k]\n\t"
+			"mov %[nr], %[n]\n\t"
+			"sub $3, %[n]\n\t"
+			"4:\n\t"
+			"add $16, %[k]\n\t"
+			"movdqu (%[k]), %%xmm1\n\t"
+			"dec %[n]\n\t"
+			"jz 5f\n\t"
+			"aesenc %%xmm1, %%xmm0\n\t"
+			"jmp 4b\n\t"
+			"5:\n\t"
+			"aesenclast %%xmm1, %%xmm0\n\t"
+			"movdqu (%[data]), %%xmm1\n\t"
+			"pxor %%xmm1, %%xmm0\n\t"
+			"movdqu %%xmm0, (%[data])\n\t"
+			"add $16, %[data]\n\t"
+			"pshufb %%xmm5, %%xmm0\n\t"
+			"pxor %%xmm0, %%xmm2\n\t"
+			"dec %[blks]\n\t"
+			"jnz 3b\n\t"
+			"6:\n\t"
+			p3GF_MUL1
+			p3GF_MUL2
+			p3GF_MUL3
+			p3GF_MUL4
+			p3GCM_STORE
+			: [data] "+r" (data), [blks] "+r" (blks), [k] "=&r" (k),
+			  [n] "=&r" (n)
+			: [nk] "r" (nk), [nr] "rm" ((long) nr), [hk] "r" (hk),
+			  [ctr] "r" (ctr), [x] "r" (x), [bs] "r" (p3aesni_bswap),
+			  [one] "r" (p3aesni_one)
+			: "cc", "memory");
+	} else {
+		// As for encryption, with xmm6: current cipher block.  The GHASH
+		// of each cipher block is done during its own AES rounds.
+		asm volatile(
+			p3GCM_LOAD
+			"1:\n\t"
+			"movdqu (%[data]), %%xmm6\n\t"
+			"movdqa %%xmm6, %%xmm1\n\t"
+			"pshufb %%xmm5, %%xmm1\n\t"
+			"pxor %%xmm1, %%xmm2\n\t"
+			p3GCM_CTR
+			"movdqu 16(%[nk]), %%xmm1\n\t"
+			p3GF_MUL1
+			"aesenc %%xmm1, %%xmm0\n\t"
+			"movdqu 32(%[nk]), %%xmm1\n\t"
+			p3GF_MUL2
+			"aesenc %%xmm1, %%xmm0\n\t"
+			"movdqu 48(%[nk]), %%xmm1\n\t"
+			p3GF_MUL3
+			"aesenc %%xmm1, %%xmm0\n\t"
+			p3GF_MUL4
+			"lea 48(%[nk]), %[k]\n\t"
+			"mov %[nr], %[n]\n\t"
+			"sub $3, %[n]\n\t"
+			"2:\n\t"
+			"add $16, %[k]\n\t"
+			"movdqu (%[k]), %%xmm1\n\t"
+			"dec %[n]\n\t"
+			"jz 3f\n\t"
+			"aesenc %%xmm1, %%xmm0\n\t"
+			"jmp 2b\n\t"
+			"3:\n\t"
+			"aesenclast %%xmm1, %%xmm0\n\t"
+			"pxor %%xmm6, %%xmm0\n\t"
+			"movdqu %%xmm0, (%[data])\n\t"
+			"add $16, %[data]\n\t"
+			"dec %[blks]\n\t"
+			"jnz 1b\n\t"
+			p3GCM_STORE
+			: [data] "+r" (data), [blks] "+r" (blks), [k] "=&r" (k),
+			  [n] "=&r" (n)
+			: [nk] "r" (nk), [nr] "rm" ((long) nr), [hk] "r" (hk),
+			  [ctr] "r" (ctr), [x] "r" (x), [bs] "r" (p3aesni_bswap),
+			  [one] "r" (p3aesni_one)
+			: "cc", "memory");
+	}
+	kernel_fpu_end();
+	return (0);
+#else
+	return (-1);
+#endif
+} /* end p3aesni_gcm */
+
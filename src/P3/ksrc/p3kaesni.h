@@ -0,0 +1,66 @@
+/**
+ * \file p3kaesni.h
+ * <h3>Protected Point to Point AES instruction header file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * The AES instruction functions encrypt and decrypt with the x86 AES
+ * instructions, or the ARMv8 Crypto Extensions for CBC and CTR mode,
+ * using the key schedules built by the AES table code.
+ * The AES-GCM function also uses the PCLMULQDQ instruction.
+ */
+
+#ifndef _p3kAESNI_H
+#define _p3kAESNI_H
+
+/*****  CONSTANTS  *****/
+
+#define p3AESNI_MAXNR	14		/**< Maximum number of AES rounds */
+#define p3AESNI_KSIZE	(16 * (p3AESNI_MAXNR + 1))	/**< Key schedule size */
+#ifdef CONFIG_X86_64
+#define p3AESNI_WAYS	8		/**< Buffers encrypted together */
+#else
+#define p3AESNI_WAYS	4		/**< Buffers encrypted together */
+#endif
+
+/*****  DATA DEFINITIONS  *****/
+
+typedef struct _p3aesni_stream p3aesni_stream;
+
+/**
+ * Structure:
+ * p3aesni_stream
+ *
+ * \par Description:
+ * A buffer to be encrypted by p3aesni_cbc_multi.
+ */
+
+struct _p3aesni_stream {
+	const unsigned char	*nk;	/**< Key schedule set by p3aesni_key */
+	int					nr;		/**< Number of rounds */
+	unsigned char		*data;	/**< Buffer, encrypted in place */
+	int					len;	/**< Size of the buffer (multiple of 16) */
+	unsigned char		*iv;	/**< 16 byte IV */
+};
+
+/*****  PROTOTYPES  *****/
+
+int p3aesni_detect(void);
+int p3aesni_clmul(void);
+void p3aesni_key(const unsigned int *rk, int nr, unsigned char *nk);
+int p3aesni_cbc(const unsigned char *nk, int nr, unsigned char *data, int len,
+		int encrypt, unsigned char *iv);
+int p3aesni_cbc_multi(p3aesni_stream *streams, int count);
+int p3aesni_ctr(const unsigned char *nk, int nr, unsigned char *data, int len,
+		unsigned char *ctr);
+int p3aesni_gcm(const unsigned char *nk, int nr, const unsigned char *hk,
+		unsigned char *data, int len, int encrypt, unsigned char *ctr,
+		unsigned char *x);
+
+/*****  EXTERNAL DEFINITIONS  *****/
+
+extern int p3aesni_on;
+extern int p3aesni_gcm_on;
+
+#endif /* _p3kAESNI_H */
+
@@ -0,0 +1,325 @@
+/**
+ * \file p3karm.c
+ * <h3>Protected Point to Point ARM AES instruction file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * The ARM AES instruction functions replace the AES table code for CBC
+ * and CTR mode on ARM processors with the ARMv8 Crypto Extensions, in
+ * both the 32 and 64 bit instruction sets.  The instructions use the
+ * NEON registers, so they are only built for kernels that let modules
+ * use NEON (CONFIG_KERNEL_MODE_NEON), and only used when NEON is usable
+ * in the current context.  Otherwise the bitsliced code or the table
+ * code is used.
+ *
+ * The instructions use the same round keys as the table code, in byte
+ * order, like the x86 AES instructions.  AESE adds the round key before
+ * SubBytes and ShiftRows, so a round is AESE with the round key and
+ * AESMC, and the last round key is added with an exclusive or.
+ * Decryption is the same with AESD and AESIMC, and the decryption key
+ * schedule of the table code.
+ *
+ * p3ARM_WAYS blocks are in the AES unit at the same time for CBC
+ * decryption and CTR mode, which hides the latency of the instructions.
+ * CBC encryption is serial, so each block is encrypted alone.
+ */
+
+#include "p3kbase.h"
+#include "p3kaesni.h"
+#include "p3karm.h"
+
+#if (defined(CONFIG_ARM) || defined(CONFIG_ARM64)) && \
+		defined(CONFIG_KERNEL_MODE_NEON)
+#define p3ARM_CE
+#include <linux/cpufeature.h>
+#include <asm/neon.h>
+#include <asm/simd.h>
+#endif
+
+/**
+ * \par Function:
+ * p3karm_detect
+ *
+ * \par Description:
+ * Determine if the ARM AES instructions can be used.  This only checks
+ * the CPU features.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - int: 1 if the AES instructions can be used, else 0
+ */
+
+int p3karm_detect(void)
+{
+#ifdef p3ARM_CE
+	if (cpu_have_feature(cpu_feature(AES)))
+		return (1);
+#endif
+	return (0);
+} /* end p3karm_detect */
+
+#ifdef p3ARM_CE
+/*
+ * The state of each block is in register 0 - 3 and the round key is in
+ * register 4.  The LLVM assembler does not take the crypto extension
+ * from .arch_extension, so the architecture is set as the kernel's own
+ * AES code does.
+ */
+#ifdef CONFIG_ARM64
+#define p3CE_ARCH		".arch armv8-a+crypto\n\t"
+#define p3CE_E(i) \
+	"aese v" #i ".16b, v4.16b\n\t" \
+	"aesmc v" #i ".16b, v" #i ".16b\n\t"
+#define p3CE_EL(i) \
+	"aese v" #i ".16b, v4.16b\n\t"
+#define p3CE_D(i) \
+	"aesd v" #i ".16b, v4.16b\n\t" \
+	"aesimc v" #i ".16b, v" #i ".16b\n\t"
+#define p3CE_DL(i) \
+	"aesd v" #i ".16b, v4.16b\n\t"
+#define p3CE_X(i) \
+	"eor v" #i ".16b, v" #i ".16b, v4.16b\n\t"
+#define p3CE_LDKI		"ld1 {v4.16b}, [%[k]], #16\n\t"
+#define p3CE_LDK		"ld1 {v4.16b}, [%[k]]\n\t"
+#define p3CE_BNE		"b.ne "
+#define p3CE_LD1		"ld1 {v0.16b}, [%[buf]]\n\t"
+#define p3CE_ST1		"st1 {v0.16b}, [%[buf]]\n\t"
+#define p3CE_LD4		"ld1 {v0.16b-v3.16b}, [%[buf]]\n\t"
+#define p3CE_ST4		"st1 {v0.16b-v3.16b}, [%[buf]]\n\t"
+#define p3CE_CLOBBER	"v0", "v1", "v2", "v3", "v4"
+#else
+#define p3CE_ARCH		".arch armv8-a\n\t.fpu crypto-neon-fp-armv8\n\t"
+#define p3CE_E(i) \
+	"aese.8 q" #i ", q4\n\t" \
+	"aesmc.8 q" #i ", q" #i "\n\t"
+#define p3CE_EL(i) \
+	"aese.8 q" #i ", q4\n\t"
+#define p3CE_D(i) \
+	"aesd.8 q" #i ", q4\n\t" \
+	"aesimc.8 q" #i ", q" #i "\n\t"
+#define p3CE_DL(i) \
+	"aesd.8 q" #i ", q4\n\t"
+#define p3CE_X(i) \
+	"veor q" #i ", q" #i ", q4\n\t"
+#define p3CE_LDKI		"vld1.8 {d8-d9}, [%[k]]!\n\t"
+#define p3CE_LDK		"vld1.8 {d8-d9}, [%[k]]\n\t"
+#define p3CE_BNE		"bne "
+#define p3CE_LD1		"vld1.8 {d0-d1}, [%[buf]]\n\t"
+#define p3CE_ST1		"vst1.8 {d0-d1}, [%[buf]]\n\t"
+#define p3CE_LD4 \
+	"vld1.8 {d0-d3}, [%[buf]]\n\t" \
+	"vld1.8 {d4-d7}, [%[buf2]]\n\t"
+#define p3CE_ST4 \
+	"vst1.8 {d0-d3}, [%[buf]]\n\t" \
+	"vst1.8 {d4-d7}, [%[buf2]]\n\t"
+#define p3CE_CLOBBER	"d0", "d1", "d2", "d3", "d4", "d5", "d6", "d7", \
+						"d8", "d9"
+#endif
+
+#define p3CE_EACH1(M)	M(0)
+#define p3CE_EACH4(M)	M(0) M(1) M(2) M(3)
+
+/*
+ * nr - 1 rounds with the round and mix instructions, the last round
+ * without the mix instruction, then the last round key.
+ */
+#define p3CE_ROUNDS(EACH, R, L) \
+	"mov %[k], %[nk]\n\t" \
+	"sub %[n], %[nr], #1\n\t" \
+	"1:\n\t" \
+	p3CE_LDKI \
+	EACH(R) \
+	"subs %[n], %[n], #1\n\t" \
+	p3CE_BNE "1b\n\t" \
+	p3CE_LDKI \
+	EACH(L) \
+	p3CE_LDK \
+	EACH(p3CE_X)
+
+/*
+ * Encrypt or decrypt one block in place.  NEON must be usable.
+ */
+static inline void p3ce_ecb1(const unsigned char *nk, long nr,
+		unsigned char *buf, int decrypt)
+{
+	const unsigned char *k;
+	long n;
+
+	if (decrypt)
+		asm volatile(
+			p3CE_ARCH
+			p3CE_LD1
+			p3CE_ROUNDS(p3CE_EACH1, p3CE_D, p3CE_DL)
+			p3CE_ST1
+			: [k] "=&r" (k), [n] "=&r" (n)
+			: [nk] "r" (nk), [nr] "r" (nr), [buf] "r" (buf)
+			: "cc", "memory", p3CE_CLOBBER);
+	else
+		asm volatile(
+			p3CE_ARCH
+			p3CE_LD1
+			p3CE_ROUNDS(p3CE_EACH1, p3CE_E, p3CE_EL)
+			p3CE_ST1
+			: [k] "=&r" (k), [n] "=&r" (n)
+			: [nk] "r" (nk), [nr] "r" (nr), [buf] "r" (buf)
+			: "cc", "memory", p3CE_CLOBBER);
+} /* end p3ce_ecb1 */
+
+/*
+ * Encrypt or decrypt p3ARM_WAYS blocks in place.  NEON must be usable.
+ */
+static inline void p3ce_ecb4(const unsigned char *nk, long nr,
+		unsigned char *buf, int decrypt)
+{
+	const unsigned char *k;
+	long n;
+	unsigned char *buf2 = buf + 32;
+
+	if (decrypt)
+		asm volatile(
+			p3CE_ARCH
+			p3CE_LD4
+			p3CE_ROUNDS(p3CE_EACH4, p3CE_D, p3CE_DL)
+			p3CE_ST4
+			: [k] "=&r" (k), [n] "=&r" (n)
+			: [nk] "r" (nk), [nr] "r" (nr), [buf] "r" (buf),
+			  [buf2] "r" (buf2)
+			: "cc", "memory", p3CE_CLOBBER);
+	else
+		asm volatile(
+			p3CE_ARCH
+			p3CE_LD4
+			p3CE_ROUNDS(p3CE_EACH4, p3CE_E, p3CE_EL)
+			p3CE_ST4
+			: [k] "=&r" (k), [n] "=&r" (n)
+			: [nk] "r" (nk), [nr] "r" (nr), [buf] "r" (buf),
+			  [buf2] "r" (buf2)
+			: "cc", "memory", p3CE_CLOBBER);
+} /* end p3ce_ecb4 */
+#endif
+
+/**
+ * \par Function:
+ * p3karm_cbc
+ *
+ * \par Description:
+ * Encrypt or decrypt a buffer in place in CBC mode with the ARM AES
+ * instructions.  The IV is set to the last cipher block.
+ *
+ * \par Inputs:
+ * - nk: The key schedule set by p3aesni_key, for the encryption
+ *   or decryption direction
+ * - nr: The number of rounds
+ * - data: The buffer to be encrypted or decrypted
+ * - len: The size of the buffer, which must be a multiple of 16
+ * - encrypt: 1 to encrypt, 0 to decrypt
+ * - iv: The 16 byte IV
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0 = OK
+ *   - <0 = NEON cannot be used now, use the table code
+ */
+
+int p3karm_cbc(const unsigned char *nk, int nr, unsigned char *data, int len,
+		int encrypt, unsigned char *iv)
+{
+#ifdef p3ARM_CE
+	int i, n;
+	unsigned char blk[16 * p3ARM_WAYS], chain[16];
+
+	if ((len & 0xf) || !may_use_simd())
+		return (-1);
+
+	kernel_neon_begin();
+	for ( ; len > 0; data += n, len -= n) {
+		if (encrypt) {
+			// Each block uses the previous cipher block
+			n = 16;
+			for (i=0; i < 16; i++)
+				data[i] ^= iv[i];
+			p3ce_ecb1(nk, (long) nr, data, 0);
+			memcpy(iv, data, 16);
+			continue;
+		}
+		n = (len < sizeof(blk)) ? len : sizeof(blk);
+		memset(blk, 0, sizeof(blk));
+		memcpy(blk, data, n);
+		p3ce_ecb4(nk, (long) nr, blk, 1);
+		// Go back from the end, so the previous cipher block is unchanged
+		memcpy(chain, &data[n - 16], 16);
+		for (i=n - 1; i >= 0; i--)
+			data[i] = blk[i] ^ ((i < 16) ? iv[i] : data[i - 16]);
+		memcpy(iv, chain, 16);
+	}
+	kernel_neon_end();
+	memset(blk, 0, sizeof(blk));
+	return (0);
+#else
+	return (-1);
+#endif
+} /* end p3karm_cbc */
+
+/**
+ * \par Function:
+ * p3karm_ctr
+ *
+ * \par Description:
+ * Encrypt or decrypt a buffer of any size in place in CTR mode with the
+ * ARM AES instructions.  The last 4 bytes of the counter block are a
+ * big endian block counter, which is set to the next counter on return.
+ *
+ * \par Inputs:
+ * - nk: The encryption key schedule set by p3aesni_key
+ * - nr: The number of rounds
+ * - data: The buffer to be encrypted or decrypted
+ * - len: The size of the buffer
+ * - ctr: The 16 byte counter block
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0 = OK
+ *   - <0 = NEON cannot be used now, use the table code
+ */
+
+int p3karm_ctr(const unsigned char *nk, int nr, unsigned char *data, int len,
+		unsigned char *ctr)
+{
+#ifdef p3ARM_CE
+	unsigned char ks[16 * p3ARM_WAYS];
+	unsigned int c;
+	int i, n;
+
+	if (len <= 0 || !may_use_simd())
+		return (-1);
+
+	c = (ctr[12] << 24) | (ctr[13] << 16) | (ctr[14] << 8) | ctr[15];
+	kernel_neon_begin();
+	for ( ; len > 0; data += n, len -= n) {
+		n = (len < sizeof(ks)) ? len : sizeof(ks);
+		// Counters of unused blocks are not consumed
+		for (i=0; i < n; i += 16, c++) {
+			memcpy(&ks[i], ctr, 12);
+			ks[i + 12] = (unsigned char) (c >> 24);
+			ks[i + 13] = (unsigned char) (c >> 16);
+			ks[i + 14] = (unsigned char) (c >> 8);
+			ks[i + 15] = (unsigned char) c;
+		}
+		p3ce_ecb4(nk, (long) nr, ks, 0);
+		for (i=0; i < n; i++)
+			data[i] ^= ks[i];
+	}
+	kernel_neon_end();
+	memset(ks, 0, sizeof(ks));
+	ctr[12] = (unsigned char) (c >> 24);
+	ctr[13] = (unsigned char) (c >> 16);
+	ctr[14] = (unsigned char) (c >> 8);
+	ctr[15] = (unsigned char) c;
+	return (0);
+#else
+	return (-1);
+#endif
+} /* end p3karm_ctr */
+
@@ -0,0 +1,28 @@
+/**
+ * \file p3karm.h
+ * <h3>Protected Point to Point ARM AES instruction header file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * The ARM AES instruction functions encrypt and decrypt with the ARMv8
+ * Crypto Extensions, using the key schedules built by the AES table
+ * code.  They are called through the AES instruction functions.
+ */
+
+#ifndef _p3kARM_H
+#define _p3kARM_H
+
+/*****  CONSTANTS  *****/
+
+#define p3ARM_WAYS		4		/**< Blocks encrypted together */
+
+/*****  PROTOTYPES  *****/
+
+int p3karm_detect(void);
+int p3karm_cbc(const unsigned char *nk, int nr, unsigned char *data, int len,
+		int encrypt, unsigned char *iv);
+int p3karm_ctr(const unsigned char *nk, int nr, unsigned char *data, int len,
+		unsigned char *ctr);
+
+#endif /* _p3kARM_H */
+
@@ -8,7 +8,12 @@
 #ifndef _p3k_BASE_H
 #define _p3k_BASE_H
 
+/* The known answer tests build the crypto code in user space */
+#ifdef p3TEST
+#include "p3ktest.h"
+#else
 #include "p3linux.h"
+#endif
 
 /*****  CONSTANTS  *****/
 
@@ -88,6 +93,39 @@
 
 /*****  MACROS  *****/
 
+/**
+ * Macros:
+ *   p3trace_prgs, p3trace_stru, p3trace_data
+ *
+ * Description:
+ *   Call a P3 trace event if its debugging category is set in p3DEBUG.
+ *   The trace events are defined in the system dependent trace header.
+ *   - p3trace_prgs: Progress (lookup, crypto, keys, rekey, control,
+ *     packet path steps)
+ *   - p3trace_stru: Structure values (obfuscation layout, system buffers)
+ *   - p3trace_data: Data values (packet data)
+ *
+ * Parameters:
+ *   - event: The event name without the p3_ prefix
+ *   - args: The event arguments
+ */
+
+#ifdef p3DBG_PRGS
+#define p3trace_prgs(event, args...)	trace_p3_##event(args)
+#else
+#define p3trace_prgs(event, args...)	do { } while (0)
+#endif
+#ifdef p3DBG_STRU
+#define p3trace_stru(event, args...)	trace_p3_##event(args)
+#else
+#define p3trace_stru(event, args...)	do { } while (0)
+#endif
+#ifdef p3DBG_DATA
+#define p3trace_data(event, args...)	trace_p3_##event(args)
+#else
+#define p3trace_data(event, args...)	do { } while (0)
+#endif
+
 /**
  * Macro:
  *   p3malloc
@@ -0,0 +1,602 @@
+/**
+ * \file p3kbsaes.c
+ * <h3>Protected Point to Point bitsliced AES file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * The bitsliced AES functions replace the AES table code for CBC and
+ * CTR mode on processors without AES instructions, mainly the ARM
+ * processors of the Android secondary.  The table code looks up the
+ * S-box and round tables with secret indexes, so its cache timing
+ * depends on the key and data.  The bitsliced code has no secret
+ * indexes or branches, so it runs in constant time.
+ *
+ * Two blocks are handled together.  Bit b of every byte of the two
+ * blocks is in word b of the state, at the position of the byte (16 *
+ * block + 4 * column + row), so each AES step is done with logic
+ * operations on the 8 words.  The S-box is the circuit of Boyar and
+ * Peralta, and the inverse S-box wraps it with the inverse affine
+ * transform.  Only integer registers are used, so the code can run in
+ * any context.
+ *
+ * The bitsliced code uses the same round keys as the table code, in
+ * byte order (the key schedule used by the AES instructions).  The
+ * decryption key schedule has the inverse MixColumns transform applied
+ * to the middle round keys, so decryption is done with the equivalent
+ * inverse cipher.
+ */
+
+#include "p3kbase.h"
+#include "p3kaesni.h"
+#include "p3kbsaes.h"
+
+/** Set when the bitsliced AES code is used by DoAES */
+int p3bsaes_on = 0;
+
+#if defined(CONFIG_ARM) || defined(CONFIG_ARM64)
+static int p3bsaes = 1;
+#else
+static int p3bsaes = 0;
+#endif
+module_param(p3bsaes, int, 0444);
+MODULE_PARM_DESC(p3bsaes, "Use the constant time AES code without AES instructions (1 = on)");
+
+/**
+ * \par Function:
+ * p3bsaes_detect
+ *
+ * \par Description:
+ * Determine if the bitsliced AES code should be used.  It is on by
+ * default for ARM processors, where it is used if the AES instructions
+ * cannot be used.  The caller enables the code by setting p3bsaes_on
+ * after testing it.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - int: 1 if the bitsliced AES code should be used, else 0
+ */
+
+int p3bsaes_detect(void)
+{
+	return (p3bsaes ? 1 : 0);
+} /* end p3bsaes_detect */
+
+/*
+ * Transpose an 8x8 bit matrix, with row i in byte i and column b in
+ * bit b of the byte.
+ */
+static inline unsigned long long p3bs_transpose(unsigned long long x)
+{
+	unsigned long long t;
+
+	t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+	x ^= t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+	x ^= t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+	x ^= t ^ (t << 28);
+	return (x);
+} /* end p3bs_transpose */
+
+/*
+ * Convert two blocks to the bitsliced state.
+ */
+static void p3bs_load(unsigned int *q, const unsigned char *in)
+{
+	int b, i, m;
+	unsigned long long x;
+
+	for (b=0; b < 8; b++)
+		q[b] = 0;
+	for (m=0; m < 4; m++, in += 8) {
+		x = 0;
+		for (i=7; i >= 0; i--)
+			x = (x << 8) | in[i];
+		x = p3bs_transpose(x);
+		for (b=0; b < 8; b++)
+			q[b] |= ((unsigned int) (x >> (8 * b)) & 0xff) << (8 * m);
+	}
+} /* end p3bs_load */
+
+/*
+ * Convert the bitsliced state to two blocks.
+ */
+static void p3bs_store(unsigned char *out, const unsigned int *q)
+{
+	int b, i, m;
+	unsigned long long x;
+
+	for (m=0; m < 4; m++, out += 8) {
+		x = 0;
+		for (b=7; b >= 0; b--)
+			x = (x << 8) | ((q[b] >> (8 * m)) & 0xff);
+		x = p3bs_transpose(x);
+		for (i=0; i < 8; i++)
+			out[i] = (unsigned char) (x >> (8 * i));
+	}
+} /* end p3bs_store */
+
+/*
+ * Apply the S-box to every byte of the state (Boyar and Peralta, "A
+ * depth-16 circuit for the AES S-box").
+ */
+static void p3bs_sbox(unsigned int *q)
+{
+	unsigned int x0, x1, x2, x3, x4, x5, x6, x7;
+	unsigned int y1, y2, y3, y4, y5, y6, y7, y8, y9;
+	unsigned int y10, y11, y12, y13, y14, y15, y16, y17, y18, y19;
+	unsigned int y20, y21;
+	unsigned int z0, z1, z2, z3, z4, z5, z6, z7, z8, z9;
+	unsigned int z10, z11, z12, z13, z14, z15, z16, z17;
+	unsigned int t0, t1, t2, t3, t4, t5, t6, t7, t8, t9;
+	unsigned int t10, t11, t12, t13, t14, t15, t16, t17, t18, t19;
+	unsigned int t20, t21, t22, t23, t24, t25, t26, t27, t28, t29;
+	unsigned int t30, t31, t32, t33, t34, t35, t36, t37, t38, t39;
+	unsigned int t40, t41, t42, t43, t44, t45, t46, t47, t48, t49;
+	unsigned int t50, t51, t52, t53, t54, t55, t56, t57, t58, t59;
+	unsigned int t60, t61, t62, t63, t64, t65, t66, t67;
+	unsigned int s0, s1, s2, s3, s4, s5, s6, s7;
+
+	x0 = q[7];
+	x1 = q[6];
+	x2 = q[5];
+	x3 = q[4];
+	x4 = q[3];
+	x5 = q[2];
+	x6 = q[1];
+	x7 = q[0];
+
+	// Top linear transform
+	y14 = x3 ^ x5;
+	y13 = x0 ^ x6;
+	y9 = x0 ^ x3;
+	y8 = x0 ^ x5;
+	t0 = x1 ^ x2;
+	y1 = t0 ^ x7;
+	y4 = y1 ^ x3;
+	y12 = y13 ^ y14;
+	y2 = y1 ^ x0;
+	y5 = y1 ^ x6;
+	y3 = y5 ^ y8;
+	t1 = x4 ^ y12;
+	y15 = t1 ^ x5;
+	y20 = t1 ^ x1;
+	y6 = y15 ^ x7;
+	y10 = y15 ^ t0;
+	y11 = y20 ^ y9;
+	y7 = x7 ^ y11;
+	y17 = y10 ^ y11;
+	y19 = y10 ^ y8;
+	y16 = t0 ^ y11;
+	y21 = y13 ^ y16;
+	y18 = x0 ^ y16;
+
+	// Non-linear section
+	t2 = y12 & y15;
+	t3 = y3 & y6;
+	t4 = t3 ^ t2;
+	t5 = y4 & x7;
+	t6 = t5 ^ t2;
+	t7 = y13 & y16;
+	t8 = y5 & y1;
+	t9 = t8 ^ t7;
+	t10 = y2 & y7;
+	t11 = t10 ^ t7;
+	t12 = y9 & y11;
+	t13 = y14 & y17;
+	t14 = t13 ^ t12;
+	t15 = y8 & y10;
+	t16 = t15 ^ t12;
+	t17 = t4 ^ t14;
+	t18 = t6 ^ t16;
+	t19 = t9 ^ t14;
+	t20 = t11 ^ t16;
+	t21 = t17 ^ y20;
+	t22 = t18 ^ y19;
+	t23 = t19 ^ y21;
+	t24 = t20 ^ y18;
+
+	t25 = t21 ^ t22;
+	t26 = t21 & t23;
+	t27 = t24 ^ t26;
+	t28 = t25 & t27;
+	t29 = t28 ^ t22;
+	t30 = t23 ^ t24;
+	t31 = t22 ^ t26;
+	t32 = t31 & t30;
+	t33 = t32 ^ t24;
+	t34 = t23 ^ t33;
+	t35 = t27 ^ t33;
+	t36 = t24 & t35;
+	t37 = t36 ^ t34;
+	t38 = t27 ^ t36;
+	t39 = t29 & t38;
+	t40 = t25 ^ t39;
+
+	t41 = t40 ^ t37;
+	t42 = t29 ^ t33;
+	t43 = t29 ^ t40;
+	t44 = t33 ^ t37;
+	t45 = t42 ^ t41;
+	z0 = t44 & y15;
+	z1 = t37 & y6;
+	z2 = t33 & x7;
+	z3 = t43 & y16;
+	z4 = t40 & y1;
+	z5 = t29 & y7;
+	z6 = t42 & y11;
+	z7 = t45 & y17;
+	z8 = t41 & y10;
+	z9 = t44 & y12;
+	z10 = t37 & y3;
+	z11 = t33 & y4;
+	z12 = t43 & y13;
+	z13 = t40 & y5;
+	z14 = t29 & y2;
+	z15 = t42 & y9;
+	z16 = t45 & y14;
+	z17 = t41 & y8;
+
+	// Bottom linear transform
+	t46 = z15 ^ z16;
+	t47 = z10 ^ z11;
+	t48 = z5 ^ z13;
+	t49 = z9 ^ z10;
+	t50 = z2 ^ z12;
+	t51 = z2 ^ z5;
+	t52 = z7 ^ z8;
+	t53 = z0 ^ z3;
+	t54 = z6 ^ z7;
+	t55 = z16 ^ z17;
+	t56 = z12 ^ t48;
+	t57 = t50 ^ t53;
+	t58 = z4 ^ t46;
+	t59 = z3 ^ t54;
+	t60 = t46 ^ t57;
+	t61 = z14 ^ t57;
+	t62 = t52 ^ t58;
+	t63 = t49 ^ t58;
+	t64 = z4 ^ t59;
+	t65 = t61 ^ t62;
+	t66 = z1 ^ t63;
+	s0 = t59 ^ t63;
+	s6 = t56 ^ ~t62;
+	s7 = t48 ^ ~t60;
+	t67 = t64 ^ t65;
+	s3 = t53 ^ t66;
+	s4 = t51 ^ t66;
+	s5 = t47 ^ t65;
+	s1 = t64 ^ ~s3;
+	s2 = t55 ^ ~t67;
+
+	q[7] = s0;
+	q[6] = s1;
+	q[5] = s2;
+	q[4] = s3;
+	q[3] = s4;
+	q[2] = s5;
+	q[1] = s6;
+	q[0] = s7;
+} /* end p3bs_sbox */
+
+/*
+ * Apply the inverse of the S-box affine transform to every byte.
+ */
+static void p3bs_invaffine(unsigned int *q)
+{
+	int i;
+	unsigned int n[8];
+
+	for (i=0; i < 8; i++)
+		n[i] = q[(i + 2) & 7] ^ q[(i + 5) & 7] ^ q[(i + 7) & 7];
+	for (i=0; i < 8; i++)
+		q[i] = n[i];
+	q[0] = ~q[0];
+	q[2] = ~q[2];
+} /* end p3bs_invaffine */
+
+/*
+ * Apply the inverse S-box to every byte of the state.  The S-box is the
+ * affine transform of the inverse, so the inverse S-box is the inverse
+ * affine transform on both sides of the S-box.
+ */
+static void p3bs_invsbox(unsigned int *q)
+{
+	p3bs_invaffine(q);
+	p3bs_sbox(q);
+	p3bs_invaffine(q);
+} /* end p3bs_invsbox */
+
+/*
+ * Rotate the bits of each 16 bit half right, which moves each byte of
+ * a block s positions back.
+ */
+#define p3BS_ROT16(x, s) \
+	((((x) >> (s)) & (0x0000ffffU >> (s)) * 0x00010001U) | \
+	(((x) << (16 - (s))) & ~((0x0000ffffU >> (s)) * 0x00010001U)))
+
+/*
+ * Rotate the bits of each nibble right, which moves each byte of a
+ * column k rows back.
+ */
+#define p3BS_ROT4(x, k) \
+	((((x) >> (k)) & (0xfU >> (k)) * 0x11111111U) | \
+	(((x) << (4 - (k))) & ~((0xfU >> (k)) * 0x11111111U)))
+
+#define p3BS_ROW(r)		(0x11111111U << (r))
+
+/*
+ * Rotate row r of the state left by r columns (ShiftRows).
+ */
+static void p3bs_shiftrows(unsigned int *q)
+{
+	int b;
+	unsigned int x;
+
+	for (b=0; b < 8; b++) {
+		x = q[b];
+		q[b] = (x & p3BS_ROW(0)) | p3BS_ROT16(x & p3BS_ROW(1), 4) |
+				p3BS_ROT16(x & p3BS_ROW(2), 8) | p3BS_ROT16(x & p3BS_ROW(3), 12);
+	}
+} /* end p3bs_shiftrows */
+
+/*
+ * Rotate row r of the state right by r columns (InvShiftRows).
+ */
+static void p3bs_invshiftrows(unsigned int *q)
+{
+	int b;
+	unsigned int x;
+
+	for (b=0; b < 8; b++) {
+		x = q[b];
+		q[b] = (x & p3BS_ROW(0)) | p3BS_ROT16(x & p3BS_ROW(1), 12) |
+				p3BS_ROT16(x & p3BS_ROW(2), 8) | p3BS_ROT16(x & p3BS_ROW(3), 4);
+	}
+} /* end p3bs_invshiftrows */
+
+/*
+ * Multiply every byte by x in GF(2^8).
+ */
+static void p3bs_xtime(unsigned int *q)
+{
+	unsigned int hi = q[7];
+
+	q[7] = q[6];
+	q[6] = q[5];
+	q[5] = q[4];
+	q[4] = q[3] ^ hi;
+	q[3] = q[2] ^ hi;
+	q[2] = q[1];
+	q[1] = q[0] ^ hi;
+	q[0] = hi;
+} /* end p3bs_xtime */
+
+/*
+ * Mix the columns of the state (MixColumns):
+ * b(r) = 2 * (a(r) + a(r+1)) + a(r+1) + a(r+2) + a(r+3)
+ */
+static void p3bs_mixcolumns(unsigned int *q)
+{
+	int b;
+	unsigned int t[8], r1;
+
+	for (b=0; b < 8; b++) {
+		r1 = p3BS_ROT4(q[b], 1);
+		t[b] = q[b] ^ r1;
+		q[b] = r1 ^ p3BS_ROT4(q[b], 2) ^ p3BS_ROT4(q[b], 3);
+	}
+	p3bs_xtime(t);
+	for (b=0; b < 8; b++)
+		q[b] ^= t[b];
+} /* end p3bs_mixcolumns */
+
+/*
+ * Unmix the columns of the state (InvMixColumns), which is MixColumns
+ * after a(r) = a(r) + 4 * (a(r) + a(r+2)).
+ */
+static void p3bs_invmixcolumns(unsigned int *q)
+{
+	int b;
+	unsigned int t[8];
+
+	for (b=0; b < 8; b++)
+		t[b] = q[b] ^ p3BS_ROT4(q[b], 2);
+	p3bs_xtime(t);
+	p3bs_xtime(t);
+	for (b=0; b < 8; b++)
+		q[b] ^= t[b];
+	p3bs_mixcolumns(q);
+} /* end p3bs_invmixcolumns */
+
+/*
+ * Convert a key schedule to bitsliced round keys, with each round key
+ * in both blocks.
+ */
+static void p3bs_key(const unsigned char *nk, int nr, unsigned int sk[][8])
+{
+	int i;
+	unsigned char k[32];
+
+	for (i=0; i <= nr; i++, nk += 16) {
+		memcpy(k, nk, 16);
+		memcpy(&k[16], nk, 16);
+		p3bs_load(sk[i], k);
+	}
+	memset(k, 0, sizeof(k));
+} /* end p3bs_key */
+
+static inline void p3bs_addkey(unsigned int *q, const unsigned int *k)
+{
+	int b;
+
+	for (b=0; b < 8; b++)
+		q[b] ^= k[b];
+} /* end p3bs_addkey */
+
+/*
+ * Encrypt the two blocks of a state.
+ */
+static void p3bs_encrypt(unsigned int sk[][8], int nr, unsigned int *q)
+{
+	int i;
+
+	p3bs_addkey(q, sk[0]);
+	for (i=1; i < nr; i++) {
+		p3bs_sbox(q);
+		p3bs_shiftrows(q);
+		p3bs_mixcolumns(q);
+		p3bs_addkey(q, sk[i]);
+	}
+	p3bs_sbox(q);
+	p3bs_shiftrows(q);
+	p3bs_addkey(q, sk[nr]);
+} /* end p3bs_encrypt */
+
+/*
+ * Decrypt the two blocks of a state with a decryption key schedule.
+ */
+static void p3bs_decrypt(unsigned int sk[][8], int nr, unsigned int *q)
+{
+	int i;
+
+	p3bs_addkey(q, sk[0]);
+	for (i=1; i < nr; i++) {
+		p3bs_invsbox(q);
+		p3bs_invshiftrows(q);
+		p3bs_invmixcolumns(q);
+		p3bs_addkey(q, sk[i]);
+	}
+	p3bs_invsbox(q);
+	p3bs_invshiftrows(q);
+	p3bs_addkey(q, sk[nr]);
+} /* end p3bs_decrypt */
+
+/**
+ * \par Function:
+ * p3bsaes_cbc
+ *
+ * \par Description:
+ * Encrypt or decrypt a buffer in place in CBC mode with the bitsliced
+ * AES code.  CBC encryption is serial, so each block is encrypted
+ * alone.  CBC decryption does not depend on the previous result, so
+ * two blocks are decrypted together.  The IV is set to the last cipher
+ * block.
+ *
+ * \par Inputs:
+ * - nk: The key schedule set by p3aesni_key, for the encryption
+ *   or decryption direction
+ * - nr: The number of rounds
+ * - data: The buffer to be encrypted or decrypted
+ * - len: The size of the buffer, which must be a multiple of 16
+ * - encrypt: 1 to encrypt, 0 to decrypt
+ * - iv: The 16 byte IV
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0 = OK
+ *   - <0 = The buffer cannot be handled, use the table code
+ */
+
+int p3bsaes_cbc(const unsigned char *nk, int nr, unsigned char *data, int len,
+		int encrypt, unsigned char *iv)
+{
+	int i, n;
+	unsigned int sk[p3AESNI_MAXNR + 1][8], q[8];
+	unsigned char blk[16 * p3BSAES_BLKS], chain[16];
+
+	if ((len & 0xf) || nr > p3AESNI_MAXNR)
+		return (-1);
+
+	p3bs_key(nk, nr, sk);
+	for ( ; len > 0; data += n, len -= n) {
+		if (encrypt) {
+			// Each block uses the previous cipher block
+			n = 16;
+			for (i=0; i < 16; i++)
+				blk[i] = blk[i + 16] = data[i] ^ iv[i];
+			p3bs_load(q, blk);
+			p3bs_encrypt(sk, nr, q);
+			p3bs_store(blk, q);
+			memcpy(data, blk, 16);
+			memcpy(iv, blk, 16);
+			continue;
+		}
+		// A single last block is decrypted in both halves of the state
+		n = (len < sizeof(blk)) ? 16 : sizeof(blk);
+		memcpy(blk, data, 16);
+		memcpy(&blk[16], &data[n - 16], 16);
+		p3bs_load(q, blk);
+		p3bs_decrypt(sk, nr, q);
+		p3bs_store(blk, q);
+		// Go back from the end, so the previous cipher block is unchanged
+		memcpy(chain, &data[n - 16], 16);
+		for (i=n - 1; i >= 0; i--)
+			data[i] = blk[i] ^ ((i < 16) ? iv[i] : data[i - 16]);
+		memcpy(iv, chain, 16);
+	}
+	memset(sk, 0, sizeof(sk));
+	memset(q, 0, sizeof(q));
+	memset(blk, 0, sizeof(blk));
+	return (0);
+} /* end p3bsaes_cbc */
+
+/**
+ * \par Function:
+ * p3bsaes_ctr
+ *
+ * \par Description:
+ * Encrypt or decrypt a buffer of any size in place in CTR mode with the
+ * bitsliced AES code.  Two counter blocks are encrypted together.  The
+ * last 4 bytes of the counter block are a big endian block counter,
+ * which is set to the next counter on return.
+ *
+ * \par Inputs:
+ * - nk: The encryption key schedule set by p3aesni_key
+ * - nr: The number of rounds
+ * - data: The buffer to be encrypted or decrypted
+ * - len: The size of the buffer
+ * - ctr: The 16 byte counter block
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0 = OK
+ *   - <0 = The buffer cannot be handled, use the table code
+ */
+
+int p3bsaes_ctr(const unsigned char *nk, int nr, unsigned char *data, int len,
+		unsigned char *ctr)
+{
+	int i, n;
+	unsigned int sk[p3AESNI_MAXNR + 1][8], q[8];
+	unsigned char ks[16 * p3BSAES_BLKS];
+
+	if (nr > p3AESNI_MAXNR)
+		return (-1);
+
+	p3bs_key(nk, nr, sk);
+	for ( ; len > 0; data += n, len -= n) {
+		memcpy(ks, ctr, 16);
+		for (i=15; i >= 12 && ++ctr[i] == 0; i--)
+			;
+		memcpy(&ks[16], ctr, 16);
+		p3bs_load(q, ks);
+		p3bs_encrypt(sk, nr, q);
+		p3bs_store(ks, q);
+		n = (len < sizeof(ks)) ? len : sizeof(ks);
+		for (i=0; i < n; i++)
+			data[i] ^= ks[i];
+		// The second counter is only used if there is a second block
+		if (n > 16) {
+			for (i=15; i >= 12 && ++ctr[i] == 0; i--)
+				;
+		}
+	}
+	memset(sk, 0, sizeof(sk));
+	memset(q, 0, sizeof(q));
+	memset(ks, 0, sizeof(ks));
+	return (0);
+} /* end p3bsaes_ctr */
+
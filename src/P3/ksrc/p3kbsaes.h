@@ -0,0 +1,31 @@
+/**
+ * \file p3kbsaes.h
+ * <h3>Protected Point to Point bitsliced AES header file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * The bitsliced AES functions encrypt and decrypt in constant time
+ * without tables, using the key schedules built by the AES table code.
+ */
+
+#ifndef _p3kBSAES_H
+#define _p3kBSAES_H
+
+/*****  CONSTANTS  *****/
+
+#define p3BSAES_BLKS	2		/**< Blocks encrypted together */
+
+/*****  PROTOTYPES  *****/
+
+int p3bsaes_detect(void);
+int p3bsaes_cbc(const unsigned char *nk, int nr, unsigned char *data, int len,
+		int encrypt, unsigned char *iv);
+int p3bsaes_ctr(const unsigned char *nk, int nr, unsigned char *data, int len,
+		unsigned char *ctr);
+
+/*****  EXTERNAL DEFINITIONS  *****/
+
+extern int p3bsaes_on;
+
+#endif /* _p3kBSAES_H */
+
@@ -0,0 +1,432 @@
+/**
+ * \file p3kcapi.c
+ * <h3>Protected Point to Point kernel crypto API file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * The kernel crypto API provider uses the "cbc(aes)" synchronous block
+ * cipher of the Linux kernel, so the best AES implementation registered
+ * with the kernel is used.  One transform is used for each context.
+ * AES-GCM contexts use the "gcm(aes)" synchronous AEAD cipher, if the
+ * kernel has it.  This kernel has no ChaCha20-Poly1305 cipher, so the
+ * CHACHA20 key type needs the Mocana provider.
+ *
+ * Allocating a transform may sleep, but session keys are changed in the
+ * packet path.  A list of unkeyed spare transforms is allocated at
+ * module initialization and refilled by a work item, and released
+ * transforms are freed by the same work item.  Every rekey takes four
+ * transforms, so the number kept is doubled each time the list runs
+ * out, up to p3KAPI_SPARE_MAX.  If there are no spare transforms,
+ * creating a context fails and the epoch uses the built in provider.
+ */
+
+#include "p3kbase.h"
+#include "p3kcrypto.h"
+#include "p3kcapi.h"
+
+#include <linux/crypto.h>
+#include <linux/scatterlist.h>
+#include <linux/err.h>
+
+/**
+ * Structure:
+ * p3kapi_ctx
+ *
+ * \par Description:
+ * A kernel crypto API context.
+ */
+
+typedef struct _p3kapi_ctx p3kapi_ctx;
+
+struct _p3kapi_ctx {
+	struct list_head		list;	/**< Spare or released list entry */
+	struct crypto_blkcipher	*tfm;	/**< The cipher transform */
+	struct crypto_aead		*atfm;	/**< The AEAD transform */
+};
+
+static LIST_HEAD(p3kapi_spare);
+static LIST_HEAD(p3kapi_aspare);
+static LIST_HEAD(p3kapi_dead);
+static DEFINE_SPINLOCK(p3kapi_lock);
+static struct work_struct p3kapi_work;
+static int p3kapi_count = 0;
+static int p3kapi_acount = 0;
+static int p3kapi_want = p3KAPI_SPARE;	/**< Spare transforms to keep */
+static int p3kapi_run = 0;
+static int p3kapi_gcm = 0;		/**< Set if the kernel has the AEAD cipher */
+
+/**
+ * \par Function:
+ * p3kapi_fill
+ *
+ * \par Description:
+ * Free the released transforms and allocate spare transforms.  This
+ * runs in process context.
+ *
+ * \par Inputs:
+ * - work: The work item (not used)
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3kapi_fill(struct work_struct *work)
+{
+	LIST_HEAD(dead);
+	p3kapi_ctx *ctx, *next;
+	struct crypto_blkcipher *tfm;
+	struct crypto_aead *atfm;
+
+	// Free the released transforms
+	spin_lock_bh(&p3kapi_lock);
+	list_splice_init(&p3kapi_dead, &dead);
+	spin_unlock_bh(&p3kapi_lock);
+	list_for_each_entry_safe(ctx, next, &dead, list) {
+		list_del(&ctx->list);
+		if (ctx->atfm != NULL)
+			crypto_free_aead(ctx->atfm);
+		else
+			crypto_free_blkcipher(ctx->tfm);
+		kfree(ctx);
+	}
+
+	// Allocate spare transforms
+	while (p3kapi_run && p3kapi_count < ACCESS_ONCE(p3kapi_want)) {
+		if ((ctx = (p3kapi_ctx *) kmalloc(sizeof(p3kapi_ctx), GFP_KERNEL)) == NULL)
+			break;
+		tfm = crypto_alloc_blkcipher(p3KAPI_ALG, 0, CRYPTO_ALG_ASYNC);
+		if (IS_ERR(tfm)) {
+			kfree(ctx);
+			break;
+		}
+		ctx->tfm = tfm;
+		ctx->atfm = NULL;
+		spin_lock_bh(&p3kapi_lock);
+		list_add_tail(&ctx->list, &p3kapi_spare);
+		p3kapi_count++;
+		spin_unlock_bh(&p3kapi_lock);
+	}
+	while (p3kapi_run && p3kapi_gcm && p3kapi_acount < ACCESS_ONCE(p3kapi_want)) {
+		if ((ctx = (p3kapi_ctx *) kmalloc(sizeof(p3kapi_ctx), GFP_KERNEL)) == NULL)
+			break;
+		atfm = crypto_alloc_aead(p3KAPI_AEAD, 0, CRYPTO_ALG_ASYNC);
+		if (IS_ERR(atfm)) {
+			kfree(ctx);
+			break;
+		}
+		ctx->tfm = NULL;
+		ctx->atfm = atfm;
+		spin_lock_bh(&p3kapi_lock);
+		list_add_tail(&ctx->list, &p3kapi_aspare);
+		p3kapi_acount++;
+		spin_unlock_bh(&p3kapi_lock);
+	}
+} /* end p3kapi_fill */
+
+/**
+ * \par Function:
+ * p3kapi_cleanup
+ *
+ * \par Description:
+ * Stop the kernel crypto API provider and free the spare transforms.
+ * All contexts must have been released.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3kapi_cleanup(void)
+{
+	p3kapi_run = 0;
+	cancel_work_sync(&p3kapi_work);
+	spin_lock_bh(&p3kapi_lock);
+	list_splice_init(&p3kapi_spare, &p3kapi_dead);
+	list_splice_init(&p3kapi_aspare, &p3kapi_dead);
+	p3kapi_count = 0;
+	p3kapi_acount = 0;
+	p3kapi_want = p3KAPI_SPARE;
+	spin_unlock_bh(&p3kapi_lock);
+	p3kapi_fill(NULL);
+} /* end p3kapi_cleanup */
+
+/**
+ * \par Function:
+ * p3kapi_init
+ *
+ * \par Description:
+ * Start the kernel crypto API provider by allocating the spare
+ * transforms.  AEAD transforms are only used if the first one can
+ * be allocated.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: The cipher is not available
+ */
+
+static int p3kapi_init(void)
+{
+	int stat = 0;
+
+	INIT_WORK(&p3kapi_work, p3kapi_fill);
+	p3kapi_run = 1;
+	p3kapi_gcm = 1;
+	p3kapi_fill(NULL);
+	if (p3kapi_acount == 0)
+		p3kapi_gcm = 0;
+	if (p3kapi_count < p3KAPI_SPARE) {
+		p3kapi_cleanup();
+		stat = -1;
+	}
+	return (stat);
+} /* end p3kapi_init */
+
+/**
+ * \par Function:
+ * p3kapi_create
+ *
+ * \par Description:
+ * Create a context for a key from a spare transform.  A CBC transform
+ * both encrypts and decrypts, so the direction is not used.
+ *
+ * \par Inputs:
+ * - key: The key
+ * - size: The key size, in bytes
+ * - encrypt: 1 for an encryption context, 0 for decryption
+ *
+ * \par Outputs:
+ * - void *: The context or NULL if there is an error
+ */
+
+static void *p3kapi_create(unsigned char *key, int size, int encrypt)
+{
+	p3kapi_ctx *ctx = NULL;
+
+	spin_lock_bh(&p3kapi_lock);
+	if (!list_empty(&p3kapi_spare)) {
+		ctx = list_first_entry(&p3kapi_spare, p3kapi_ctx, list);
+		list_del(&ctx->list);
+		p3kapi_count--;
+	} else if (p3kapi_want < p3KAPI_SPARE_MAX) {
+		// Keep more spare transforms for the sessions
+		p3kapi_want <<= 1;
+	}
+	spin_unlock_bh(&p3kapi_lock);
+	if (p3kapi_run)
+		schedule_work(&p3kapi_work);
+	if (ctx == NULL) {
+p3errmsg(p3MSG_DEBUG, "p3kapi_create: No spare transform\n");
+		goto out;
+	}
+	if (crypto_blkcipher_setkey(ctx->tfm, key, size) < 0) {
+		spin_lock_bh(&p3kapi_lock);
+		list_add_tail(&ctx->list, &p3kapi_dead);
+		spin_unlock_bh(&p3kapi_lock);
+		ctx = NULL;
+	}
+
+out:
+	return ((void *) ctx);
+} /* end p3kapi_create */
+
+/**
+ * \par Function:
+ * p3kapi_release
+ *
+ * \par Description:
+ * Release a context.  The transform is freed by the work item, so
+ * this may be called in interrupt context.
+ *
+ * \par Inputs:
+ * - ctx: The context
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3kapi_release(void *ctx)
+{
+	spin_lock_bh(&p3kapi_lock);
+	list_add_tail(&((p3kapi_ctx *) ctx)->list, &p3kapi_dead);
+	spin_unlock_bh(&p3kapi_lock);
+	if (p3kapi_run)
+		schedule_work(&p3kapi_work);
+} /* end p3kapi_release */
+
+/**
+ * \par Function:
+ * p3kapi_crypt
+ *
+ * \par Description:
+ * Encrypt or decrypt a buffer in place.  The IV is set to the last
+ * cipher block.
+ *
+ * \par Inputs:
+ * - ctx: The context
+ * - buffer: The buffer
+ * - size: The size of the buffer, which must be a multiple of 16
+ * - encrypt: 1 to encrypt, 0 to decrypt
+ * - iv: The 16 byte IV
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Kernel error number
+ */
+
+static int p3kapi_crypt(void *ctx, unsigned char *buffer, int size,
+		int encrypt, unsigned char *iv)
+{
+	struct blkcipher_desc desc;
+	struct scatterlist sg;
+
+	desc.tfm = ((p3kapi_ctx *) ctx)->tfm;
+	desc.info = iv;
+	desc.flags = 0;
+	sg_init_one(&sg, buffer, size);
+	if (encrypt)
+		return (crypto_blkcipher_encrypt_iv(&desc, &sg, &sg, size));
+	return (crypto_blkcipher_decrypt_iv(&desc, &sg, &sg, size));
+} /* end p3kapi_crypt */
+
+/**
+ * \par Function:
+ * p3kapi_aead_create
+ *
+ * \par Description:
+ * Create an AES-GCM context for a key from a spare transform.
+ *
+ * \par Inputs:
+ * - key: The key
+ * - size: The key size, in bytes
+ * - ktype: The key type (p3KTYPE_*), which must be an AES-GCM type
+ *
+ * \par Outputs:
+ * - void *: The context or NULL if there is an error
+ */
+
+static void *p3kapi_aead_create(unsigned char *key, int size, int ktype)
+{
+	p3kapi_ctx *ctx = NULL;
+
+	if (!p3KTYPE_GCM(ktype))
+		goto out;
+	spin_lock_bh(&p3kapi_lock);
+	if (!list_empty(&p3kapi_aspare)) {
+		ctx = list_first_entry(&p3kapi_aspare, p3kapi_ctx, list);
+		list_del(&ctx->list);
+		p3kapi_acount--;
+	} else if (p3kapi_want < p3KAPI_SPARE_MAX) {
+		p3kapi_want <<= 1;
+	}
+	spin_unlock_bh(&p3kapi_lock);
+	if (p3kapi_run && p3kapi_gcm)
+		schedule_work(&p3kapi_work);
+	if (ctx == NULL) {
+p3errmsg(p3MSG_DEBUG, "p3kapi_aead_create: No spare transform\n");
+		goto out;
+	}
+	if (crypto_aead_setkey(ctx->atfm, key, size) < 0 ||
+			crypto_aead_setauthsize(ctx->atfm, p3TAG_SIZE) < 0) {
+		spin_lock_bh(&p3kapi_lock);
+		list_add_tail(&ctx->list, &p3kapi_dead);
+		spin_unlock_bh(&p3kapi_lock);
+		ctx = NULL;
+	}
+
+out:
+	return ((void *) ctx);
+} /* end p3kapi_aead_create */
+
+/**
+ * \par Function:
+ * p3kapi_aead_crypt
+ *
+ * \par Description:
+ * Encrypt or decrypt a buffer in place with an AEAD context.  The
+ * kernel AES-GCM cipher takes a 16 byte IV and sets the block counter
+ * itself, so only the first p3NONCE_SIZE bytes are used.
+ *
+ * \par Inputs:
+ * - ctx: The context
+ * - buffer: The buffer, followed by the tag
+ * - size: The size of the buffer
+ * - aad: The associated data
+ * - alen: The size of the associated data
+ * - nonce: The nonce
+ * - encrypt: 1 to encrypt, 0 to decrypt
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Kernel error number (-EBADMSG if the tag does not match)
+ */
+
+static int p3kapi_aead_crypt(void *ctx, unsigned char *buffer, int size,
+		unsigned char *aad, int alen, unsigned char *nonce, int encrypt)
+{
+	int stat;
+	unsigned char iv[16];
+	struct aead_request *req;
+	struct scatterlist sg, asg;
+
+	if ((req = aead_request_alloc(((p3kapi_ctx *) ctx)->atfm,
+			GFP_ATOMIC)) == NULL)
+		return (-ENOMEM);
+	memset(iv, 0, sizeof(iv));
+	memcpy(iv, nonce, p3NONCE_SIZE);
+	aead_request_set_callback(req, 0, NULL, NULL);
+	sg_init_one(&sg, buffer, size + p3TAG_SIZE);
+	sg_init_one(&asg, aad, alen);
+	aead_request_set_assoc(req, &asg, alen);
+	if (encrypt) {
+		aead_request_set_crypt(req, &sg, &sg, size, iv);
+		stat = crypto_aead_encrypt(req);
+	} else {
+		aead_request_set_crypt(req, &sg, &sg, size + p3TAG_SIZE, iv);
+		stat = crypto_aead_decrypt(req);
+	}
+	aead_request_free(req);
+	return (stat);
+} /* end p3kapi_aead_crypt */
+
+/**
+ * \par Function:
+ * p3kapi_reason
+ *
+ * \par Description:
+ * Get the text for a kernel crypto API error.
+ *
+ * \par Inputs:
+ * - stat: The kernel error number
+ *
+ * \par Outputs:
+ * - const char *: The error text
+ */
+
+static const char *p3kapi_reason(int stat)
+{
+	if (stat == -EINVAL)
+		return ("Invalid buffer size");
+	return ("Kernel crypto API error");
+} /* end p3kapi_reason */
+
+const p3cipher p3kapi_cipher = {
+	.name = "kernel",
+	.init = p3kapi_init,
+	.cleanup = p3kapi_cleanup,
+	.create = p3kapi_create,
+	.release = p3kapi_release,
+	.crypt = p3kapi_crypt,
+	.reason = p3kapi_reason,
+	.aead_create = p3kapi_aead_create,
+	.aead_release = p3kapi_release,
+	.aead_crypt = p3kapi_aead_crypt,
+};
+
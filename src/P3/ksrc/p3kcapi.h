@@ -0,0 +1,26 @@
+/**
+ * \file p3kcapi.h
+ * <h3>Protected Point to Point kernel crypto API header file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * The kernel crypto API provider encrypts and decrypts with the cipher
+ * implementations registered with the Linux kernel.
+ */
+
+#ifndef _p3kCAPI_H
+#define _p3kCAPI_H
+
+/*****  CONSTANTS  *****/
+
+#define p3KAPI_ALG		"cbc(aes)"	/**< Kernel cipher algorithm name */
+#define p3KAPI_AEAD		"gcm(aes)"	/**< Kernel AEAD algorithm name */
+#define p3KAPI_SPARE	16			/**< Unkeyed transforms first kept for rekeys */
+#define p3KAPI_SPARE_MAX	1024	/**< Most unkeyed transforms kept */
+
+/*****  EXTERNAL DEFINITIONS  *****/
+
+extern const p3cipher p3kapi_cipher;
+
+#endif /* _p3kCAPI_H */
+
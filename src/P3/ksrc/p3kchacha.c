@@ -0,0 +1,663 @@
+/**
+ * \file p3kchacha.c
+ * <h3>Protected Point to Point ChaCha20-Poly1305 file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * ChaCha20-Poly1305 (RFC 8439) encrypts a buffer with the ChaCha20
+ * stream cipher and authenticates the cipher text and the associated
+ * data with Poly1305.  The 16 byte tag follows the buffer.  It only uses
+ * 32 bit additions, exclusive ors and rotations, so it is fast and runs
+ * in constant time on processors without AES instructions.
+ *
+ * Pairs of whole ChaCha20 blocks are handled with the SSE2 instructions
+ * on x86_64 processors, and with the NEON instructions on ARM processors
+ * when the kernel lets modules use NEON.  Each block is kept as four
+ * rows of four words, so a column round is four quarter rounds at once,
+ * and the rows are rotated to make the diagonal round.  The remaining
+ * blocks, and all blocks when the SIMD registers cannot be used in the
+ * current context, are handled by the C code.  Poly1305 uses 26 bit
+ * limbs, so it only needs 32 by 32 bit multiplications.
+ */
+
+#include "p3kbase.h"
+#include "p3kchacha.h"
+
+#ifdef CONFIG_X86
+#include <asm/i387.h>
+#endif
+#if (defined(CONFIG_ARM) || defined(CONFIG_ARM64)) && \
+		defined(CONFIG_KERNEL_MODE_NEON) && !defined(CONFIG_CPU_BIG_ENDIAN)
+#define p3CC_NEON
+#include <asm/neon.h>
+#include <asm/simd.h>
+#endif
+
+/** Set when the SIMD instructions are used for ChaCha20 */
+int p3chacha_simd_on = 0;
+
+/** The ChaCha20 constant "expand 32-byte k" */
+static const unsigned int p3chacha_sigma[4] = {
+	0x61707865, 0x3320646e, 0x79622d32, 0x6b206574
+};
+
+/** Increment of the block counter in the last row */
+static const unsigned int p3chacha_one[4] = { 1, 0, 0, 0 };
+
+#define p3CC_LE32(p) \
+	((unsigned int) (p)[0] | ((unsigned int) (p)[1] << 8) | \
+	((unsigned int) (p)[2] << 16) | ((unsigned int) (p)[3] << 24))
+
+#define p3CC_ROTL(v, n)	(((v) << (n)) | ((v) >> (32 - (n))))
+
+#define p3CC_QR(a, b, c, d) \
+	a += b; d ^= a; d = p3CC_ROTL(d, 16); \
+	c += d; b ^= c; b = p3CC_ROTL(b, 12); \
+	a += b; d ^= a; d = p3CC_ROTL(d, 8); \
+	c += d; b ^= c; b = p3CC_ROTL(b, 7);
+
+/**
+ * \par Function:
+ * p3chacha_detect
+ *
+ * \par Description:
+ * Determine if the SIMD instructions can be used for ChaCha20.  This
+ * only checks the CPU features.  The caller enables the instructions
+ * by setting p3chacha_simd_on after testing them.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - int: 1 if the SIMD instructions can be used, else 0
+ */
+
+int p3chacha_detect(void)
+{
+#if defined(CONFIG_X86_64)
+	return (1);
+#elif defined(p3CC_NEON)
+	if (cpu_has_neon())
+		return (1);
+#endif
+	return (0);
+} /* end p3chacha_detect */
+
+/**
+ * \par Function:
+ * p3chacha_block
+ *
+ * \par Description:
+ * Make one 64 byte block of the ChaCha20 key stream.
+ *
+ * \par Inputs:
+ * - st: The 16 word ChaCha20 state
+ * - ks: The 64 byte key stream block to be set
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3chacha_block(const unsigned int *st, unsigned char *ks)
+{
+	int i;
+	unsigned int x[16];
+
+	memcpy(x, st, sizeof(x));
+	for (i=0; i < 10; i++) {
+		p3CC_QR(x[0], x[4], x[8], x[12])
+		p3CC_QR(x[1], x[5], x[9], x[13])
+		p3CC_QR(x[2], x[6], x[10], x[14])
+		p3CC_QR(x[3], x[7], x[11], x[15])
+		p3CC_QR(x[0], x[5], x[10], x[15])
+		p3CC_QR(x[1], x[6], x[11], x[12])
+		p3CC_QR(x[2], x[7], x[8], x[13])
+		p3CC_QR(x[3], x[4], x[9], x[14])
+	}
+	for (i=0; i < 16; i++, ks += 4) {
+		x[i] += st[i];
+		ks[0] = (unsigned char) x[i];
+		ks[1] = (unsigned char) (x[i] >> 8);
+		ks[2] = (unsigned char) (x[i] >> 16);
+		ks[3] = (unsigned char) (x[i] >> 24);
+	}
+	memset(x, 0, sizeof(x));
+} /* end p3chacha_block */
+
+#if defined(CONFIG_X86_64) || defined(p3CC_NEON)
+/*
+ * The rows of the first block are in registers 0 - 3 and the rows of
+ * the second block in registers 4 - 7.  The quarter round and double
+ * round are the same for each instruction set.
+ */
+#ifdef CONFIG_X86_64
+#define p3CS_ADD(a, b)		"paddd %%xmm" #b ", %%xmm" #a "\n\t"
+#define p3CS_XOR(a, b)		"pxor %%xmm" #b ", %%xmm" #a "\n\t"
+#define p3CS_ROT16(a) \
+	"pshuflw $0xb1, %%xmm" #a ", %%xmm" #a "\n\t" \
+	"pshufhw $0xb1, %%xmm" #a ", %%xmm" #a "\n\t"
+#define p3CS_XROT(a, b, n, m) \
+	"pxor %%xmm" #b ", %%xmm" #a "\n\t" \
+	"movdqa %%xmm" #a ", %%xmm8\n\t" \
+	"pslld $" #n ", %%xmm" #a "\n\t" \
+	"psrld $" #m ", %%xmm8\n\t" \
+	"por %%xmm8, %%xmm" #a "\n\t"
+#define p3CS_DIAG(b, c, d) \
+	"pshufd $0x39, %%xmm" #b ", %%xmm" #b "\n\t" \
+	"pshufd $0x4e, %%xmm" #c ", %%xmm" #c "\n\t" \
+	"pshufd $0x93, %%xmm" #d ", %%xmm" #d "\n\t"
+#define p3CS_UNDIAG(b, c, d) \
+	"pshufd $0x93, %%xmm" #b ", %%xmm" #b "\n\t" \
+	"pshufd $0x4e, %%xmm" #c ", %%xmm" #c "\n\t" \
+	"pshufd $0x39, %%xmm" #d ", %%xmm" #d "\n\t"
+#elif defined(CONFIG_ARM64)
+#define p3CS_ADD(a, b)		"add v" #a ".4s, v" #a ".4s, v" #b ".4s\n\t"
+#define p3CS_XOR(a, b)		"eor v" #a ".16b, v" #a ".16b, v" #b ".16b\n\t"
+#define p3CS_ROT16(a)		"rev32 v" #a ".8h, v" #a ".8h\n\t"
+#define p3CS_XROT(a, b, n, m) \
+	"eor v16.16b, v" #a ".16b, v" #b ".16b\n\t" \
+	"shl v" #a ".4s, v16.4s, #" #n "\n\t" \
+	"sri v" #a ".4s, v16.4s, #" #m "\n\t"
+#define p3CS_EXT(a, n) \
+	"ext v" #a ".16b, v" #a ".16b, v" #a ".16b, #" #n "\n\t"
+#else
+#define p3CS_ADD(a, b)		"vadd.i32 q" #a ", q" #a ", q" #b "\n\t"
+#define p3CS_XOR(a, b)		"veor q" #a ", q" #a ", q" #b "\n\t"
+#define p3CS_ROT16(a)		"vrev32.16 q" #a ", q" #a "\n\t"
+#define p3CS_XROT(a, b, n, m) \
+	"veor q8, q" #a ", q" #b "\n\t" \
+	"vshl.i32 q" #a ", q8, #" #n "\n\t" \
+	"vsri.32 q" #a ", q8, #" #m "\n\t"
+#define p3CS_EXT(a, n) \
+	"vext.8 q" #a ", q" #a ", q" #a ", #" #n "\n\t"
+#endif
+#ifndef CONFIG_X86_64
+#define p3CS_DIAG(b, c, d)		p3CS_EXT(b, 4) p3CS_EXT(c, 8) p3CS_EXT(d, 12)
+#define p3CS_UNDIAG(b, c, d)	p3CS_EXT(b, 12) p3CS_EXT(c, 8) p3CS_EXT(d, 4)
+#endif
+
+#define p3CS_QR(a, b, c, d) \
+	p3CS_ADD(a, b) p3CS_XOR(d, a) p3CS_ROT16(d) \
+	p3CS_ADD(c, d) p3CS_XROT(b, c, 12, 20) \
+	p3CS_ADD(a, b) p3CS_XROT(d, a, 8, 24) \
+	p3CS_ADD(c, d) p3CS_XROT(b, c, 7, 25)
+
+#define p3CS_DROUND \
+	p3CS_QR(0, 1, 2, 3) p3CS_QR(4, 5, 6, 7) \
+	p3CS_DIAG(1, 2, 3) p3CS_DIAG(5, 6, 7) \
+	p3CS_QR(0, 1, 2, 3) p3CS_QR(4, 5, 6, 7) \
+	p3CS_UNDIAG(1, 2, 3) p3CS_UNDIAG(5, 6, 7)
+#endif
+
+/**
+ * \par Function:
+ * p3chacha_simd
+ *
+ * \par Description:
+ * Encrypt or decrypt pairs of whole blocks in place with the SIMD
+ * instructions.  The block counter of the state is advanced by two
+ * for each pair.
+ *
+ * \par Inputs:
+ * - st: The 16 word ChaCha20 state
+ * - data: The buffer
+ * - pairs: The number of 128 byte pairs of blocks
+ *
+ * \par Outputs:
+ * - int: The number of bytes done, 0 if the SIMD registers cannot be
+ *   used in the current context
+ */
+
+static int p3chacha_simd(unsigned int *st, unsigned char *data, long pairs)
+{
+#if defined(CONFIG_X86_64) || defined(p3CC_NEON)
+	long n, done = pairs << 7;
+#endif
+
+#if defined(CONFIG_X86_64)
+	// The state rows are in xmm9 - xmm12 and the increment in xmm13
+	if (!irq_fpu_usable())
+		return (0);
+	kernel_fpu_begin();
+	asm volatile(
+		"movdqu (%[st]), %%xmm9\n\t"
+		"movdqu 16(%[st]), %%xmm10\n\t"
+		"movdqu 32(%[st]), %%xmm11\n\t"
+		"movdqu 48(%[st]), %%xmm12\n\t"
+		"movdqu (%[one]), %%xmm13\n\t"
+		"1:\n\t"
+		"movdqa %%xmm9, %%xmm0\n\t"
+		"movdqa %%xmm10, %%xmm1\n\t"
+		"movdqa %%xmm11, %%xmm2\n\t"
+		"movdqa %%xmm12, %%xmm3\n\t"
+		"movdqa %%xmm9, %%xmm4\n\t"
+		"movdqa %%xmm10, %%xmm5\n\t"
+		"movdqa %%xmm11, %%xmm6\n\t"
+		"movdqa %%xmm12, %%xmm7\n\t"
+		"paddd %%xmm13, %%xmm7\n\t"
+		"mov $10, %[n]\n\t"
+		"2:\n\t"
+		p3CS_DROUND
+		"dec %[n]\n\t"
+		"jnz 2b\n\t"
+		"paddd %%xmm9, %%xmm0\n\t"
+		"paddd %%xmm10, %%xmm1\n\t"
+		"paddd %%xmm11, %%xmm2\n\t"
+		"paddd %%xmm12, %%xmm3\n\t"
+		"paddd %%xmm13, %%xmm12\n\t"
+		"paddd %%xmm9, %%xmm4\n\t"
+		"paddd %%xmm10, %%xmm5\n\t"
+		"paddd %%xmm11, %%xmm6\n\t"
+		"paddd %%xmm12, %%xmm7\n\t"
+		"paddd %%xmm13, %%xmm12\n\t"
+#define p3CS_DATA(i, off) \
+		"movdqu " #off "(%[data]), %%xmm8\n\t" \
+		"pxor %%xmm8, %%xmm" #i "\n\t" \
+		"movdqu %%xmm" #i ", " #off "(%[data])\n\t"
+		p3CS_DATA(0, 0) p3CS_DATA(1, 16) p3CS_DATA(2, 32) p3CS_DATA(3, 48)
+		p3CS_DATA(4, 64) p3CS_DATA(5, 80) p3CS_DATA(6, 96) p3CS_DATA(7, 112)
+		"add $128, %[data]\n\t"
+		"dec %[pairs]\n\t"
+		"jnz 1b\n\t"
+		"movdqu %%xmm12, 48(%[st])\n\t"
+		: [data] "+r" (data), [pairs] "+r" (pairs), [n] "=&r" (n)
+		: [st] "r" (st), [one] "r" (p3chacha_one)
+		: "cc", "memory");
+	kernel_fpu_end();
+	return ((int) done);
+#elif defined(p3CC_NEON)
+	// The state rows are in register 17 - 20 and the increment in 21
+	unsigned int *row3 = st + 12;
+
+	if (!may_use_simd())
+		return (0);
+	kernel_neon_begin();
+#ifdef CONFIG_ARM64
+#define p3CS_MOV(a, b)		"mov v" #a ".16b, v" #b ".16b\n\t"
+#define p3CS_DATA(i) \
+		"ld1 {v16.16b}, [%[data]]\n\t" \
+		"eor v" #i ".16b, v" #i ".16b, v16.16b\n\t" \
+		"st1 {v" #i ".16b}, [%[data]], #16\n\t"
+	asm volatile(
+		"ld1 {v17.4s-v20.4s}, [%[st]]\n\t"
+		"ld1 {v21.4s}, [%[one]]\n\t"
+		"1:\n\t"
+		p3CS_MOV(0, 17) p3CS_MOV(1, 18) p3CS_MOV(2, 19) p3CS_MOV(3, 20)
+		p3CS_MOV(4, 17) p3CS_MOV(5, 18) p3CS_MOV(6, 19) p3CS_MOV(7, 20)
+		p3CS_ADD(7, 21)
+		"mov %[n], #10\n\t"
+		"2:\n\t"
+		p3CS_DROUND
+		"subs %[n], %[n], #1\n\t"
+		"b.ne 2b\n\t"
+		p3CS_ADD(0, 17) p3CS_ADD(1, 18) p3CS_ADD(2, 19) p3CS_ADD(3, 20)
+		p3CS_ADD(20, 21)
+		p3CS_ADD(4, 17) p3CS_ADD(5, 18) p3CS_ADD(6, 19) p3CS_ADD(7, 20)
+		p3CS_ADD(20, 21)
+		p3CS_DATA(0) p3CS_DATA(1) p3CS_DATA(2) p3CS_DATA(3)
+		p3CS_DATA(4) p3CS_DATA(5) p3CS_DATA(6) p3CS_DATA(7)
+		"subs %[pairs], %[pairs], #1\n\t"
+		"b.ne 1b\n\t"
+		"st1 {v20.4s}, [%[row3]]\n\t"
+		: [data] "+r" (data), [pairs] "+r" (pairs), [n] "=&r" (n)
+		: [st] "r" (st), [one] "r" (p3chacha_one), [row3] "r" (row3)
+		: "cc", "memory", "v0", "v1", "v2", "v3", "v4", "v5", "v6", "v7",
+		  "v16", "v17", "v18", "v19", "v20", "v21");
+#else
+#define p3CS_MOV(a, b)		"vmov q" #a ", q" #b "\n\t"
+#define p3CS_DATA(lo, hi) \
+		"vld1.8 {d16-d17}, [%[data]]\n\t" \
+		"veor d" #lo ", d" #lo ", d16\n\t" \
+		"veor d" #hi ", d" #hi ", d17\n\t" \
+		"vst1.8 {d" #lo "-d" #hi "}, [%[data]]!\n\t"
+	unsigned int *row2 = st + 8;
+
+	asm volatile(
+		"vld1.32 {d18-d21}, [%[st]]\n\t"
+		"vld1.32 {d22-d25}, [%[row2]]\n\t"
+		"vld1.32 {d26-d27}, [%[one]]\n\t"
+		"1:\n\t"
+		p3CS_MOV(0, 9) p3CS_MOV(1, 10) p3CS_MOV(2, 11) p3CS_MOV(3, 12)
+		p3CS_MOV(4, 9) p3CS_MOV(5, 10) p3CS_MOV(6, 11) p3CS_MOV(7, 12)
+		p3CS_ADD(7, 13)
+		"mov %[n], #10\n\t"
+		"2:\n\t"
+		p3CS_DROUND
+		"subs %[n], %[n], #1\n\t"
+		"bne 2b\n\t"
+		p3CS_ADD(0, 9) p3CS_ADD(1, 10) p3CS_ADD(2, 11) p3CS_ADD(3, 12)
+		p3CS_ADD(12, 13)
+		p3CS_ADD(4, 9) p3CS_ADD(5, 10) p3CS_ADD(6, 11) p3CS_ADD(7, 12)
+		p3CS_ADD(12, 13)
+		p3CS_DATA(0, 1) p3CS_DATA(2, 3) p3CS_DATA(4, 5) p3CS_DATA(6, 7)
+		p3CS_DATA(8, 9) p3CS_DATA(10, 11) p3CS_DATA(12, 13) p3CS_DATA(14, 15)
+		"subs %[pairs], %[pairs], #1\n\t"
+		"bne 1b\n\t"
+		"vst1.32 {d24-d25}, [%[row3]]\n\t"
+		: [data] "+r" (data), [pairs] "+r" (pairs), [n] "=&r" (n)
+		: [st] "r" (st), [one] "r" (p3chacha_one), [row2] "r" (row2),
+		  [row3] "r" (row3)
+		: "cc", "memory", "d0", "d1", "d2", "d3", "d4", "d5", "d6", "d7",
+		  "d8", "d9", "d10", "d11", "d12", "d13", "d14", "d15", "d16",
+		  "d17", "d18", "d19", "d20", "d21", "d22", "d23", "d24", "d25",
+		  "d26", "d27");
+#endif
+	kernel_neon_end();
+	return ((int) done);
+#else
+	return (0);
+#endif
+} /* end p3chacha_simd */
+
+/**
+ * \par Function:
+ * p3chacha_stream
+ *
+ * \par Description:
+ * Encrypt or decrypt a buffer in place with the ChaCha20 key stream.
+ * The block counter of the state is set to the next block.
+ *
+ * \par Inputs:
+ * - st: The 16 word ChaCha20 state
+ * - data: The buffer
+ * - len: The size of the buffer
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3chacha_stream(unsigned int *st, unsigned char *data, int len)
+{
+	int i, n;
+	unsigned char ks[64];
+
+	// Pairs of whole blocks with the SIMD instructions
+	if (p3chacha_simd_on && len >= 128 &&
+			(n = p3chacha_simd(st, data, (long) (len >> 7))) > 0) {
+		data += n;
+		len -= n;
+	}
+
+	// Remaining blocks with the C code
+	for ( ; len > 0; data += n, len -= n) {
+		p3chacha_block(st, ks);
+		st[12]++;
+		n = (len < sizeof(ks)) ? len : sizeof(ks);
+		for (i=0; i < n; i++)
+			data[i] ^= ks[i];
+	}
+	memset(ks, 0, sizeof(ks));
+} /* end p3chacha_stream */
+
+/*
+ * Poly1305 state: the key r and the accumulator h in 26 bit limbs, and
+ * the key s that is added at the end.
+ */
+typedef struct {
+	unsigned int	r[5];
+	unsigned int	h[5];
+	unsigned int	s[4];
+} p3poly;
+
+/**
+ * \par Function:
+ * p3poly_blocks
+ *
+ * \par Description:
+ * Add data to a Poly1305 accumulator.  A partial last block is padded
+ * with zeros, as ChaCha20-Poly1305 pads the associated data and the
+ * cipher text to a multiple of 16 bytes.
+ *
+ * \par Inputs:
+ * - p: The Poly1305 state
+ * - m: The data
+ * - len: The size of the data
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3poly_blocks(p3poly *p, const unsigned char *m, int len)
+{
+	unsigned int r0 = p->r[0], r1 = p->r[1], r2 = p->r[2], r3 = p->r[3];
+	unsigned int r4 = p->r[4], s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5;
+	unsigned int s4 = r4 * 5, h0 = p->h[0], h1 = p->h[1], h2 = p->h[2];
+	unsigned int h3 = p->h[3], h4 = p->h[4], c;
+	unsigned long long d0, d1, d2, d3, d4;
+	unsigned char pad[16];
+
+	for ( ; len > 0; m += 16, len -= 16) {
+		if (len < 16) {
+			memset(pad, 0, sizeof(pad));
+			memcpy(pad, m, len);
+			m = pad;
+		}
+		// h += m, with the high bit of each 16 byte block set
+		h0 += p3CC_LE32(m) & 0x3ffffff;
+		h1 += (p3CC_LE32(m + 3) >> 2) & 0x3ffffff;
+		h2 += (p3CC_LE32(m + 6) >> 4) & 0x3ffffff;
+		h3 += (p3CC_LE32(m + 9) >> 6) & 0x3ffffff;
+		h4 += (p3CC_LE32(m + 12) >> 8) | (1 << 24);
+
+		// h *= r, mod 2^130 - 5
+		d0 = ((unsigned long long) h0 * r0) + ((unsigned long long) h1 * s4) +
+			((unsigned long long) h2 * s3) + ((unsigned long long) h3 * s2) +
+			((unsigned long long) h4 * s1);
+		d1 = ((unsigned long long) h0 * r1) + ((unsigned long long) h1 * r0) +
+			((unsigned long long) h2 * s4) + ((unsigned long long) h3 * s3) +
+			((unsigned long long) h4 * s2);
+		d2 = ((unsigned long long) h0 * r2) + ((unsigned long long) h1 * r1) +
+			((unsigned long long) h2 * r0) + ((unsigned long long) h3 * s4) +
+			((unsigned long long) h4 * s3);
+		d3 = ((unsigned long long) h0 * r3) + ((unsigned long long) h1 * r2) +
+			((unsigned long long) h2 * r1) + ((unsigned long long) h3 * r0) +
+			((unsigned long long) h4 * s4);
+		d4 = ((unsigned long long) h0 * r4) + ((unsigned long long) h1 * r3) +
+			((unsigned long long) h2 * r2) + ((unsigned long long) h3 * r1) +
+			((unsigned long long) h4 * r0);
+		c = (unsigned int) (d0 >> 26);
+		h0 = (unsigned int) d0 & 0x3ffffff;
+		d1 += c;
+		c = (unsigned int) (d1 >> 26);
+		h1 = (unsigned int) d1 & 0x3ffffff;
+		d2 += c;
+		c = (unsigned int) (d2 >> 26);
+		h2 = (unsigned int) d2 & 0x3ffffff;
+		d3 += c;
+		c = (unsigned int) (d3 >> 26);
+		h3 = (unsigned int) d3 & 0x3ffffff;
+		d4 += c;
+		c = (unsigned int) (d4 >> 26);
+		h4 = (unsigned int) d4 & 0x3ffffff;
+		h0 += c * 5;
+		c = h0 >> 26;
+		h0 &= 0x3ffffff;
+		h1 += c;
+	}
+	p->h[0] = h0;
+	p->h[1] = h1;
+	p->h[2] = h2;
+	p->h[3] = h3;
+	p->h[4] = h4;
+	memset(pad, 0, sizeof(pad));
+} /* end p3poly_blocks */
+
+/**
+ * \par Function:
+ * p3poly_tag
+ *
+ * \par Description:
+ * Reduce a Poly1305 accumulator and add the key s to make the tag.
+ *
+ * \par Inputs:
+ * - p: The Poly1305 state
+ * - tag: The 16 byte tag to be set
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3poly_tag(p3poly *p, unsigned char *tag)
+{
+	int i;
+	unsigned int h[5], g[5], c, mask;
+	unsigned long long f;
+
+	// Carry through all of the limbs
+	memcpy(h, p->h, sizeof(h));
+	for (i=1, c=0; i < 5; i++) {
+		h[i] += c;
+		c = h[i] >> 26;
+		h[i] &= 0x3ffffff;
+	}
+	h[0] += c * 5;
+	c = h[0] >> 26;
+	h[0] &= 0x3ffffff;
+	h[1] += c;
+
+	// Use h - (2^130 - 5) if it is not negative, without a branch
+	for (i=0, c=5; i < 5; i++) {
+		g[i] = h[i] + c;
+		c = g[i] >> 26;
+		g[i] &= 0x3ffffff;
+	}
+	g[4] = (g[4] | (c << 26)) - (1 << 26);
+	mask = (g[4] >> 31) - 1;
+	for (i=0; i < 5; i++)
+		h[i] = (h[i] & ~mask) | (g[i] & mask);
+
+	// tag = (h + s) mod 2^128
+	g[0] = h[0] | (h[1] << 26);
+	g[1] = (h[1] >> 6) | (h[2] << 20);
+	g[2] = (h[2] >> 12) | (h[3] << 14);
+	g[3] = (h[3] >> 18) | (h[4] << 8);
+	for (i=0, f=0; i < 4; i++, tag += 4) {
+		f = (f >> 32) + g[i] + p->s[i];
+		tag[0] = (unsigned char) f;
+		tag[1] = (unsigned char) (f >> 8);
+		tag[2] = (unsigned char) (f >> 16);
+		tag[3] = (unsigned char) (f >> 24);
+	}
+	memset(h, 0, sizeof(h));
+	memset(g, 0, sizeof(g));
+} /* end p3poly_tag */
+
+/**
+ * \par Function:
+ * p3chacha_key
+ *
+ * \par Description:
+ * Set up a ChaCha20-Poly1305 key.
+ *
+ * \par Inputs:
+ * - cc: The ChaCha20-Poly1305 key to be set
+ * - key: The key
+ * - size: The key size, in bytes (p3CHACHA_KEYSZ)
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Invalid key size
+ */
+
+int p3chacha_key(p3chacha *cc, const unsigned char *key, int size)
+{
+	int i;
+
+	if (size != p3CHACHA_KEYSZ)
+		return (-1);
+	for (i=0; i < 8; i++)
+		cc->key[i] = p3CC_LE32(&key[4 * i]);
+	return (0);
+} /* end p3chacha_key */
+
+/**
+ * \par Function:
+ * p3chacha_crypt
+ *
+ * \par Description:
+ * Encrypt or decrypt a buffer in place.  When encrypting, the tag is
+ * written after the buffer.  When decrypting, the tag after the buffer
+ * is checked first, and the buffer is not decrypted if the check fails.
+ *
+ * \par Inputs:
+ * - cc: The ChaCha20-Poly1305 key
+ * - buffer: The buffer, followed by p3CHACHA_TAGSZ bytes for the tag
+ * - size: The size of the buffer
+ * - aad: The associated data, which is authenticated but not encrypted
+ * - alen: The size of the associated data
+ * - nonce: The p3CHACHA_NONCESZ byte nonce, which must not be repeated
+ *   for the key
+ * - encrypt: 1 to encrypt, 0 to decrypt
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: The tag does not match
+ */
+
+int p3chacha_crypt(const p3chacha *cc, unsigned char *buffer, int size,
+		const unsigned char *aad, int alen, const unsigned char *nonce,
+		int encrypt)
+{
+	int i, stat = 0;
+	unsigned int st[16];
+	unsigned char ks[64], diff;
+	p3poly p;
+
+	memcpy(st, p3chacha_sigma, sizeof(p3chacha_sigma));
+	memcpy(&st[4], cc->key, sizeof(cc->key));
+	st[12] = 0;
+	st[13] = p3CC_LE32(nonce);
+	st[14] = p3CC_LE32(nonce + 4);
+	st[15] = p3CC_LE32(nonce + 8);
+
+	// Block 0 makes the Poly1305 key, the data starts at block 1
+	p3chacha_block(st, ks);
+	st[12] = 1;
+	p.r[0] = p3CC_LE32(ks) & 0x3ffffff;
+	p.r[1] = (p3CC_LE32(ks + 3) >> 2) & 0x3ffff03;
+	p.r[2] = (p3CC_LE32(ks + 6) >> 4) & 0x3ffc0ff;
+	p.r[3] = (p3CC_LE32(ks + 9) >> 6) & 0x3f03fff;
+	p.r[4] = (p3CC_LE32(ks + 12) >> 8) & 0x00fffff;
+	for (i=0; i < 4; i++)
+		p.s[i] = p3CC_LE32(ks + 16 + (4 * i));
+	memset(p.h, 0, sizeof(p.h));
+
+	p3poly_blocks(&p, aad, alen);
+	if (encrypt)
+		p3chacha_stream(st, buffer, size);
+	p3poly_blocks(&p, buffer, size);
+
+	// Length block (sizes in bytes, little endian)
+	memset(ks, 0, 16);
+	ks[0] = (unsigned char) alen;
+	ks[1] = (unsigned char) (alen >> 8);
+	ks[2] = (unsigned char) (alen >> 16);
+	ks[3] = (unsigned char) (alen >> 24);
+	ks[8] = (unsigned char) size;
+	ks[9] = (unsigned char) (size >> 8);
+	ks[10] = (unsigned char) (size >> 16);
+	ks[11] = (unsigned char) (size >> 24);
+	p3poly_blocks(&p, ks, 16);
+	p3poly_tag(&p, ks);
+
+	if (encrypt) {
+		memcpy(&buffer[size], ks, p3CHACHA_TAGSZ);
+		goto out;
+	}
+	for (i=0, diff=0; i < p3CHACHA_TAGSZ; i++)
+		diff |= buffer[size + i] ^ ks[i];
+	if (diff) {
+		stat = -1;
+		goto out;
+	}
+	p3chacha_stream(st, buffer, size);
+
+out:
+	memset(st, 0, sizeof(st));
+	memset(ks, 0, sizeof(ks));
+	memset(&p, 0, sizeof(p));
+	return (stat);
+} /* end p3chacha_crypt */
+
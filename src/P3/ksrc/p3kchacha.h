@@ -0,0 +1,50 @@
+/**
+ * \file p3kchacha.h
+ * <h3>Protected Point to Point ChaCha20-Poly1305 header file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * The ChaCha20-Poly1305 functions encrypt and authenticate a buffer
+ * without AES, for processors that do not have AES instructions.
+ */
+
+#ifndef _p3kCHACHA_H
+#define _p3kCHACHA_H
+
+/*****  CONSTANTS  *****/
+
+#define p3CHACHA_KEYSZ		32		/**< Size of the key */
+#define p3CHACHA_TAGSZ		16		/**< Size of the authentication tag */
+#define p3CHACHA_NONCESZ	12		/**< Size of the nonce */
+
+/*****  DATA DEFINITIONS  *****/
+
+typedef struct _p3chacha p3chacha;
+
+/**
+ * Structure:
+ * p3chacha
+ *
+ * \par Description:
+ * A ChaCha20-Poly1305 key.  The Poly1305 key of each buffer is made
+ * from the key and the nonce, so only the ChaCha20 key is kept.
+ */
+
+struct _p3chacha {
+	unsigned int		key[8];		/**< Key, as little endian words */
+};
+
+/*****  PROTOTYPES  *****/
+
+int p3chacha_detect(void);
+int p3chacha_key(p3chacha *cc, const unsigned char *key, int size);
+int p3chacha_crypt(const p3chacha *cc, unsigned char *buffer, int size,
+		const unsigned char *aad, int alen, const unsigned char *nonce,
+		int encrypt);
+
+/*****  EXTERNAL DEFINITIONS  *****/
+
+extern int p3chacha_simd_on;
+
+#endif /* _p3kCHACHA_H */
+
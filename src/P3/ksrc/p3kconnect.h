@@ -12,14 +12,19 @@
 
 #include "p3kbase.h"
 #include "p3kcrypto.h"
+#include "p3kobf.h"
 
 /*****  CONSTANTS  *****/
 
+#define p3HOST_HASHBITS	12		/**< Remote host table hash bits */
+#define p3HOST_HASHSZ	(1 << p3HOST_HASHBITS)	/**< Remote host table size */
+
 /*****  DATA DEFINITIONS  *****/
 
 typedef struct _p3host p3host;
 typedef struct _p3session p3session;
 typedef struct _p3route p3route;
+typedef struct _p3rnode p3rnode;
 typedef struct _p3net p3net;
 typedef struct _p3ctlmsg p3ctlmsg;
 typedef struct _p3packet p3packet;
@@ -34,8 +39,9 @@ typedef struct _p3work p3work;
  */
 
 struct _p3host {
+	p3rcu			rcu;		/*<< RCU release header (must be first) */
 	p3host			*next;		/*<< Timer queue pointer */
-	p3host			*hlist;		/*<< TODO: Change list to Red Black tree */
+	p3host			*hlist;		/*<< Host table hash chain */
 	p3net			*net;		/*<< P3 host network information */
 	p3net			*subnet;	/*<< Array of subnets */
 	p3session		*session;	/*<< P3 host session information */
@@ -75,10 +81,13 @@ struct _p3session {
 	int				dindex;		/*<< Data key index */
 	int				cindex;		/*<< Control key index */
 	// NOTE: The P3 session sequence starts at 1.  0 is used internally.
-	unsigned int	sseq;		/*<< Sequence for data sent using key 1 */
+	p3seq			sseq;		/*<< Next sequence for data sent using key 1 */
 #define p3SEQ_DIFF	0xa65d
+/* Sequence numbers wrap, so they are compared by their 32 bit difference */
+#define p3SEQ_GE(seq1, seq2)	((int) ((seq1) - (seq2)) >= 0)
 	unsigned int	rID0;		/*<< Sequence start for data received using key 0 */
 	unsigned int	rID1;		/*<< Sequence start for data received using key 1 */
+	unsigned int	sID1;		/*<< Sequence start for data sent using key 1 */
 #ifndef _p3_SECONDARY
 	time_t			dikey;		/*<< Next time to use data index */
 	time_t			cikey;		/*<< Next time to use control index */
@@ -86,8 +95,10 @@ struct _p3session {
 	int				citime;		/*<< Period to rekey control from list */
 	time_t			rekey;		/*<< Next time to rekey */
 	int				rk_wait;	/*<< Period to initiate rekeying in seconds */
+	int				kring;		/*<< Key server ring for new keys */
 #endif
 	p3lock			lock;		/*<< Session lock */
+	p3parq			parq;		/*<< Reorder queue of parallel crypto jobs */
 /* There are 2 P3 headers.  They are both the same size because the ESP header
  * and the UDP header are the same size.  The constant fields in the IP header
  * of the P3 header are built when the session is created and the rest are set
@@ -128,16 +139,41 @@ struct _p3session {
  *
  * \par Description:
  * The route table for determining which P3 host to send packets to.
+ *
+ * The table is a path compressed binary trie of network prefixes, so a
+ * longest prefix match visits at most one node per prefix bit.  Lookups
+ * from the packet path are lock free under RCU.  Changes from the
+ * configuration path are serialized by the table lock and published
+ * with p3rcu_assign, and unlinked nodes are released with p3rcu_free.
  */
 
 struct _p3route {
-	p3net			**nets;		/*<< P3 networks */
+	p3rnode			*root;		/*<< Root of the prefix trie */
 	int				netsz;		/*<< Number of networks in table */
-#define P3MAXROUTE	8
+	int				bits;		/*<< Address size in bits (32 or 128) */
+	p3lock			lock;		/*<< Table update lock */
 	unsigned int	flag;
 //reserve p3IP_TYPE	0x30000000	/* IP version field */
 };
 
+/**
+ * Structure:
+ * p3rnode
+ *
+ * \par Description:
+ * A P3 route table trie node.  The key and prefix length of a node do
+ * not change once the node is in the table.  A node without a network
+ * joins two branches that differ at bit plen.
+ */
+
+struct _p3rnode {
+	p3rcu			rcu;		/*<< RCU release header (must be first) */
+	p3rnode			*child[2];	/*<< Branches for bit plen of the address */
+	p3net			*net;		/*<< Network for this prefix or NULL */
+	unsigned int	key[4];		/*<< Prefix in host order 32 bit words */
+	int				plen;		/*<< Prefix length in bits */
+};
+
 /**
  * Structure:
  * p3net
@@ -152,6 +188,7 @@ struct _p3net {
 		struct in6_addr v6;
 	} net;							/*<< Subnet address (IPv4 or IPv6) */
 	struct in_addr		mask;		/*<< Subnet mask (IPv4) */
+	int					prefix;		/*<< Prefix length of the subnet */
 	p3host				*host;		/*<< Remote host entry for route */
 	void				*netdata;	/*<< OS dependent network information */
 	unsigned int		flag;
@@ -191,6 +228,8 @@ struct _p3packet {
 	p3host			*host;		/*<< Packet source P3 host */
 	p3work			*work;		/*<< Packet handler work fields */
 	int				netdata;	/*<< Interface to net_utils function */
+	unsigned int	seq;		/*<< Reserved session sequence number (0 = none) */
+	int				tag;		/*<< Size of the AEAD tag at the end of the packet */
 	unsigned int	flag;
 #define p3PKT_SIZE	0x0000ffff	/* Size of packet data */
 #define p3PKT_OP	0x00070000	/* Operation flags */
@@ -201,6 +240,10 @@ struct _p3packet {
 #define p3PKT_SRP3	0x00200000	/* Packet source is P3 host */
 #define p3PKT_DSSUB	0x00400000	/* Packet destination is subnet */
 #define p3PKT_DSP3	0x00800000	/* Packet destination is P3 host */
+#define p3PKT_INPLACE	0x01000000	/* Packet is handled in the system buffer */
+#define p3PKT_LOOKUP	0x02000000	/* Packet was looked up by the caller */
+#define p3PKT_DEFER		0x04000000	/* Data is encrypted by the caller */
+#define p3PKT_PARALLEL	0x08000000	/* Packet is handled by a parallel crypto worker */
 };
 
 /**
@@ -216,11 +259,9 @@ struct _p3work {
 	unsigned char	*buf;
 	struct tcphdr	*tcph;
 	struct udphdr	*udph;
-	unsigned char	*dloc[8];
 	p3ctlmsg		ctlmsg;
+	p3obf			obf;		/*<< Obfuscation block layout */
 	int				newlen;
-	int				blen[8];
-	int				bloc[8];
 	int				idx1;
 	int				idx2;
 	int				i1;
@@ -229,6 +270,8 @@ struct _p3work {
 	unsigned int	ui1;
 	unsigned int	ui2;
 	unsigned long	l;
+	unsigned int	wflag;
+#define p3WRK_POOL	0x01	/* Work area belongs to the work area pool */
 };
 
 /*****  MACROS  *****/
@@ -15,6 +15,7 @@
 
 #include "p3kbase.h"
 #include "p3kcrypto.h"
+#include "p3knet.h"
 
 #include "moc_src/moptions.h"
 #include "moc_src/mtypes.h"
@@ -26,377 +27,2877 @@
 #include "moc_src/mocana.h"
 
 #include "moc_src/hw_accel.h"
+#include "moc_src/aesalgo.h"
 #include "moc_src/aes.h"
 #include "moc_src/aes_ctr.h"
 #include "moc_src/aes_cmac.h"
 #include "moc_src/aes_ccm.h"
 #include "moc_src/aes_ecb.h"
 
+#include "p3kaesni.h"
+#include "p3kbsaes.h"
+#include "p3kgcm.h"
+#include "p3kchacha.h"
+#include "p3kcapi.h"
+
 char unknown_err[] = {"Unknown error"};
-p3lock crypto_lock;
-int initlock = 1, lockheld = 0;;
+
+static const p3cipher p3moc_cipher;
+
+/** The crypto providers that can be chosen with the p3crypto parameter */
+static const p3cipher *p3ciphers[] = {
+	&p3moc_cipher,
+	&p3kapi_cipher,
+	NULL
+};
+
+/** The provider used for new session keys */
+static const p3cipher *p3ops = &p3moc_cipher;
+
+/** Set when the AES-GCM operations of the provider pass the known answer tests */
+static int p3aead_ok = 0;
+
+/** Set when the CTR operation of the provider passes the known answer tests */
+static int p3ctr_ok = 0;
+
+/** Set when the provider passes the ChaCha20-Poly1305 known answer tests */
+static int p3chacha_ok = 0;
+
+#define p3BENCH_MAX		4		/* Engines timed by the crypto benchmark */
+#define p3BENCH_TIME	(HZ / 64 + 1)	/* Jiffies to time each packet size */
+
+/** The packet sizes timed by the crypto benchmark */
+static const int p3bench_size[p3BENCH_SIZES] = {
+	p3PKT_SMALL, p3PKT_MED, p3PKT_LARGE
+};
+
+/** A crypto engine that passed the known answer tests and its speed */
+typedef struct {
+	const char		*name;		/*<< Engine name for the statistics */
+	const p3cipher	*ops;		/*<< Provider */
+	int				aesni;		/*<< Value of p3aesni_on */
+	int				bsaes;		/*<< Value of p3bsaes_on */
+	int				mbs[p3BENCH_SIZES];	/*<< MB/s for each packet size */
+} p3bench;
+
+/** The engines timed when the module was initialized and the one used */
+static p3bench p3benches[p3BENCH_MAX];
+static int p3bench_count = 0;
+static int p3bench_best = -1;
+
+/** A Mocana provider AEAD context, for AES-GCM or ChaCha20-Poly1305 */
+typedef struct {
+	int				chacha;		/*<< Set for ChaCha20-Poly1305 */
+	union {
+		p3gcm		gcm;
+		p3chacha	cc;
+	} u;
+} p3moc_aead;
+
+/**
+ * Known answer tests for the AES engines (NIST SP 800-38A F.2.1 and F.2.5).
+ * Each test is 4 blocks encrypted in CBC mode with the same IV and
+ * plain text.
+ */
+static const unsigned char p3kat_iv[16] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+	0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+};
+static const unsigned char p3kat_pt[64] = {
+	0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96,
+	0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+	0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c,
+	0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+	0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11,
+	0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+	0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17,
+	0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10
+};
+static const struct {
+	int				size;
+	unsigned char	key[p3MAX_KSIZE];
+	unsigned char	ct[64];
+} p3kat[] = {
+	{ p3KSIZE_AES128, {
+		0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+		0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+	}, {
+		0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46,
+		0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+		0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee,
+		0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+		0x73, 0xbe, 0xd6, 0xb8, 0xe3, 0xc1, 0x74, 0x3b,
+		0x71, 0x16, 0xe6, 0x9e, 0x22, 0x22, 0x95, 0x16,
+		0x3f, 0xf1, 0xca, 0xa1, 0x68, 0x1f, 0xac, 0x09,
+		0x12, 0x0e, 0xca, 0x30, 0x75, 0x86, 0xe1, 0xa7
+	} },
+	{ p3KSIZE_AES256, {
+		0x60, 0x3d, 0xeb, 0x10, 0x15, 0xca, 0x71, 0xbe,
+		0x2b, 0x73, 0xae, 0xf0, 0x85, 0x7d, 0x77, 0x81,
+		0x1f, 0x35, 0x2c, 0x07, 0x3b, 0x61, 0x08, 0xd7,
+		0x2d, 0x98, 0x10, 0xa3, 0x09, 0x14, 0xdf, 0xf4
+	}, {
+		0xf5, 0x8c, 0x4c, 0x04, 0xd6, 0xe5, 0xf1, 0xba,
+		0x77, 0x9e, 0xab, 0xfb, 0x5f, 0x7b, 0xfb, 0xd6,
+		0x9c, 0xfc, 0x4e, 0x96, 0x7e, 0xdb, 0x80, 0x8d,
+		0x67, 0x9f, 0x77, 0x7b, 0xc6, 0x70, 0x2c, 0x7d,
+		0x39, 0xf2, 0x33, 0x69, 0xa9, 0xd9, 0xba, 0xcf,
+		0xa5, 0x30, 0xe2, 0x63, 0x04, 0x23, 0x14, 0x61,
+		0xb2, 0xeb, 0x05, 0xe2, 0xc3, 0x9b, 0xe9, 0xfc,
+		0xda, 0x6c, 0x19, 0x07, 0x8c, 0x6a, 0x9d, 0x1b
+	} }
+};
+
+/**
+ * Known answer tests for AES-CTR (NIST SP 800-38A F.5.1 and F.5.5).  The
+ * keys and plain text are those of the CBC tests.
+ */
+static const unsigned char p3ckat_ctr[16] = {
+	0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7,
+	0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+};
+static const unsigned char p3ckat_ct[][64] = {
+	{
+		0x87, 0x4d, 0x61, 0x91, 0xb6, 0x20, 0xe3, 0x26,
+		0x1b, 0xef, 0x68, 0x64, 0x99, 0x0d, 0xb6, 0xce,
+		0x98, 0x06, 0xf6, 0x6b, 0x79, 0x70, 0xfd, 0xff,
+		0x86, 0x17, 0x18, 0x7b, 0xb9, 0xff, 0xfd, 0xff,
+		0x5a, 0xe4, 0xdf, 0x3e, 0xdb, 0xd5, 0xd3, 0x5e,
+		0x5b, 0x4f, 0x09, 0x02, 0x0d, 0xb0, 0x3e, 0xab,
+		0x1e, 0x03, 0x1d, 0xda, 0x2f, 0xbe, 0x03, 0xd1,
+		0x79, 0x21, 0x70, 0xa0, 0xf3, 0x00, 0x9c, 0xee
+	}, {
+		0x60, 0x1e, 0xc3, 0x13, 0x77, 0x57, 0x89, 0xa5,
+		0xb7, 0xa7, 0xf5, 0x04, 0xbb, 0xf3, 0xd2, 0x28,
+		0xf4, 0x43, 0xe3, 0xca, 0x4d, 0x62, 0xb5, 0x9a,
+		0xca, 0x84, 0xe9, 0x90, 0xca, 0xca, 0xf5, 0xc5,
+		0x2b, 0x09, 0x30, 0xda, 0xa2, 0x3d, 0xe9, 0x4c,
+		0xe8, 0x70, 0x17, 0xba, 0x2d, 0x84, 0x98, 0x8d,
+		0xdf, 0xc9, 0xc5, 0x8d, 0xb6, 0x7a, 0xad, 0xa6,
+		0x13, 0xc2, 0xdd, 0x08, 0x45, 0x79, 0x41, 0xa6
+	}
+};
+
+/**
+ * Known answer tests for AES-GCM (GCM specification test cases 4 and 16).
+ * The tests have a partial last block and partial associated data.
+ */
+static const unsigned char p3gkat_nonce[p3NONCE_SIZE] = {
+	0xca, 0xfe, 0xba, 0xbe, 0xfa, 0xce, 0xdb, 0xad,
+	0xde, 0xca, 0xf8, 0x88
+};
+static const unsigned char p3gkat_aad[20] = {
+	0xfe, 0xed, 0xfa, 0xce, 0xde, 0xad, 0xbe, 0xef,
+	0xfe, 0xed, 0xfa, 0xce, 0xde, 0xad, 0xbe, 0xef,
+	0xab, 0xad, 0xda, 0xd2
+};
+static const unsigned char p3gkat_pt[60] = {
+	0xd9, 0x31, 0x32, 0x25, 0xf8, 0x84, 0x06, 0xe5,
+	0xa5, 0x59, 0x09, 0xc5, 0xaf, 0xf5, 0x26, 0x9a,
+	0x86, 0xa7, 0xa9, 0x53, 0x15, 0x34, 0xf7, 0xda,
+	0x2e, 0x4c, 0x30, 0x3d, 0x8a, 0x31, 0x8a, 0x72,
+	0x1c, 0x3c, 0x0c, 0x95, 0x95, 0x68, 0x09, 0x53,
+	0x2f, 0xcf, 0x0e, 0x24, 0x49, 0xa6, 0xb5, 0x25,
+	0xb1, 0x6a, 0xed, 0xf5, 0xaa, 0x0d, 0xe6, 0x57,
+	0xba, 0x63, 0x7b, 0x39
+};
+static const struct {
+	int				size;
+	unsigned char	key[p3MAX_KSIZE];
+	unsigned char	ct[60 + p3TAG_SIZE];
+} p3gkat[] = {
+	{ p3KSIZE_AES128, {
+		0xfe, 0xff, 0xe9, 0x92, 0x86, 0x65, 0x73, 0x1c,
+		0x6d, 0x6a, 0x8f, 0x94, 0x67, 0x30, 0x83, 0x08
+	}, {
+		0x42, 0x83, 0x1e, 0xc2, 0x21, 0x77, 0x74, 0x24,
+		0x4b, 0x72, 0x21, 0xb7, 0x84, 0xd0, 0xd4, 0x9c,
+		0xe3, 0xaa, 0x21, 0x2f, 0x2c, 0x02, 0xa4, 0xe0,
+		0x35, 0xc1, 0x7e, 0x23, 0x29, 0xac, 0xa1, 0x2e,
+		0x21, 0xd5, 0x14, 0xb2, 0x54, 0x66, 0x93, 0x1c,
+		0x7d, 0x8f, 0x6a, 0x5a, 0xac, 0x84, 0xaa, 0x05,
+		0x1b, 0xa3, 0x0b, 0x39, 0x6a, 0x0a, 0xac, 0x97,
+		0x3d, 0x58, 0xe0, 0x91,
+		0x5b, 0xc9, 0x4f, 0xbc, 0x32, 0x21, 0xa5, 0xdb,
+		0x94, 0xfa, 0xe9, 0x5a, 0xe7, 0x12, 0x1a, 0x47
+	} },
+	{ p3KSIZE_AES256, {
+		0xfe, 0xff, 0xe9, 0x92, 0x86, 0x65, 0x73, 0x1c,
+		0x6d, 0x6a, 0x8f, 0x94, 0x67, 0x30, 0x83, 0x08,
+		0xfe, 0xff, 0xe9, 0x92, 0x86, 0x65, 0x73, 0x1c,
+		0x6d, 0x6a, 0x8f, 0x94, 0x67, 0x30, 0x83, 0x08
+	}, {
+		0x52, 0x2d, 0xc1, 0xf0, 0x99, 0x56, 0x7d, 0x07,
+		0xf4, 0x7f, 0x37, 0xa3, 0x2a, 0x84, 0x42, 0x7d,
+		0x64, 0x3a, 0x8c, 0xdc, 0xbf, 0xe5, 0xc0, 0xc9,
+		0x75, 0x98, 0xa2, 0xbd, 0x25, 0x55, 0xd1, 0xaa,
+		0x8c, 0xb0, 0x8e, 0x48, 0x59, 0x0d, 0xbb, 0x3d,
+		0xa7, 0xb0, 0x8b, 0x10, 0x56, 0x82, 0x88, 0x38,
+		0xc5, 0xf6, 0x1e, 0x63, 0x93, 0xba, 0x7a, 0x0a,
+		0xbc, 0xc9, 0xf6, 0x62,
+		0x76, 0xfc, 0x6e, 0xce, 0x0f, 0x4e, 0x17, 0x68,
+		0xcd, 0xdf, 0x88, 0x53, 0xbb, 0x2d, 0x55, 0x1b
+	} }
+};
+
+/**
+ * Known answer test for ChaCha20-Poly1305 (RFC 8439 A.5).  The test has
+ * several pairs of blocks, a partial last block and partial associated
+ * data.
+ */
+static const unsigned char p3xkat_key[p3CHACHA_KEYSZ] = {
+	0x1c, 0x92, 0x40, 0xa5, 0xeb, 0x55, 0xd3, 0x8a,
+	0xf3, 0x33, 0x88, 0x86, 0x04, 0xf6, 0xb5, 0xf0,
+	0x47, 0x39, 0x17, 0xc1, 0x40, 0x2b, 0x80, 0x09,
+	0x9d, 0xca, 0x5c, 0xbc, 0x20, 0x70, 0x75, 0xc0
+};
+static const unsigned char p3xkat_nonce[p3NONCE_SIZE] = {
+	0x00, 0x00, 0x00, 0x00, 0x01, 0x02, 0x03, 0x04,
+	0x05, 0x06, 0x07, 0x08
+};
+static const unsigned char p3xkat_aad[12] = {
+	0xf3, 0x33, 0x88, 0x86, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x4e, 0x91
+};
+static const char p3xkat_pt[] =
+	"Internet-Drafts are draft documents valid for a maximum of six "
+	"months and may be updated, replaced, or obsoleted by other "
+	"documents at any time. It is inappropriate to use Internet-Drafts "
+	"as reference material or to cite them other than as "
+	"/\xe2\x80\x9cwork in progress./\xe2\x80\x9d";
+static const unsigned char p3xkat_ct[sizeof(p3xkat_pt) - 1 + p3TAG_SIZE] = {
+	0x64, 0xa0, 0x86, 0x15, 0x75, 0x86, 0x1a, 0xf4,
+	0x60, 0xf0, 0x62, 0xc7, 0x9b, 0xe6, 0x43, 0xbd,
+	0x5e, 0x80, 0x5c, 0xfd, 0x34, 0x5c, 0xf3, 0x89,
+	0xf1, 0x08, 0x67, 0x0a, 0xc7, 0x6c, 0x8c, 0xb2,
+	0x4c, 0x6c, 0xfc, 0x18, 0x75, 0x5d, 0x43, 0xee,
+	0xa0, 0x9e, 0xe9, 0x4e, 0x38, 0x2d, 0x26, 0xb0,
+	0xbd, 0xb7, 0xb7, 0x3c, 0x32, 0x1b, 0x01, 0x00,
+	0xd4, 0xf0, 0x3b, 0x7f, 0x35, 0x58, 0x94, 0xcf,
+	0x33, 0x2f, 0x83, 0x0e, 0x71, 0x0b, 0x97, 0xce,
+	0x98, 0xc8, 0xa8, 0x4a, 0xbd, 0x0b, 0x94, 0x81,
+	0x14, 0xad, 0x17, 0x6e, 0x00, 0x8d, 0x33, 0xbd,
+	0x60, 0xf9, 0x82, 0xb1, 0xff, 0x37, 0xc8, 0x55,
+	0x97, 0x97, 0xa0, 0x6e, 0xf4, 0xf0, 0xef, 0x61,
+	0xc1, 0x86, 0x32, 0x4e, 0x2b, 0x35, 0x06, 0x38,
+	0x36, 0x06, 0x90, 0x7b, 0x6a, 0x7c, 0x02, 0xb0,
+	0xf9, 0xf6, 0x15, 0x7b, 0x53, 0xc8, 0x67, 0xe4,
+	0xb9, 0x16, 0x6c, 0x76, 0x7b, 0x80, 0x4d, 0x46,
+	0xa5, 0x9b, 0x52, 0x16, 0xcd, 0xe7, 0xa4, 0xe9,
+	0x90, 0x40, 0xc5, 0xa4, 0x04, 0x33, 0x22, 0x5e,
+	0xe2, 0x82, 0xa1, 0xb0, 0xa0, 0x6c, 0x52, 0x3e,
+	0xaf, 0x45, 0x34, 0xd7, 0xf8, 0x3f, 0xa1, 0x15,
+	0x5b, 0x00, 0x47, 0x71, 0x8c, 0xbc, 0x54, 0x6a,
+	0x0d, 0x07, 0x2b, 0x04, 0xb3, 0x56, 0x4e, 0xea,
+	0x1b, 0x42, 0x22, 0x73, 0xf5, 0x48, 0x27, 0x1a,
+	0x0b, 0xb2, 0x31, 0x60, 0x53, 0xfa, 0x76, 0x99,
+	0x19, 0x55, 0xeb, 0xd6, 0x31, 0x59, 0x43, 0x4e,
+	0xce, 0xbb, 0x4e, 0x46, 0x6d, 0xae, 0x5a, 0x10,
+	0x73, 0xa6, 0x72, 0x76, 0x27, 0x09, 0x7a, 0x10,
+	0x49, 0xe6, 0x17, 0xd9, 0x1d, 0x36, 0x10, 0x94,
+	0xfa, 0x68, 0xf0, 0xff, 0x77, 0x98, 0x71, 0x30,
+	0x30, 0x5b, 0xea, 0xba, 0x2e, 0xda, 0x04, 0xdf,
+	0x99, 0x7b, 0x71, 0x4d, 0x6c, 0x6f, 0x2c, 0x29,
+	0xa6, 0xad, 0x5c, 0xb4, 0x02, 0x2b, 0x02, 0x70,
+	0x9b, 0xee, 0xad, 0x9d, 0x67, 0x89, 0x0c, 0xbb,
+	0x22, 0x39, 0x23, 0x36, 0xfe, 0xa1, 0x85, 0x1f,
+	0x38
+};
+
+/**
+ * \par Function:
+ * p3moc_create
+ *
+ * \par Description:
+ * Create a Mocana AES context for a key.
+ *
+ * \par Inputs:
+ * - key: The key
+ * - size: The key size, in bytes
+ * - encrypt: 1 for an encryption context, 0 for decryption
+ *
+ * \par Outputs:
+ * - void *: The context or NULL if there is an error
+ */
+
+static void *p3moc_create(unsigned char *key, int size, int encrypt)
+{
+	return ((void *) CreateAESCtx(MOC_SYM(hwAccelCtx) key, size,
+			encrypt ? TRUE : FALSE));
+} /* end p3moc_create */
+
+/**
+ * \par Function:
+ * p3moc_release
+ *
+ * \par Description:
+ * Release a Mocana AES context.
+ *
+ * \par Inputs:
+ * - ctx: The context
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3moc_release(void *ctx)
+{
+	if (DeleteAESCtx(MOC_SYM(hwAccelCtx) (BulkCtx)ctx) < 0)
+		p3errmsg(p3MSG_ERR, "p3_rekey: Failed to release crypto context\n");
+} /* end p3moc_release */
+
+/**
+ * \par Function:
+ * p3moc_crypt
+ *
+ * \par Description:
+ * Encrypt or decrypt a buffer in place in CBC mode with a Mocana AES
+ * context.  The IV is set to the last cipher block.
+ *
+ * \par Inputs:
+ * - ctx: The context
+ * - buffer: The buffer
+ * - size: The size of the buffer, which must be a multiple of 16
+ * - encrypt: 1 to encrypt, 0 to decrypt
+ * - iv: The 16 byte IV
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Mocana error code
+ */
+
+static int p3moc_crypt(void *ctx, unsigned char *buffer, int size,
+		int encrypt, unsigned char *iv)
+{
+	return (DoAES(MOC_SYM(hwAccelCtx) (BulkCtx)ctx, buffer, size,
+			encrypt ? TRUE : FALSE, iv));
+} /* end p3moc_crypt */
+
+/**
+ * \par Function:
+ * p3moc_crypt_batch
+ *
+ * \par Description:
+ * Encrypt several buffers in CBC mode with Mocana AES contexts.  The
+ * AES instructions encrypt independent buffers together.  CBC
+ * decryption does not depend on the previous cipher block, so it is
+ * already parallel within one buffer and is not handled here.
+ *
+ * \par Inputs:
+ * - ctx: The contexts
+ * - buffer: The buffers
+ * - size: The buffer sizes, which must be multiples of 16
+ * - iv: The 16 byte IVs
+ * - count: The number of buffers (at most p3BATCH_MAX)
+ * - encrypt: 1 to encrypt, 0 to decrypt
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: The buffers must be handled one at a time
+ */
+
+static int p3moc_crypt_batch(void **ctx, unsigned char **buffer, int *size,
+		unsigned char **iv, int count, int encrypt)
+{
+	int i;
+	aesCipherContext *aes;
+	p3aesni_stream streams[p3BATCH_MAX];
+
+	if (!encrypt || !p3aesni_on || count < 2)
+		return (-1);
+	for (i=0; i < count; i++) {
+		aes = (aesCipherContext *) ctx[i];
+		if (aes->mode != MODE_CBC || !aes->encrypt || (size[i] & 0xf))
+			return (-1);
+		streams[i].nk = aes->nk;
+		streams[i].nr = aes->Nr;
+		streams[i].data = buffer[i];
+		streams[i].len = size[i];
+		streams[i].iv = iv[i];
+	}
+	return (p3aesni_cbc_multi(streams, count));
+} /* end p3moc_crypt_batch */
+
+/**
+ * \par Function:
+ * p3moc_reason
+ *
+ * \par Description:
+ * Get the text for a Mocana error code.
+ *
+ * \par Inputs:
+ * - stat: The error code
+ *
+ * \par Outputs:
+ * - const char *: The error text
+ */
+
+static const char *p3moc_reason(int stat)
+{
+	char *mocerr;
+
+	if ((mocerr = MERROR_lookUpErrorCode(stat)) == NULL)
+		mocerr = unknown_err;
+	return (mocerr);
+} /* end p3moc_reason */
+
+/**
+ * \par Function:
+ * p3moc_aead_create
+ *
+ * \par Description:
+ * Create an AES-GCM or ChaCha20-Poly1305 context for a key.
+ *
+ * \par Inputs:
+ * - key: The key
+ * - size: The key size, in bytes
+ * - ktype: The key type (p3KTYPE_*)
+ *
+ * \par Outputs:
+ * - void *: The context or NULL if there is an error
+ */
+
+static void *p3moc_aead_create(unsigned char *key, int size, int ktype)
+{
+	int stat;
+	p3moc_aead *aead;
+
+	if ((aead = (p3moc_aead *) p3malloc(sizeof(p3moc_aead))) == NULL)
+		goto out;
+	aead->chacha = p3KTYPE_CHACHA(ktype);
+	if (aead->chacha)
+		stat = p3chacha_key(&aead->u.cc, key, size);
+	else
+		stat = p3gcm_key(&aead->u.gcm, key, size);
+	if (stat < 0) {
+		p3free(aead);
+		aead = NULL;
+	}
+
+out:
+	return ((void *) aead);
+} /* end p3moc_aead_create */
+
+/**
+ * \par Function:
+ * p3moc_aead_release
+ *
+ * \par Description:
+ * Release an AES-GCM or ChaCha20-Poly1305 context.
+ *
+ * \par Inputs:
+ * - ctx: The context
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3moc_aead_release(void *ctx)
+{
+	memset(ctx, 0, sizeof(p3moc_aead));
+	p3free(ctx);
+} /* end p3moc_aead_release */
+
+/**
+ * \par Function:
+ * p3moc_aead_crypt
+ *
+ * \par Description:
+ * Encrypt or decrypt a buffer in place with an AES-GCM or
+ * ChaCha20-Poly1305 context.
+ *
+ * \par Inputs:
+ * - ctx: The context
+ * - buffer: The buffer, followed by the tag
+ * - size: The size of the buffer
+ * - aad: The associated data
+ * - alen: The size of the associated data
+ * - nonce: The nonce
+ * - encrypt: 1 to encrypt, 0 to decrypt
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: The tag does not match
+ */
+
+static int p3moc_aead_crypt(void *ctx, unsigned char *buffer, int size,
+		unsigned char *aad, int alen, unsigned char *nonce, int encrypt)
+{
+	p3moc_aead *aead = (p3moc_aead *) ctx;
+
+	if (aead->chacha)
+		return (p3chacha_crypt(&aead->u.cc, buffer, size, aad, alen, nonce,
+				encrypt));
+	return (p3gcm_crypt(&aead->u.gcm, buffer, size, aad, alen, nonce, encrypt));
+} /* end p3moc_aead_crypt */
+
+/**
+ * \par Function:
+ * p3moc_ctr_crypt
+ *
+ * \par Description:
+ * Encrypt or decrypt a buffer of any size in place in CTR mode with a
+ * Mocana AES encryption context.  The context is only read, so it can
+ * be used on several CPUs at once.  The last 4 bytes of the counter
+ * block are a big endian block counter.
+ *
+ * \par Inputs:
+ * - ctx: The encryption context
+ * - buffer: The buffer
+ * - size: The size of the buffer
+ * - ctr: The 16 byte counter block, set to the next counter
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Mocana error code
+ */
+
+static int p3moc_ctr_crypt(void *ctx, unsigned char *buffer, int size,
+		unsigned char *ctr)
+{
+	int i, n;
+	unsigned char ks[16];
+	aesCipherContext *aes = (aesCipherContext *) ctx;
+
+	if (!aes->encrypt)
+		return (ERR_AES_BAD_OPERATION);
+	if (p3aesni_on && p3aesni_ctr(aes->nk, aes->Nr, buffer, size, ctr) == 0)
+		return (0);
+	if (p3bsaes_on && p3bsaes_ctr(aes->nk, aes->Nr, buffer, size, ctr) == 0)
+		return (0);
+	for ( ; size > 0; size -= n, buffer += n) {
+		aesEncrypt(aes->rk, aes->Nr, ctr, ks);
+		n = (size < 16) ? size : 16;
+		for (i=0; i < n; i++)
+			buffer[i] ^= ks[i];
+		// Increment the block counter
+		for (i=15; i >= 12 && ++ctr[i] == 0; i--)
+			;
+	}
+	memset(ks, 0, sizeof(ks));
+	return (0);
+} /* end p3moc_ctr_crypt */
+
+static const p3cipher p3moc_cipher = {
+	.name = "mocana",
+	.create = p3moc_create,
+	.release = p3moc_release,
+	.crypt = p3moc_crypt,
+	.reason = p3moc_reason,
+	.crypt_batch = p3moc_crypt_batch,
+	.aead_create = p3moc_aead_create,
+	.aead_release = p3moc_aead_release,
+	.aead_crypt = p3moc_aead_crypt,
+	.ctr_crypt = p3moc_ctr_crypt,
+};
+
+/**
+ * \par Function:
+ * p3_get_key_size
+ *
+ * \par Description:
+ * Get the size of an encryption key.
+ *
+ * \par Inputs:
+ * - type: The type of the encryption algorithm.
+ *
+ * \par Outputs:
+ * - int:
+ *   - 0: Key size
+ *   - <0: Error
+ */
+int p3_get_key_size(int type)
+{
+	int size = -1;
+
+	switch(type) {
+	case p3KTYPE_AES128:
+	case p3KTYPE_AESGCM128:
+	case p3KTYPE_AESCTR128:
+		size = p3KSIZE_AES128;
+		break;
+
+	case p3KTYPE_AES256:
+	case p3KTYPE_AESGCM256:
+	case p3KTYPE_AESCTR256:
+	case p3KTYPE_CHACHA20:
+		size = p3KSIZE_AES256;
+		break;
+	}
+
+	return (size);
+} /* end p3_get_key_size */
+
+/**
+ * \par Function:
+ * p3_key_init
+ *
+ * \par Description:
+ * Set up the key manager for the Ramdisk buffer.  The number of key
+ * rings is written to the buffer for the key server, which sets the
+ * number of slots in each ring when it starts.
+ *
+ * \par Inputs:
+ * - key_mgr: The P3 key manager structure to set up
+ * - ramdisk: The Ramdisk buffer
+ * - size: The size of the Ramdisk buffer, in bytes
+ * - rings: The number of key rings
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: The buffer is too small for the key rings
+ */
+int p3_key_init(p3key_mgr *key_mgr, unsigned char *ramdisk, int size, int rings)
+{
+	int stat = 0;
+
+	if (rings < 1 || rings > p3KSERV_RINGS)
+		rings = 1;
+	key_mgr->key_serv = (p3key_serv *) ramdisk;
+	key_mgr->rings = rings;
+	key_mgr->slots = (size - (int) sizeof(p3key_serv) -
+			(rings * (int) sizeof(p3key_ring))) / p3KSERV_SLOT;
+	if (key_mgr->slots < rings) {
+		sprintf(p3buf, "p3_key_init: Ramdisk is too small for %d key rings\n",
+				rings);
+		p3errmsg(p3MSG_CRIT, p3buf);
+		stat = -1;
+		goto out;
+	}
+	key_mgr->key_serv->cbuf_sz = 0;
+	key_mgr->key_serv->rings = rings;
+
+out:
+	return (stat);
+} /* end p3_key_init */
+
+/**
+ * \page P3KM_MSGS Protected Point to Point Kernel Module Messages
+ * <hr><b>p3_key_init: Ramdisk is too small for <i>number</i> key rings</b>
+ * \par Description (CRIT):
+ * The ramdisk set by the p3ramdisk_kb module parameter does not have
+ * room for a key in each of the key rings set by the p3key_rings module
+ * parameter.  The P3 kernel module is not started.
+ * \par Response:
+ * Increase p3ramdisk_kb or decrease p3key_rings.
+ *
+ */
+
+/**
+ * \par Function:
+ * p3_get_key
+ *
+ * \par Description:
+ * Get an encryption key from the Ramdisk buffer.
+ *
+ * \par Inputs:
+ * - key: The P3 key structure.  The flag in the structure contains
+ *   information about the key, such as its type (size).  The new key
+ *   is returned in this structure.
+ * - ring: The key ring of the session
+ * - key_mgr: The P3 key manager structure that maintains information
+ *   about the circular buffer of keys.
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Error
+ *   - >0: Key unavailable, try later
+ */
+int p3_get_key(p3key *key, int ring, p3key_mgr *key_mgr)
+{
+	return (p3_get_keys(key, 1, ring, key_mgr));
+} /* end p3_get_key */
+
+/**
+ * \par Function:
+ * p3_get_keys
+ *
+ * \par Description:
+ * Get several encryption keys from a key ring of the Ramdisk buffer at
+ * once.  The keys are taken without a lock: the key server only moves
+ * the tail after the keys before it are written, and the keys are
+ * copied before the head is moved past them with a compare and
+ * exchange.  If another CPU moves the head first, the copies may have
+ * been overwritten by the key server, so they are made again.  The
+ * counts and slot number come from memory the key server can write, so
+ * they are checked before the slots are read.  The key server is woken
+ * when the keys left in the ring drop below the low watermark or there
+ * are not enough keys.
+ *
+ * \par Inputs:
+ * - keys: The P3 key structures.  The size of each key must be set,
+ *   and the new keys are returned in these structures.
+ * - count: The number of keys
+ * - ring: The key ring of the session, any number can be used
+ * - key_mgr: The P3 key manager structure that maintains information
+ *   about the circular buffer of keys.
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Error
+ *   - >0: Not enough keys, none were taken, try later
+ */
+int p3_get_keys(p3key *keys, int count, int ring, p3key_mgr *key_mgr)
+{
+	int i, stat = 0;
+	unsigned int head, tail, mask, slots, low;
+	p3key_serv *key_serv;
+	p3key_ring *kring;
+	unsigned char *cbuf;
+
+	if (key_mgr == NULL || (key_serv = key_mgr->key_serv) == NULL) {
+		p3errmsg(p3MSG_ERR, "p3_get_key: Key server is NULL\n");
+		stat = -1;
+		goto out;
+	}
+	slots = ACCESS_ONCE(key_serv->cbuf_sz);
+	if (slots == 0 || (slots & (slots - 1)) != 0 ||
+			slots > key_mgr->slots / key_mgr->rings) {
+		p3errmsg(p3MSG_ERR, "p3_get_key: Key server buffer is not valid\n");
+		stat = -1;
+		goto out;
+	}
+	mask = slots - 1;
+	ring = (unsigned int) ring % key_mgr->rings;
+	kring = (p3key_ring *) (key_serv + 1);
+	cbuf = (unsigned char *) (kring + key_mgr->rings) + (ring * slots * p3KSERV_SLOT);
+	kring += ring;
+
+	do {
+		// Reserve keys that the key server has finished writing
+		head = ACCESS_ONCE(kring->head);
+		tail = ACCESS_ONCE(kring->tail);
+		smp_rmb();
+		if (tail - head > slots) {
+			p3errmsg(p3MSG_ERR, "p3_get_key: Key server buffer is not valid\n");
+			stat = -1;
+			goto trace;
+		}
+		// Not enough keys available
+		if (tail - head < count) {
+			p3seq_add(key_mgr->starved, 1);
+			p3key_wake();
+			stat = 1;
+			goto trace;
+		}
+		for (i=0; i < count; i++) {
+			if (keys[i].size > p3KSERV_SLOT) {
+				stat = -1;
+				goto trace;
+			}
+			memcpy(keys[i].key, &cbuf[((head + i) & mask) * p3KSERV_SLOT],
+					keys[i].size);
+		}
+	// Commit, cmpxchg orders the copies before the new head
+	} while (cmpxchg(&kring->head, head, head + count) != head);
+// TODO: Zero used keys??
+
+	// Wake the key server if the keys are running low
+	low = min_t(unsigned int, p3key_low, slots);
+	if (tail - head - count < low) {
+		if (tail - head >= low)
+			p3seq_add(key_mgr->low, 1);
+		p3key_wake();
+	}
+
+trace:
+	p3trace_prgs(get_key, head, tail, count, stat);
+
+out:
+	return (stat);
+} /* end p3_get_keys */
+
+/**
+ * \par Function:
+ * p3_key_avail
+ *
+ * \par Description:
+ * Get the number of keys in the Ramdisk buffer that the kernel module
+ * has not taken, over all key rings.
+ *
+ * \par Inputs:
+ * - key_mgr: The P3 key manager structure that maintains information
+ *   about the circular buffer of keys.
+ *
+ * \par Outputs:
+ * - int: The number of keys, or <0 if the buffer is not valid
+ */
+int p3_key_avail(p3key_mgr *key_mgr)
+{
+	int i, avail = 0;
+	unsigned int head, tail, slots;
+	p3key_ring *kring;
+
+	if (key_mgr == NULL || key_mgr->key_serv == NULL)
+		return (-1);
+	slots = ACCESS_ONCE(key_mgr->key_serv->cbuf_sz);
+	if (slots > key_mgr->slots / key_mgr->rings)
+		return (-1);
+	kring = (p3key_ring *) (key_mgr->key_serv + 1);
+	for (i=0; i < key_mgr->rings; i++) {
+		head = ACCESS_ONCE(kring[i].head);
+		tail = ACCESS_ONCE(kring[i].tail);
+		if (tail - head > slots)
+			return (-1);
+		avail += tail - head;
+	}
+	return (avail);
+} /* end p3_key_avail */
+
+/**
+ * \par Function:
+ * p3_key_low
+ *
+ * \par Description:
+ * Check whether the key server should add keys to the Ramdisk buffer.
+ * This is true when the keys left in any key ring are below the
+ * p3key_low watermark, which is limited to the size of a ring, or the
+ * buffer has not been set up yet.
+ *
+ * \par Inputs:
+ * - key_mgr: The P3 key manager structure that maintains information
+ *   about the circular buffer of keys.
+ *
+ * \par Outputs:
+ * - int: 1 if the keys are low, else 0
+ */
+int p3_key_low(p3key_mgr *key_mgr)
+{
+	int i;
+	unsigned int slots, low;
+	p3key_ring *kring;
+
+	if (p3_key_avail(key_mgr) < 0)
+		return (0);
+	slots = ACCESS_ONCE(key_mgr->key_serv->cbuf_sz);
+	if (slots == 0)
+		return (1);
+	low = min_t(unsigned int, p3key_low, slots);
+	kring = (p3key_ring *) (key_mgr->key_serv + 1);
+	for (i=0; i < key_mgr->rings; i++) {
+		if (ACCESS_ONCE(kring[i].tail) - ACCESS_ONCE(kring[i].head) < low)
+			return (1);
+	}
+	return (0);
+} /* end p3_key_low */
+
+/**
+ * \page P3KM_MSGS Protected Point to Point Kernel Module Messages
+ * <hr><b>p3_get_key: Key server is NULL</b>
+ * \par Description (ERR):
+ * The key server was not properly initialized.
+ * \par Response:
+ * Report the problem to Velocite Systems support.
+ *
+ * <hr><b>p3_get_key: Key server buffer is not valid</b>
+ * \par Description (ERR):
+ * The number of key slots or the head and tail counts written by the
+ * key server are not possible for the ramdisk.  No keys are taken.
+ * \par Response:
+ * Restart the P3 primary application, or report the problem to
+ * Velocite Systems support.
+ *
+ */
+
+
+/**
+ * \par Function:
+ * p3_get_key_array
+ *
+ * \par Description:
+ * Get an array of encryption keys.  All keys in the array are true
+ * random numbers.
+ *
+ * \par Inputs:
+ * - size: The size, in bytes, of the key to be retrieved
+ * - number: The number of keys in the array
+ * - key_mgr: The P3 key server structure that maintains information
+ *   about the circular buffer of keys.
+ *
+ * \par Outputs:
+ * - p3key**: The array containing the keys.  If there is an error,
+ *   NULL is returned.
+ */
+p3key **p3_get_key_array(int size, int number, p3key_mgr *key_mgr)
+{
+	p3key **gk_key_array = NULL;
+	// TODO: Get an encryption key array
+	return (gk_key_array);
+} /* end p3_get_key_array */
+
+/**
+ * \par Function:
+ * p3_crypto_kat
+ *
+ * \par Description:
+ * Run the known answer tests with a crypto provider.  Each test
+ * encrypts and decrypts the test data in place, as the packet path does.
+ *
+ * \par Inputs:
+ * - ops: The crypto provider
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: A test failed
+ */
+
+static int p3_crypto_kat(const p3cipher *ops)
+{
+	int i, stat = 0;
+	unsigned char buf[64], iv[16];
+	void *enc = NULL, *dec = NULL;
+
+	for (i=0; i < sizeof(p3kat) / sizeof(p3kat[0]) && !stat; i++) {
+		if ((enc = ops->create((unsigned char *) p3kat[i].key,
+				p3kat[i].size, 1)) == NULL ||
+				(dec = ops->create((unsigned char *) p3kat[i].key,
+				p3kat[i].size, 0)) == NULL) {
+			stat = -1;
+			goto release;
+		}
+		memcpy(buf, p3kat_pt, sizeof(buf));
+		memcpy(iv, p3kat_iv, sizeof(iv));
+		if (ops->crypt(enc, buf, sizeof(buf), 1, iv) < 0 ||
+				memcmp(buf, p3kat[i].ct, sizeof(buf)) != 0) {
+			stat = -1;
+			goto release;
+		}
+		memcpy(iv, p3kat_iv, sizeof(iv));
+		if (ops->crypt(dec, buf, sizeof(buf), 0, iv) < 0 ||
+				memcmp(buf, p3kat_pt, sizeof(buf)) != 0) {
+			stat = -1;
+		}
+
+release:
+		if (enc != NULL)
+			ops->release(enc);
+		if (dec != NULL)
+			ops->release(dec);
+		enc = dec = NULL;
+	}
+	return (stat);
+} /* end p3_crypto_kat */
+
+/**
+ * \par Function:
+ * p3_crypto_ctr_kat
+ *
+ * \par Description:
+ * Run the AES-CTR known answer tests with a crypto provider.  Each test
+ * encrypts and decrypts the test data in place, and encrypts a partial
+ * last block.
+ *
+ * \par Inputs:
+ * - ops: The crypto provider
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: A test failed or the provider has no AES-CTR
+ */
+
+static int p3_crypto_ctr_kat(const p3cipher *ops)
+{
+	int i, stat = 0;
+	unsigned char buf[64], ctr[16];
+	void *ctx;
+
+	if (ops->ctr_crypt == NULL) {
+		stat = -1;
+		goto out;
+	}
+	for (i=0; i < sizeof(p3kat) / sizeof(p3kat[0]) && !stat; i++) {
+		if ((ctx = ops->create((unsigned char *) p3kat[i].key,
+				p3kat[i].size, 1)) == NULL) {
+			stat = -1;
+			goto out;
+		}
+		memcpy(buf, p3kat_pt, sizeof(buf));
+		memcpy(ctr, p3ckat_ctr, sizeof(ctr));
+		if (ops->ctr_crypt(ctx, buf, sizeof(buf), ctr) < 0 ||
+				memcmp(buf, p3ckat_ct[i], sizeof(buf)) != 0)
+			stat = -1;
+		memcpy(ctr, p3ckat_ctr, sizeof(ctr));
+		if (ops->ctr_crypt(ctx, buf, sizeof(buf), ctr) < 0 ||
+				memcmp(buf, p3kat_pt, sizeof(buf)) != 0)
+			stat = -1;
+		memcpy(ctr, p3ckat_ctr, sizeof(ctr));
+		if (ops->ctr_crypt(ctx, buf, sizeof(buf) - 5, ctr) < 0 ||
+				memcmp(buf, p3ckat_ct[i], sizeof(buf) - 5) != 0 ||
+				memcmp(&buf[sizeof(buf) - 5], &p3kat_pt[sizeof(buf) - 5], 5) != 0)
+			stat = -1;
+		ops->release(ctx);
+	}
+
+out:
+	return (stat);
+} /* end p3_crypto_ctr_kat */
+
+/**
+ * \par Function:
+ * p3_crypto_gcm_kat
+ *
+ * \par Description:
+ * Run the AES-GCM known answer tests with a crypto provider.  Each test
+ * encrypts and decrypts the test data in place, and checks that a
+ * changed tag is rejected.
+ *
+ * \par Inputs:
+ * - ops: The crypto provider
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: A test failed or the provider has no AES-GCM
+ */
+
+static int p3_crypto_gcm_kat(const p3cipher *ops)
+{
+	int i, stat = 0;
+	unsigned char buf[60 + p3TAG_SIZE], nonce[p3NONCE_SIZE], aad[20];
+	void *ctx;
+
+	if (ops->aead_create == NULL) {
+		stat = -1;
+		goto out;
+	}
+	for (i=0; i < sizeof(p3gkat) / sizeof(p3gkat[0]) && !stat; i++) {
+		if ((ctx = ops->aead_create((unsigned char *) p3gkat[i].key,
+				p3gkat[i].size, (p3gkat[i].size == p3KSIZE_AES128) ?
+				p3KTYPE_AESGCM128 : p3KTYPE_AESGCM256)) == NULL) {
+			stat = -1;
+			goto out;
+		}
+		memcpy(buf, p3gkat_pt, sizeof(p3gkat_pt));
+		memcpy(nonce, p3gkat_nonce, sizeof(nonce));
+		memcpy(aad, p3gkat_aad, sizeof(aad));
+		if (ops->aead_crypt(ctx, buf, sizeof(p3gkat_pt), aad, sizeof(aad),
+				nonce, 1) < 0 ||
+				memcmp(buf, p3gkat[i].ct, sizeof(buf)) != 0 ||
+				ops->aead_crypt(ctx, buf, sizeof(p3gkat_pt), aad, sizeof(aad),
+				nonce, 0) < 0 ||
+				memcmp(buf, p3gkat_pt, sizeof(p3gkat_pt)) != 0) {
+			stat = -1;
+		} else {
+			memcpy(buf, p3gkat[i].ct, sizeof(buf));
+			buf[sizeof(buf) - 1] ^= 1;
+			if (ops->aead_crypt(ctx, buf, sizeof(p3gkat_pt), aad, sizeof(aad),
+					nonce, 0) == 0)
+				stat = -1;
+		}
+		ops->aead_release(ctx);
+	}
+
+out:
+	return (stat);
+} /* end p3_crypto_gcm_kat */
+
+/**
+ * \par Function:
+ * p3_crypto_chacha_kat
+ *
+ * \par Description:
+ * Run the ChaCha20-Poly1305 known answer test with a crypto provider.
+ * The test encrypts and decrypts the test data in place, and checks
+ * that a changed tag is rejected.
+ *
+ * \par Inputs:
+ * - ops: The crypto provider
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: The test failed or the provider has no ChaCha20-Poly1305
+ */
+
+static int p3_crypto_chacha_kat(const p3cipher *ops)
+{
+	int stat = 0, size = sizeof(p3xkat_pt) - 1;
+	unsigned char buf[sizeof(p3xkat_ct)], nonce[p3NONCE_SIZE];
+	unsigned char aad[sizeof(p3xkat_aad)];
+	void *ctx;
+
+	if (ops->aead_create == NULL || (ctx = ops->aead_create((unsigned char *)
+			p3xkat_key, sizeof(p3xkat_key), p3KTYPE_CHACHA20)) == NULL) {
+		stat = -1;
+		goto out;
+	}
+	memcpy(buf, p3xkat_pt, size);
+	memcpy(nonce, p3xkat_nonce, sizeof(nonce));
+	memcpy(aad, p3xkat_aad, sizeof(aad));
+	if (ops->aead_crypt(ctx, buf, size, aad, sizeof(aad), nonce, 1) < 0 ||
+			memcmp(buf, p3xkat_ct, sizeof(buf)) != 0 ||
+			ops->aead_crypt(ctx, buf, size, aad, sizeof(aad), nonce, 0) < 0 ||
+			memcmp(buf, p3xkat_pt, size) != 0) {
+		stat = -1;
+	} else {
+		memcpy(buf, p3xkat_ct, sizeof(buf));
+		buf[sizeof(buf) - 1] ^= 1;
+		if (ops->aead_crypt(ctx, buf, size, aad, sizeof(aad), nonce, 0) == 0)
+			stat = -1;
+	}
+	ops->aead_release(ctx);
+
+out:
+	return (stat);
+} /* end p3_crypto_chacha_kat */
+
+/**
+ * \par Function:
+ * p3_crypto_bench_run
+ *
+ * \par Description:
+ * Time an AES engine the way the kernel RAID6 code chooses its
+ * functions.  Each packet size is encrypted and decrypted in AES-256-CBC
+ * for a fixed number of jiffies with preemption off, and the data is
+ * checked when the time is up.  The engine is added to the benchmark
+ * table with its speed for each packet size.
+ *
+ * \par Inputs:
+ * - name: The engine name
+ * - ops: The crypto provider
+ * - aesni: The value of p3aesni_on for the engine
+ * - bsaes: The value of p3bsaes_on for the engine
+ * - buf: A buffer of at least p3PKT_LARGE bytes
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3_crypto_bench_run(const char *name, const p3cipher *ops,
+		int aesni, int bsaes, unsigned char *buf)
+{
+	int i, n, size, stat = 0;
+	unsigned long bytes, start;
+	unsigned char iv[16];
+	void *enc = NULL, *dec = NULL;
+	p3bench *bench;
+
+	if (p3bench_count >= p3BENCH_MAX)
+		return;
+	p3aesni_on = aesni;
+	p3bsaes_on = bsaes;
+	n = sizeof(p3kat) / sizeof(p3kat[0]) - 1;
+	if ((enc = ops->create((unsigned char *) p3kat[n].key,
+			p3kat[n].size, 1)) == NULL ||
+			(dec = ops->create((unsigned char *) p3kat[n].key,
+			p3kat[n].size, 0)) == NULL)
+		goto out;
+
+	bench = &p3benches[p3bench_count];
+	for (n=0; n < p3BENCH_SIZES && !stat; n++) {
+		size = p3bench_size[n];
+		for (i=0; i < size; i++)
+			buf[i] = (unsigned char) i;
+		bytes = 0;
+		preempt_disable();
+		start = jiffies;
+		while (jiffies == start)
+			cpu_relax();
+		start = jiffies;
+		while (time_before(jiffies, start + p3BENCH_TIME) && !stat) {
+			memcpy(iv, p3kat_iv, sizeof(iv));
+			if (ops->crypt(enc, buf, size, 1, iv) < 0)
+				stat = -1;
+			memcpy(iv, p3kat_iv, sizeof(iv));
+			if (ops->crypt(dec, buf, size, 0, iv) < 0)
+				stat = -1;
+			bytes += size << 1;
+		}
+		preempt_enable();
+		for (i=0; i < size; i++) {
+			if (buf[i] != (unsigned char) i)
+				stat = -1;
+		}
+		bench->mbs[n] = ((bytes >> 10) * HZ / p3BENCH_TIME) >> 10;
+	}
+	if (stat < 0) {
+		sprintf(p3buf, "p3_crypto_probe: Benchmark of AES %s failed\n", name);
+		p3errmsg(p3MSG_WARN, p3buf);
+		goto out;
+	}
+	bench->name = name;
+	bench->ops = ops;
+	bench->aesni = aesni;
+	bench->bsaes = bsaes;
+	p3bench_count++;
+
+out:
+	if (enc != NULL)
+		ops->release(enc);
+	if (dec != NULL)
+		ops->release(dec);
+} /* end p3_crypto_bench_run */
+
+/**
+ * \par Function:
+ * p3_crypto_engines
+ *
+ * \par Description:
+ * Test the AES engines of a crypto provider and time the ones that
+ * pass the known answer tests.  For the Mocana provider, the constant
+ * time AES code replaces the AES table code if it is enabled and passes
+ * the tests, and the AES instructions are timed if the CPU has them.
+ *
+ * \par Inputs:
+ * - ops: The crypto provider
+ * - buf: A buffer of at least p3PKT_LARGE bytes
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: The provider failed the known answer tests
+ */
+
+static int p3_crypto_engines(const p3cipher *ops, unsigned char *buf)
+{
+	int stat = 0, bsaes = 0;
+
+	p3aesni_on = 0;
+	p3bsaes_on = 0;
+	if (p3_crypto_kat(ops) < 0) {
+		stat = -1;
+		goto out;
+	}
+	if (ops != &p3moc_cipher) {
+		p3_crypto_bench_run(ops->name, ops, 0, 0, buf);
+		goto out;
+	}
+
+	if (p3bsaes_detect()) {
+		p3bsaes_on = 1;
+		if (p3_crypto_kat(ops) < 0 || p3_crypto_ctr_kat(ops) < 0)
+			p3errmsg(p3MSG_WARN, "p3_crypto_probe: Constant time AES test failed\n");
+		else
+			bsaes = 1;
+		p3bsaes_on = 0;
+	}
+	p3_crypto_bench_run(bsaes ? "constant" : "tables", ops, 0, bsaes, buf);
+	if (p3aesni_detect()) {
+		p3aesni_on = 1;
+		p3bsaes_on = bsaes;
+		if (p3_crypto_kat(ops) < 0)
+			p3errmsg(p3MSG_WARN, "p3_crypto_probe: AES instruction test failed\n");
+		else
+			p3_crypto_bench_run("instructions", ops, 1, bsaes, buf);
+	}
+
+out:
+	p3aesni_on = 0;
+	p3bsaes_on = 0;
+	return (stat);
+} /* end p3_crypto_engines */
+
+/**
+ * \par Function:
+ * p3_crypto_probe
+ *
+ * \par Description:
+ * Choose the crypto provider and AES engine when the module is
+ * initialized.  The provider is named by the p3crypto parameter, or is
+ * any provider that can be started if p3crypto is auto (only the Mocana
+ * provider if the constant time AES code is enabled).  Each AES engine
+ * of the provider that passes the known answer tests is timed, and the
+ * fastest one is used.  For the Mocana provider, the engines are the AES
+ * instructions if the CPU has them, and the AES table code or, if it is
+ * enabled, the constant time AES code.  The constant time AES code is
+ * also used when the AES instructions cannot be used in the current
+ * context.  AES-GCM key types are only allowed if the
+ * provider passes the AES-GCM tests, and the PCLMULQDQ code is used the
+ * same way.  AES-CTR and ChaCha20-Poly1305 key types are only allowed
+ * if the provider passes their tests, and the ChaCha20 SIMD code is
+ * used the same way.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: The provider could not be started or failed the known
+ *     answer tests
+ */
+
+int p3_crypto_probe(void)
+{
+	int i, stat = 0, all, best = -1;
+	int started[sizeof(p3ciphers) / sizeof(p3ciphers[0])];
+	unsigned long speed, fastest = 0;
+	unsigned char *buf = NULL;
+	const p3cipher *ops;
+
+	all = (p3crypto != NULL && strcmp(p3crypto, p3CRYPTO_AUTO) == 0);
+	memset(started, 0, sizeof(started));
+	p3bench_count = 0;
+	p3bench_best = -1;
+	if ((buf = (unsigned char *) p3malloc(p3PKT_LARGE)) == NULL) {
+		p3errmsg(p3MSG_CRIT, "p3_crypto_probe: No memory for the crypto benchmark\n");
+		stat = -1;
+		goto out;
+	}
+
+	// Test and time the AES engines of each provider that can be used
+	for (i=0; p3ciphers[i] != NULL; i++) {
+		ops = p3ciphers[i];
+		if (!all && p3crypto != NULL && strcmp(p3crypto, ops->name) != 0)
+			continue;
+		// Only the Mocana provider is known to have constant time AES
+		if (all && ops != &p3moc_cipher && p3bsaes_detect())
+			continue;
+		if (ops->init != NULL && ops->init() < 0) {
+			if (all) {
+				sprintf(p3buf, "p3_crypto_probe: Crypto provider %s is not available\n",
+						ops->name);
+				p3errmsg(p3MSG_WARN, p3buf);
+				continue;
+			}
+			sprintf(p3buf, "p3_crypto_probe: Failed to start crypto provider %s\n",
+					ops->name);
+			p3errmsg(p3MSG_CRIT, p3buf);
+			stat = -1;
+			goto cleanup;
+		}
+		started[i] = 1;
+		if (p3_crypto_engines(ops, buf) < 0) {
+			p3errmsg(p3MSG_CRIT, "p3_crypto_probe: AES known answer test failed\n");
+			stat = -1;
+			goto cleanup;
+		}
+		if (!all)
+			break;
+	}
+	if (p3ciphers[i] == NULL && !all) {
+		sprintf(p3buf, "p3_crypto_probe: Unknown crypto provider %s\n", p3crypto);
+		p3errmsg(p3MSG_CRIT, p3buf);
+		stat = -1;
+		goto cleanup;
+	}
+
+	// Use the engine that moved the most data over all packet sizes
+	for (i=0; i < p3bench_count; i++) {
+		speed = p3benches[i].mbs[0] + p3benches[i].mbs[1] + p3benches[i].mbs[2];
+		if (best < 0 || speed > fastest) {
+			best = i;
+			fastest = speed;
+		}
+	}
+	if (best < 0) {
+		p3errmsg(p3MSG_CRIT, "p3_crypto_probe: No AES engine is available\n");
+		stat = -1;
+		goto cleanup;
+	}
+	p3bench_best = best;
+	p3ops = p3benches[best].ops;
+	p3aesni_on = p3benches[best].aesni;
+	p3bsaes_on = p3benches[best].bsaes;
+
+cleanup:
+	for (i=0; p3ciphers[i] != NULL; i++) {
+		if (started[i] && (stat < 0 || p3ciphers[i] != p3ops) &&
+				p3ciphers[i]->cleanup != NULL)
+			p3ciphers[i]->cleanup();
+	}
+	p3free(buf);
+	if (stat < 0) {
+		p3ops = &p3moc_cipher;
+		p3bench_count = 0;
+		p3bench_best = -1;
+		goto out;
+	}
+	ops = p3ops;
+	if (ops == &p3moc_cipher)
+		sprintf(p3buf, "%s: Using AES %s, %d MB/s\n", P3APP,
+				p3aesni_on ? "instructions" :
+				(p3bsaes_on ? "constant time code" : "tables"),
+				p3benches[best].mbs[p3BENCH_SIZES - 1]);
+	else
+		sprintf(p3buf, "%s: Using AES %s, %d MB/s\n", P3APP, ops->name,
+				p3benches[best].mbs[p3BENCH_SIZES - 1]);
+	p3errmsg(p3MSG_INFO, p3buf);
+
+	// ChaCha20-Poly1305 is only used for sessions if it passes the tests
+	p3chacha_simd_on = 0;
+	p3chacha_ok = 0;
+	if (p3_crypto_chacha_kat(ops) < 0) {
+		p3errmsg(p3MSG_WARN, "p3_crypto_probe: ChaCha20-Poly1305 is not available\n");
+	} else {
+		p3chacha_ok = 1;
+		if (ops == &p3moc_cipher && p3chacha_detect()) {
+			p3chacha_simd_on = 1;
+			if (p3_crypto_chacha_kat(ops) < 0) {
+				p3chacha_simd_on = 0;
+				p3errmsg(p3MSG_WARN, "p3_crypto_probe: ChaCha20 SIMD test failed\n");
+			}
+		}
+	}
+
+	// AES-CTR is only used for sessions if it passes the tests
+	p3ctr_ok = 0;
+	if (p3_crypto_ctr_kat(ops) < 0)
+		p3errmsg(p3MSG_WARN, "p3_crypto_probe: AES-CTR is not available\n");
+	else
+		p3ctr_ok = 1;
+
+	// AES-GCM is only used for sessions if it passes the tests
+	p3aesni_gcm_on = 0;
+	p3aead_ok = 0;
+	if (p3_crypto_gcm_kat(ops) < 0) {
+		p3errmsg(p3MSG_WARN, "p3_crypto_probe: AES-GCM is not available\n");
+		goto out;
+	}
+	p3aead_ok = 1;
+	if (ops == &p3moc_cipher && p3aesni_on && p3aesni_clmul()) {
+		p3aesni_gcm_on = 1;
+		if (p3_crypto_gcm_kat(ops) < 0) {
+			p3aesni_gcm_on = 0;
+			p3errmsg(p3MSG_WARN, "p3_crypto_probe: AES-GCM instruction test failed\n");
+		}
+	}
+
+out:
+	return (stat);
+} /* end p3_crypto_probe */
+
+/**
+ * \page P3KM_MSGS Protected Point to Point Kernel Module Messages
+ * <hr><b>p3_crypto_probe: No memory for the crypto benchmark</b>
+ * \par Description (CRIT):
+ * There was not enough memory for the buffer used to time the AES
+ * engines.  The P3 kernel module is not started.
+ * \par Response:
+ * Check the system memory and load the module again.
+ *
+ * <hr><b>p3_crypto_probe: Unknown crypto provider <i>name</i></b>
+ * \par Description (CRIT):
+ * The p3crypto module parameter does not name a crypto provider.
+ * The P3 kernel module is not started.
+ * \par Response:
+ * Set p3crypto to mocana, kernel or auto.
+ *
+ * <hr><b>p3_crypto_probe: Crypto provider <i>name</i> is not available</b>
+ * \par Description (WARN):
+ * The p3crypto module parameter is auto and the crypto provider could
+ * not be started.  The fastest of the other providers is used.
+ * \par Response:
+ * Load the kernel AES modules if the kernel provider should be timed.
+ *
+ * <hr><b>p3_crypto_probe: Failed to start crypto provider <i>name</i></b>
+ * \par Description (CRIT):
+ * The crypto provider could not be started.  For the kernel provider,
+ * the cbc(aes) algorithm is not available or there was a system
+ * resource problem.  The P3 kernel module is not started.
+ * \par Response:
+ * Load the kernel AES modules or use the mocana provider.
+ *
+ * <hr><b>p3_crypto_probe: AES known answer test failed</b>
+ * \par Description (CRIT):
+ * The crypto provider did not produce the expected results for the
+ * NIST test vectors.  The P3 kernel module is not started.
+ * \par Response:
+ * Report the problem to Velocite Systems support.
+ *
+ * <hr><b>p3_crypto_probe: Benchmark of AES <i>engine</i> failed</b>
+ * \par Description (WARN):
+ * The AES engine passed the known answer tests but failed to encrypt
+ * and decrypt the benchmark data.  The engine is not used.
+ * \par Response:
+ * Report the problem to Velocite Systems support.
+ *
+ * <hr><b>p3_crypto_probe: No AES engine is available</b>
+ * \par Description (CRIT):
+ * None of the AES engines of the crypto provider could be timed.  The
+ * P3 kernel module is not started.
+ * \par Response:
+ * Report the problem to Velocite Systems support.
+ *
+ * <hr><b>p3_crypto_probe: AES instruction test failed</b>
+ * \par Description (WARN):
+ * The AES instructions did not produce the expected results for the
+ * NIST test vectors.  The AES table code is used instead.
+ * \par Response:
+ * Report the problem to Velocite Systems support.
+ *
+ * <hr><b>p3_crypto_probe: Constant time AES test failed</b>
+ * \par Description (WARN):
+ * The constant time AES code did not produce the expected results for
+ * the NIST test vectors.  The AES table code is used instead.
+ * \par Response:
+ * Report the problem to Velocite Systems support.
+ *
+ * <hr><b>p3_crypto_probe: AES-CTR is not available</b>
+ * \par Description (WARN):
+ * The crypto provider does not support AES-CTR, or AES-CTR did not
+ * produce the expected results for the NIST test vectors.  Sessions
+ * with an AES-CTR key type cannot be started.
+ * \par Response:
+ * Use the mocana provider or an AES-CBC key type, or report the
+ * problem to Velocite Systems support.
+ *
+ * <hr><b>p3_crypto_probe: ChaCha20-Poly1305 is not available</b>
+ * \par Description (WARN):
+ * The crypto provider does not support ChaCha20-Poly1305, or it did
+ * not produce the expected results for the RFC 8439 test vector.
+ * Sessions with the CHACHA20 key type cannot be started.
+ * \par Response:
+ * Use the mocana provider or an AES key type, or report the problem
+ * to Velocite Systems support.
+ *
+ * <hr><b>p3_crypto_probe: ChaCha20 SIMD test failed</b>
+ * \par Description (WARN):
+ * The ChaCha20 code using the SSE2 or NEON instructions did not produce
+ * the expected results for the RFC 8439 test vector.  The ChaCha20 C
+ * code is used instead.
+ * \par Response:
+ * Report the problem to Velocite Systems support.
+ *
+ * <hr><b>p3_crypto_probe: AES-GCM is not available</b>
+ * \par Description (WARN):
+ * The crypto provider does not support AES-GCM, or AES-GCM did not
+ * produce the expected results for the test vectors.  Sessions with
+ * an AES-GCM key type cannot be started.
+ * \par Response:
+ * Use an AES-CBC key type, or report the problem to Velocite Systems
+ * support.
+ *
+ * <hr><b>p3_crypto_probe: AES-GCM instruction test failed</b>
+ * \par Description (WARN):
+ * The AES-GCM function using the PCLMULQDQ instruction did not produce
+ * the expected results for the test vectors.  The AES-GCM table code
+ * is used instead.
+ * \par Response:
+ * Report the problem to Velocite Systems support.
+ *
+ * <hr><b>Using AES <i>engine</i>, <i>speed</i> MB/s</b>
+ * \par Description (INFO):
+ * The AES engine used for encryption and decryption is either the
+ * AES instructions of the CPU, the constant time AES code or the AES
+ * table code of the Mocana provider, or the kernel crypto API.  It was
+ * the fastest engine that passed the tests, and the speed is for large
+ * packets.  The speed of each engine is in the P3 statistics.
+ * \par Response:
+ * No response required.
+ *
+ */
+
+/**
+ * \par Function:
+ * p3_crypto_bench
+ *
+ * \par Description:
+ * Get the results of the crypto benchmark run when the module was
+ * initialized, for the statistics.
+ *
+ * \par Inputs:
+ * - idx: The index of the AES engine
+ * - name: Set to the engine name
+ * - size: Set to the p3BENCH_SIZES packet sizes that were timed
+ * - mbs: Set to the MB/s of the engine for each packet size
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 1: The engine is used
+ *   - 0: The engine is not used
+ *   - <0: There is no engine with the index
+ */
+
+int p3_crypto_bench(int idx, const char **name, int *size, int *mbs)
+{
+	int i;
+
+	if (idx < 0 || idx >= p3bench_count)
+		return (-1);
+	*name = p3benches[idx].name;
+	for (i=0; i < p3BENCH_SIZES; i++) {
+		size[i] = p3bench_size[i];
+		mbs[i] = p3benches[idx].mbs[i];
+	}
+	return (idx == p3bench_best);
+} /* end p3_crypto_bench */
+
+/**
+ * \par Function:
+ * p3_crypto_cleanup
+ *
+ * \par Description:
+ * Stop the crypto provider.  This is called after all session keys
+ * have been released.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - None
+ */
+
+void p3_crypto_cleanup(void)
+{
+	if (p3ops->cleanup != NULL)
+		p3ops->cleanup();
+	p3ops = &p3moc_cipher;
+	p3aead_ok = 0;
+	p3ctr_ok = 0;
+	p3chacha_ok = 0;
+} /* end p3_crypto_cleanup */
+
+/**
+ * \par Function:
+ * p3keyset_put
+ *
+ * \par Description:
+ * Drop a reference to a key set.  The crypto contexts of the set and
+ * the set itself are released with the last reference.
+ *
+ * \par Inputs:
+ * - set: The key set or NULL
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3keyset_put(p3keyset *set)
+{
+	int i;
+	p3keyctx *k;
+
+	if (set == NULL || !p3ref_put(set->ref))
+		return;
+	for (i=0; i < set->count; i++) {
+		k = &set->key[i];
+		if (k->enc != NULL)
+			set->ops->release(k->enc);
+		if (k->dec != NULL)
+			set->ops->release(k->dec);
+		if (k->aenc != NULL)
+			set->ops->aead_release(k->aenc);
+		if (k->adec != NULL)
+			set->ops->aead_release(k->adec);
+	}
+	p3free(set);
+} /* end p3keyset_put */
+
+/**
+ * \par Function:
+ * p3_ktype_ok
+ *
+ * \par Description:
+ * Determine if the data mode of a key type passed the known answer
+ * tests of the current provider.
+ *
+ * \par Inputs:
+ * - ktype: The key type (p3KTYPE_*)
+ *
+ * \par Outputs:
+ * - int: 1 if the key type can be used, else 0
+ */
+
+static int p3_ktype_ok(int ktype)
+{
+	if (p3KTYPE_GCM(ktype))
+		return (p3aead_ok);
+	if (p3KTYPE_CHACHA(ktype))
+		return (p3chacha_ok);
+	if (p3KTYPE_CTR(ktype))
+		return (p3ctr_ok);
+	return (1);
+} /* end p3_ktype_ok */
+
+/**
+ * \par Function:
+ * p3keyset_create
+ *
+ * \par Description:
+ * Create the crypto contexts for each key of a key array.  The keys are
+ * expanded once here, so a rekey to an index of the array does not
+ * create any contexts.  The contexts of all of the keys follow the set
+ * in one allocation.
+ *
+ * \par Inputs:
+ * - list: The key array
+ * - count: The number of keys in the array
+ * - ktype: The key type (p3KTYPE_*)
+ *
+ * \par Outputs:
+ * - p3keyset *: The new set, with one reference, or NULL if there is
+ *   an error
+ */
+
+static p3keyset *p3keyset_create(unsigned char *list, int count, int ktype)
+{
+	int i, size, aead = p3KTYPE_AEAD(ktype);
+	unsigned char *key;
+	p3keyctx *k;
+	p3keyset *set = NULL;
+
+	if ((size = p3_get_key_size(ktype)) < 0 || count <= 0 ||
+			!p3_ktype_ok(ktype))
+		goto out;
+	if ((set = (p3keyset *) p3calloc(sizeof(p3keyset) +
+			(count * sizeof(p3keyctx)))) == NULL)
+		goto out;
+	p3ref_set(set->ref, 1);
+	set->ops = p3ops;
+	set->ktype = ktype;
+	set->key = (p3keyctx *) (set + 1);
+	for (i=0; i < count; i++) {
+		k = &set->key[i];
+		key = &list[i * size];
+		// Partly created keys are released with the set
+		set->count = i + 1;
+		if ((k->enc = set->ops->create(key, size, 1)) == NULL ||
+				(k->dec = set->ops->create(key, size, 0)) == NULL)
+			goto error;
+		if (aead && ((k->aenc = set->ops->aead_create(key, size,
+				ktype)) == NULL ||
+				(k->adec = set->ops->aead_create(key, size, ktype)) == NULL))
+			goto error;
+	}
+	goto out;
+
+error:
+	p3keyset_put(set);
+	set = NULL;
+
+out:
+	return (set);
+} /* end p3keyset_create */
+
+/**
+ * \par Function:
+ * p3keyset_find
+ *
+ * \par Description:
+ * Get the key set of a session for a new key given by an index.  The
+ * set is only used if it was created by the current provider for the
+ * current key type.
+ *
+ * \par Inputs:
+ * - keys: The session key managment structure.
+ * - idx: The key array index or -1
+ *
+ * \par Outputs:
+ * - p3keyset *: The key set, with a reference for the caller, or NULL
+ *   if the key contexts must be created
+ */
+
+static p3keyset *p3keyset_find(p3keymgmt *keys, int idx)
+{
+	p3keyset *set;
+
+	if (idx < 0)
+		return (NULL);
+	p3lock(keys->lock);
+	set = keys->keyset;
+	if (set != NULL && idx < set->count && set->ops == p3ops &&
+			set->ktype == keys->ktype)
+		p3ref_get(set->ref);
+	else
+		set = NULL;
+	p3unlock(keys->lock);
+	return (set);
+} /* end p3keyset_find */
+
+/**
+ * \par Function:
+ * p3_set_keys
+ *
+ * \par Description:
+ * Set the key array of a session.  The crypto contexts of every key
+ * are created now for the session key type, and replace those of the
+ * previous array.  Epochs using keys of the previous array keep them
+ * until the epochs are released.  If the contexts cannot be created,
+ * those of the previous array are still released, and a rekey to an
+ * index creates the contexts from the key.
+ *
+ * \par Inputs:
+ * - list: The key array, or NULL to remove the array
+ * - count: The number of keys in the array
+ * - keys: The session key managment structure.
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Error
+ */
+
+int p3_set_keys(unsigned char *list, int count, p3keymgmt *keys)
+{
+	int stat = 0;
+	p3keyset *set = NULL, *old;
+
+	// The indexes of the previous array are not valid for the new one
+	if (list != NULL &&
+			(set = p3keyset_create(list, count, keys->ktype)) == NULL) {
+		p3errmsg(p3MSG_WARN, "p3_set_keys: Failed to create key array crypto contexts\n");
+		stat = -1;
+	}
+	p3lock(keys->lock);
+	old = keys->keyset;
+	keys->keyset = set;
+	p3unlock(keys->lock);
+	p3keyset_put(old);
+
+	return (stat);
+} /* end p3_set_keys */
+
+/**
+ * \page P3KM_MSGS Protected Point to Point Kernel Module Messages
+ * <hr><b>p3_set_keys: Failed to create key array crypto contexts</b>
+ * \par Description (WARN):
+ * The cryptography contexts for a key array sent by the primary could
+ * not be created ahead of time.  This is most likely a system resource
+ * problem, such as too few kernel crypto API transforms for a large
+ * array.  The key array is still used, and the contexts of a key are
+ * created when the key is used by a rekey.
+ * \par Response:
+ * None, unless rekeys are also failing.
+ *
+ */
+
+/**
+ * \par Function:
+ * p3epoch_clear
+ *
+ * \par Description:
+ * Release the crypto contexts of an epoch, which is kept.
+ *
+ * \par Inputs:
+ * - epoch: The epoch
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3epoch_clear(p3epoch *epoch)
+{
+	// Contexts from a key set are released with the set
+	if (epoch->dset != NULL) {
+		p3keyset_put(epoch->dset);
+		epoch->datenc = epoch->datdec = NULL;
+	}
+	if (epoch->cset != NULL) {
+		p3keyset_put(epoch->cset);
+		epoch->ctlenc = epoch->ctldec = NULL;
+	}
+	if (epoch->datenc != NULL) {
+		if (epoch->aead)
+			epoch->ops->aead_release(epoch->datenc);
+		else
+			epoch->ops->release(epoch->datenc);
+	}
+	if (epoch->datdec != NULL) {
+		if (epoch->aead)
+			epoch->ops->aead_release(epoch->datdec);
+		else
+			epoch->ops->release(epoch->datdec);
+	}
+	if (epoch->ctlenc != NULL)
+		epoch->ops->release(epoch->ctlenc);
+	if (epoch->ctldec != NULL)
+		epoch->ops->release(epoch->ctldec);
+	epoch->dset = epoch->cset = NULL;
+	epoch->datenc = epoch->datdec = epoch->ctlenc = epoch->ctldec = NULL;
+} /* end p3epoch_clear */
+
+/**
+ * \par Function:
+ * p3epoch_release
+ *
+ * \par Description:
+ * Release the crypto contexts of an epoch and the epoch itself.  This
+ * is called after all readers of the epoch have finished.
+ *
+ * \par Inputs:
+ * - head: The RCU head at the start of the epoch
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3epoch_release(p3rcu *head)
+{
+	p3epoch *epoch = (p3epoch *) head;
+
+	p3epoch_clear(epoch);
+	if (epoch->keys != NULL)
+		memset(epoch->keys, 0, p3KMG_KEYS * sizeof(p3key));
+	p3free(epoch);
+} /* end p3epoch_release */
+
+/**
+ * \par Function:
+ * p3epoch_build
+ *
+ * \par Description:
+ * Create the crypto contexts of an epoch for a data and control key.
+ * The epoch is not yet visible to the packet path.  For an AEAD key
+ * type, the data contexts are AEAD contexts and the control contexts
+ * are CBC contexts.  For a CTR key type, both data contexts are CBC
+ * encryption contexts, used to make the key stream.  A key given by a
+ * key array index uses the contexts of the session key set.  If the
+ * current provider cannot create the contexts, as when the kernel
+ * crypto API has no spare transforms, the built in provider is used.
+ *
+ * \par Inputs:
+ * - keys: The session key managment structure.
+ * - ktype: The key type of the contexts (p3KTYPE_*).
+ * - dkey: The data key, used if the key set has no context for didx.
+ * - didx: The key array index of the data key or -1.
+ * - ckey: The control key, used if the key set has no context for cidx.
+ * - cidx: The key array index of the control key or -1.
+ * - epoch: A cleared epoch to fill in, or NULL to allocate one.
+ *
+ * \par Outputs:
+ * - p3epoch *: The new epoch or NULL if there is an error, in which
+ *   case an epoch passed in is released.
+ */
+
+static p3epoch *p3epoch_build(p3keymgmt *keys, int ktype, p3key *dkey,
+		int didx, p3key *ckey, int cidx, p3epoch *epoch)
+{
+	p3keyctx *k;
+	char *err;
+
+	if (epoch == NULL && (epoch = (p3epoch *) p3calloc(sizeof(p3epoch))) == NULL) {
+		p3errmsg(p3MSG_ERR, "p3_init_crypto: Failed to create data crypto context\n");
+		goto out;
+	}
+	epoch->ops = p3ops;
+	epoch->ktype = ktype;
+	epoch->aead = p3KTYPE_AEAD(ktype);
+	epoch->ctr = p3KTYPE_CTR(ktype);
+
+retry:
+	epoch->dset = p3keyset_find(keys, didx);
+	epoch->cset = p3keyset_find(keys, cidx);
+	// Get data encryption context (one each for encryption and decryption)
+	err = "p3_init_crypto: Failed to create data crypto context\n";
+	if (epoch->dset != NULL) {
+		k = &epoch->dset->key[didx];
+		epoch->datenc = epoch->aead ? k->aenc : k->enc;
+		epoch->datdec = epoch->aead ? k->adec : (epoch->ctr ? k->enc : k->dec);
+	} else if (epoch->aead) {
+		if (!p3_ktype_ok(ktype) || epoch->ops->aead_create == NULL ||
+				(epoch->datenc = epoch->ops->aead_create(dkey->key,
+				dkey->size, ktype)) == NULL ||
+				(epoch->datdec = epoch->ops->aead_create(dkey->key,
+				dkey->size, ktype)) == NULL)
+			goto error;
+	} else if (!p3_ktype_ok(ktype) ||
+			(epoch->datenc = epoch->ops->create(dkey->key,
+			dkey->size, 1)) == NULL ||
+			(epoch->datdec = epoch->ops->create(dkey->key,
+			dkey->size, epoch->ctr)) == NULL) {
+		goto error;
+	}
+	// Get control encryption context (one each for encryption and decryption)
+	err = "p3_init_crypto: Failed to create control crypto context\n";
+	if (epoch->cset != NULL) {
+		k = &epoch->cset->key[cidx];
+		epoch->ctlenc = k->enc;
+		epoch->ctldec = k->dec;
+	} else if ((epoch->ctlenc = epoch->ops->create(ckey->key,
+			ckey->size, 1)) == NULL ||
+			(epoch->ctldec = epoch->ops->create(ckey->key,
+			ckey->size, 0)) == NULL) {
+		goto error;
+	}
+	goto out;
+
+error:
+	// A provider may run out of contexts, so use the built in provider
+	// with the keys themselves
+	if (epoch->ops != &p3moc_cipher) {
+		p3epoch_clear(epoch);
+		epoch->ops = &p3moc_cipher;
+		didx = cidx = -1;
+		p3trace_prgs(path, __func__, "Built in provider", ktype);
+		goto retry;
+	}
+	p3errmsg(p3MSG_ERR, err);
+	p3epoch_release(&epoch->rcu);
+	epoch = NULL;
+
+out:
+	return(epoch);
+} /* end p3epoch_build */
+
+/**
+ * \par Function:
+ * p3epoch_create
+ *
+ * \par Description:
+ * Create an epoch with the crypto contexts for the data and control
+ * new keys.  A new key given by a key array index uses the contexts of
+ * the session key set, and the index is cleared.
+ *
+ * \par Inputs:
+ * - keys: The session key managment structure.
+ *
+ * \par Outputs:
+ * - p3epoch *: The new epoch or NULL if there is an error
+ */
+
+static p3epoch *p3epoch_create(p3keymgmt *keys)
+{
+	int didx = keys->dnewidx, cidx = keys->cnewidx;
+
+	// An index is only used for the next epoch
+	keys->dnewidx = keys->cnewidx = -1;
+
+	return (p3epoch_build(keys, keys->ktype, keys->dnewkey, didx,
+			keys->cnewkey, cidx, NULL));
+} /* end p3epoch_create */
+
+/**
+ * \par Function:
+ * p3epoch_ready
+ *
+ * \par Description:
+ * Take the epoch prepared for the new keys, if it was made from the
+ * data and control new keys and the current key type.  Otherwise the
+ * prepared epoch is released, since the new keys were replaced after
+ * it was taken.
+ *
+ * \par Inputs:
+ * - keys: The session key managment structure.
+ *
+ * \par Outputs:
+ * - p3epoch *: The prepared epoch or NULL
+ */
+
+static p3epoch *p3epoch_ready(p3keymgmt *keys)
+{
+	p3epoch *epoch;
+
+	if ((epoch = xchg(&keys->ready, NULL)) == NULL)
+		goto out;
+	if (keys->dnewidx >= 0 || keys->cnewidx >= 0 || epoch->ktype != keys->ktype ||
+			(epoch->ops != p3ops && epoch->ops != &p3moc_cipher) ||
+			memcmp(&epoch->keys[0], keys->dnewkey, sizeof(p3key)) != 0 ||
+			memcmp(&epoch->keys[1], keys->cnewkey, sizeof(p3key)) != 0) {
+		p3epoch_release(&epoch->rcu);
+		epoch = NULL;
+		goto out;
+	}
+	// The keys are not needed once the contexts are published
+	memset(epoch->keys, 0, p3KMG_KEYS * sizeof(p3key));
+	epoch->keys = NULL;
+
+out:
+	return (epoch);
+} /* end p3epoch_ready */
+
+/**
+ * \par Function:
+ * p3_prepare_epoch
+ *
+ * \par Description:
+ * Prepare the epoch of the next rekey of a session ahead of time.  A
+ * data and control key are taken from the session key ring and their
+ * crypto contexts are created, so the rekey only publishes the epoch.
+ * Nothing is done if the session already has a prepared epoch.  This
+ * is called by the key epoch thread, never on the packet path.
+ *
+ * \par Inputs:
+ * - keys: The session key managment structure.
+ * - ring: The key ring of the session.
+ * - key_mgr: The key server management structure.
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Error
+ *   - >0: Keys not available, retry later
+ */
+
+int p3_prepare_epoch(p3keymgmt *keys, int ring, p3key_mgr *key_mgr)
+{
+	int stat = 0, ktype, size;
+	p3epoch *epoch;
+	p3key *nkey;
+
+	if (ACCESS_ONCE(keys->next) != NULL)
+		goto out;
+	ktype = ACCESS_ONCE(keys->ktype);
+	if ((size = p3_get_key_size(ktype)) < 0) {
+		stat = -1;
+		goto out;
+	}
+	// The keys are kept after the epoch until they are sent
+	if ((epoch = (p3epoch *) p3calloc(sizeof(p3epoch) +
+			(p3KMG_KEYS * sizeof(p3key)))) == NULL) {
+		stat = -1;
+		goto out;
+	}
+	nkey = (p3key *) (epoch + 1);
+	nkey[0].size = nkey[1].size = size;
+	if ((stat = p3_get_keys(nkey, p3KMG_KEYS, ring, key_mgr)) != 0) {
+		p3free(epoch);
+		goto out;
+	}
+	epoch->keys = nkey;
+	if ((epoch = p3epoch_build(keys, ktype, &nkey[0], -1, &nkey[1], -1, epoch)) == NULL) {
+		stat = -1;
+		goto out;
+	}
+	if (cmpxchg(&keys->next, NULL, epoch) != NULL)
+		p3epoch_release(&epoch->rcu);
+
+out:
+	return (stat);
+} /* end p3_prepare_epoch */
+
+/**
+ * \par Function:
+ * p3_next_keys
+ *
+ * \par Description:
+ * Use the keys of the epoch prepared ahead as the data and control new
+ * keys of a session.  The prepared epoch is kept for p3_rekey, which
+ * publishes it if the new keys have not been changed since.  A prepared
+ * epoch of an old key type is released.
+ *
+ * \par Inputs:
+ * - keys: The session key managment structure.
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: The new keys are set
+ *   - >0: No epoch is prepared, get the new keys from the key server
+ */
+
+int p3_next_keys(p3keymgmt *keys)
+{
+	int stat = 0;
+	p3epoch *epoch;
+
+	if ((epoch = xchg(&keys->next, NULL)) != NULL &&
+			(epoch->ktype != keys->ktype ||
+			(epoch->ops != p3ops && epoch->ops != &p3moc_cipher))) {
+		p3epoch_release(&epoch->rcu);
+		epoch = NULL;
+	}
+	if (epoch == NULL) {
+		stat = 1;
+		goto out;
+	}
+	memcpy(keys->dnewkey, &epoch->keys[0], sizeof(p3key));
+	memcpy(keys->cnewkey, &epoch->keys[1], sizeof(p3key));
+	// Replace an epoch that was prepared for a rekey that did not finish
+	if ((epoch = xchg(&keys->ready, epoch)) != NULL)
+		p3epoch_release(&epoch->rcu);
+
+out:
+	return (stat);
+} /* end p3_next_keys */
+
+/**
+ * \par Function:
+ * p3_init_crypto
+ *
+ * \par Description:
+ * Initialize the keys for a session by creating the crypto context
+ * for each key.  Any keys already in use by the session are released.
+ *
+ * <i>The value of the data and control new key fields will be used
+ *    for initializing the contexts.</i>
+ *
+ * \par Inputs:
+ * - keys: The session key managment structure.
+ * - start: The sequence number of the next data packet sent.
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Error
+ */
+
+int p3_init_crypto(p3keymgmt *keys, unsigned int start)
+{
+	int stat = 0;
+	p3epoch *epoch, *old;
+
+	// The new keys do not come from a prepared epoch
+	if ((epoch = xchg(&keys->ready, NULL)) != NULL)
+		p3epoch_release(&epoch->rcu);
+	if ((epoch = p3epoch_create(keys)) == NULL) {
+		stat = -1;
+		goto out;
+	}
+	epoch->start = start;
+	p3lock(keys->lock);
+	old = keys->epoch;
+	p3rcu_assign(keys->epoch, epoch);
+	p3unlock(keys->lock);
+	// Release the replaced keys after current packets are handled
+	if (old != NULL) {
+		if (old->prev != NULL)
+			p3rcu_call(&old->prev->rcu, p3epoch_release);
+		p3rcu_call(&old->rcu, p3epoch_release);
+	}
+
+out:
+	return(stat);
+} /* end p3_init_crypto */
+
+/**
+ * \page P3KM_MSGS Protected Point to Point Kernel Module Messages
+ * <hr><b>p3_init_crypto: Failed to create <i>P3 type</i> crypto context</b>
+ * \par Description (CRIT):
+ * The cryptography context structure could not be created.  This
+ * is most likely a system resource problem.
+ * \par Response:
+ * Troubleshoot the operating system problem.
+ *
+ */
+
+/**
+ * \par Function:
+ * p3_rekey
+ *
+ * \par Description:
+ * Update the key management structure after a P3 Rekey control message
+ * has been completed.  A new epoch is created from the new keys, or
+ * taken from the epoch prepared ahead for them, and published as key 1,
+ * and the current epoch becomes key 0.  The oldest epoch is released
+ * when the packets using it have been handled, so encryption and
+ * decryption continue while the keys are changed.
+ *
+ * <i>Note that the data and control new key fields must contain the new keys
+ *    to be used.</i>
+ *
+ * \par Inputs:
+ * - keys: The session key managment structure.
+ * - start: The sequence number of the first data packet sent with the
+ *   new keys.  Data packets with earlier sequence numbers are still
+ *   encrypted with key 0.
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Error
+ */
+
+int p3_rekey(p3keymgmt *keys, unsigned int start)
+{
+	int stat = 0;
+	p3epoch *epoch, *old = NULL;
+
+	// Use the epoch prepared for the new keys, or initialize them now
+	if ((epoch = p3epoch_ready(keys)) == NULL &&
+			(epoch = p3epoch_create(keys)) == NULL) {
+		stat = -1;
+		goto out;
+	}
+	epoch->start = start;
+	p3lock(keys->lock);
+	epoch->prev = keys->epoch;
+	if (epoch->prev != NULL) {
+		old = epoch->prev->prev;
+		p3rcu_assign(epoch->prev->prev, NULL);
+	}
+	p3rcu_assign(keys->epoch, epoch);
+	p3unlock(keys->lock);
+	// Release the oldest keys
+	if (old != NULL)
+		p3rcu_call(&old->rcu, p3epoch_release);
+
+out:
+	p3trace_prgs(rekey, keys, epoch != NULL ? epoch->prev : NULL, epoch, stat);
+	return (stat);
+} /* end p3_rekey */
+
+/**
+ * \page P3KM_MSGS Protected Point to Point Kernel Module Messages
+ * <hr><b>p3_rekey: Failed to release crypto context</b>
+ * \par Description (ERR):
+ * The cryptography context structure could not be released.  This
+ * will probably lead to a system resource problem, however processing
+ * continues.
+ * \par Response:
+ * Troubleshoot the operating system problem based on the reason code.
+ *
+ */
+
+/**
+ * \par Function:
+ * p3epoch_send
+ *
+ * \par Description:
+ * Get the epoch that encrypts a data packet.  A packet that got its
+ * sequence number before a rekey is encrypted with key 0, which the
+ * other host expects for it, even if the rekey has completed since.
+ * This must be called between p3rcu_read_lock and p3rcu_read_unlock.
+ *
+ * \par Inputs:
+ * - keys: The session key managment structure.
+ * - id: The ID of the P3 packet.
+ *
+ * \par Outputs:
+ * - p3epoch *: The epoch or NULL if there is none
+ */
+
+static inline p3epoch *p3epoch_send(p3keymgmt *keys, unsigned int id)
+{
+	p3epoch *epoch = p3rcu_deref(keys->epoch), *prev;
+
+	if (epoch != NULL && (int) (id - epoch->start) < 0 &&
+			(prev = p3rcu_deref(epoch->prev)) != NULL)
+		epoch = prev;
+	return (epoch);
+} /* end p3epoch_send */
+
+/**
+ * \par Function:
+ * p3_key_limit
+ *
+ * \par Description:
+ * Determine if a data packet may be sent with the data key chosen for
+ * it.  The AEAD and CTR nonces hold the 32 bit packet ID, so a data key
+ * must not send 2^32 packets, and it is not used again in a later
+ * epoch.  A rekey is due after p3SEQ_REKEY packets, and packets are
+ * dropped after p3SEQ_LIMIT packets until the rekey.
+ *
+ * \par Inputs:
+ * - keys: The session key managment structure.
+ * - id: The ID of the P3 packet.
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - >0: OK, but the session must be rekeyed
+ *   - <0: The packet must not be sent
+ */
+
+int p3_key_limit(p3keymgmt *keys, unsigned int id)
+{
+	int stat = 0;
+	unsigned int sent;
+	p3epoch *epoch;
+
+	p3rcu_read_lock();
+	if ((epoch = p3epoch_send(keys, id)) != NULL) {
+		sent = id - epoch->start;
+		if (sent >= p3SEQ_LIMIT)
+			stat = -1;
+		else if (sent >= p3SEQ_REKEY)
+			stat = 1;
+	}
+	p3rcu_read_unlock();
+	return (stat);
+} /* end p3_key_limit */
+
+/**
+ * \par Function:
+ * p3_get_ctx
+ *
+ * \par Description:
+ * Get the crypto context for a session crypto type.  This must be
+ * called between p3rcu_read_lock and p3rcu_read_unlock, and the context
+ * must only be used before p3rcu_read_unlock.  Data contexts are only
+ * returned if they are of the requested kind (CBC or CTR, or AEAD),
+ * control contexts are always CBC contexts.
+ *
+ * The data encryption key is chosen by the packet ID (see p3epoch_send),
+ * and is not used for a packet ID past p3SEQ_LIMIT.  AEAD and CTR data
+ * keys are never sent again as key array indexes (see p3KTYPE_NONCE),
+ * so a nonce is never used twice with one key.
+ *
+ * \par Inputs:
+ * - key: The session crypto type (ie. p3DATENC1, p3CTLDEC0).
+ * - id: The ID of the P3 packet.
+ * - keys: The session key managment structure.
+ * - aead: 1 for an AEAD context, 0 for a CBC or CTR context
+ * - ops: Set to the provider of the context
+ * - ctr: Set to 1 for a CTR context, else 0 (may be NULL)
+ *
+ * \par Outputs:
+ * - void *: The crypto context or NULL if there is none
+ */
+
+static inline void *p3_get_ctx(int key, unsigned int id, p3keymgmt *keys,
+		int aead, const p3cipher **ops, int *ctr)
+{
+	p3epoch *epoch = p3rcu_deref(keys->epoch);
+
+	if (ctr != NULL)
+		*ctr = 0;
+	if (epoch == NULL)
+		return (NULL);
+	if (key == p3DATENC0 || key == p3DATDEC0 || key == p3CTLENC0 ||
+			key == p3CTLDEC0) {
+		if ((epoch = p3rcu_deref(epoch->prev)) == NULL)
+			return (NULL);
+	} else if (key == p3DATENC1) {
+		epoch = p3epoch_send(keys, id);
+		if (id - epoch->start >= p3SEQ_LIMIT)
+			return (NULL);
+	}
+	*ops = epoch->ops;
+	if (ctr != NULL && (key == p3DATENC1 || key == p3DATENC0 ||
+			key == p3DATDEC1 || key == p3DATDEC0))
+		*ctr = epoch->ctr;
+	switch (key) {
+	case p3DATENC1:
+	case p3DATENC0:
+		return ((epoch->aead == aead) ? epoch->datenc : NULL);
+	case p3DATDEC1:
+	case p3DATDEC0:
+		return ((epoch->aead == aead) ? epoch->datdec : NULL);
+	case p3CTLENC1:
+	case p3CTLENC0:
+		return (aead ? NULL : epoch->ctlenc);
+	case p3CTLDEC1:
+	case p3CTLDEC0:
+		return (aead ? NULL : epoch->ctldec);
+	}
+	return (NULL);
+} /* end p3_get_ctx */
+
+/**
+ * \par Function:
+ * p3_iv
+ *
+ * \par Description:
+ * Set the CBC IV for a packet, which is the packet ID repeated.
+ *
+ * \par Inputs:
+ * - iv: The 16 byte IV to be set
+ * - id: The ID of the P3 packet
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static inline void p3_iv(unsigned char *iv, unsigned int id)
+{
+	iv[0] = iv[4] = iv[8] = iv[12] = (id >> 24) & 0xff;
+	iv[1] = iv[5] = iv[9] = iv[13] = (id >> 16) & 0xff;
+	iv[2] = iv[6] = iv[10] = iv[14] = (id >> 8) & 0xff;
+	iv[3] = iv[7] = iv[11] = iv[15] = id & 0xff;
+} /* end p3_iv */
+
+/**
+ * \par Function:
+ * p3_nonce
+ *
+ * \par Description:
+ * Build the AEAD nonce for a packet.  Both P3 hosts of a session send
+ * with the same data key, so the nonce holds the sender direction as
+ * well as the packet ID.
+ *
+ * \par Inputs:
+ * - nonce: The p3NONCE_SIZE byte nonce to be set
+ * - dir: The sender direction (p3KMG_PRIDIR or p3KMG_SECDIR)
+ * - id: The ID of the P3 packet
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static inline void p3_nonce(unsigned char *nonce, int dir, unsigned int id)
+{
+	memset(nonce, 0, p3NONCE_SIZE);
+	nonce[3] = (unsigned char) dir;
+	nonce[8] = (id >> 24) & 0xff;
+	nonce[9] = (id >> 16) & 0xff;
+	nonce[10] = (id >> 8) & 0xff;
+	nonce[11] = id & 0xff;
+} /* end p3_nonce */
+
+/**
+ * \par Function:
+ * p3_ctr_block
+ *
+ * \par Description:
+ * Set the CTR counter block for a packet, which is the AEAD nonce of
+ * the packet followed by a block counter starting at 1.  The direction
+ * in the nonce keeps the two P3 hosts of a session from using the same
+ * counters.
+ *
+ * \par Inputs:
+ * - ctr: The 16 byte counter block to be set
+ * - dir: The sender direction (p3KMG_PRIDIR or p3KMG_SECDIR)
+ * - id: The ID of the P3 packet
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static inline void p3_ctr_block(unsigned char *ctr, int dir, unsigned int id)
+{
+	p3_nonce(ctr, dir, id);
+	ctr[12] = ctr[13] = ctr[14] = 0;
+	ctr[15] = 1;
+} /* end p3_ctr_block */
 
 /**
  * \par Function:
- * p3_get_key_size
+ * p3_encrypt
  *
  * \par Description:
- * Get the size of an encryption key.
+ * Encrypt a buffer.
  *
  * \par Inputs:
- * - type: The type of the encryption algorithm.
+ * - buffer:  The buffer to be encrypted.  The encrypted data is
+ *   returned in this buffer.
+ * - size: The size of the buffer, in bytes, which must be a
+ *   multiple of 16 for a CBC key.
+ * - id: The ID of the P3 packet.
+ * - crypto: The session crypto type (ie. p3DATENC1, p3CTLENC0).
  *
  * \par Outputs:
- * - int:
- *   - 0: Key size
+ * - int: Status
+ *   - 0: OK
  *   - <0: Error
  */
-int p3_get_key_size(int type)
+
+int p3_encrypt(unsigned char *buffer, int size, unsigned int id, int key, p3keymgmt *keys)
 {
-	int size = -1;
+	int stat = 0, ctr;
+	unsigned char iv[16];
+	void *ctx;
+	const p3cipher *ops;
 
-	switch(type) {
-	case p3KTYPE_AES128:
-		size = p3KSIZE_AES128;
-		break;
+	// Set key
+	p3rcu_read_lock();
+	if ((ctx = p3_get_ctx(key, id, keys, 0, &ops, &ctr)) == NULL) {
+		p3rcu_read_unlock();
+		p3trace_prgs(path, __func__, "Bad key type", key);
+		stat = -1;
+		goto out;
+	}
 
-	case p3KTYPE_AES256:
-		size = p3KSIZE_AES256;
-		break;
+	// Initialize the IV to the packet ID, or the CTR counter block to
+	// the packet nonce
+	if (ctr) {
+		p3_ctr_block(iv, keys->dir, id);
+		stat = ops->ctr_crypt(ctx, buffer, size, iv);
+	} else {
+		p3_iv(iv, id);
+		stat = ops->crypt(ctx, buffer, size, 1, iv);
 	}
+    if (stat < 0) {
+		p3pkterr(p3MSG_ERR, "p3_encrypt: Failed to encrypt buffer: %s\n",
+				ops->reason(stat));
+		stat = -1;
+    }
+	p3rcu_read_unlock();
+	p3trace_prgs(encrypt, id, size, key, stat);
 
-	return (size);
-} /* end p3_get_key_size */
+out:
+	return (stat);
+} /* end p3_encrypt */
+
+/**
+ * \page P3KM_MSGS Protected Point to Point Kernel Module Messages
+ * <hr><b>p3_encrypt: Failed to encrypt buffer: <i>reason code</i></b>
+ * \par Description (ERR):
+ * There was an error encrypting a buffer.
+ * \par Response:
+ * Troubleshoot the operating system problem based on the reason code.
+ *
+ */
 
 /**
  * \par Function:
- * p3_get_key
+ * p3_decrypt
  *
  * \par Description:
- * Get an encryption key from the Ramdisk buffer.
+ * Decrypt a buffer.
  *
  * \par Inputs:
- * - key: The P3 key structure.  The flag in the structure contains
- *   information about the key, such as its type (size).  The new key
- *   is returned in this structure.
- * - key_mgr: The P3 key manager structure that maintains information
- *   about the circular buffer of keys.
+ * - buffer:  The buffer to be decrypted.  The decrypted data is
+ *   returned in this buffer.
+ * - size: The size of the buffer, in bytes, which must be a
+ *   multiple of 16 for a CBC key.
+ * - id: The ID of the P3 packet.
+ * - crypto: The session crypto type (ie. p3DATENC1, p3CTLENC0).
  *
  * \par Outputs:
  * - int: Status
  *   - 0: OK
  *   - <0: Error
- *   - >0: Key unavailable, try later
  */
-int p3_get_key(p3key *key, p3key_mgr *key_mgr)
+
+int p3_decrypt(unsigned char *buffer, int size, unsigned int id, int key, p3keymgmt *keys)
 {
-	int i, stat = 0;
-	unsigned long l;
-	p3key_serv *key_serv;
-	unsigned char *cbuf;
+	int stat = 0, ctr;
+	unsigned char iv[16];
+	void *ctx;
+	const p3cipher *ops;
 
-	if (key_mgr == NULL || (key_serv = key_mgr->key_serv) == NULL) {
-		p3errmsg(p3MSG_ERR, "p3_get_key: Key server is NULL\n");
+	// Set key
+	p3rcu_read_lock();
+	if ((ctx = p3_get_ctx(key, id, keys, 0, &ops, &ctr)) == NULL) {
+		p3rcu_read_unlock();
+		p3trace_prgs(path, __func__, "Bad key type", key);
 		stat = -1;
 		goto out;
 	}
-	l = (unsigned long) key_serv + sizeof(p3key_serv);
-	cbuf = (unsigned char *) l;
 
-sprintf(p3buf, " == Get key: H %d, T %d\n", key_serv->head, key_serv->tail);
-p3errmsg(p3MSG_DEBUG, p3buf);
-	p3lock(key_mgr->lock);
-	// No keys available
-	if (key_serv->head == key_serv->tail ||
-			key_serv->head == (key_serv->tail - 1)) {
-		stat = 1;
-// TODO: Zero used keys??
+	// Initialize the IV to the packet ID, or the CTR counter block to
+	// the packet nonce of the other P3 host
+	if (ctr) {
+		p3_ctr_block(iv, keys->dir ^ 1, id);
+		stat = ops->ctr_crypt(ctx, buffer, size, iv);
 	} else {
-		// Tail has wrapped around circular buffer
-		if (key_serv->tail < key_serv->head) {
-			if ((key_serv->head + key->size) <= key_serv->cbuf_sz) {
-sprintf(p3buf, " == Copy key: %p, %p, %d\n",
-	&key->key, &cbuf[key_serv->head], key->size);
-p3errmsg(p3MSG_DEBUG, p3buf);
-				memcpy(&key->key, &cbuf[key_serv->head], key->size);
-			// Head wraps around circular buffer
-			} else {
-				key_serv->head = 0;
-				if ((key_serv->tail - key_serv->head) < key->size) {
-					stat = 1;
-				} else {
-sprintf(p3buf, " == Copy key: %p, %p, %d\n",
-	&key->key, &cbuf[key_serv->head], key->size);
-p3errmsg(p3MSG_DEBUG, p3buf);
-					memcpy(&key->key, &cbuf[key_serv->head], key->size);
-				}
-			}
-			// Advance head
-			if ((key_serv->head += key->size) > key_serv->cbuf_sz)
-				key_serv->head = 0;
-		// Not enough key data
-		} else if ((key_serv->tail - key_serv->head) < key->size) {
-			stat = 1;
-		} else {
-sprintf(p3buf, " == Copy key: %p, %p, %d\n",
-	&key->key, &cbuf[key_serv->head], key->size);
-p3errmsg(p3MSG_DEBUG, p3buf);
-			memcpy(&key->key, &cbuf[key_serv->head], key->size);
-			// Advance head
-			if ((key_serv->head += key->size) > key_serv->cbuf_sz)
-				key_serv->head = 0;
-		}
-
+		p3_iv(iv, id);
+		stat = ops->crypt(ctx, buffer, size, 0, iv);
 	}
-	p3unlock(key_mgr->lock);
+    if (stat < 0) {
+		p3pkterr(p3MSG_ERR, "p3_decrypt: Failed to decrypt buffer: %s\n",
+				ops->reason(stat));
+		stat = -1;
+    }
+	p3rcu_read_unlock();
+	p3trace_prgs(decrypt, id, size, key, stat);
 
 out:
 	return (stat);
-} /* end p3_get_key */
+} /* end p3_decrypt */
 
 /**
  * \page P3KM_MSGS Protected Point to Point Kernel Module Messages
- * <hr><b>p3_get_key: Key server is NULL</b>
+ * <hr><b>p3_decrypt: Failed to decrypt buffer: <i>reason code</i></b>
  * \par Description (ERR):
- * The key server was not properly initialized.
+ * There was an error encrypting a buffer.
  * \par Response:
- * Report the problem to Velocite Systems support.
+ * Troubleshoot the operating system problem based on the reason code.
  *
  */
 
-
 /**
  * \par Function:
- * p3_get_key_array
+ * p3_crypt_batch
  *
  * \par Description:
- * Get an array of encryption keys.  All keys in the array are true
- * random numbers.
+ * Encrypt or decrypt a batch of buffers, which can be for different
+ * sessions.  Up to p3BATCH_MAX buffers are given to the provider at
+ * one time, so it can keep several independent CBC chains in the AES
+ * unit.  If the provider cannot handle the buffers together, or a
+ * buffer has a CTR key, each buffer is handled as by p3_encrypt or
+ * p3_decrypt.
  *
  * \par Inputs:
- * - size: The size, in bytes, of the key to be retrieved
- * - number: The number of keys in the array
- * - key_mgr: The P3 key server structure that maintains information
- *   about the circular buffer of keys.
+ * - batch: The buffers, with the status of each buffer set on return
+ * - count: The number of buffers
+ * - encrypt: 1 to encrypt, 0 to decrypt
  *
  * \par Outputs:
- * - p3key**: The array containing the keys.  If there is an error,
- *   NULL is returned.
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Error for at least one buffer
  */
-p3key **p3_get_key_array(int size, int number, p3key_mgr *key_mgr)
+
+static int p3_crypt_batch(p3batch *batch, int count, int encrypt)
 {
-	p3key **gk_key_array = NULL;
-	// TODO: Get an encryption key array
-	return (gk_key_array);
-} /* end p3_get_key_array */
+	int i, j, n, stat = 0;
+	unsigned char iv[p3BATCH_MAX][16], *buffer[p3BATCH_MAX], *ivp[p3BATCH_MAX];
+	int size[p3BATCH_MAX];
+	void *ctx[p3BATCH_MAX];
+	p3batch *ent[p3BATCH_MAX];
+	const p3cipher *ops[p3BATCH_MAX];
+	int ctr[p3BATCH_MAX];
+	int mixed;
+
+	p3rcu_read_lock();
+	for (i=0; i < count; i += p3BATCH_MAX) {
+		// Get the contexts, only contexts of one provider are handled together
+		mixed = 0;
+		for (j=i, n=0; j < count && j < (i + p3BATCH_MAX); j++) {
+			if ((ctx[n] = p3_get_ctx(batch[j].key, batch[j].id, batch[j].keys, 0,
+					&ops[n], &ctr[n])) == NULL) {
+				p3trace_prgs(path, __func__, "Bad key type", batch[j].key);
+				batch[j].stat = -1;
+				stat = -1;
+				continue;
+			}
+			// CTR buffers are already parallel within the buffer
+			if (ops[n] != ops[0] || ctr[n])
+				mixed = 1;
+			batch[j].stat = 0;
+			if (ctr[n])
+				p3_ctr_block(iv[n], encrypt ? batch[j].keys->dir :
+						batch[j].keys->dir ^ 1, batch[j].id);
+			else
+				p3_iv(iv[n], batch[j].id);
+			ivp[n] = iv[n];
+			buffer[n] = batch[j].buffer;
+			size[n] = batch[j].size;
+			ent[n++] = &batch[j];
+		}
+		if (n == 0)
+			continue;
+		if (!mixed && ops[0]->crypt_batch != NULL &&
+				ops[0]->crypt_batch(ctx, buffer, size, ivp, n, encrypt) == 0)
+			goto trace;
+		// Handle each buffer
+		for (j=0; j < n; j++) {
+			if (ctr[j])
+				ent[j]->stat = ops[j]->ctr_crypt(ctx[j], buffer[j], size[j],
+						ivp[j]);
+			else
+				ent[j]->stat = ops[j]->crypt(ctx[j], buffer[j], size[j],
+						encrypt, ivp[j]);
+			if (ent[j]->stat < 0) {
+				p3pkterr(p3MSG_ERR, "%s: Failed to %s buffer: %s\n",
+						encrypt ? "p3_encrypt" : "p3_decrypt",
+						encrypt ? "encrypt" : "decrypt",
+						ops[j]->reason(ent[j]->stat));
+				ent[j]->stat = -1;
+				stat = -1;
+			}
+		}
+trace:
+		for (j=0; j < n; j++) {
+			if (encrypt)
+				p3trace_prgs(encrypt, ent[j]->id, ent[j]->size, ent[j]->key,
+						ent[j]->stat);
+			else
+				p3trace_prgs(decrypt, ent[j]->id, ent[j]->size, ent[j]->key,
+						ent[j]->stat);
+		}
+	}
+	p3rcu_read_unlock();
+	return (stat);
+} /* end p3_crypt_batch */
 
 /**
  * \par Function:
- * p3_init_crypto
+ * p3_encrypt_batch
  *
  * \par Description:
- * Initialize the keys for a session by creating the crypto context
- * for each key.
- *
- * <i>The value of the data and control new key fields will be used
- *    for initializing the contexts.</i>
+ * Encrypt a batch of buffers.  Each buffer is encrypted as by
+ * p3_encrypt.
  *
  * \par Inputs:
- * - keys: The session key managment structure.
+ * - batch: The buffers, with the status of each buffer set on return
+ * - count: The number of buffers
  *
  * \par Outputs:
  * - int: Status
  *   - 0: OK
- *   - <0: Error
+ *   - <0: Error for at least one buffer
  */
 
-int p3_init_crypto(p3keymgmt *keys)
+int p3_encrypt_batch(p3batch *batch, int count)
 {
-	int stat = 0;
-	BulkCtx aesCtx;
-int ix;
-
-	if (initlock) {
-		initlock = 0;
-		p3lock_init(crypto_lock);
-	}
-
-sprintf(p3buf, "Call init crypto: %p, %d\n", keys->dnewkey->key, (keys->dnewkey->size));
-p3errmsg(p3MSG_DEBUG, p3buf);
-strcpy(p3buf, "Initial Key: ");
-for (ix=0; ix < keys->dnewkey->size; ix++) {
-sprintf(p3buf, "%s%2.2x", p3buf, keys->dnewkey->key[ix]);
-}
-sprintf(p3buf, "%s\n", p3buf);
-p3errmsg(p3MSG_DEBUG, p3buf);
-	// Get data encryption context (one each for encryption and decryption)
-	if (!lockheld)
-		p3lock(crypto_lock);
-	if ((aesCtx = CreateAESCtx(MOC_SYM(hwAccelCtx) keys->dnewkey->key,
-			keys->dnewkey->size, TRUE)) == NULL) {
-		p3errmsg(p3MSG_ERR, "p3_init_crypto: Failed to create data crypto context\n");
-		stat = -1;
-		goto out;
-	}
-	keys->datenc1 = aesCtx;
-	if ((aesCtx = CreateAESCtx(MOC_SYM(hwAccelCtx) keys->dnewkey->key,
-			keys->dnewkey->size, FALSE)) == NULL) {
-		p3errmsg(p3MSG_ERR, "p3_init_crypto: Failed to create data crypto context\n");
-		stat = -1;
-		goto out;
-	}
-	keys->datdec1 = aesCtx;
-	// Get control encryption context (one each for encryption and decryption)
-	if ((aesCtx = CreateAESCtx(MOC_SYM(hwAccelCtx) keys->cnewkey->key,
-			keys->cnewkey->size, TRUE)) == NULL) {
-		p3errmsg(p3MSG_ERR, "p3_init_crypto: Failed to create control crypto context\n");
-		stat = -1;
-		goto out;
-	}
-	keys->ctlenc1 = aesCtx;
-	if ((aesCtx = CreateAESCtx(MOC_SYM(hwAccelCtx) keys->cnewkey->key,
-			keys->cnewkey->size, FALSE)) == NULL) {
-		p3errmsg(p3MSG_ERR, "p3_init_crypto: Failed to create control crypto context\n");
-		stat = -1;
-		goto out;
-	}
-	keys->ctldec1 = aesCtx;
-	if (!lockheld)
-		p3unlock(crypto_lock);
-
-out:
-p3errmsg(p3MSG_DEBUG, "Exit init crypto\n");
-	return(stat);
-} /* end p3_init_crypto */
+	return (p3_crypt_batch(batch, count, 1));
+} /* end p3_encrypt_batch */
 
 /**
- * \page P3KM_MSGS Protected Point to Point Kernel Module Messages
- * <hr><b>p3_init_crypto: Failed to create <i>P3 type</i> crypto context</b>
- * \par Description (CRIT):
- * The cryptography context structure could not be created.  This
- * is most likely a system resource problem.
- * \par Response:
- * Troubleshoot the operating system problem.
+ * \par Function:
+ * p3_decrypt_batch
+ *
+ * \par Description:
+ * Decrypt a batch of buffers.  Each buffer is decrypted as by
+ * p3_decrypt.
+ *
+ * \par Inputs:
+ * - batch: The buffers, with the status of each buffer set on return
+ * - count: The number of buffers
  *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Error for at least one buffer
  */
 
+int p3_decrypt_batch(p3batch *batch, int count)
+{
+	return (p3_crypt_batch(batch, count, 0));
+} /* end p3_decrypt_batch */
+
 /**
  * \par Function:
- * p3_rekey
+ * p3_aead
  *
  * \par Description:
- * Update the key management structure after a P3 Rekey control message
- * has been completed.  This consists of releasing the oldest keys,
- * copying the current keys to the previous key fields, and
- * initializing the new keys.
- *
- * <i>Note that the data and control new key fields must contain the new keys
- *    to be used.</i>
+ * Determine if the data contexts of a session crypto type are AEAD
+ * contexts, so p3_seal and p3_open are used instead of p3_encrypt and
+ * p3_decrypt, and the data is followed by a p3TAG_SIZE byte tag.
  *
  * \par Inputs:
+ * - key: The session crypto type (ie. p3DATENC1, p3DATDEC0).
  * - keys: The session key managment structure.
  *
  * \par Outputs:
- * - int: Status
- *   - 0: OK
- *   - <0: Error
+ * - int: 1 if the contexts are AEAD contexts, else 0
  */
 
-int p3_rekey(p3keymgmt *keys)
+int p3_aead(int key, p3keymgmt *keys)
 {
-	int stat = 0;
-
-int i;
-sprintf(p3buf, "Rekey: %p\n", keys);
-p3errmsg(p3MSG_DEBUG, p3buf);
-	// Release the oldest keys
-sprintf(p3buf, " == DE1 %p, DE0 %p, DD1 %p, DD0 %p\n",
-keys->datenc1, keys->datenc0, keys->datdec0, keys->datdec1);
-p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, " == CE1 %p, CE0 %p, CD1 %p, CD0 %p\n",
-keys->ctlenc1, keys->ctlenc0, keys->ctldec0, keys->ctldec1);
-p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  New DKey: ");
-for (i=0; i < 16; i++) {
-	if (!(i & 3))
-		sprintf(p3buf, "%s ", p3buf);
-	sprintf(p3buf, "%s%2.2x", p3buf, keys->dnewkey->key[i]);
-}
-sprintf(p3buf, "%s\n", p3buf);
-p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  New CKey: ");
-for (i=0; i < 16; i++) {
-	if (!(i & 3))
-		sprintf(p3buf, "%s ", p3buf);
-	sprintf(p3buf, "%s%2.2x", p3buf, keys->cnewkey->key[i]);
-}
-sprintf(p3buf, "%s\n", p3buf);
-p3errmsg(p3MSG_DEBUG, p3buf);
-
-	p3lock(crypto_lock);
-    if (keys->datenc0 != NULL &&
-			DeleteAESCtx(MOC_SYM(hwAccelCtx) (BulkCtx)keys->datenc0) < 0) {
-		p3errmsg(p3MSG_ERR, "p3_rekey: Failed to release data crypto context\n");
-    }
-    if (keys->datdec0 != NULL &&
-			DeleteAESCtx(MOC_SYM(hwAccelCtx) (BulkCtx)keys->datdec0) < 0) {
-		p3errmsg(p3MSG_ERR, "p3_rekey: Failed to release data crypto context\n");
-    }
-    if (keys->ctlenc0 != NULL &&
-			DeleteAESCtx(MOC_SYM(hwAccelCtx) (BulkCtx)keys->ctlenc0) < 0) {
-		p3errmsg(p3MSG_ERR, "p3_rekey: Failed to release control crypto context\n");
-    }
-    if (keys->ctldec0 != NULL &&
-			DeleteAESCtx(MOC_SYM(hwAccelCtx) (BulkCtx)keys->ctldec0) < 0) {
-		p3errmsg(p3MSG_ERR, "p3_rekey: Failed to release control crypto context\n");
-    }
-// if (keys->datenc0 != NULL) {
-// 	stat = -1;
-// 	goto out;
-// }
-
-	// Set key 0 to key 1 values
-	keys->datenc0 = keys->datenc1;
-	keys->datdec0 = keys->datdec1;
-	keys->ctlenc0 = keys->ctlenc1;
-	keys->ctldec0 = keys->ctldec1;
-
-	// Initialize the new keys
-	lockheld = 1;
-	stat = p3_init_crypto(keys);
-	lockheld = 0;
-	p3unlock(crypto_lock);
+	int aead = 0;
+	p3epoch *epoch;
 
-out:
-	return (stat);
-} /* end p3_rekey */
+	p3rcu_read_lock();
+	if ((epoch = p3rcu_deref(keys->epoch)) != NULL &&
+			(key == p3DATENC0 || key == p3DATDEC0))
+		epoch = p3rcu_deref(epoch->prev);
+	if (epoch != NULL)
+		aead = epoch->aead;
+	p3rcu_read_unlock();
+	return (aead);
+} /* end p3_aead */
 
 /**
- * \page P3KM_MSGS Protected Point to Point Kernel Module Messages
- * <hr><b>p3_rekey: Failed to release <i>P3 type</i> crypto context</b>
- * \par Description (ERR):
- * The cryptography context structure could not be released.  This
- * will probably lead to a system resource problem, however processing
- * continues.
- * \par Response:
- * Troubleshoot the operating system problem based on the reason code.
+ * \par Function:
+ * p3_ctr
  *
+ * \par Description:
+ * Determine if the data contexts of a session crypto type are CTR
+ * contexts, so p3_encrypt and p3_decrypt take a buffer of any size and
+ * the data does not have to be padded to a multiple of 16.
+ *
+ * \par Inputs:
+ * - key: The session crypto type (ie. p3DATENC1, p3DATDEC0).
+ * - keys: The session key managment structure.
+ *
+ * \par Outputs:
+ * - int: 1 if the contexts are CTR contexts, else 0
  */
 
+int p3_ctr(int key, p3keymgmt *keys)
+{
+	int ctr = 0;
+	p3epoch *epoch;
+
+	p3rcu_read_lock();
+	if ((epoch = p3rcu_deref(keys->epoch)) != NULL &&
+			(key == p3DATENC0 || key == p3DATDEC0))
+		epoch = p3rcu_deref(epoch->prev);
+	if (epoch != NULL)
+		ctr = epoch->ctr;
+	p3rcu_read_unlock();
+	return (ctr);
+} /* end p3_ctr */
+
 /**
  * \par Function:
- * p3_encrypt
+ * p3_seal
  *
  * \par Description:
- * Encrypt a buffer.
+ * Encrypt and authenticate a buffer with an AEAD data key.  The tag is
+ * written after the buffer.
  *
  * \par Inputs:
- * - buffer:  The buffer to be encrypted.  The encrypted data is
- *   returned in this buffer.
- * - size: The size of the buffer, in bytes, which must be a
- *   multiple of 16.
+ * - buffer:  The buffer to be encrypted, followed by p3TAG_SIZE bytes
+ *   for the tag.  The encrypted data is returned in this buffer.
+ * - size: The size of the buffer, in bytes.
+ * - aad: The associated data, which is authenticated but not encrypted.
+ * - alen: The size of the associated data, in bytes.
  * - id: The ID of the P3 packet.
- * - crypto: The session crypto type (ie. p3DATENC1, p3CTLENC0).
+ * - key: The session crypto type (ie. p3DATENC1).
+ * - keys: The session key managment structure.
  *
  * \par Outputs:
  * - int: Status
@@ -404,130 +2905,89 @@ out:
  *   - <0: Error
  */
 
-int p3_encrypt(unsigned char *buffer, int size, unsigned int id, int key, p3keymgmt *keys)
+int p3_seal(unsigned char *buffer, int size, unsigned char *aad, int alen,
+		unsigned int id, int key, p3keymgmt *keys)
 {
 	int stat = 0;
-	char *mocerr;
-	unsigned char iv[16];
+	unsigned char nonce[p3NONCE_SIZE];
 	void *ctx;
+	const p3cipher *ops;
 
-	// Initialize the IV to the packet ID
-	iv[0] = iv[4] = iv[8] = iv[12] = (id >> 24) & 0xff;
-	iv[1] = iv[5] = iv[9] = iv[13] = (id >> 16) & 0xff;
-	iv[2] = iv[6] = iv[10] = iv[14] = (id >> 8) & 0xff;
-	iv[3] = iv[7] = iv[11] = iv[15] = id & 0xff;
-
-	// Set key
-	p3lock(crypto_lock);
-	if (key == p3DATENC1)
-		ctx = keys->datenc1;
-	else if (key == p3CTLENC1)
-		ctx = keys->ctlenc1;
-	else if (key == p3DATENC0)
-		ctx = keys->datenc0;
-	else if (key == p3CTLENC0)
-		ctx = keys->ctlenc0;
-	else {
-		p3unlock(crypto_lock);
-p3errmsg(p3MSG_DEBUG, "Bad Encrypt key type\n");
+	p3_nonce(nonce, keys->dir, id);
+	p3rcu_read_lock();
+	if ((ctx = p3_get_ctx(key, id, keys, 1, &ops, NULL)) == NULL) {
+		p3rcu_read_unlock();
+		p3trace_prgs(path, __func__, "Bad key type", key);
 		stat = -1;
 		goto out;
 	}
-	p3unlock(crypto_lock);
-
-    if ((stat = DoAES(MOC_SYM(hwAccelCtx) (BulkCtx)ctx, buffer, size, TRUE, iv)) < 0) {
-		if ((mocerr = MERROR_lookUpErrorCode(stat)) == NULL)
-			mocerr = unknown_err;
-    	sprintf(p3buf, "p3_encrypt: Failed to encrypt buffer: %s\n", mocerr);
-		p3errmsg(p3MSG_ERR, p3buf);
+	if ((stat = ops->aead_crypt(ctx, buffer, size, aad, alen, nonce, 1)) < 0) {
+		p3pkterr(p3MSG_ERR, "p3_seal: Failed to encrypt buffer\n");
 		stat = -1;
-    }
+	}
+	p3rcu_read_unlock();
+	p3trace_prgs(encrypt, id, size, key, stat);
 
 out:
 	return (stat);
-} /* end p3_encrypt */
+} /* end p3_seal */
 
 /**
  * \page P3KM_MSGS Protected Point to Point Kernel Module Messages
- * <hr><b>p3_encrypt: Failed to encrypt buffer: <i>reason code</i></b>
+ * <hr><b>p3_seal: Failed to encrypt buffer</b>
  * \par Description (ERR):
- * There was an error encrypting a buffer.
+ * There was an error encrypting a buffer with an AEAD key.
  * \par Response:
- * Troubleshoot the operating system problem based on the reason code.
+ * Troubleshoot the operating system problem.
  *
  */
 
 /**
  * \par Function:
- * p3_decrypt
+ * p3_open
  *
  * \par Description:
- * Decrypt a buffer.
+ * Decrypt a buffer with an AEAD data key and check its tag.  If the
+ * tag does not match, the buffer must be dropped.
  *
  * \par Inputs:
- * - buffer:  The buffer to be decrypted.  The decrypted data is
- *   returned in this buffer.
- * - size: The size of the buffer, in bytes, which must be a
- *   multiple of 16.
+ * - buffer:  The buffer to be decrypted, followed by the tag.  The
+ *   decrypted data is returned in this buffer.
+ * - size: The size of the buffer without the tag, in bytes.
+ * - aad: The associated data.
+ * - alen: The size of the associated data, in bytes.
  * - id: The ID of the P3 packet.
- * - crypto: The session crypto type (ie. p3DATENC1, p3CTLENC0).
+ * - key: The session crypto type (ie. p3DATDEC1, p3DATDEC0).
+ * - keys: The session key managment structure.
  *
  * \par Outputs:
  * - int: Status
  *   - 0: OK
- *   - <0: Error
+ *   - <0: Error or the buffer is not authentic
  */
 
-int p3_decrypt(unsigned char *buffer, int size, unsigned int id, int key, p3keymgmt *keys)
+int p3_open(unsigned char *buffer, int size, unsigned char *aad, int alen,
+		unsigned int id, int key, p3keymgmt *keys)
 {
 	int stat = 0;
-	char *mocerr;
-	unsigned char iv[16];
+	unsigned char nonce[p3NONCE_SIZE];
 	void *ctx;
+	const p3cipher *ops;
 
-	// Initialize the IV to the packet ID
-	iv[0] = iv[4] = iv[8] = iv[12] = (id >> 24) & 0xff;
-	iv[1] = iv[5] = iv[9] = iv[13] = (id >> 16) & 0xff;
-	iv[2] = iv[6] = iv[10] = iv[14] = (id >> 8) & 0xff;
-	iv[3] = iv[7] = iv[11] = iv[15] = id & 0xff;
-
-	// Set key
-	p3lock(crypto_lock);
-	if (key == p3DATDEC1)
-		ctx = keys->datdec1;
-	else if (key == p3CTLDEC1)
-		ctx = keys->ctldec1;
-	else if (key == p3DATDEC0)
-		ctx = keys->datdec0;
-	else if (key == p3CTLDEC0)
-		ctx = keys->ctldec0;
-	else {
-		p3unlock(crypto_lock);
-p3errmsg(p3MSG_DEBUG, "Bad Decrypt key type\n");
+	// The buffer was sent from the other P3 host
+	p3_nonce(nonce, keys->dir ^ 1, id);
+	p3rcu_read_lock();
+	if ((ctx = p3_get_ctx(key, id, keys, 1, &ops, NULL)) == NULL) {
+		p3rcu_read_unlock();
+		p3trace_prgs(path, __func__, "Bad key type", key);
 		stat = -1;
 		goto out;
 	}
-	p3unlock(crypto_lock);
-
-    if ((stat = DoAES(MOC_SYM(hwAccelCtx) (BulkCtx)ctx, buffer, size, FALSE, iv)) < 0) {
-		if ((mocerr = MERROR_lookUpErrorCode(stat)) == NULL)
-			mocerr = unknown_err;
-    	sprintf(p3buf, "p3_decrypt: Failed to decrypt buffer: %s\n", mocerr);
-		p3errmsg(p3MSG_ERR, p3buf);
+	if (ops->aead_crypt(ctx, buffer, size, aad, alen, nonce, 0) < 0)
 		stat = -1;
-    }
+	p3rcu_read_unlock();
+	p3trace_prgs(decrypt, id, size, key, stat);
 
 out:
 	return (stat);
-} /* end p3_decrypt */
-
-/**
- * \page P3KM_MSGS Protected Point to Point Kernel Module Messages
- * <hr><b>p3_decrypt: Failed to decrypt buffer: <i>reason code</i></b>
- * \par Description (ERR):
- * There was an error encrypting a buffer.
- * \par Response:
- * Troubleshoot the operating system problem based on the reason code.
- *
- */
-
+} /* end p3_open */
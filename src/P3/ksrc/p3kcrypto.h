@@ -18,10 +18,40 @@
 #define p3KSIZE_AES128	16
 #define p3KTYPE_AES256	2
 #define p3KSIZE_AES256	32
+#define p3KTYPE_AESGCM128	3	/* AES-GCM data, AES-CBC control with 128 bit keys */
+#define p3KTYPE_AESGCM256	4	/* AES-GCM data, AES-CBC control with 256 bit keys */
+#define p3KTYPE_AESCTR128	5	/* AES-CTR data, AES-CBC control with 128 bit keys */
+#define p3KTYPE_AESCTR256	6	/* AES-CTR data, AES-CBC control with 256 bit keys */
+#define p3KTYPE_CHACHA20	7	/* ChaCha20-Poly1305 data, AES-CBC control with 256 bit keys */
 #define p3MAX_KSIZE		p3KSIZE_AES256
 
+#define p3KTYPE_GCM(type) \
+	((type) == p3KTYPE_AESGCM128 || (type) == p3KTYPE_AESGCM256)
+#define p3KTYPE_CHACHA(type)	((type) == p3KTYPE_CHACHA20)
+#define p3KTYPE_AEAD(type)		(p3KTYPE_GCM(type) || p3KTYPE_CHACHA(type))
+#define p3KTYPE_CTR(type) \
+	((type) == p3KTYPE_AESCTR128 || (type) == p3KTYPE_AESCTR256)
+/* The data nonce only holds the 32 bit packet ID, so data keys of these
+ * types are never reused from the key array */
+#define p3KTYPE_NONCE(type)		(p3KTYPE_AEAD(type) || p3KTYPE_CTR(type))
+
+#define p3KSERV_LINE	64		/* Cache line size, the head and tail are on separate lines */
+#define p3KSERV_SLOT	32		/* Bytes in each key slot, which holds the largest key */
+#define p3KSERV_RINGS	256		/* Most key rings in the ramdisk */
+
+#define p3BATCH_MAX		16		/* Buffers handed to a provider at one time */
+#define p3TAG_SIZE		16		/* Size of the AEAD tag after the data */
+#define p3NONCE_SIZE	12		/* Size of the AEAD nonce */
+/* The nonce holds the 32 bit packet ID, so a data key must be replaced
+   well before it sends 2^32 packets */
+#define p3SEQ_REKEY		0x80000000	/* Packets sent with a data key before a rekey */
+#define p3SEQ_LIMIT		0xf0000000	/* Packets sent with a data key before dropping */
+
 #define p3CRYPTO_ALIGN	16
 
+#define p3CRYPTO_AUTO	"auto"	/* p3crypto value to choose the fastest provider */
+#define p3BENCH_SIZES	3		/* Packet sizes timed by the crypto benchmark */
+
 #define p3DATENC1		1
 #define p3DATDEC1		2
 #define p3DATENC0		3
@@ -34,9 +64,15 @@
 /*****  DATA DEFINITIONS  *****/
 
 typedef struct _p3key_serv p3key_serv;
+typedef struct _p3key_ring p3key_ring;
 typedef struct _p3key_mgr p3key_mgr;
 typedef struct _p3key p3key;
 typedef struct _p3keymgmt p3keymgmt;
+typedef struct _p3epoch p3epoch;
+typedef struct _p3keyset p3keyset;
+typedef struct _p3keyctx p3keyctx;
+typedef struct _p3cipher p3cipher;
+typedef struct _p3batch p3batch;
 
 /**
  * Structure:
@@ -44,12 +80,34 @@ typedef struct _p3keymgmt p3keymgmt;
  * 
  * \par Description:
  * The key server structure to maintain information about encyrption keys.
+ * The structure is at the start of the ramdisk shared with the key
+ * server.  It is followed by a p3key_ring for each key ring, then the
+ * key slots of each ring in turn.  Each session takes its keys from one
+ * ring, so a busy session cannot use the keys of the other rings.
  */
 
 struct _p3key_serv {
-	int				head;		/**< Head pointer index for the circular buffer */
-	int				tail;		/**< Tail pointer index for the circular buffer */
-	int				cbuf_sz;	/**< Number of slots in the circular buffer */
+	int				cbuf_sz;	/**< Number of key slots in each ring (power of 2) */
+	int				rings;		/**< Number of rings, set by the kernel module */
+	unsigned char	pad0[p3KSERV_LINE - (2 * sizeof(int))];
+};
+
+/**
+ * Structure:
+ * p3key_ring
+ *
+ * \par Description:
+ * The counts of a key ring.  The head and tail count the keys taken and
+ * added, and a key is in slot (count & (cbuf_sz - 1)) of the ring.  The
+ * kernel module only writes the head and the key server only writes the
+ * tail, so neither side takes a lock.
+ */
+
+struct _p3key_ring {
+	unsigned int	head;		/**< Keys taken by the kernel module */
+	unsigned char	pad0[p3KSERV_LINE - sizeof(int)];
+	unsigned int	tail;		/**< Keys added by the key server */
+	unsigned char	pad1[p3KSERV_LINE - sizeof(int)];
 };
 
 /**
@@ -62,7 +120,10 @@ struct _p3key_serv {
 
 struct _p3key_mgr {
 	p3key_serv		*key_serv;	/*<< Key server */
-	p3lock			lock;		/**< Circular buffer lock */
+	int				rings;		/**< Number of key rings */
+	int				slots;		/**< Most key slots that fit in the ramdisk */
+	p3seq			low;		/**< Times the keys dropped below the low watermark */
+	p3seq			starved;	/**< Requests that found too few keys */
 };
 
 /**
@@ -78,6 +139,126 @@ struct _p3key {
 	unsigned int	size;
 };
 
+/**
+ * Structure:
+ * p3cipher
+ *
+ * \par Description:
+ * The operations of a crypto provider.  A context is created for one
+ * key and one direction, and is used by the packet path without locks,
+ * so the crypt operation must not sleep.  The create and release
+ * operations may be called in interrupt context.
+ */
+
+struct _p3cipher {
+	const char		*name;		/**< Provider name (p3crypto parameter) */
+	int				(*init)(void);		/**< Start the provider (optional) */
+	void			(*cleanup)(void);	/**< Stop the provider (optional) */
+	void			*(*create)(unsigned char *key, int size, int encrypt);
+	void			(*release)(void *ctx);
+	int				(*crypt)(void *ctx, unsigned char *buffer, int size,
+						int encrypt, unsigned char *iv);
+	const char		*(*reason)(int stat);	/**< Error text for a crypt status */
+	/* Crypt several buffers at once (optional), <0 if the caller must
+	   use crypt for each buffer */
+	int				(*crypt_batch)(void **ctx, unsigned char **buffer, int *size,
+						unsigned char **iv, int count, int encrypt);
+	/* AEAD operations (optional), the tag follows the buffer and the
+	   key type chooses AES-GCM or ChaCha20-Poly1305 */
+	void			*(*aead_create)(unsigned char *key, int size, int ktype);
+	void			(*aead_release)(void *ctx);
+	int				(*aead_crypt)(void *ctx, unsigned char *buffer, int size,
+						unsigned char *aad, int alen, unsigned char *nonce,
+						int encrypt);
+	/* CTR mode encryption and decryption with an encryption context
+	   (optional), the counter block is set to the next counter */
+	int				(*ctr_crypt)(void *ctx, unsigned char *buffer, int size,
+						unsigned char *ctr);
+};
+
+/**
+ * Structure:
+ * p3epoch
+ *
+ * \par Description:
+ * The crypto contexts created from one pair of session keys.  An epoch
+ * is not changed after it is published, so the packet path uses it
+ * without locks.  The current epoch is key 1 and the epoch it replaced
+ * is key 0.  An epoch prepared ahead of a rekey holds its own keys,
+ * which are sent to the secondary before the epoch is published.
+ */
+
+struct _p3epoch {
+	p3rcu			rcu;		/*<< Release after current readers finish */
+	p3epoch			*prev;		/*<< Previous epoch (key 0), RCU protected */
+	const p3cipher	*ops;		/*<< Provider of the crypto contexts */
+	int				aead;		/*<< Data contexts are AEAD contexts */
+	int				ctr;		/*<< Data contexts are CTR (encryption) contexts */
+	void			*datenc;	/*<< Session data encryption context */
+	void			*datdec;	/*<< Session data decryption context */
+	void			*ctlenc;	/*<< Session control encryption context */
+	void			*ctldec;	/*<< Session control decryption context */
+	p3keyset		*dset;		/*<< Key set owning the data contexts or NULL */
+	p3keyset		*cset;		/*<< Key set owning the control contexts or NULL */
+	int				ktype;		/*<< Key type of the contexts (p3KTYPE_*) */
+	p3key			*keys;		/*<< Data and control keys of a prepared epoch or NULL */
+	unsigned int	start;		/*<< Sequence number of the first data packet sent */
+};
+
+/**
+ * Structure:
+ * p3keyctx
+ *
+ * \par Description:
+ * The crypto contexts of one key of a key array.  The AEAD contexts
+ * are only created for an AEAD key type, and are used when the key is
+ * a data key.
+ */
+
+struct _p3keyctx {
+	void			*enc;		/*<< CBC encryption context */
+	void			*dec;		/*<< CBC decryption context */
+	void			*aenc;		/*<< AEAD encryption context or NULL */
+	void			*adec;		/*<< AEAD decryption context or NULL */
+};
+
+/**
+ * Structure:
+ * p3keyset
+ *
+ * \par Description:
+ * The crypto contexts of a session key array, created when the array
+ * is set.  A rekey to an index of the array uses the contexts of the
+ * set instead of creating new ones.  The set is released when it has
+ * been replaced and no epoch uses it.
+ */
+
+struct _p3keyset {
+	p3ref			ref;		/*<< Session and epoch references */
+	const p3cipher	*ops;		/*<< Provider of the crypto contexts */
+	int				ktype;		/*<< Key type of the keys (p3KTYPE_*) */
+	int				count;		/*<< Number of keys */
+	p3keyctx		*key;		/*<< Contexts of each key */
+};
+
+/**
+ * Structure:
+ * p3batch
+ *
+ * \par Description:
+ * A buffer for p3_encrypt_batch or p3_decrypt_batch.  The buffers of
+ * a batch can be for different sessions.
+ */
+
+struct _p3batch {
+	unsigned char	*buffer;	/*<< Buffer, encrypted or decrypted in place */
+	int				size;		/*<< Size of the buffer (multiple of 16 for CBC) */
+	unsigned int	id;			/*<< ID of the P3 packet */
+	int				key;		/*<< Session crypto type (ie. p3DATENC1) */
+	p3keymgmt		*keys;		/*<< Session key management structure */
+	int				stat;		/*<< Set to the status of the buffer */
+};
+
 /**
  * Structure:
  * p3keymgmt
@@ -87,30 +268,52 @@ struct _p3key {
  */
 
 struct _p3keymgmt {
-	void			*datenc0;	/*<< Session data encryption context 0 */
-	void			*datdec0;	/*<< Session data decryption context 0 */
-	void			*datenc1;	/*<< Session data encryption context 1 */
-	void			*datdec1;	/*<< Session data decryption context 1 */
-	void			*ctlenc0;	/*<< Session control encryption context 0 */
-	void			*ctldec0;	/*<< Session control decryption context 0 */
-	void			*ctlenc1;	/*<< Session control encryption context 1 */
-	void			*ctldec1;	/*<< Session control decryption context 1 */
+	p3epoch			*epoch;		/*<< Current epoch (key 1), RCU protected */
+	p3lock			lock;		/*<< Serializes epoch changes */
 	p3key			*dnewkey;	/*<< New data key */
 	p3key			*cnewkey;	/*<< New control key */
 #define p3KMG_KEYS	2
+	p3keyset		*keyset;	/*<< Contexts of the key array or NULL */
+	p3epoch			*next;		/*<< Epoch prepared ahead of the next rekey or NULL */
+	p3epoch			*ready;		/*<< Prepared epoch of the new keys or NULL */
+	int				dnewidx;	/*<< Key array index of new data key or -1 */
+	int				cnewidx;	/*<< Key array index of new control key or -1 */
+	int				ktype;		/*<< Key type of new epochs (p3KTYPE_*) */
+	int				dir;		/*<< Sender direction in AEAD and CTR nonces */
+#define p3KMG_PRIDIR	0		/* Sent by the primary */
+#define p3KMG_SECDIR	1		/* Sent by the secondary */
 };
 
 /*****  MACROS  *****/
 
 /*****  PROTOTYPES  *****/
 
+int p3_crypto_probe(void);
+int p3_crypto_bench(int idx, const char **name, int *size, int *mbs);
+void p3_crypto_cleanup(void);
 int p3_get_key_size(int type);
-int p3_get_key(p3key *key, p3key_mgr *key_mgr);
+int p3_key_init(p3key_mgr *key_mgr, unsigned char *ramdisk, int size, int rings);
+int p3_get_key(p3key *key, int ring, p3key_mgr *key_mgr);
+int p3_get_keys(p3key *keys, int count, int ring, p3key_mgr *key_mgr);
+int p3_key_avail(p3key_mgr *key_mgr);
+int p3_key_low(p3key_mgr *key_mgr);
 p3key **p3_get_key_array(int size, int number, p3key_mgr *key_mgr);
-int p3_init_crypto(p3keymgmt *keys);
-int p3_rekey(p3keymgmt *keys);
+int p3_init_crypto(p3keymgmt *keys, unsigned int start);
+int p3_set_keys(unsigned char *list, int count, p3keymgmt *keys);
+int p3_rekey(p3keymgmt *keys, unsigned int start);
+int p3_key_limit(p3keymgmt *keys, unsigned int id);
+int p3_prepare_epoch(p3keymgmt *keys, int ring, p3key_mgr *key_mgr);
+int p3_next_keys(p3keymgmt *keys);
 int p3_encrypt(unsigned char *buffer, int size, unsigned int id, int key, p3keymgmt *keys);
 int p3_decrypt(unsigned char *buffer, int size, unsigned int id, int key, p3keymgmt *keys);
+int p3_encrypt_batch(p3batch *batch, int count);
+int p3_decrypt_batch(p3batch *batch, int count);
+int p3_aead(int key, p3keymgmt *keys);
+int p3_ctr(int key, p3keymgmt *keys);
+int p3_seal(unsigned char *buffer, int size, unsigned char *aad, int alen,
+		unsigned int id, int key, p3keymgmt *keys);
+int p3_open(unsigned char *buffer, int size, unsigned char *aad, int alen,
+		unsigned int id, int key, p3keymgmt *keys);
 
 /*****  EXTERNAL DEFINITIONS  *****/
 
@@ -0,0 +1,259 @@
+/**
+ * \file p3kgcm.c
+ * <h3>Protected Point to Point AES-GCM file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * AES-GCM (NIST SP 800-38D) encrypts a buffer in counter mode and
+ * authenticates the cipher text and the associated data with GHASH,
+ * so a packet is encrypted and authenticated in one pass.  The 16 byte
+ * tag follows the buffer.
+ *
+ * The whole blocks of the buffer are handled by the AES and PCLMULQDQ
+ * instructions when they are available.  Otherwise, and for the
+ * associated data, the final partial block and the length block, the
+ * AES table code and a 4 bit table GHASH are used.
+ */
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#else
+#include <string.h>
+#endif
+
+#include "moc_src/moptions.h"
+#include "moc_src/mtypes.h"
+#include "moc_src/mdefs.h"
+#include "moc_src/aesalgo.h"
+
+#include "p3kgcm.h"
+
+/** Reduction values for the 4 bit GHASH table */
+static const unsigned long long p3gcm_last4[16] = {
+	0x0000, 0x1c20, 0x3840, 0x2460, 0x7080, 0x6ca0, 0x48c0, 0x54e0,
+	0xe100, 0xfd20, 0xd940, 0xc560, 0x9180, 0x8da0, 0xa9c0, 0xb5e0
+};
+
+/**
+ * \par Function:
+ * p3gcm_mult
+ *
+ * \par Description:
+ * Multiply the GHASH state by the hash key.
+ *
+ * \par Inputs:
+ * - gcm: The AES-GCM key
+ * - x: The 16 byte GHASH state
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3gcm_mult(const p3gcm *gcm, unsigned char *x)
+{
+	int i;
+	unsigned char lo, hi, rem;
+	unsigned long long zh, zl;
+
+	lo = x[15] & 0xf;
+	zh = gcm->hh[lo];
+	zl = gcm->hl[lo];
+	for (i=15; i >= 0; i--) {
+		lo = x[i] & 0xf;
+		hi = (x[i] >> 4) & 0xf;
+		if (i != 15) {
+			rem = (unsigned char) zl & 0xf;
+			zl = (zh << 60) | (zl >> 4);
+			zh = (zh >> 4) ^ (p3gcm_last4[rem] << 48);
+			zh ^= gcm->hh[lo];
+			zl ^= gcm->hl[lo];
+		}
+		rem = (unsigned char) zl & 0xf;
+		zl = (zh << 60) | (zl >> 4);
+		zh = (zh >> 4) ^ (p3gcm_last4[rem] << 48);
+		zh ^= gcm->hh[hi];
+		zl ^= gcm->hl[hi];
+	}
+	for (i=7; i >= 0; i--) {
+		x[i] = (unsigned char) zh;
+		x[i + 8] = (unsigned char) zl;
+		zh >>= 8;
+		zl >>= 8;
+	}
+} /* end p3gcm_mult */
+
+/**
+ * \par Function:
+ * p3gcm_hash
+ *
+ * \par Description:
+ * Add data to the GHASH state.  A final partial block is padded with
+ * zeros.
+ *
+ * \par Inputs:
+ * - gcm: The AES-GCM key
+ * - x: The 16 byte GHASH state
+ * - data: The data
+ * - len: The size of the data
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3gcm_hash(const p3gcm *gcm, unsigned char *x,
+		const unsigned char *data, int len)
+{
+	int i, n;
+
+	for (; len > 0; len -= n, data += n) {
+		n = (len < 16) ? len : 16;
+		for (i=0; i < n; i++)
+			x[i] ^= data[i];
+		p3gcm_mult(gcm, x);
+	}
+} /* end p3gcm_hash */
+
+/**
+ * \par Function:
+ * p3gcm_key
+ *
+ * \par Description:
+ * Set up an AES-GCM key.
+ *
+ * \par Inputs:
+ * - gcm: The AES-GCM key to be set
+ * - key: The AES key
+ * - size: The AES key size, in bytes (16, 24 or 32)
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Invalid key size
+ */
+
+int p3gcm_key(p3gcm *gcm, const unsigned char *key, int size)
+{
+	int stat = 0, i, j;
+	unsigned long long vh, vl;
+
+	if (size != 16 && size != 24 && size != 32) {
+		stat = -1;
+		goto out;
+	}
+	memset(gcm, 0, sizeof(p3gcm));
+	gcm->nr = aesKeySetupEnc(gcm->rk, key, size << 3);
+	p3aesni_key(gcm->rk, gcm->nr, gcm->nk);
+	// The hash key is the encrypted zero block
+	aesEncrypt(gcm->rk, gcm->nr, gcm->h, gcm->h);
+
+	// Multiples of the hash key for each 4 bit value
+	for (i=0, vh=0, vl=0; i < 8; i++) {
+		vh = (vh << 8) | gcm->h[i];
+		vl = (vl << 8) | gcm->h[i + 8];
+	}
+	gcm->hl[8] = vl;
+	gcm->hh[8] = vh;
+	for (i=4; i > 0; i >>= 1) {
+		j = (vl & 1) ? 0xe1 : 0;
+		vl = (vh << 63) | (vl >> 1);
+		vh = (vh >> 1) ^ ((unsigned long long) j << 56);
+		gcm->hl[i] = vl;
+		gcm->hh[i] = vh;
+	}
+	for (i=2; i <= 8; i <<= 1) {
+		for (j=1; j < i; j++) {
+			gcm->hh[i + j] = gcm->hh[i] ^ gcm->hh[j];
+			gcm->hl[i + j] = gcm->hl[i] ^ gcm->hl[j];
+		}
+	}
+
+out:
+	return (stat);
+} /* end p3gcm_key */
+
+/**
+ * \par Function:
+ * p3gcm_crypt
+ *
+ * \par Description:
+ * Encrypt or decrypt a buffer in place.  When encrypting, the tag is
+ * written after the buffer.  When decrypting, the tag after the buffer
+ * is checked, and the buffer must not be used if the check fails.
+ *
+ * \par Inputs:
+ * - gcm: The AES-GCM key
+ * - buffer: The buffer, followed by p3GCM_TAGSZ bytes for the tag
+ * - size: The size of the buffer
+ * - aad: The associated data, which is authenticated but not encrypted
+ * - alen: The size of the associated data
+ * - nonce: The p3GCM_NONCESZ byte nonce, which must not be repeated for
+ *   the key
+ * - encrypt: 1 to encrypt, 0 to decrypt
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: The tag does not match
+ */
+
+int p3gcm_crypt(const p3gcm *gcm, unsigned char *buffer, int size,
+		const unsigned char *aad, int alen, const unsigned char *nonce,
+		int encrypt)
+{
+	int i, n, done = 0;
+	unsigned int bits;
+	unsigned char j0[16], ctr[16], x[16], ks[16], diff;
+
+	// The first counter block is the nonce and a block count of 1
+	memcpy(j0, nonce, p3GCM_NONCESZ);
+	j0[12] = j0[13] = j0[14] = 0;
+	j0[15] = 1;
+	memcpy(ctr, j0, sizeof(ctr));
+	ctr[15] = 2;
+	memset(x, 0, sizeof(x));
+	p3gcm_hash(gcm, x, aad, alen);
+
+	// Whole blocks with the AES and PCLMULQDQ instructions
+	if (p3aesni_gcm_on && (n = size & ~0xf) > 0 &&
+			p3aesni_gcm(gcm->nk, gcm->nr, gcm->h, buffer, n, encrypt,
+			ctr, x) == 0)
+		done = n;
+
+	// Remaining blocks with the table code
+	for (; done < size; done += n) {
+		n = ((size - done) < 16) ? size - done : 16;
+		aesEncrypt((ubyte4 *) gcm->rk, gcm->nr, ctr, ks);
+		for (i=15; i >= 12 && ++ctr[i] == 0; i--)
+			;
+		if (!encrypt)
+			p3gcm_hash(gcm, x, &buffer[done], n);
+		for (i=0; i < n; i++)
+			buffer[done + i] ^= ks[i];
+		if (encrypt)
+			p3gcm_hash(gcm, x, &buffer[done], n);
+	}
+
+	// Length block (sizes in bits), then the tag
+	memset(ks, 0, sizeof(ks));
+	bits = (unsigned int) alen << 3;
+	ks[4] = (unsigned char) (bits >> 24);
+	ks[5] = (unsigned char) (bits >> 16);
+	ks[6] = (unsigned char) (bits >> 8);
+	ks[7] = (unsigned char) bits;
+	bits = (unsigned int) size << 3;
+	ks[12] = (unsigned char) (bits >> 24);
+	ks[13] = (unsigned char) (bits >> 16);
+	ks[14] = (unsigned char) (bits >> 8);
+	ks[15] = (unsigned char) bits;
+	p3gcm_hash(gcm, x, ks, sizeof(ks));
+	aesEncrypt((ubyte4 *) gcm->rk, gcm->nr, j0, ks);
+	if (encrypt) {
+		for (i=0; i < p3GCM_TAGSZ; i++)
+			buffer[size + i] = ks[i] ^ x[i];
+		return (0);
+	}
+	for (i=0, diff=0; i < p3GCM_TAGSZ; i++)
+		diff |= buffer[size + i] ^ ks[i] ^ x[i];
+	return (diff ? -1 : 0);
+} /* end p3gcm_crypt */
+
@@ -0,0 +1,53 @@
+/**
+ * \file p3kgcm.h
+ * <h3>Protected Point to Point AES-GCM header file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * The AES-GCM functions encrypt and authenticate a buffer in one pass.
+ */
+
+#ifndef _p3kGCM_H
+#define _p3kGCM_H
+
+/*****  INCLUDE FILES *****/
+
+#include "p3kaesni.h"
+
+/*****  CONSTANTS  *****/
+
+#define p3GCM_TAGSZ		16		/**< Size of the authentication tag */
+#define p3GCM_NONCESZ	12		/**< Size of the nonce */
+
+/*****  DATA DEFINITIONS  *****/
+
+typedef struct _p3gcm p3gcm;
+
+/**
+ * Structure:
+ * p3gcm
+ *
+ * \par Description:
+ * An AES-GCM key.  The key schedule is kept in the forms used by the
+ * AES table code and by the AES instructions, and the hash key in the
+ * table used by the GHASH table code.
+ */
+
+struct _p3gcm {
+	unsigned int		rk[4 * (p3AESNI_MAXNR + 1)];	/**< Table code key schedule */
+	unsigned char		nk[p3AESNI_KSIZE];	/**< AES instruction key schedule */
+	int					nr;			/**< Number of rounds */
+	unsigned char		h[16];		/**< Hash key */
+	unsigned long long	hl[16];		/**< GHASH table, low 64 bits */
+	unsigned long long	hh[16];		/**< GHASH table, high 64 bits */
+};
+
+/*****  PROTOTYPES  *****/
+
+int p3gcm_key(p3gcm *gcm, const unsigned char *key, int size);
+int p3gcm_crypt(const p3gcm *gcm, unsigned char *buffer, int size,
+		const unsigned char *aad, int alen, const unsigned char *nonce,
+		int encrypt);
+
+#endif /* _p3kGCM_H */
+
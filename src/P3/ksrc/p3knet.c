@@ -29,9 +29,10 @@
 /** The primary P3 route tables */
 p3route *ipv4route = NULL;
 p3route *ipv6route = NULL;
-/** The remote host table */
-// TODO: Convert remote host table to Red Black tree
-p3host *p3hosts = NULL;
+/** The remote host table, hashed by host address */
+p3host *p3hosts[p3HOST_HASHSZ];
+int p3hostsz = 0;
+static p3lock p3hostlock;
 
 /**
  * \par Function:
@@ -60,28 +61,27 @@ p3host *p3hosts = NULL;
 
 int init_p3net(void)
 {
-	int i, stat = 0;
-	unsigned long l;
+	int stat = 0;
 
-	// TODO: Build Red Black tree
+	p3lock_init(p3hostlock);
+	// Choose the AES engine
+	if (p3_crypto_probe() < 0) {
+		stat = -1;
+		goto out;
+	}
 	// Create P3 route tables
-	i = sizeof(p3route) + (P3MAXROUTE * sizeof(p3net *));
-	if ((ipv4route = (p3route *) p3calloc(i)) == NULL) {
+	if ((ipv4route = p3route_create(32)) == NULL) {
 		p3errmsg(p3MSG_CRIT, "init_p3primary: Failed to allocate IPv4 route table\n");
 		stat = -1;
 		goto out;
 	}
-	l = (unsigned long) ipv4route + sizeof(p3route);
-	ipv4route->nets = (p3net **) l;
-
-	i = sizeof(p3route) + (P3MAXROUTE * sizeof(p3net *));
-	if ((ipv6route = (p3route *) p3calloc(i)) == NULL) {
+	if ((ipv6route = p3route_create(128)) == NULL) {
 		p3errmsg(p3MSG_CRIT, "init_p3primary: Failed to allocate IPv6 route table\n");
+		p3route_free(ipv4route);
+		ipv4route = NULL;
 		stat = -1;
 		goto out;
 	}
-	l = (unsigned long) ipv6route + sizeof(p3route);
-	ipv6route->nets = (p3net **) l;
 
 out:
 	return (stat);
@@ -99,6 +99,190 @@ out:
  *
  */
 
+/**
+ * \par Function:
+ * cleanup_p3net
+ *
+ * \par Description:
+ * Release the network tables.  This is called after the packet hooks
+ * have been removed.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - None
+ */
+
+void cleanup_p3net(void)
+{
+	int i;
+	p3host *host;
+
+	p3route_free(ipv4route);
+	ipv4route = NULL;
+	p3route_free(ipv6route);
+	ipv6route = NULL;
+	for (i=0; i < p3HOST_HASHSZ; i++) {
+		while ((host = p3hosts[i]) != NULL) {
+			p3hosts[i] = host->hlist;
+			p3free(host);
+		}
+	}
+	p3hostsz = 0;
+} /* end cleanup_p3net */
+
+/**
+ * \par Function:
+ * p3host_hash
+ *
+ * \par Description:
+ * Get the remote host table index for a host address.
+ *
+ * \par Inputs:
+ * - ipver: The IP version of the address (p3HST_IPV4 or p3HST_IPV6)
+ * - addr: The network order host address
+ *
+ * \par Outputs:
+ * - unsigned int: The host table index
+ */
+
+static inline unsigned int p3host_hash(int ipver, const void *addr)
+{
+	const unsigned int *a = (const unsigned int *) addr;
+	unsigned int h = a[0];
+
+	if (ipver == p3HST_IPV6)
+		h ^= a[1] ^ a[2] ^ a[3];
+	return ((h * 0x9e3779b1) >> (32 - p3HOST_HASHBITS));
+} /* end p3host_hash */
+
+/**
+ * \par Function:
+ * p3host_find
+ *
+ * \par Description:
+ * Find a remote P3 host by address.  This does not lock the host table
+ * and is used by both the packet path and the configuration path.
+ *
+ * Hosts are released with p3rcu_free, so a host found from the packet
+ * path remains valid until the netfilter hook returns.
+ *
+ * \par Inputs:
+ * - ipver: The IP version of the address (p3HST_IPV4 or p3HST_IPV6)
+ * - addr: The network order host address
+ *
+ * \par Outputs:
+ * - p3host *: The remote host or NULL if not found
+ */
+
+p3host *p3host_find(int ipver, const void *addr)
+{
+	int size;
+	p3host *host;
+
+	size = ipver == p3HST_IPV6 ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+	p3rcu_read_lock();
+	host = p3rcu_deref(p3hosts[p3host_hash(ipver, addr)]);
+	while (host != NULL) {
+		if ((host->flag & p3HST_IPVER) == ipver &&
+				memcmp(&host->addr, addr, size) == 0)
+			break;
+		host = p3rcu_deref(host->hlist);
+	}
+	p3rcu_read_unlock();
+	return (host);
+} /* end p3host_find */
+
+/**
+ * \par Function:
+ * p3host_add
+ *
+ * \par Description:
+ * Add a remote P3 host to the host table.  The host address and IP
+ * version flag must be set, and the host should be completely
+ * initialized, since it is visible to the packet path when this returns.
+ *
+ * \par Inputs:
+ * - host: The remote host
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0 = OK
+ *   - >0 = A host with the same address is already in the table
+ */
+
+int p3host_add(p3host *host)
+{
+	int ipver, size, stat = 0;
+	unsigned int idx;
+	p3host *hent;
+
+	ipver = host->flag & p3HST_IPVER;
+	size = ipver == p3HST_IPV6 ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+	idx = p3host_hash(ipver, &host->addr);
+	p3lock(p3hostlock);
+	for (hent = p3hosts[idx]; hent != NULL; hent = hent->hlist) {
+		if ((hent->flag & p3HST_IPVER) == ipver &&
+				memcmp(&hent->addr, &host->addr, size) == 0) {
+			stat = 1;
+			goto unlock;
+		}
+	}
+	host->hlist = p3hosts[idx];
+	p3rcu_assign(p3hosts[idx], host);
+	p3hostsz++;
+
+unlock:
+	p3unlock(p3hostlock);
+	return (stat);
+} /* end p3host_add */
+
+/**
+ * \par Function:
+ * p3host_remove
+ *
+ * \par Description:
+ * Remove a remote P3 host and its networks from the host and route
+ * tables, and release the host after current lookups finish.  The host
+ * need not be in the host table, so this also cleans up a host whose
+ * configuration failed.
+ *
+ * \par Inputs:
+ * - host: The remote host
+ *
+ * \par Outputs:
+ * - None
+ */
+
+void p3host_remove(p3host *host)
+{
+	int i, snets;
+	p3host **hent;
+	p3net *snet;
+
+	p3lock(p3hostlock);
+	hent = &p3hosts[p3host_hash(host->flag & p3HST_IPVER, &host->addr)];
+	while (*hent != NULL && *hent != host)
+		hent = &(*hent)->hlist;
+	if (*hent != NULL) {
+		p3rcu_assign(*hent, host->hlist);
+		p3hostsz--;
+	}
+	p3unlock(p3hostlock);
+
+	snets = (host->flag & p3HST_SNETS) >> p3HST_SNSHF;
+	for (i=0, snet = host->subnet; snet != NULL && i < snets; i++, snet++) {
+		if (snet->flag & p3HST_IPV4)
+			p3route_delete(ipv4route, snet, (unsigned char *)&snet->net.v4,
+					snet->prefix);
+		else if (snet->flag & p3HST_IPV6)
+			p3route_delete(ipv6route, snet, (unsigned char *)&snet->net.v6,
+					snet->prefix);
+	}
+	p3rcu_free(host);
+} /* end p3host_remove */
+
 /**
  * \par Function:
  * build_p3table
@@ -119,42 +303,39 @@ out:
 
 int build_p3table(p3net *net, int ipver)
 {
-	int i, stat = 0;
+	int stat = 0;
 
 p3errmsg(p3MSG_DEBUG, "Enter build P3 table\n");
-	// Check for network already defined
+	// Add network, checking for network already defined
 	if (ipver == p3HST_IPV4) {
-		// TODO: Build Red Black tree
-		if (ipv4route->netsz == P3MAXROUTE) {
-			p3errmsg(p3MSG_WARN, "build_p3table: Maximum routes exceeded\n");
-			stat = 1;
-			goto out;
-		}
-		for (i=0; i < ipv4route->netsz; i++) {
-			// TODO: Put host definition before subnet definition
-			if (memcmp(&ipv4route->nets[i]->net.v4, &net->net.v4, sizeof(struct in_addr)) == 0 &&
-				memcmp(&ipv4route->nets[i]->mask, &net->mask, sizeof(struct in_addr)) == 0) {
-				p3errmsg(p3MSG_WARN, "build_p3table: Route already exists\n");
-				stat = 1;
-				goto out;
-			}
-		}
-		ipv4route->nets[ipv4route->netsz++] = net;
+		net->prefix = p3route_prefix(&net->mask);
+		stat = p3route_insert(ipv4route, net,
+				(unsigned char *)&net->net.v4, net->prefix);
+	} else if (ipver == p3HST_IPV6) {
+		// TODO: Support IPv6 prefix configuration
+		if (net->prefix == 0)
+			net->prefix = 128;
+		stat = p3route_insert(ipv6route, net,
+				(unsigned char *)&net->net.v6, net->prefix);
+	}
+	if (stat < 0) {
+		p3errmsg(p3MSG_CRIT, "build_p3table: Failed to add route\n");
+	} else if (stat > 0) {
+		p3errmsg(p3MSG_WARN, "build_p3table: Route already exists\n");
 	}
-	// TODO: Build IPv6 P3 table
 
-out:
 p3errmsg(p3MSG_DEBUG, "Exit build P3 table\n");
 	return (stat);
 } /* end build_p3table */
 
 /**
  * \page P3KM_MSGS Protected Point to Point Kernel Module Messages
- * <hr><b>build_p3table: Maximum routes exceeded</b>
- * \par Description (WARN):
- * The P3 kernel module has attempted to add a new route to the P3 route table.
+ * <hr><b>build_p3table: Failed to add route</b>
+ * \par Description (CRIT):
+ * The P3 kernel module failed to allocate memory for a new route in the
+ * P3 route table.
  * \par Response:
- * Report the problem to Velocite Systems support.
+ * Troubleshoot the operating system memory problem.
  *
  * <hr><b>build_p3table: Route already exists</b>
  * \par Description (WARN):
@@ -203,6 +384,127 @@ out:
 	return (stat);
 } /* end set_net_active */
 
+/**
+ * \par Function:
+ * p3_alloc_seq
+ *
+ * \par Description:
+ * Allocate the next sequence number of a session without locking.
+ * Sequence number 0 is never used, since it marks the packet that
+ * establishes the raw socket.
+ *
+ * \par Inputs:
+ * - session: The session of the remote P3 host
+ *
+ * \par Outputs:
+ * - unsigned int: The sequence number
+ */
+
+static inline unsigned int p3_alloc_seq(p3session *session)
+{
+	unsigned int sseq;
+
+	do {
+		sseq = p3seq_add(session->sseq, 1) - 1;
+	} while (sseq == 0);
+	return (sseq);
+} /* end p3_alloc_seq */
+
+/**
+ * \par Function:
+ * p3_next_seq
+ *
+ * \par Description:
+ * Get the next sequence number for a data packet sent in a session.
+ * Data packets are not sent while the session is rekeying.
+ *
+ * The Rekey flag is set before the rekey message gets its sequence
+ * number, and is tested again after a sequence number is allocated.
+ * A data packet therefore never gets a sequence number after the start
+ * of the new key while it would be encrypted with the old key.
+ *
+ * A data key is never used for more than p3SEQ_LIMIT packets, since the
+ * nonce holds the 32 bit sequence number.  The primary starts a rekey
+ * once the key has sent p3SEQ_REKEY packets, and data packets are
+ * dropped if the rekey has not completed by the limit.  Control
+ * messages use the control key, which has no nonce, and are still sent.
+ *
+ * \par Inputs:
+ * - session: The session of the remote P3 host
+ * - sseq: The sequence number to be set
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0 = OK
+ *   - <0 = Session is rekeying and data packets are not sent
+ */
+
+int p3_next_seq(p3session *session, unsigned int *sseq)
+{
+	int stat;
+
+	// If rekeying, do not send data packets
+	// TODO: Set delay sequence ID
+	if (session->flag & p3PSS_REKEY)
+		return (-1);
+	*sseq = p3_alloc_seq(session);
+	// The allocation is a full barrier, so a rekey started before it is seen
+	if (session->flag & p3PSS_REKEY)
+		return (-1);
+	if ((stat = p3_key_limit(&session->keymgmt, *sseq)) < 0) {
+		p3pkterr(p3MSG_ERR, "p3_next_seq: Data key packet limit reached\n");
+		return (-1);
+	}
+#ifndef _p3_SECONDARY
+	// Retry the rekey every few packets if it cannot be started
+	if (stat > 0 && !(*sseq & 0xfff))
+		start_rekeying(session);
+#endif
+	return (0);
+} /* end p3_next_seq */
+
+/**
+ * \page P3KM_MSGS Protected Point to Point Kernel Module Messages
+ * <hr><b>p3_next_seq: Data key packet limit reached</b>
+ * \par Description (ERR):
+ * The data key of a session has sent the most packets allowed with one
+ * key, and the session has not been rekeyed.  Data packets of the
+ * session are discarded until the rekey completes.
+ * \par Response:
+ * Verify the key server is supplying keys and the remote P3 host is
+ * answering rekey messages.
+ *
+ */
+
+/**
+ * \par Function:
+ * p3_rekey_seq
+ *
+ * \par Description:
+ * Get the first sequence number for a new key.  This is the sequence
+ * number following the next one allocated, which is used by the rekey
+ * message sent next.  Data packets must already be stopped with the
+ * Rekey flag.
+ *
+ * \par Inputs:
+ * - session: The session of the remote P3 host
+ *
+ * \par Outputs:
+ * - unsigned int: The sequence number
+ */
+
+unsigned int p3_rekey_seq(p3session *session)
+{
+	unsigned int sseq = p3seq_read(session->sseq);
+
+	if (!sseq)
+		sseq++;
+	sseq++;
+	if (!sseq)
+		sseq++;
+	return (sseq);
+} /* end p3_rekey_seq */
+
 #define PW pkt->work
 
 /**
@@ -222,6 +524,12 @@ out:
  *     - Encrypt the packet, add the P3 header and return the packet to the stack
  *   - If destination is not another P3 system, return the packet to the stack
  *
+ * If the p3PKT_LOOKUP flag is set, the caller has already set the
+ * lookup results of the packet.  If the p3PKT_DEFER flag is set, the
+ * data of a non-AEAD packet is left unencrypted and the sequence number
+ * is returned, so the caller can encrypt several packets together.  The
+ * flag is cleared if the packet was encrypted here.
+ *
  * \par Inputs:
  * - pkt: A p3packet structure containing information about the packet.
  * - p3sys_net: The system network structure pointer.  This is passed as
@@ -245,7 +553,10 @@ int packet_handler(p3packet *pkt, void *p3sys_net)
 	unsigned char *bufp;
 // TODO: Support IPv6 in packet handler
 
-	p3_lookup(pkt);
+	// Segments of one packet share the lookup done by the caller
+	if (!(pkt->flag & p3PKT_LOOKUP))
+		p3_lookup(pkt);
+	p3trace_prgs(lookup, pkt->packet, pkt->flag, pkt->net);
 /***
  *** Packet source is local subnet, it will be intercepted again
  ***/
@@ -255,21 +566,13 @@ int packet_handler(p3packet *pkt, void *p3sys_net)
  *** Source is P3 host
  ***/
 	} else if (pkt->flag & p3PKT_P3SRC) {
-sprintf(p3buf, "P3 source net found: pkt %p, net %p, flag %x\n",
-	pkt->packet, pkt->net, pkt->flag);
-p3errmsg(p3MSG_DEBUG, p3buf);
 		// Network is not active, return packet to stack
 		if (!(pkt->net->flag & p3NET_ACT)) {
-sprintf(p3buf, "P3 session not active: %2.2x%2.2x%2.2x%2.2x\n",
-	pkt->packet[12], pkt->packet[13], pkt->packet[14], pkt->packet[15]);
-p3errmsg(p3MSG_DEBUG, p3buf);
 			goto out;
 		}
 		// Session is not a P3 session
 		iph = (struct iphdr *) pkt->packet;
 		if (iph->protocol != p3PROTO) {
-sprintf(p3buf, "Protocol not P3: %d\n", iph->protocol);
-p3errmsg(p3MSG_DEBUG, p3buf);
 			goto out;
 		}
 		// Pass initialization connection
@@ -283,16 +586,15 @@ p3errmsg(p3MSG_DEBUG, p3buf);
 			decode_ctl = ntohs(tcph->source);
 #endif
 			if (tcph->syn && decode_ctl == pkt->net->host->port) {
-p3errmsg(p3MSG_DEBUG, "P3 session init\n");
+				p3trace_prgs(path, __func__, "P3 session init", 0);
 				goto out;
 			}
 		}
 		// Set OS dependent inbound network info for remote P3 host
 		if ((pkt->flag & p3PKT_SRP3) && !(pkt->net->flag & p3NET_DEVI)) {
 			if (p3net_utils(p3SET_DEVIN, p3sys_net, pkt) < 0) {
-				sprintf(p3buf, "packet_handler: System network utility\
- failed: %d\n", p3SET_DEVIN);
-				p3errmsg(p3MSG_ERR, p3buf);
+				p3pkterr(p3MSG_ERR, "packet_handler: System network utility failed: %d\n",
+						p3SET_DEVIN);
 				stat = -1;
 				goto out;
 			}
@@ -301,26 +603,22 @@ p3errmsg(p3MSG_DEBUG, "P3 session init\n");
 		// Get work space with 2 data buffers
 		addmss = sizeof(p3work) + 
 				(((pkt->flag & p3PKT_SIZE) - p3SESSION_HDR4) << 1);
-		if ((pkt->work = (p3work *) p3malloc(addmss)) == NULL) {
+		if ((pkt->work = (p3work *) p3work_alloc(addmss)) == NULL) {
 			p3errmsg(p3MSG_CRIT, "packet_handler: Failed to allocate P3 packet buffer\n");
 			stat = -1;
 			goto out;
 		}
-strcpy(p3buf, "P3 hdr:");
-for (PW->i1=0; PW->i1 < p3SESSION_HDR4; PW->i1++) {
-	if (!(PW->i1 & 3))
-		sprintf(p3buf, "%s ", p3buf);
-	sprintf(p3buf, "%s%2.2x", p3buf, pkt->packet[PW->i1]);
-}
-sprintf(p3buf, "%s\n", p3buf);
-p3errmsg(p3MSG_DEBUG, p3buf);
-		memset(pkt->work, 0, sizeof(p3work));
+		p3trace_data(packet, "P3 hdr", pkt->packet, p3SESSION_HDR4);
 		PW->l = (unsigned long) PW + sizeof(p3work);
 		PW->newbuf = (unsigned char *) PW->l;
 		PW->l += (pkt->flag & p3PKT_SIZE) - p3SESSION_HDR4;
 		PW->buf = (unsigned char *) PW->l;
 		PW->newlen = (pkt->flag & p3PKT_SIZE) - p3SESSION_HDR4;
-		memcpy(PW->newbuf, &pkt->packet[p3SESSION_HDR4], PW->newlen);
+		// Decrypt in the system buffer if possible, else in the work area
+		if (p3net_utils(p3SET_INPLACE, p3sys_net, pkt) == 0)
+			PW->newbuf = &pkt->packet[p3SESSION_HDR4];
+		else
+			memcpy(PW->newbuf, &pkt->packet[p3SESSION_HDR4], PW->newlen);
 		// Use P3 sequence number to choose encryption key
 		sseq = (unsigned int) pkt->packet[p3SESSION_HDR4 - 4];
 		sseq <<= 8;
@@ -329,28 +627,32 @@ p3errmsg(p3MSG_DEBUG, p3buf);
 		sseq |= (unsigned int) pkt->packet[p3SESSION_HDR4 - 2];
 		sseq <<= 8;
 		sseq |= (unsigned int) pkt->packet[p3SESSION_HDR4 - 1];
-		if (pkt->host->session->rID1 <= sseq ||
-				sseq < pkt->host->session->rID0) {
+		if (p3SEQ_GE(sseq, pkt->host->session->rID1)) {
 			decode_dat = p3DATDEC1;
 			decode_ctl = p3CTLDEC1;
 		} else {
 			decode_dat = p3DATDEC0;
 			decode_ctl = p3CTLDEC0;
 		}
-		// Decrypt original packet
-sprintf(p3buf, "Decrypt packet: Seq %d\n", sseq);
-p3errmsg(p3MSG_DEBUG, p3buf);
-		if (p3_decrypt(PW->newbuf, PW->newlen, sseq,
+		// Decrypt original packet, AEAD keys also authenticate the P3 header
+		if (p3_aead(decode_dat, &pkt->host->session->keymgmt)) {
+			PW->newlen -= p3TAG_SIZE;
+			if (PW->newlen <= 0 || p3_open(PW->newbuf, PW->newlen,
+					&pkt->packet[p3SESSION_HDR4 - p3HDR_SIZE], p3HDR_SIZE, sseq,
+					decode_dat, &pkt->host->session->keymgmt) < 0) {
+				p3trace_prgs(path, __func__, "Authentication error", -1);
+				stat = -1;
+				goto out;
+			}
+		} else if (p3_decrypt(PW->newbuf, PW->newlen, sseq,
 				decode_dat, &pkt->host->session->keymgmt) < 0) {
-p3errmsg(p3MSG_DEBUG, "Decryption error\n");
+			p3trace_prgs(path, __func__, "Decryption error", -1);
 			stat = -1;
 			goto out;
 		}
 		pkt->packet = PW->newbuf;
 		pkt->flag &= ~p3PKT_SIZE;
 		pkt->flag |= PW->newlen;
-sprintf(p3buf, "Deobfuscate packet: New Len %d\n", PW->newlen);
-p3errmsg(p3MSG_DEBUG, p3buf);
 		if (deobfuscate(pkt) < 0) {
 			stat = -1;
 			goto out;
@@ -359,7 +661,7 @@ p3errmsg(p3MSG_DEBUG, p3buf);
 		// Handle control message
 		if (iph->protocol == 17) {
 			PW->i1 = iph->ihl << 2;
-			PW->udph = (struct udphdr *)&PW->newbuf[PW->i1];
+			PW->udph = (struct udphdr *)&pkt->packet[PW->i1];
 #ifndef _p3_SECONDARY
 			PW->i1 = ntohs(PW->udph->dest);
 			bufp = (char *) &primain->addr.v4;
@@ -367,28 +669,18 @@ p3errmsg(p3MSG_DEBUG, p3buf);
 			PW->i1 = ntohs(PW->udph->source);
 			bufp = (char *) &secmain->addr.v4;
 #endif
-			if (memcmp(&PW->newbuf[p3IP4_DADDR], bufp, sizeof(struct in_addr))
+			if (memcmp(&pkt->packet[p3IP4_DADDR], bufp, sizeof(struct in_addr))
 					== 0 && PW->i1 == pkt->host->port) {
 				// Get length of encrypted data (multiple of 16)
-p3errmsg(p3MSG_DEBUG, "Decrypt control packet\n");
-sprintf(p3buf, "Control Pkt: Len %d Seq %d\n", ntohs(PW->udph->len), sseq);
-for (PW->i1=0; PW->i1 < ntohs(iph->tot_len); PW->i1++) {
-	if (!(PW->i1 & 3))
-		sprintf(p3buf, "%s ", p3buf);
-	if (!(PW->i1 & 15))
-		sprintf(p3buf, "%s\n  ", p3buf);
-	sprintf(p3buf, "%s%2.2x", p3buf, PW->newbuf[PW->i1]);
-}
-sprintf(p3buf, "%s\n", p3buf);
-p3errmsg(p3MSG_DEBUG, p3buf);
+				p3trace_data(packet, "Control pkt", pkt->packet, ntohs(iph->tot_len));
 				PW->i1 = ntohs(PW->udph->len);
-				if (p3_decrypt(&PW->newbuf[p3CONTROL_HDR4], PW->i1, sseq,
+				if (p3_decrypt(&pkt->packet[p3CONTROL_HDR4], PW->i1, sseq,
 						decode_ctl, &pkt->host->session->keymgmt) < 0) {
-p3errmsg(p3MSG_DEBUG, "Control decryption error\n");
+					p3trace_prgs(path, __func__, "Control decryption error", -1);
 					stat = -1;
 					goto out;
 				}
-				PW->ctlmsg.message = &PW->newbuf[p3SESSION_HDR4];
+				PW->ctlmsg.message = &pkt->packet[p3SESSION_HDR4];
 				PW->ui1 = (unsigned int) PW->ctlmsg.message[0];
 				PW->ui1 <<= 8;
 				PW->ui1 |= (unsigned int) PW->ctlmsg.message[1];
@@ -397,18 +689,23 @@ p3errmsg(p3MSG_DEBUG, "Control decryption error\n");
 				PW->ui1 <<= 8;
 				PW->ui1 |= (unsigned int) PW->ctlmsg.message[3];
 				PW->ctlmsg.len = PW->ui1;
+				p3trace_prgs(control, 0, sseq, PW->ctlmsg.message[4],
+						PW->ctlmsg.len);
 if (pkt->flag & p3PKT_DSSUB)
 	pkt->host->session->flag |= p3PSS_CFWD;
 else
 	pkt->host->session->flag &= ~p3PSS_CFWD;
-				if (parse_ctl_message(&PW->ctlmsg, pkt->host->session) < 0) {
-p3errmsg(p3MSG_DEBUG, "Control parsing error\n");
+				// Data packets of the session are not handled meanwhile
+				p3net_utils(p3CTL_BEGIN, p3sys_net, pkt);
+				PW->i2 = parse_ctl_message(&PW->ctlmsg, pkt->host->session);
+				p3net_utils(p3CTL_END, p3sys_net, pkt);
+				if (PW->i2 < 0) {
+					p3trace_prgs(path, __func__, "Control parsing error", -1);
 					// Clear rekeying just in case
 					pkt->host->session->flag &= ~p3PSS_REKEY;
 					stat = -1;
 					goto out;
 				}
-p3errmsg(p3MSG_DEBUG, "Control packet handled\n");
 				stat = p3PKTS_CONTROL;
 				goto out;
 			}
@@ -440,28 +737,11 @@ p3errmsg(p3MSG_DEBUG, "Control packet handled\n");
 				stat |= p3PKTS_CHKSUM;
 			}
 		}
-PW->newlen = pkt->flag & p3PKT_SIZE;
-if (PW->newlen > 96)
-	PW->ui1 = 96;
-else
-	PW->ui1 = PW->newlen;
-sprintf(p3buf, "Pkt (Len %d):", PW->newlen);
-for (PW->i1=0; PW->i1 < PW->ui1; PW->i1++) {
-	if (!(PW->i1 & 3))
-		sprintf(p3buf, "%s ", p3buf);
-	if (!(PW->i1 & 15))
-		sprintf(p3buf, "%s\n  ", p3buf);
-	sprintf(p3buf, "%s%2.2x", p3buf, pkt->packet[PW->i1]);
-}
-sprintf(p3buf, "%s\n", p3buf);
-p3errmsg(p3MSG_DEBUG, p3buf);
+		p3trace_data(packet, "Decrypted pkt", pkt->packet, pkt->flag & p3PKT_SIZE);
 /***
  *** Destination is P3 subnet
  ***/
 	} else if (pkt->flag & p3PKT_P3DST) {
-sprintf(p3buf, "P3 dest net found: pkt %p, net %p, flag %x\n",
-	pkt->packet, pkt->net, pkt->flag);
-p3errmsg(p3MSG_DEBUG, p3buf);
 		// Pass initialization connection
 		iph = (struct iphdr *)pkt->packet;
 		if (iph->protocol == 6) {
@@ -473,7 +753,7 @@ p3errmsg(p3MSG_DEBUG, p3buf);
 			decode_ctl = ntohs(tcph->dest);
 #endif
 			if (tcph->syn && decode_ctl == pkt->net->host->port) {
-p3errmsg(p3MSG_DEBUG, "P3 session init\n");
+				p3trace_prgs(path, __func__, "P3 session init", 0);
 				goto out;
 			}
 		}
@@ -483,16 +763,15 @@ p3errmsg(p3MSG_DEBUG, "P3 session init\n");
 		else if (pkt->net->flag & p3HST_IPV6)
 			decode_dat = p3SESSION_HDR6;
 		else {
-p3errmsg(p3MSG_DEBUG, "Err 1\n");
+			p3trace_prgs(path, __func__, "Unknown IP version", -1);
 			stat = -1;
 			goto out;
 		}
 // Set OS dependent inbound network info
 		if (!(pkt->net->flag & p3NET_DEVO)) {
 			if (p3net_utils(p3SET_DEVOUT, p3sys_net, pkt) < 0) {
-				sprintf(p3buf, "packet_handler: System network utility\
- failed: %d\n", p3SET_DEVOUT);
-				p3errmsg(p3MSG_ERR, p3buf);
+				p3pkterr(p3MSG_ERR, "packet_handler: System network utility failed: %d\n",
+						p3SET_DEVOUT);
 				stat = -1;
 				goto out;
 			}
@@ -513,13 +792,12 @@ p3errmsg(p3MSG_DEBUG, "Err 1\n");
 		decode_dat = addmss;
 		addmss <<= 1;
 		addmss += sizeof(p3work);
-		if ((pkt->work = (p3work *) p3malloc(addmss)) == NULL) {
+		if ((pkt->work = (p3work *) p3work_alloc(addmss)) == NULL) {
 			p3errmsg(p3MSG_CRIT, "packet_handler: Failed to allocate P3 packet buffer\n");
 			stat = -1;
 			goto out;
 		}
 		addmss = 0;
-		memset(pkt->work, 0, sizeof(p3work));
 		PW->l = (unsigned long) PW + sizeof(p3work);
 		PW->newbuf = (unsigned char *) PW->l;
 		PW->l += decode_dat;
@@ -537,9 +815,8 @@ p3errmsg(p3MSG_DEBUG, "Err 1\n");
 		if (iph->protocol == p3PROTO && !PW->ui1) {
 			if (!(pkt->net->flag & p3NET_RAW)) {
 				if (p3net_utils(p3SET_RAW, p3sys_net, pkt) < 0) {
-					sprintf(p3buf, "packet_handler: System network utility\
- failed: %d\n", p3SET_RAW);
-					p3errmsg(p3MSG_ERR, p3buf);
+					p3pkterr(p3MSG_ERR, "packet_handler: System network utility failed: %d\n",
+							p3SET_RAW);
 					stat = -1;
 					goto out;
 				}
@@ -554,29 +831,18 @@ p3errmsg(p3MSG_DEBUG, "Err 1\n");
 					pkt->net->flag |= p3NET_ACT;
 				stat = p3PKTS_RAWSOCK;
 			} else {
-p3errmsg(p3MSG_DEBUG, "Err 2\n");
+				p3trace_prgs(path, __func__, "Raw socket already set", -1);
 				stat = -1;
 			}
 			goto out;
 		}
 		if (!(pkt->net->flag & p3NET_ACT)) {
-			p3free(pkt->work);
-p3errmsg(p3MSG_DEBUG, "Net not active\n");
+			p3work_free(pkt->work);
+			pkt->work = NULL;
+			p3trace_prgs(path, __func__, "Net not active", 0);
 			goto out;
 		}
-PW->ui1 = ntohs(iph->tot_len);
-sprintf(p3buf, "Pkt (Len %d):", PW->ui1);
-if (PW->ui1 > 96)
-	PW->ui1 = 96;
-for (PW->i1=0; PW->i1 < PW->ui1; PW->i1++) {
-	if (!(PW->i1 & 3))
-		sprintf(p3buf, "%s ", p3buf);
-	if (!(PW->i1 & 15))
-		sprintf(p3buf, "%s\n  ", p3buf);
-	sprintf(p3buf, "%s%2.2x", p3buf, pkt->packet[PW->i1]);
-}
-sprintf(p3buf, "%s\n", p3buf);
-p3errmsg(p3MSG_DEBUG, p3buf);
+		p3trace_data(packet, "Original pkt", pkt->packet, ntohs(iph->tot_len));
 		// If packet is TCP SYN, make sure MSS allows for P3 header requirements
 		if (iph->protocol == 6) {
 			PW->idx1 = (pkt->packet[0] & 0xf) << 2;
@@ -608,7 +874,7 @@ p3errmsg(p3MSG_DEBUG, p3buf);
 						else if (pkt->net->flag & p3HST_IPV6)
 							PW->idx1 = p3MSS_V6;
 						else {
-p3errmsg(p3MSG_DEBUG, "Err 3\n");
+							p3trace_prgs(path, __func__, "Unknown IP version", -1);
 							stat = -1;
 							goto out;
 						}
@@ -617,13 +883,9 @@ p3errmsg(p3MSG_DEBUG, "Err 3\n");
 							bufp[3] = (unsigned char) (PW->idx1 & 0xff);
 							pkt->netdata |= PW->idx1 << 16;
 							// Recalculate the TCP checksum
-sprintf(p3buf, "Reduce MSS from %d to %d (%x)\n",
-	PW->i1, PW->idx1, pkt->netdata);
-p3errmsg(p3MSG_DEBUG, p3buf);
 							if (p3net_utils(p3TCP_CHECK, p3sys_net, pkt) < 0) {
-								sprintf(p3buf, "packet_handler: System network\
- utility failed: %d\n", p3TCP_CHECK);
-								p3errmsg(p3MSG_ERR, p3buf);
+								p3pkterr(p3MSG_ERR, "packet_handler: System network utility failed: %d\n",
+										p3TCP_CHECK);
 								stat = -1;
 								goto out;
 							}
@@ -634,14 +896,11 @@ p3errmsg(p3MSG_DEBUG, p3buf);
 				// MSS not already in TCP options
 				if (bufp >= &pkt->packet[PW->idx2]) {
 					if (p3net_utils(p3GET_MTU, p3sys_net, pkt) < 0) {
-						sprintf(p3buf, "packet_handler: System network\
- utility failed: %d\n", p3GET_MTU);
-						p3errmsg(p3MSG_ERR, p3buf);
+						p3pkterr(p3MSG_ERR, "packet_handler: System network utility failed: %d\n",
+								p3GET_MTU);
 						stat = -1;
 						goto out;
 					}
-sprintf(p3buf, "Set MSS: MTU = %d\n", pkt->netdata);
-p3errmsg(p3MSG_DEBUG, p3buf);
 					if (pkt->net->flag & p3HST_IPV4)
 						addmss = pkt->netdata - p3EXTRA_V4;
 					else if (pkt->net->flag & p3HST_IPV6)
@@ -661,25 +920,43 @@ p3errmsg(p3MSG_DEBUG, p3buf);
 			PW->idx1 = p3SESSION_HDR4;
 		else if (pkt->net->flag & p3HST_IPV6)
 			PW->idx1 = p3SESSION_HDR6;
-		// Encrypted data size must be multiple of 16
+		// Encrypted data size must be multiple of 16, except for CTR keys
 		if (PW->i1 <= p3PKT_SMALL)
 			PW->newlen = p3PKT_SMALL + PW->idx1;
 		else if (PW->i1 < p3PKT_MED)
 			PW->newlen = p3PKT_MED + PW->idx1;
 		else if (PW->i1 < p3PKT_LARGE)
 			PW->newlen = p3PKT_LARGE + PW->idx1;
+		else if (p3_ctr(p3DATENC1, &pkt->net->host->session->keymgmt))
+			PW->newlen = PW->i1 + PW->idx1;
 		else
 			PW->newlen = ((PW->i1 + 0xf) & ~0xf) + PW->idx1;
+		// AEAD keys add a tag after the encrypted data
+		pkt->tag = 0;
+		if (p3_aead(p3DATENC1, &pkt->net->host->session->keymgmt)) {
+			pkt->tag = p3TAG_SIZE;
+			PW->newlen += pkt->tag;
+		}
 		if (PW->newlen > p3PKT_MAX) {
-			sprintf(p3buf, "packet_handler: Packet too large (%d)\n", PW->newlen);
-			p3errmsg(p3MSG_DEBUG, p3buf);
+			p3trace_prgs(path, __func__, "Packet too large", PW->newlen);
 			stat = -1;
 			goto out;
 		}
+		PW->i3 = ntohs(iph->tot_len);
 		pkt->flag &= ~p3PKT_SIZE;
 		pkt->flag |= PW->newlen;
+		// Build the new packet in the system buffer if possible, else in the work area
+		if (p3net_utils(p3SET_INPLACE, p3sys_net, pkt) == 0) {
+			PW->newbuf = pkt->packet;
+			pkt->packet = &PW->newbuf[p3SESSION_HDR4];
+		}
+		// The packet is obfuscated into the new buffer, so copy it to the
+		// work area if it is already there or has to be modified
+		if ((pkt->flag & p3PKT_INPLACE) || addmss) {
+			memcpy(PW->buf, pkt->packet, PW->i3);
+			pkt->packet = PW->buf;
+		}
 		if (addmss) {
-			// Copy original header
 			PW->idx1 = (pkt->packet[0] & 0xf) << 2;		// IP header length
 			if ((PW->i1 = (pkt->packet[PW->idx1 + 12] & 0xf0) >> 2) == 0x3c) {
 				p3errmsg(p3MSG_WARN, "packet_handler: Cannot increase TCP options field\n");
@@ -687,53 +964,40 @@ p3errmsg(p3MSG_DEBUG, p3buf);
 				goto out;
 			}
 			PW->idx2 = PW->idx1 + PW->i1;	// IP + TCP header length
-sprintf(p3buf, "Add MSS (%d) Idx %d, Endx %d\n", addmss, PW->idx1, PW->idx2);
-p3errmsg(p3MSG_DEBUG, p3buf);
-			memcpy(&PW->newbuf[p3SESSION_HDR4], pkt->packet, PW->idx2);
-			// Add MSS field at end of current options (EOL changed to NOP previously)
-			PW->i1 = PW->idx2 + p3SESSION_HDR4;
-			PW->newbuf[PW->i1++] = 0x02;
-			PW->newbuf[PW->i1++] = 0x04;
-			PW->newbuf[PW->i1++] = (unsigned char) ((addmss >> 8) & 0xff);
-			PW->newbuf[PW->i1++] = (unsigned char) (addmss & 0xff);
-			// Append payload to new header
-			memcpy(&PW->newbuf[PW->i1], &pkt->packet[PW->idx2],
-					(pkt->flag & p3PKT_SIZE) - PW->idx2);
+			// Move payload to make room for MSS field at end of current
+			// options (EOL changed to NOP previously)
+			memmove(&pkt->packet[PW->idx2 + 4], &pkt->packet[PW->idx2],
+					PW->i3 - PW->idx2);
+			PW->i1 = PW->idx2;
+			pkt->packet[PW->i1++] = 0x02;
+			pkt->packet[PW->i1++] = 0x04;
+			pkt->packet[PW->i1++] = (unsigned char) ((addmss >> 8) & 0xff);
+			pkt->packet[PW->i1++] = (unsigned char) (addmss & 0xff);
 			// Set new IP total length and checksum
-			pkt->flag += 4;
-			iph = (struct iphdr *) &PW->newbuf[p3SESSION_HDR4];
-			iph->tot_len = htons((pkt->flag & p3PKT_SIZE));
+			PW->i3 += 4;
+			iph = (struct iphdr *) pkt->packet;
+			iph->tot_len = htons(PW->i3);
 			iph->check = 0;
 			p3SET_CHECKSUM_V4(iph);
 			// Set new TCP header length and checksum
-			PW->newbuf[(p3SESSION_HDR4 + 12) + PW->idx1] += 0x10;
-			pkt->packet = &PW->newbuf[p3SESSION_HDR4];
+			pkt->packet[PW->idx1 + 12] += 0x10;
 			if (p3net_utils(p3TCP_CHECK_ADD, p3sys_net, pkt) < 0) {
-				sprintf(p3buf, "packet_handler: System network utility failed:\
- %d\n", p3TCP_CHECK_ADD);
-				p3errmsg(p3MSG_ERR, p3buf);
+				p3pkterr(p3MSG_ERR, "packet_handler: System network utility failed: %d\n",
+						p3TCP_CHECK_ADD);
 				stat = -1;
 				goto out;
 			}
-		} else {
-			memcpy(&PW->newbuf[p3SESSION_HDR4], pkt->packet, (pkt->flag & p3PKT_SIZE));
 		}
-		// Increment session sequence number
-		p3lock(pkt->net->host->session->lock);
-		// If rekeying, do not send data packets
-		// TODO: Set delay sequence ID
-		if (pkt->net->host->session->flag & p3PSS_REKEY) {
-			p3unlock(pkt->net->host->session->lock);
-p3errmsg(p3MSG_DEBUG, "Err 4\n");
+		// Use the sequence number reserved when the packet was queued,
+		// else increment session sequence number
+		if (pkt->seq != 0) {
+			sseq = pkt->seq;
+		} else if (p3_next_seq(pkt->net->host->session, &sseq) < 0) {
+			p3trace_prgs(path, __func__, "No sequence number", -1);
 			stat = -1;
 			goto out;
 		}
-		PW->ui1 = pkt->net->host->session->sseq + p3SEQ_DIFF;
-		sseq = pkt->net->host->session->sseq;
-		pkt->net->host->session->sseq++;
-		if (!pkt->net->host->session->sseq)
-			pkt->net->host->session->sseq++;
-		p3unlock(pkt->net->host->session->lock);
+		PW->ui1 = sseq + p3SEQ_DIFF;
 		// Initialize P3 header
 		memcpy(PW->newbuf, pkt->net->host->session->p3hdr, p3SESSION_HDR4);
 		PW->newbuf[p3IP4_ID] = (PW->ui1 >> 8) & 0xff;
@@ -747,44 +1011,42 @@ p3errmsg(p3MSG_DEBUG, "Err 4\n");
 		PW->newbuf[p3SESSION_HDR4 - 1] = sseq & 0xff;
 		// Packet being forwarded
 		if (pkt->flag & p3PKT_DSSUB) {
-p3errmsg(p3MSG_DEBUG, "Set forwarding flag in P3 header\n");
 			PW->newbuf[p3SESSION_HDR4 - p3HDR_FLAG3] |= p3HDR_FORWARD;
 		}
 		// Provide kernel handler with new buffer and status
-		pkt->packet = PW->newbuf;
-sprintf(p3buf, "Obfuscate pkt: New len %d\n", PW->newlen);
-p3errmsg(p3MSG_DEBUG, p3buf);
 		if (obfuscate(pkt) < 0) {
-p3errmsg(p3MSG_DEBUG, "Err 5\n");
+			p3trace_prgs(path, __func__, "Obfuscation error", -1);
 			stat = -1;
 			goto out;
 		}
-sprintf(p3buf, "Encrypt pkt Seq %d\n", sseq);
-p3errmsg(p3MSG_DEBUG, p3buf);
-		// Encrypt the current packet
-		if (p3_encrypt(&PW->newbuf[p3SESSION_HDR4], (PW->newlen - p3SESSION_HDR4),
+		// Encrypt the current packet, the caller may encrypt it with others
+		if (pkt->tag) {
+			pkt->flag &= ~p3PKT_DEFER;
+			if (p3_seal(&PW->newbuf[p3SESSION_HDR4],
+					(PW->newlen - p3SESSION_HDR4 - pkt->tag),
+					&PW->newbuf[p3SESSION_HDR4 - p3HDR_SIZE], p3HDR_SIZE, sseq,
+					p3DATENC1, &pkt->net->host->session->keymgmt) < 0) {
+				p3trace_prgs(path, __func__, "Encryption error", -1);
+				stat = -1;
+				goto out;
+			}
+		} else if (pkt->flag & p3PKT_DEFER) {
+			pkt->seq = sseq;
+		} else if (p3_encrypt(&PW->newbuf[p3SESSION_HDR4], (PW->newlen - p3SESSION_HDR4),
 				sseq, p3DATENC1, &pkt->net->host->session->keymgmt) < 0) {
-p3errmsg(p3MSG_DEBUG, "Err 6\n");
+			p3trace_prgs(path, __func__, "Encryption error", -1);
 			stat = -1;
 			goto out;
 		}
 
 		stat = p3PKTS_ADDHDR;
-
-sprintf(p3buf, "P3 Hdr: ");
-for (PW->i1=0; PW->i1 < p3SESSION_HDR4; PW->i1++) {
-	if (!(PW->i1 & 3))
-		sprintf(p3buf, "%s ", p3buf);
-	sprintf(p3buf, "%s%2.2x", p3buf, pkt->packet[PW->i1]);
-}
-sprintf(p3buf, "%s\n", p3buf);
-p3errmsg(p3MSG_DEBUG, p3buf);
+		p3trace_data(packet, "P3 hdr", pkt->packet, p3SESSION_HDR4);
 
 	} // Else let stack handle intercepted packet as is
 
 out:
 	if (stat < 0 && pkt->work != NULL ) {
-		p3free(pkt->work);
+		p3work_free(pkt->work);
 		pkt->work = NULL;
 		pkt->packet = NULL;
 	}
@@ -841,10 +1103,7 @@ out:
 
 void p3_lookup(p3packet *pkt)
 {
-	int i, j;
-	unsigned char *adr1, *adr2;
-	unsigned char ip4[sizeof(struct in_addr)];
-	unsigned char ip6[sizeof(struct in6_addr)];
+	unsigned char *adr1;
 	void *local_adr;
 	struct iphdr *iph = (struct iphdr *) pkt->packet;
 
@@ -855,7 +1114,7 @@ void p3_lookup(p3packet *pkt)
 	if (ipv4route == NULL) {
 		goto out;
 	}
-	if (p3hosts == NULL) {
+	if (p3hostsz == 0) {
 		goto out;
 	}
 #ifndef _p3_SECONDARY
@@ -866,70 +1125,44 @@ void p3_lookup(p3packet *pkt)
 
 	if (iph->version == 4) {
 		// Test for encrypted packet from P3 host
-		pkt->host = p3hosts;
-		adr1 = (unsigned char *)&iph->saddr;
-		while (pkt->host != NULL) {
-// adr2 = (unsigned char *)&pkt->host->addr.v4;
-// sprintf(p3buf, "Src %2.2x%2.2x%2.2x%2.2x Cmpr %2.2x%2.2x%2.2x%2.2x\n",
-// adr1[0], adr1[1], adr1[2], adr1[3],
-// adr2[0], adr2[1], adr2[2], adr2[3]);
-// p3errmsg(p3MSG_DEBUG, p3buf);
-			if (memcmp(adr1, &pkt->host->addr.v4, sizeof(struct in_addr)) == 0) {
-				// Forward packet to local subnet
-				if (pkt->packet[p3SESSION_HDR4 - p3HDR_FLAG3] & p3HDR_FORWARD) {
+		if ((pkt->host = p3host_find(p3HST_IPV4, &iph->saddr)) != NULL) {
+			// Forward packet to local subnet
+			if (pkt->packet[p3SESSION_HDR4 - p3HDR_FLAG3] & p3HDR_FORWARD) {
 #ifndef _p3_SECONDARY
-					pkt->net = primain->subnet;
+				pkt->net = primain->subnet;
 #else
-					pkt->net = secmain->subnet;
+				pkt->net = secmain->subnet;
 #endif
-					pkt->flag |= p3PKT_P3SRC | p3PKT_SRP3 | p3PKT_DSSUB;
-					goto out;
-				} else {
-					pkt->net = pkt->host->net;
-					pkt->flag |= p3PKT_P3SRC | p3PKT_SRP3;
-				}
+				pkt->flag |= p3PKT_P3SRC | p3PKT_SRP3 | p3PKT_DSSUB;
 				goto out;
+			} else {
+				pkt->net = pkt->host->net;
+				pkt->flag |= p3PKT_P3SRC | p3PKT_SRP3;
 			}
-			pkt->host = pkt->host->hlist;
+			goto out;
 		}
 		// Test for destination
-		// TODO: Use Red Black tree
-		for (i=0; i < ipv4route->netsz; i++) {
-			// Get packet subnet using route entry mask
-			adr1 = (unsigned char *)&iph->daddr;
-			adr2 = (unsigned char *)&ipv4route->nets[i]->mask;
-			for (j=0; j < sizeof(struct in_addr); j++) {
-				ip4[j] = adr1[j] & adr2[j];
+		adr1 = (unsigned char *)&iph->daddr;
+		if ((pkt->net = p3route_lookup(ipv4route, adr1)) != NULL) {
+			pkt->flag |= p3PKT_P3DST;
+			// Check for dest is P3 host or subnet
+			if (memcmp(adr1, &pkt->net->host->addr.v4,
+					sizeof(struct in_addr)) == 0)
+				pkt->flag |= p3PKT_DSP3;
+			else
+				pkt->flag |= p3PKT_DSSUB;
+			// Test for packet source is P3 host or local subnet
+			adr1 = (unsigned char *)&iph->saddr;
+			if (memcmp(adr1, local_adr, sizeof(struct in_addr)) == 0)
+				pkt->flag |= p3PKT_SRP3;
+			else {
+				pkt->flag ^= p3PKT_SRSUB;
 			}
-// adr2 = (unsigned char *)&ipv4route->nets[i]->net.v4;
-// sprintf(p3buf, "Dst %2.2x%2.2x%2.2x%2.2x Cmpr %2.2x%2.2x%2.2x%2.2x\n",
-// ip4[0], ip4[1], ip4[2], ip4[3],
-// adr2[0], adr2[1], adr2[2], adr2[3]);
-// p3errmsg(p3MSG_DEBUG, p3buf);
-			if (memcmp(&ipv4route->nets[i]->net.v4, ip4,
-					sizeof(struct in_addr)) == 0) {
-				pkt->net = ipv4route->nets[i];
-				pkt->flag |= p3PKT_P3DST;
-				// Check for dest is P3 host or subnet
-				if (memcmp(adr1, &pkt->net->host->addr.v4,
-						sizeof(struct in_addr)) == 0)
-					pkt->flag |= p3PKT_DSP3;
-				else
-					pkt->flag |= p3PKT_DSSUB;
-				// Test for packet source is P3 host or local subnet
-				adr1 = (unsigned char *)&iph->saddr;
-				if (memcmp(adr1, local_adr, sizeof(struct in_addr)) == 0)
-					pkt->flag |= p3PKT_SRP3;
-				else {
-					pkt->flag ^= p3PKT_SRSUB;
-				}
 // !!! Temporary !!!
 // !!! Temporary !!!
 #ifndef _p3_SECONDARY
-if (pkt->net->host->session != NULL && !(pkt->net->host->session->sseq & 0x3f) &&
+if (pkt->net->host->session != NULL && !(p3seq_read(pkt->net->host->session->sseq) & 0x3f) &&
 		!(pkt->net->host->session->flag & p3PSS_REKEY)) {
-sprintf(p3buf, "Start Rekeying: Seq %d\n", pkt->net->host->session->sseq);
-p3errmsg(p3MSG_DEBUG, p3buf);
 if (pkt->flag & p3PKT_DSSUB)
 	pkt->net->host->session->flag |= p3PSS_CFWD;
 else
@@ -940,8 +1173,7 @@ else
 #endif
 // !!! Temporary !!!
 // !!! Temporary !!!
-				goto out;
-			}
+			goto out;
 		}
 		// Test for raw packet to local subnet
 #ifndef _p3_SECONDARY
@@ -959,7 +1191,7 @@ else
 			pkt->flag |= p3PKT_P3DST;
 		}
 	} else if (iph->version == 6) {
-	// TODO: Handle IPv6
+	// TODO: Handle IPv6 (destinations are looked up in ipv6route)
 	}
 
 out:
@@ -983,10 +1215,15 @@ out:
  * obfuscate
  *
  * \par Description:
- * Manipulate a packet to obfuscate it when encrypted.
+ * Manipulate a packet to obfuscate it when encrypted.  The obfuscated
+ * data is written once, directly after the P3 header in the work area
+ * new buffer, so the packet must not be in that buffer.
  *
  * \par Inputs:
  * - pkt: A p3packet structure containing information about the packet.
+ *   - packet: The original packet, which is replaced by the new buffer
+ *   - flag: The size of the new packet including the P3 header
+ *   - tag: The size of the AEAD tag at the end of the new packet
  *
  * \par Outputs:
  * - int: Status:
@@ -996,9 +1233,7 @@ out:
 
 int obfuscate(p3packet *pkt)
 {
-	int stat = 0, bct;
-	int psize, len, dloc, blks;
-	unsigned char *pktdata = &pkt->packet[p3SESSION_HDR4];
+	int stat = 0, psize;
 	struct timeval now;
 
 	if (pkt->work == NULL) {
@@ -1007,184 +1242,26 @@ int obfuscate(p3packet *pkt)
 		goto out;
 	}
 
-	// Number of blocks is variable
+	// Block layout varies with the time
 	do_gettimeofday(&now);
 	// TODO: ===>> Handle IPv6 packet length
-	psize = pktdata[2];
+	psize = pkt->packet[2];
 	psize <<= 8;
-	psize |= pktdata[3];
-	if (psize < p3PKT_MED) {
-		if (psize < 40)
-			blks = 2;
-		else if (now.tv_usec & 2)
-			blks = 2;
-		else
-			blks = 3;
-	} else {
-		blks = now.tv_usec & 7;
-		if (blks == 0)
-			blks = 4;
-		else if (blks == 1)
-			blks = 6;
-	}
-	if  ((blks * 3) > (((pkt->flag & p3PKT_SIZE) - p3SESSION_HDR4) - psize))
-		blks = (((pkt->flag & p3PKT_SIZE) - p3SESSION_HDR4) - psize) / 3;
-
-	if (blks <= 0) {
-		sprintf(p3buf, "Obfuscate Blks <= 0 (%d, %d)\n",
-			(pkt->flag & p3PKT_SIZE), psize);
-		p3errmsg(p3MSG_DEBUG, p3buf);
+	psize |= pkt->packet[3];
+	// ===>> Handle IPv6 P3 header size
+	if (p3obf_plan(&PW->obf, pkt->packet, psize,
+			(pkt->flag & p3PKT_SIZE) - p3SESSION_HDR4 - pkt->tag,
+			now.tv_usec) < 0) {
+		p3trace_prgs(path, __func__, "Obfuscate plan failed", psize);
 		stat = -1;
 		goto out;
 	}
+	p3trace_stru(obfuscate, PW->obf.blks, psize, PW->obf.len, now.tv_usec,
+			PW->obf.bloc, PW->obf.blen);
 
-	// Get range of variable adjustment
-	PW->i1 = psize / blks;
-	PW->i2 = psize - 1;
-	if (PW->i1 < 16)
-		len = 0x3;
-	else if (PW->i1 < 32)
-		len = 0x7;
-	else if (PW->i1 < 64)
-		len = 0xf;
-	else
-		len = 0x1f;
-	PW->bloc[0] = 0;
-	bct = PW->i1;
-	// Set variable block starting locations
-	for (PW->idx1=1; PW->idx1 < blks; PW->idx1++) {
-		PW->bloc[PW->idx1] = bct;
-		bct += PW->i1;
-		if (pktdata[PW->i2] & 2)
-			PW->bloc[PW->idx1] -= pktdata[PW->i2] & len;
-		else
-			PW->bloc[PW->idx1] += pktdata[PW->i2] & len;
-		PW->i2--;
-	}
-	// Set block sizes
-	for (PW->idx1=0; PW->idx1 < (blks - 1); PW->idx1++) {
-		PW->blen[PW->idx1] = PW->bloc[PW->idx1 + 1] - PW->bloc[PW->idx1];
-	}
-	PW->blen[PW->idx1] = psize - PW->bloc[PW->idx1];
-
-	// Set starting block index
-	if (blks < 3)
-		PW->idx2 = 1;
-	else
-		PW->idx2 = blks - 1;
-	bct = 1;
-	PW->idx1 = 0;
-	// ===>> Handle IPv6 P3 header size
-	len = (pkt->flag & p3PKT_SIZE) - p3SESSION_HDR4;
-sprintf(p3buf, "Blocks: %d, Sizes: Pkt %d Len %d, USec %x\n",
-	blks, psize, len, now.tv_usec);
-p3errmsg(p3MSG_DEBUG, p3buf);
-	// Move data into work buffer
-PW->ui2 = 16;
-	while (PW->idx1 < len) {
-if (PW->ui2-- == 0) {
-	p3errmsg(p3MSG_DEBUG, "ERROR getting block\n");
-	stat = -1;
-	goto out;
-}
-		// Vary the block order (never use first block first)
-		if (PW->idx1 > 0) {
-			// Get next unused block
-PW->i2 = 10;
-			while (PW->blen[PW->idx2] == 0) {
-if (PW->i2-- == 0) {
-	p3errmsg(p3MSG_DEBUG, "ERROR getting block ID A\n");
-	stat = -1;
-	goto out;
-}
-				PW->idx2++;
-				if (PW->idx2 == blks) {
-					PW->idx2 = 0;
-				}
-			}
-			if ((bct <<= 1) > now.tv_usec) 
-				bct = 1;
-			// Use current block
-			if (!(bct & now.tv_usec)) {
-				// Use next unused block
-				if ((PW->idx2 += 1) == blks) {
-					PW->idx2 = 0;
-				}
-PW->i2 = 10;
-				while (PW->blen[PW->idx2] == 0) {
-if (PW->i2-- == 0) {
-	p3errmsg(p3MSG_DEBUG, "ERROR getting block ID B\n");
-	stat = -1;
-	goto out;
-}
-					PW->idx2++;
-					if (PW->idx2 == blks) {
-						PW->idx2 = 0;
-					}
-				}
-			}
-		}
-		// Copy data into work buffer
-		PW->buf[PW->idx1++] = (unsigned char) PW->idx2;
-		if (PW->idx2 == (blks - 1))
-			PW->i2 = PW->blen[PW->idx2] + (len - (psize + (blks * 3)));
-		else
-			PW->i2 = PW->blen[PW->idx2];
-		PW->buf[PW->idx1++] = (unsigned char) ((PW->i2 & 0xff00) >> 8);
-		PW->buf[PW->idx1++] = (unsigned char) (PW->i2 & 0xff);
-sprintf(p3buf, "Idx %d Loc %d Len %d From %d\n",
-	PW->idx2, PW->idx1, PW->blen[PW->idx2], PW->bloc[PW->idx2]);
-p3errmsg(p3MSG_DEBUG, p3buf);
-		memcpy(&PW->buf[PW->idx1], &pktdata[PW->bloc[PW->idx2]], PW->blen[PW->idx2]);
-if (PW->blen[PW->idx2] <= 0) {
-	p3errmsg(p3MSG_DEBUG, "ERROR in buf len\n");
-	stat = -1;
-	goto out;
-}
-		PW->idx1 += PW->blen[PW->idx2];
-		// Add pad data to last block of real data
-		if (PW->idx2 == (blks - 1)) {
-			// ===>> Handle IPv6
-			PW->i2 = (pktdata[0] & 0xf) << 2;
-			// If dloc > 0 use data only, else include headers
-			if (pktdata[9] == 6) {
-				dloc = (pktdata[(PW->i2 + 9)] & 0xf0) >> 2;
-				dloc += PW->i2;
-				if ((psize - dloc) < 0x30)
-					dloc = 0;
-			} else {
-				dloc = PW->i2;
-				if ((psize - dloc) < 0x30)
-					dloc = 0;
-			}
-			PW->i1 = len - (psize + (blks * 3));
-			PW->i2 = (now.tv_usec & 0x7) + 7;
-			PW->i3 = (now.tv_usec & 0x3) + 1;
-sprintf(p3buf, "  PadSz %d Step %d PadBy %d\n", PW->i1, PW->i2, PW->i3);
-p3errmsg(p3MSG_DEBUG, p3buf);
-			while (PW->i1 > 0) {
-				if (PW->i1 < PW->i3)
-					PW->i3 = PW->i1;
-				if ((PW->bloc[PW->idx2] + PW->i3) > psize)
-					PW->bloc[PW->idx2] = dloc + (PW->bloc[PW->idx2] - psize);
-if (PW->i3 <= 0) {
-	p3errmsg(p3MSG_DEBUG, "ERROR in pad counter\n");
-	stat = -1;
-	goto out;
-}
-				// Add pad data
-				memcpy(&PW->buf[PW->idx1], &pktdata[PW->bloc[PW->idx2]], PW->i3);
-				PW->idx1 += PW->i3;
-				PW->bloc[PW->idx2] += PW->i2 + PW->i3;
-				PW->i1 -= PW->i3;
-			}
-		}
-		// Block is complete
-		PW->blen[PW->idx2] = 0;
-	}
-
-	// Return obfuscated packet and size
-	memcpy(pktdata, PW->buf, len);
+	// Write obfuscated packet after the P3 header
+	p3obf_emit(&PW->obf, pkt->packet, &PW->newbuf[p3SESSION_HDR4]);
+	pkt->packet = PW->newbuf;
 
 out:
 	return(stat);
@@ -1207,7 +1284,9 @@ out:
  * deobfuscate
  *
  * \par Description:
- * Reassemble an obfuscated packet.
+ * Reassemble an obfuscated packet into the work area buffer.  A packet
+ * handled in the system buffer is copied back, else the packet is
+ * returned in the work area.
  *
  * \par Inputs:
  * - pkt: A p3packet structure containing information about the packet.
@@ -1221,7 +1300,6 @@ out:
 int deobfuscate(p3packet *pkt)
 {
 	int stat = 0, len;
-	unsigned char *pktdata = pkt->packet;
 
 	if (pkt->work == NULL) {
 		p3errmsg(p3MSG_ERR, "deobfuscate: Work area is NULL\n");
@@ -1229,41 +1307,23 @@ int deobfuscate(p3packet *pkt)
 		goto out;
 	}
 
-	// Sort the blocks
+	// Find the blocks
 	len = pkt->flag & p3PKT_SIZE;
-	PW->idx1 = 0;
-	for (PW->i1=0; PW->i1 < 8; PW->i1++) {
-		PW->ui1 = (unsigned int) pktdata[PW->idx1++];
-		PW->ui2 = (unsigned int) pktdata[PW->idx1++];
-		PW->ui2 <<= 8;
-		PW->ui2 |= (unsigned int) pktdata[PW->idx1++];
-sprintf(p3buf, "Idx %d Loc %d Len %d\n", PW->ui1, PW->idx1, PW->ui2);
-p3errmsg(p3MSG_DEBUG, p3buf);
-		PW->dloc[PW->ui1] = &pktdata[PW->idx1];
-		PW->blen[PW->ui1] = PW->ui2;
-		PW->idx1 += PW->ui2;
-		if (PW->idx1 >= len) {
-			PW->i1++;
-			break;
-		}
+	if (p3obf_parse(&PW->obf, pkt->packet, len) < 0) {
+		p3trace_prgs(path, __func__, "Invalid obfuscation blocks", -1);
+		stat = -1;
+		goto out;
 	}
-	if (PW->i1 < 8)
-		PW->dloc[PW->i1] = NULL;
+	p3trace_stru(deobfuscate, PW->obf.blks, len, PW->obf.blen);
 
 	// Reassemble the packet
-	PW->idx1 = 0;
-	for (PW->i1=0; PW->i1 < 8; PW->i1++) {
-		if (PW->dloc[PW->i1] == NULL)
-			break;
-		memcpy(&PW->buf[PW->idx1], PW->dloc[PW->i1], PW->blen[PW->i1]);
-		PW->idx1 += PW->blen[PW->i1];
-	}
-	memcpy(pktdata, PW->buf, len);
-	PW->ui1 = (unsigned int) PW->buf[2];
-	PW->ui1 <<= 8;
-	PW->ui1 |= (unsigned int) PW->buf[3];
+	p3obf_gather(&PW->obf, pkt->packet, PW->buf);
+	if (pkt->flag & p3PKT_INPLACE)
+		memcpy(pkt->packet, PW->buf, PW->obf.psize);
+	else
+		pkt->packet = PW->buf;
 	pkt->flag &= ~p3PKT_SIZE;
-	pkt->flag |= PW->ui1;
+	pkt->flag |= PW->obf.psize;
 
 out:
 	return(stat);
@@ -1314,6 +1374,7 @@ out:
 int p3send_control(p3session *session, p3ctlmsg *cmsg)
 {
 	int i, j, newlen, stat = 0;
+	unsigned int sseq;
 	p3packet pkt;
 	struct iphdr *iph;
 	struct udphdr *udph;
@@ -1339,112 +1400,88 @@ int p3send_control(p3session *session, p3ctlmsg *cmsg)
 	else {
 		// TODO: Split control command into multiple packets
 	}
+	// AEAD keys add a tag after the encrypted data
+	if (p3_aead(p3DATENC1, &session->keymgmt)) {
+		pkt.tag = p3TAG_SIZE;
+		newlen += pkt.tag;
+	}
 	// Get work space with 2 data buffers
 	i = sizeof(p3work) + (newlen << 1);
-	if ((pkt.work = (p3work *) p3malloc(i)) == NULL) {
+	if ((pkt.work = (p3work *) p3work_alloc(i)) == NULL) {
 		p3errmsg(p3MSG_CRIT, "p3send_control: Failed to allocate P3 work area\n");
 		stat = -1;
 		goto out;
 	}
-	memset(pkt.work, 0, sizeof(p3work));
 	CW->l = (unsigned long) CW + sizeof(p3work);
 	CW->newbuf = (unsigned char *) CW->l;
 	CW->l += newlen;
 	CW->buf = (unsigned char *) CW->l;
-	memcpy(CW->newbuf, &pkt.packet[p3SESSION_HDR4], CW->newlen);
 	pkt.host = session->host;
-	pkt.packet = CW->newbuf;
+	pkt.packet = CW->buf;
+	// Control messages are sent while rekeying
+	sseq = p3_alloc_seq(session);
 	pkt.flag = newlen;
 	// TODO: Add pad characters to control message data
 	// (Currently taking existing data.)
-	memcpy(&CW->newbuf[p3SESSION_HDR4 + p3CONTROL_HDR4], cmsg->message, cmsg->len);
-sprintf(p3buf, "Control Data: Len %d Seq %d:", cmsg->len, session->sseq);
-for (CW->i1=0; CW->i1 < cmsg->len; CW->i1++) {
-	if (!(CW->i1 & 3))
-		sprintf(p3buf, "%s ", p3buf);
-	if (!(CW->i1 & 15))
-		sprintf(p3buf, "%s\n  ", p3buf);
-	sprintf(p3buf, "%s%2.2x", p3buf, CW->newbuf[p3SESSION_HDR4 + p3CONTROL_HDR4 + CW->i1]);
-}
-sprintf(p3buf, "%s\n", p3buf);
-p3errmsg(p3MSG_DEBUG, p3buf);
+	memcpy(&CW->buf[p3CONTROL_HDR4], cmsg->message, cmsg->len);
+	p3trace_prgs(control, 1, sseq, cmsg->message[4], cmsg->len);
 	// Encrypt the control message data
 	i = (cmsg->len + 0xf) & ~0xf;
-	if (p3_encrypt(&CW->newbuf[p3SESSION_HDR4 + p3CONTROL_HDR4], i, session->sseq,
+	if (p3_encrypt(&CW->buf[p3CONTROL_HDR4], i, sseq,
 			p3CTLENC1, &session->keymgmt) < 0) {
 		p3errmsg(p3MSG_CRIT, "p3send_control: Error encrypting control message\n");
 		stat = -1;
 		goto out;
 	}
 
-	// Build the control message packet
-sprintf(p3buf, "Set P3 control message header\n");
-p3errmsg(p3MSG_DEBUG, p3buf);
-	memcpy(&CW->newbuf[p3SESSION_HDR4], session->p3hdr, p3CONTROL_HDR4);
+	// Build the control message packet in the work area buffer
+	memcpy(CW->buf, session->p3hdr, p3CONTROL_HDR4);
 	// Initialize control packet header
-	iph = (struct iphdr *) &CW->newbuf[p3SESSION_HDR4];
+	iph = (struct iphdr *) CW->buf;
 	i = ((cmsg->len + 0xf) & ~0xf) + p3SESSION_HDR4;
 	iph->tot_len = htons(i);
-	i = session->sseq + (p3SEQ_DIFF << 2);
+	i = sseq + (p3SEQ_DIFF << 2);
 	iph->id = htons(i);
 	iph->protocol = 17;		//UDP
 	p3SET_CHECKSUM_V4(iph);
-	udph = (struct udphdr *) &CW->newbuf[p3SESSION_HDR4 + sizeof(struct iphdr)];
+	udph = (struct udphdr *) &CW->buf[sizeof(struct iphdr)];
 	udph->source = htons(session->host->port);
 	udph->dest = htons(session->host->port);
 	udph->len = htons((cmsg->len + 0xf) & ~0xf);
-sprintf(p3buf, "Control Packet Header:");
-for (CW->i1=0; CW->i1 < p3CONTROL_HDR4; CW->i1++) {
-	if (!(CW->i1 & 3))
-		sprintf(p3buf, "%s ", p3buf);
-	if (!(CW->i1 & 15))
-		sprintf(p3buf, "%s\n  ", p3buf);
-	sprintf(p3buf, "%s%2.2x", p3buf, CW->newbuf[p3SESSION_HDR4 + CW->i1]);
-}
-sprintf(p3buf, "%s\n", p3buf);
-p3errmsg(p3MSG_DEBUG, p3buf);
+	p3trace_data(packet, "Control hdr", CW->buf, p3CONTROL_HDR4);
 
 	// Initialize P3 header
 	memcpy(CW->newbuf, session->p3hdr, p3SESSION_HDR4);
 	iph = (struct iphdr *) CW->newbuf;
 	iph->tot_len = htons(newlen);
-	i = session->sseq + p3SEQ_DIFF;
+	i = sseq + p3SEQ_DIFF;
 	iph->id = htons(i);
 	p3SET_CHECKSUM_V4(iph);
-	CW->newbuf[p3SESSION_HDR4 - 4] = (session->sseq >> 24) & 0xff;
-	CW->newbuf[p3SESSION_HDR4 - 3] = (session->sseq >> 16) & 0xff;
-	CW->newbuf[p3SESSION_HDR4 - 2] = (session->sseq >> 8) & 0xff;
-	CW->newbuf[p3SESSION_HDR4 - 1] = session->sseq & 0xff;
-
-	// Obfuscate and encrypt control packet
-sprintf(p3buf, "Obfuscate and encrypt ctl pkt: Seq %d\n", session->sseq);
-p3errmsg(p3MSG_DEBUG, p3buf);
+	CW->newbuf[p3SESSION_HDR4 - 4] = (sseq >> 24) & 0xff;
+	CW->newbuf[p3SESSION_HDR4 - 3] = (sseq >> 16) & 0xff;
+	CW->newbuf[p3SESSION_HDR4 - 2] = (sseq >> 8) & 0xff;
+	CW->newbuf[p3SESSION_HDR4 - 1] = sseq & 0xff;
+
+	// Obfuscate control packet into the new buffer and encrypt it
  	if (obfuscate(&pkt) < 0) {
 		p3errmsg(p3MSG_ERR, "p3send_control: Error obfuscating control packet\n");
 		stat = -1;
 		goto out;
 	}
-	if (p3_encrypt(&CW->newbuf[p3SESSION_HDR4], (newlen - p3SESSION_HDR4),
-			session->sseq, p3DATENC1, &session->keymgmt) < 0) {
+	if (pkt.tag)
+		i = p3_seal(&CW->newbuf[p3SESSION_HDR4],
+				(newlen - p3SESSION_HDR4 - pkt.tag),
+				&CW->newbuf[p3SESSION_HDR4 - p3HDR_SIZE], p3HDR_SIZE, sseq,
+				p3DATENC1, &session->keymgmt);
+	else
+		i = p3_encrypt(&CW->newbuf[p3SESSION_HDR4], (newlen - p3SESSION_HDR4),
+				sseq, p3DATENC1, &session->keymgmt);
+	if (i < 0) {
 		p3errmsg(p3MSG_ERR, "p3send_control: Error encrypting control packet\n");
 		stat = -1;
 		goto out;
 	}
-	p3lock(session->lock);
-	session->sseq++;
-	if (!session->sseq)
-		session->sseq++;
-	p3unlock(session->lock);
-sprintf(p3buf, "Encrypted Control Packet (%d):", newlen);
-for (CW->i1=0; CW->i1 < newlen; CW->i1++) {
-	if (!(CW->i1 & 3))
-		sprintf(p3buf, "%s ", p3buf);
-	if (!(CW->i1 & 15))
-		sprintf(p3buf, "%s\n  ", p3buf);
-	sprintf(p3buf, "%s%2.2x", p3buf, CW->newbuf[CW->i1]);
-}
-sprintf(p3buf, "%s\n", p3buf);
-p3errmsg(p3MSG_DEBUG, p3buf);
+	p3trace_data(packet, "Encrypted control pkt", CW->newbuf, newlen);
 
 	// Send the packet
 	if (session->flag & p3PSS_CFWD)
@@ -1454,7 +1491,7 @@ p3errmsg(p3MSG_DEBUG, p3buf);
 out:
 	p3free(cmsg);
 	if (pkt.work != NULL)
-		p3free(pkt.work);
+		p3work_free(pkt.work);
 	return (stat);
 } /* end p3send_control */
 
@@ -30,6 +30,7 @@
 #define p3PKT_LARGE		1440	/**< Fixed size of large packet */
 #define p3PKT_MAX		1500	/**< Maximum size of packet */
 #define p3PKT_MAXSZ		2048	/**< Maximum size of packet buffer */
+#define p3WORK_SIZE		(sizeof(p3work) + (p3PKT_MAXSZ << 1))	/**< Size of pooled work area */
 
 /* Network utility function types */
 #define p3TCP_CHECK		1	/**< Set a TCP checksum */
@@ -39,6 +40,9 @@
 #define p3SET_DEVOUT	5	/**< Set OS dependent outbound info */
 #define p3SET_RAW		6	/**< Set OS dependent info from raw socket */
 #define p3SET_FORWARD	7	/**< Set device info for forwarded packet */
+#define p3SET_INPLACE	8	/**< Prepare system buffer for in place handling */
+#define p3CTL_BEGIN		9	/**< Stop session data handling for a control message */
+#define p3CTL_END		10	/**< Resume session data handling after a control message */
 
 #define p3IP4_ID		4	/**< IPv4 identifier field offset */
 #define p3IP4_SADDR		12	/**< IPv4 source address field offset */
@@ -58,7 +62,13 @@
 /*****  PROTOTYPES  *****/
 
 extern int init_p3net(void);
+extern void cleanup_p3net(void);
 int build_p3table(p3net *net, int ipver);
+extern p3host *p3host_find(int ipver, const void *addr);
+extern int p3host_add(p3host *host);
+extern void p3host_remove(p3host *host);
+extern int p3_next_seq(p3session *session, unsigned int *sseq);
+extern unsigned int p3_rekey_seq(p3session *session);
 extern int packet_handler(p3packet *pkt, void *p3sys_net);
 void p3_lookup(p3packet *pkt);
 extern unsigned char *encrypt_packet(p3session *p3sess, unsigned char *packet);
@@ -67,11 +77,22 @@ int obfuscate(p3packet *pkt);
 int deobfuscate(p3packet *pkt);
 int p3send_control(p3session *session, p3ctlmsg *cmsg);
 
+/* Route table functions (p3kroute.c) */
+extern p3route *p3route_create(int bits);
+extern int p3route_prefix(const struct in_addr *mask);
+extern int p3route_insert(p3route *route, p3net *net, const unsigned char *addr,
+		int plen);
+extern int p3route_delete(p3route *route, p3net *net, const unsigned char *addr,
+		int plen);
+extern p3net *p3route_lookup(p3route *route, const unsigned char *addr);
+extern void p3route_free(p3route *route);
+
 /*****  EXTERNAL DEFINITIONS  *****/
 
 #ifndef _p3NET_C
 extern p3route *ipv4route, *ipv6route;
-extern p3host *p3hosts;
+extern p3host *p3hosts[];
+extern int p3hostsz;
 #endif
 
 
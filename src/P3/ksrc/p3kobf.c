@@ -0,0 +1,297 @@
+/**
+ * \file p3kobf.c
+ * <h3>Protected Point to Point obfuscation file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * Obfuscation splits a packet into blocks that are sent out of order,
+ * each preceded by a 3 byte header of block index and length.  The last
+ * block of the original packet is followed by pad data taken from the
+ * packet itself, so that the obfuscated data fills the fixed size of the
+ * encrypted P3 packet.
+ * <pre>
+ *   [idx][len hi][len lo][block data] ... [idx][len hi][len lo][block data][pad]
+ * </pre>
+ *
+ * The layout of a packet is first planned into a p3obf descriptor and the
+ * output is then written in one pass, so neither direction needs a copy
+ * of the whole packet in an intermediate buffer.
+ */
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#else
+#include <string.h>
+#endif
+
+#include "p3kobf.h"
+
+/**
+ * \par Function:
+ * p3obf_plan
+ *
+ * \par Description:
+ * Plan the block layout for obfuscating a packet.  The number of blocks,
+ * the block boundaries and the block order vary with the time and the
+ * packet data.
+ *
+ * \par Inputs:
+ * - obf: The descriptor to be set
+ * - src: The original IPv4 packet
+ * - psize: The original packet size
+ * - len: The size of the obfuscated data
+ * - usec: The current time in microseconds
+ *
+ * \par Outputs:
+ * - int: Status:
+ *   - 0: OK
+ *   - <0: Error
+ */
+
+int p3obf_plan(p3obf *obf, const unsigned char *src, int psize, int len,
+		unsigned int usec)
+{
+	int stat = 0, blks, size, mask, i, j;
+	unsigned int bct, used;
+
+	// Number of blocks is variable
+	if (psize < p3OBF_MED) {
+		if (psize < 40)
+			blks = 2;
+		else if (usec & 2)
+			blks = 2;
+		else
+			blks = 3;
+	} else {
+		blks = usec & 7;
+		if (blks == 0)
+			blks = 4;
+		else if (blks == 1)
+			blks = 6;
+	}
+	if ((blks * p3OBF_BLKHDR) > (len - psize))
+		blks = (len - psize) / p3OBF_BLKHDR;
+	if (blks < 2 || psize < 20) {
+		stat = -1;
+		goto out;
+	}
+	obf->blks = blks;
+	obf->psize = psize;
+	obf->len = len;
+
+	// Set variable block starting locations
+	size = psize / blks;
+	if (size < 16)
+		mask = 0x3;
+	else if (size < 32)
+		mask = 0x7;
+	else if (size < 64)
+		mask = 0xf;
+	else
+		mask = 0x1f;
+	obf->bloc[0] = 0;
+	for (i=1; i < blks; i++) {
+		j = src[psize - i];
+		if (j & 2)
+			obf->bloc[i] = (i * size) - (j & mask);
+		else
+			obf->bloc[i] = (i * size) + (j & mask);
+	}
+	// Set block sizes
+	for (i=0; i < blks; i++) {
+		if (i < (blks - 1))
+			obf->blen[i] = obf->bloc[i + 1] - obf->bloc[i];
+		else
+			obf->blen[i] = psize - obf->bloc[i];
+		if (obf->blen[i] <= 0) {
+			stat = -1;
+			goto out;
+		}
+	}
+
+	// Set block order (never use first block first)
+	j = (blks < 3) ? 1 : blks - 1;
+	obf->order[0] = j;
+	used = 1 << j;
+	bct = 1;
+	for (i=1; i < blks; i++) {
+		// Get next unused block
+		while (used & (1 << j)) {
+			if (++j == blks)
+				j = 0;
+		}
+		if ((bct <<= 1) > usec)
+			bct = 1;
+		// Use next unused block after the current block
+		if (!(bct & usec)) {
+			do {
+				if (++j == blks)
+					j = 0;
+			} while (used & (1 << j));
+		}
+		obf->order[i] = j;
+		used |= 1 << j;
+	}
+
+	// Set pad data source, if the payload is large enough use data only
+	obf->pad = len - (psize + (blks * p3OBF_BLKHDR));
+	obf->step = (usec & 0x7) + 7;
+	obf->chunk = (usec & 0x3) + 1;
+	// TODO: ===>> Handle IPv6
+	obf->dloc = (src[0] & 0xf) << 2;
+	if (src[9] == 6 && (obf->dloc + 12) < psize)
+		obf->dloc += (src[obf->dloc + 12] & 0xf0) >> 2;
+	if ((psize - obf->dloc) < p3OBF_PADMIN)
+		obf->dloc = 0;
+
+out:
+	return (stat);
+} /* end p3obf_plan */
+
+/**
+ * \par Function:
+ * p3obf_emit
+ *
+ * \par Description:
+ * Write the obfuscated data for a planned packet.  Each output byte is
+ * written once.  The source and destination must not overlap.
+ *
+ * \par Inputs:
+ * - obf: The descriptor set by p3obf_plan
+ * - src: The original packet
+ * - dst: The obfuscated data buffer (at least obf->len bytes)
+ *
+ * \par Outputs:
+ * - int: The size of the obfuscated data
+ */
+
+int p3obf_emit(const p3obf *obf, const unsigned char *src, unsigned char *dst)
+{
+	int i, j, n, loc, pad, chunk;
+	unsigned char *bufp = dst;
+
+	for (i=0; i < obf->blks; i++) {
+		j = obf->order[i];
+		// The length of the last block of the packet includes the pad
+		n = obf->blen[j];
+		if (j == (obf->blks - 1))
+			n += obf->pad;
+		*bufp++ = (unsigned char) j;
+		*bufp++ = (unsigned char) ((n & 0xff00) >> 8);
+		*bufp++ = (unsigned char) (n & 0xff);
+		memcpy(bufp, &src[obf->bloc[j]], obf->blen[j]);
+		bufp += obf->blen[j];
+		if (j != (obf->blks - 1))
+			continue;
+		// Add pad data taken from the packet, wrapping to the pad source
+		loc = obf->bloc[j];
+		chunk = obf->chunk;
+		for (pad = obf->pad; pad > 0; pad -= chunk) {
+			if (pad < chunk)
+				chunk = pad;
+			if ((loc + chunk) > obf->psize) {
+				loc = obf->dloc + (loc - obf->psize);
+				if (loc < 0)
+					loc = 0;
+			}
+			memcpy(bufp, &src[loc], chunk);
+			bufp += chunk;
+			loc += obf->step + chunk;
+		}
+	}
+	return (bufp - dst);
+} /* end p3obf_emit */
+
+/**
+ * \par Function:
+ * p3obf_parse
+ *
+ * \par Description:
+ * Find the blocks of obfuscated data.  The original packet size is
+ * taken from the IPv4 total length in the first block.
+ *
+ * \par Inputs:
+ * - obf: The descriptor to be set
+ * - src: The obfuscated data
+ * - len: The size of the obfuscated data
+ *
+ * \par Outputs:
+ * - int: Status:
+ *   - 0: OK
+ *   - <0: Invalid obfuscated data
+ */
+
+int p3obf_parse(p3obf *obf, const unsigned char *src, int len)
+{
+	int stat = 0, loc = 0, total = 0, j, n;
+	unsigned int used = 0;
+
+	obf->blks = 0;
+	while (loc < len) {
+		if (obf->blks == p3OBF_MAXBLKS || (loc + p3OBF_BLKHDR) > len) {
+			stat = -1;
+			goto out;
+		}
+		j = src[loc];
+		n = (src[loc + 1] << 8) | src[loc + 2];
+		loc += p3OBF_BLKHDR;
+		if (j >= p3OBF_MAXBLKS || (used & (1 << j)) || n > (len - loc)) {
+			stat = -1;
+			goto out;
+		}
+		used |= 1 << j;
+		obf->order[obf->blks++] = j;
+		obf->bloc[j] = loc;
+		obf->blen[j] = n;
+		loc += n;
+		total += n;
+	}
+	// Block indexes must be contiguous
+	if (used != (1U << obf->blks) - 1 || obf->blen[0] < 4) {
+		stat = -1;
+		goto out;
+	}
+	// TODO: ===>> Handle IPv6 packet length
+	obf->psize = (src[obf->bloc[0] + 2] << 8) | src[obf->bloc[0] + 3];
+	if (obf->psize < 20 || obf->psize > total) {
+		stat = -1;
+		goto out;
+	}
+	obf->len = len;
+	obf->pad = total - obf->psize;
+
+out:
+	return (stat);
+} /* end p3obf_parse */
+
+/**
+ * \par Function:
+ * p3obf_gather
+ *
+ * \par Description:
+ * Reassemble the original packet from parsed obfuscated data.  Pad data
+ * is not copied.  The source and destination must not overlap.
+ *
+ * \par Inputs:
+ * - obf: The descriptor set by p3obf_parse
+ * - src: The obfuscated data
+ * - dst: The packet buffer (at least obf->psize bytes)
+ *
+ * \par Outputs:
+ * - int: The size of the original packet
+ */
+
+int p3obf_gather(const p3obf *obf, const unsigned char *src, unsigned char *dst)
+{
+	int i, n, loc = 0;
+
+	for (i=0; i < obf->blks && loc < obf->psize; i++) {
+		n = obf->blen[i];
+		if (n > (obf->psize - loc))
+			n = obf->psize - loc;
+		memcpy(&dst[loc], &src[obf->bloc[i]], n);
+		loc += n;
+	}
+	return (loc);
+} /* end p3obf_gather */
+
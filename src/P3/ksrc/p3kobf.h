@@ -0,0 +1,61 @@
+/**
+ * \file p3kobf.h
+ * <h3>Protected Point to Point obfuscation header file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * The obfuscation functions do not use any other P3 definitions, so
+ * they can also be built outside of the kernel.
+ */
+
+#ifndef _p3kOBF_H
+#define _p3kOBF_H
+
+/*****  CONSTANTS  *****/
+
+#define p3OBF_MAXBLKS	8		/**< Maximum number of obfuscation blocks */
+#define p3OBF_BLKHDR	3		/**< Size of a block header (index, length) */
+#define p3OBF_MED		640		/**< Smallest packet using up to 7 blocks (p3PKT_MED) */
+#define p3OBF_PADMIN	0x30	/**< Minimum payload used as pad source data */
+
+/*****  DATA DEFINITIONS  *****/
+
+typedef struct _p3obf p3obf;
+
+/**
+ * Structure:
+ * p3obf
+ *
+ * \par Description:
+ * The block layout of an obfuscated packet.  When obfuscating, block
+ * locations are offsets in the original packet.  When deobfuscating,
+ * they are offsets of the block data in the obfuscated data.
+ */
+
+struct _p3obf {
+	int				blks;		/*<< Number of blocks */
+	int				psize;		/*<< Original packet size */
+	int				len;		/*<< Obfuscated data size */
+	int				pad;		/*<< Number of pad bytes after last block */
+	int				dloc;		/*<< Start of pad source data */
+	int				step;		/*<< Pad source bytes skipped per chunk */
+	int				chunk;		/*<< Pad bytes copied per chunk */
+	unsigned char	order[p3OBF_MAXBLKS];	/*<< Block output order */
+	int				bloc[p3OBF_MAXBLKS];	/*<< Block locations */
+	int				blen[p3OBF_MAXBLKS];	/*<< Block data lengths */
+};
+
+/*****  MACROS  *****/
+
+/*****  PROTOTYPES  *****/
+
+int p3obf_plan(p3obf *obf, const unsigned char *src, int psize, int len,
+		unsigned int usec);
+int p3obf_emit(const p3obf *obf, const unsigned char *src, unsigned char *dst);
+int p3obf_parse(p3obf *obf, const unsigned char *src, int len);
+int p3obf_gather(const p3obf *obf, const unsigned char *src, unsigned char *dst);
+
+/*****  EXTERNAL DEFINITIONS  *****/
+
+#endif /* _p3kOBF_H */
+
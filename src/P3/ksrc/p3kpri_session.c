@@ -96,7 +96,7 @@ void key_array_error(int flag, p3session *p3sess)
 void rekey_session(int flag, unsigned int key_num, p3session *p3sess)
 {
 	int stat = 0;
-	unsigned int newseq;
+	unsigned int newseq, start;
 	unsigned char message[4];
 	p3ctlmsg *ctlmsg;
 
@@ -105,9 +105,8 @@ void rekey_session(int flag, unsigned int key_num, p3session *p3sess)
 		goto out;
 	}
 
-	newseq = p3sess->sseq + 1;
-	if (!newseq)
-		newseq++;
+	// The new key is used after the sequence number of this message
+	newseq = start = p3_rekey_seq(p3sess);
 	message[3] = (unsigned char) newseq;
 	newseq >>= 8;
 	message[2] = (unsigned char) newseq;
@@ -126,7 +125,7 @@ void rekey_session(int flag, unsigned int key_num, p3session *p3sess)
 	}
 
 	// Use new key
-	p3_rekey(&p3sess->keymgmt);
+	p3_rekey(&p3sess->keymgmt, start);
 	p3sess->rID0 = p3sess->rID1;
 	p3sess->rID1 = key_num;
 
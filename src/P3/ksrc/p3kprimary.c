@@ -68,6 +68,7 @@ struct p3config *config = NULL;
  *
  * \par Inputs:
  * - ramdisk: The location of the RAM disk area.
+ * - size: The size of the RAM disk area, in bytes.
  *
  * \par Outputs:
  * - int: Status
@@ -75,7 +76,7 @@ struct p3config *config = NULL;
  *   - <0 = Error
  */
 
-int init_primary (unsigned char *ramdisk)
+int init_primary (unsigned char *ramdisk, int size)
 {
 	int stat = 0;
 
@@ -90,8 +91,10 @@ int init_primary (unsigned char *ramdisk)
 	primain->port = p3PRI_PORT;
 
 	// Initialize key server information
-	primain->key_mgr.key_serv = (p3key_serv *) ramdisk;
-	p3lock_init(primain->key_mgr.lock);
+	if (p3_key_init(&primain->key_mgr, ramdisk, size, p3key_rings) < 0) {
+		stat = -1;
+		goto out;
+	}
 
 	// Initialize P3 routing
 	if (init_p3net < 0) {
@@ -159,36 +162,32 @@ p3errmsg(p3MSG_DEBUG, "Invalid buffer size\n");
 			stat = -1;
 			goto out;
 		}
-		shost =  p3hosts;
 		saddr = (void *)&buffer[strlen(p3cmdlist[i])];
 		// TODO: Add support for IPv6
-		while (shost != NULL) {
-			if (memcmp(saddr, &shost->addr.v4, sizeof(struct in_addr)) == 0) {
-				if (shost->session == NULL) {
+		if ((shost = p3host_find(p3HST_IPV4, saddr)) != NULL) {
+			if (shost->session == NULL) {
 p3errmsg(p3MSG_DEBUG, "No session\n");
-					stat = -1;
-					goto out;
-				}
+				stat = -1;
+				goto out;
+			}
 /* !!!!! Temporary ====> */
 /* !!!!! Temporary ====> */
-				for (i=0; i < 16; i++) {
-					shost->session->keymgmt.dnewkey->key[i] = (i + 13) * 53;
-					shost->session->keymgmt.cnewkey->key[i] = (i + 53) * 13;
-				}
+			for (i=0; i < 16; i++) {
+				shost->session->keymgmt.dnewkey->key[i] = (i + 13) * 53;
+				shost->session->keymgmt.cnewkey->key[i] = (i + 53) * 13;
+			}
 /* <==== Temporary !!!!! */
 /* <==== Temporary !!!!! */
-				if (p3_rekey(&shost->session->keymgmt) < 0) {
+			if (p3_rekey(&shost->session->keymgmt,
+					p3seq_read(shost->session->sseq)) < 0) {
 p3errmsg(p3MSG_DEBUG, "Invalid buffer size\n");
-					stat = -1;
-					goto out;
-				}
+				stat = -1;
+				goto out;
+			}
 /* !!!!! Temporary ====> */
-				shost->session->rID0 = 1;
-				shost->session->rID1 = 1;
+			shost->session->rID0 = 1;
+			shost->session->rID1 = 1;
 /* <==== Temporary !!!!! */
-				break;
-			}
-			shost = shost->next;
 		}
 		break;
 
@@ -222,12 +221,11 @@ out:
 
 int parse_p3data(unsigned char *buffer, int size)
 {
-	int i, j, idx, hdr, stat = 0, ioc_cmd;
-	int zero[4] = {0, 0, 0, 0};
+	int i, j, idx, hdr, stat = 0, ioc_cmd, newhost = 0;
 	unsigned long l;
 	unsigned char *net, *mask;
 	p3primarycfg pcfg;
-	p3host *shost;
+	p3host *shost = NULL;
 	p3sechostcfg shcfg;
 	p3net *snet;
 	p3subnetcfg sncfg;
@@ -296,20 +294,8 @@ p3errmsg(p3MSG_DEBUG, "Enter parse P3 data\n");
 			stat = -EINVAL;
 			goto out;
 		}
-		// TODO: Convert to Red Black trees
-		shost = p3hosts;
-		while (shost != NULL) {
-			if (shcfg.flag & p3HST_IPV4 && memcmp(&shost->addr.v4,
-						&shcfg.addr.v4, sizeof (struct in_addr)) == 0) {
-				break;
-			} else if (shcfg.flag & p3HST_IPV6 && memcmp(&shost->addr.v6,
-						&shcfg.addr.v6, sizeof (struct in6_addr)) == 0) {
-				break;
-			}
-			shost = shost->hlist;
-		}
-		// Add new host definition to host list.
-		// TODO: Implement lock
+		shost = p3host_find(shcfg.flag & p3HST_IPVER, &shcfg.addr);
+		// Create new host definition, added to host table when complete
 		if (shost == NULL) {
 			if (shcfg.flag & p3HST_IPV4) {
 				hdr = p3SESSION_HDR4;
@@ -322,19 +308,13 @@ p3errmsg(p3MSG_DEBUG, "Enter parse P3 data\n");
 				stat = -ENOMEM;
 				goto out;
 			}
-			// TODO: Convert remote host table to Red Black tree
-			shost->hlist = p3hosts;
 			shost->port = primain->port;
-			p3hosts = shost;
-		}
-		if (shcfg.flag & p3HST_IPV4) {
-			if (memcmp((void *)&zero[0], &shcfg.addr.v4,
-					sizeof(struct in_addr)) != 0)
+			if (shcfg.flag & p3HST_IPV4) {
 				memcpy(&shost->addr.v4, &shcfg.addr.v4, sizeof(struct in_addr));
-		} else if (shcfg.flag & p3HST_IPV6) {
-			if (memcmp((void *)&zero[0], &shcfg.addr.v6,
-					sizeof(struct in6_addr)) != 0)
+			} else if (shcfg.flag & p3HST_IPV6) {
 				memcpy(&shost->addr.v6, &shcfg.addr.v6, sizeof(struct in6_addr));
+			}
+			newhost = 1;
 		}
 		// Initialize secondary host
 		if (shcfg.hb_wait > 0)
@@ -365,7 +345,13 @@ p3errmsg(p3MSG_DEBUG, "Enter parse P3 data\n");
 			if (shcfg.flag & p3HST_IPV4) {
 				memcpy(&snet->net.v4, &sncfg.net.v4, sizeof(struct in_addr));
 				memcpy(&snet->mask, &sncfg.mask, sizeof(struct in_addr));
+				if (p3route_prefix(&snet->mask) < 0) {
+					p3errmsg(p3MSG_ERR, "parse_p3data: Subnet mask is not contiguous\n");
+					stat = -1;
+					goto out;
+				}
 				snet->flag |= p3HST_IPV4;
+				snet->host = shost;
 				// Clear host bits to be sure
 				net = (unsigned char *)&snet->net.v4;
 				mask = (unsigned char *)&snet->mask;
@@ -373,20 +359,18 @@ p3errmsg(p3MSG_DEBUG, "Enter parse P3 data\n");
 					net[j] &= mask[j];
 				}
 				if (build_p3table(snet, p3HST_IPV4) < 0) {
-					// TODO: Handle cleanup
 					stat = -1;
 					goto out;
 				}
 			} else if (shcfg.flag & p3HST_IPV6) {
 				memcpy(&snet->net.v6, &sncfg.net.v6, sizeof(struct in6_addr));
 				snet->flag |= p3HST_IPV6;
+				snet->host = shost;
 				if (build_p3table(snet, p3HST_IPV6) < 0) {
-					// TODO: Handle cleanup
 					stat = -1;
 					goto out;
 				}
 			}
-			snet->host = shost;
 			// Set P3 host network information
 			if (shcfg.flag & p3HST_IPV4) {
 				if (memcmp(&shost->addr.v4, &snet->net.v4,
@@ -400,6 +384,15 @@ p3errmsg(p3MSG_DEBUG, "Enter parse P3 data\n");
 			l += sizeof(p3net);
 			snet = (p3net *) l;
 		}
+		// Make new host visible to the packet path
+		if (newhost) {
+			if (p3host_add(shost) != 0) {
+				p3errmsg(p3MSG_WARN, "parse_p3data: Secondary host already defined\n");
+				stat = -EEXIST;
+				goto out;
+			}
+			newhost = 0;
+		}
 /* !!!!! Temporary !!!!! */
 /* !!!!! Temporary !!!!! */
 p3errmsg(p3MSG_DEBUG, "Initialize session for unit testing\n");
@@ -407,7 +400,8 @@ p3errmsg(p3MSG_DEBUG, "Initialize session for unit testing\n");
 		shost->session->keymgmt.dnewkey->key[i] = (i + 13) * 53;
 		shost->session->keymgmt.cnewkey->key[i] = (i + 53) * 13;
 	}
-	if (p3_init_crypto(&shost->session->keymgmt) < 0) {
+	if (p3_init_crypto(&shost->session->keymgmt,
+			p3seq_read(shost->session->sseq)) < 0) {
 		stat = -1;
 		goto out;
 	}
@@ -424,19 +418,7 @@ p3errmsg(p3MSG_DEBUG, "Initialize session for unit testing\n");
 			goto out;
 		}
 		// Find session and set active
-		// TODO: Convert to Red Black trees
-		shost = p3hosts;
-		while (shost != NULL) {
-			if (nsess.flag & p3HST_IPV4 &&
-					memcmp(&shost->addr.v4, &nsess.addr.v4, sizeof (struct in_addr)) == 0) {
-				break;
-			} else if (nsess.flag & p3HST_IPV6 &&
-					memcmp(&shost->addr.v6, &nsess.addr.v6, sizeof (struct in6_addr)) == 0) {
-				break;
-			}
-			shost = shost->hlist;
-		}
-		if (shost == NULL) {
+		if ((shost = p3host_find(nsess.flag & p3HST_IPVER, &nsess.addr)) == NULL) {
 			p3errmsg(p3MSG_ERR, "parse_p3data: Secondary host undefined\n");
 			stat = -EINVAL;
 			goto out;
@@ -445,7 +427,8 @@ p3errmsg(p3MSG_DEBUG, "Initialize session for unit testing\n");
 		i = p3_get_key_size(shost->flag & p3PSS_KTYPE);
 		memcpy(shost->session->keymgmt.dnewkey->key, nsess.datakey, i);
 		memcpy(shost->session->keymgmt.cnewkey->key, nsess.ctlkey, i);
-		if (p3_init_crypto(&shost->session->keymgmt) < 0) {
+		if (p3_init_crypto(&shost->session->keymgmt,
+				p3seq_read(shost->session->sseq)) < 0) {
 			stat = -EPERM;
 			goto out;
 		}
@@ -465,6 +448,9 @@ p3errmsg(p3MSG_DEBUG, "Initialize session for unit testing\n");
 	}
 
 out:
+	// Release a new host that could not be configured
+	if (newhost)
+		p3host_remove(shost);
 p3errmsg(p3MSG_DEBUG, "Exit parse P3 data\n");
 	return(stat);
 } /* end parse_p3data */
@@ -497,6 +483,13 @@ p3errmsg(p3MSG_DEBUG, "Exit parse P3 data\n");
  * \par Response:
  * Correct the configuration data.
  *
+ * <hr><b>parse_p3data: Subnet mask is not contiguous</b>
+ * \par Description (ERR):
+ * A subnet mask of the P3 host has zero bits between its one bits.
+ * Only network prefixes can be routed.
+ * \par Response:
+ * Correct the configuration data.
+ *
  * <hr><b>parse_p3data: Failed to allocate secondary host structure</b>
  * \par Description (CRIT):
  * The P3 primary attempts to allocate a secondary host structure for each
@@ -511,6 +504,13 @@ p3errmsg(p3MSG_DEBUG, "Exit parse P3 data\n");
  * \par Response:
  * Notify the P3 application support.
  *
+ * <hr><b>parse_p3data: Secondary host already defined</b>
+ * \par Description (WARN):
+ * A new secondary host definition was added by another configuration
+ * command while this one was being processed.
+ * \par Response:
+ * Verify the configuration and correct if appropriate.
+ *
  */
 
 /**
@@ -558,3 +558,41 @@ out:
 	return;
 }
 
+
+/**
+ * \par Function:
+ * prepare_epochs
+ *
+ * \par Description:
+ * Prepare the next key epoch of each active session, so a rekey only
+ * publishes the epoch.  This is run by the key epoch thread.  A session
+ * whose key ring is empty is skipped until the next pass.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - None
+ */
+
+void prepare_epochs(void)
+{
+	int i;
+	p3host *host;
+	p3session *session;
+
+	// Hosts are released after current readers finish
+	p3rcu_read_lock();
+	for (i=0; i < p3HOST_HASHSZ; i++) {
+		for (host = p3rcu_deref(p3hosts[i]); host != NULL;
+				host = p3rcu_deref(host->hlist)) {
+			// Only sessions with keys in use are rekeyed
+			if ((session = host->session) == NULL ||
+					ACCESS_ONCE(session->keymgmt.epoch) == NULL)
+				continue;
+			p3_prepare_epoch(&session->keymgmt, session->kring,
+					&primain->key_mgr);
+		}
+	}
+	p3rcu_read_unlock();
+} /* end prepare_epochs */
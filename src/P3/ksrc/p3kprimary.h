@@ -58,10 +58,11 @@ struct _p3pri_main {
 
 /*****  PROTOTYPES  *****/
 
-extern int init_primary (unsigned char *ramdisk);
+extern int init_primary (unsigned char *ramdisk, int size);
 extern int parse_p3cmd(unsigned char *buffer, int size);
 int parse_p3data(unsigned char *buffer, int size);
 void start_rekeying(p3session *session);
+void prepare_epochs(void);
 
 /*****  EXTERNAL DEFINITIONS  *****/
 
@@ -0,0 +1,428 @@
+/**
+ * \file p3kroute.c
+ * <h3>Protected Point to Point route table file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * The route table functions provide a longest prefix match of packet
+ * addresses to the P3 networks of remote P3 hosts.  The same functions
+ * are used for the IPv4 and IPv6 route tables.
+ * - Lookup is lock free under RCU and visits at most one trie node for
+ *   each bit of the matched prefix.
+ * - Insert and delete are serialized by the table lock and never modify
+ *   a node that readers can see, except to publish a child or network
+ *   pointer.
+ */
+
+/**
+ * \page P3KM_MSGS Protected Point to Point Kernel Module Messages
+ * <p><hr><hr>
+ * \section P3KM_ROUTE P3 Route Table Messages
+ */
+
+#include "p3knet.h"
+
+/** Get bit <i>bit</i> of a trie key, counting from the most significant */
+#define p3RT_BIT(key, bit) \
+	(((key)[(bit) >> 5] >> (31 - ((bit) & 31))) & 1)
+
+/**
+ * \par Function:
+ * p3route_key
+ *
+ * \par Description:
+ * Convert a network order address to trie key words.
+ *
+ * \par Inputs:
+ * - addr: The network order address
+ * - bits: The address size in bits (32 or 128)
+ * - key: The key words to be set
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static inline void p3route_key(const unsigned char *addr, int bits,
+		unsigned int *key)
+{
+	int i;
+
+	for (i=0; i < (bits >> 5); i++, addr += 4) {
+		key[i] = (addr[0] << 24) | (addr[1] << 16) | (addr[2] << 8) | addr[3];
+	}
+} /* end p3route_key */
+
+/**
+ * \par Function:
+ * p3route_common
+ *
+ * \par Description:
+ * Find the number of leading bits that two keys have in common.
+ *
+ * \par Inputs:
+ * - key1: The first key
+ * - key2: The second key
+ * - max: The maximum number of bits to compare
+ *
+ * \par Outputs:
+ * - int: The common prefix length, no greater than max
+ */
+
+static inline int p3route_common(const unsigned int *key1,
+		const unsigned int *key2, int max)
+{
+	int i;
+	unsigned int diff;
+
+	for (i=0; i < max; i += 32) {
+		if ((diff = key1[i >> 5] ^ key2[i >> 5]) != 0) {
+			i += 32 - fls(diff);
+			break;
+		}
+	}
+	return (i < max ? i : max);
+} /* end p3route_common */
+
+/**
+ * \par Function:
+ * p3route_mask
+ *
+ * \par Description:
+ * Clear the bits of a key that follow the prefix.
+ *
+ * \par Inputs:
+ * - key: The key to be masked
+ * - plen: The prefix length
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static inline void p3route_mask(unsigned int *key, int plen)
+{
+	int i;
+
+	for (i=0; i < 4; i++, plen -= 32) {
+		if (plen <= 0)
+			key[i] = 0;
+		else if (plen < 32)
+			key[i] &= ~(0xffffffff >> plen);
+	}
+} /* end p3route_mask */
+
+/**
+ * \par Function:
+ * p3route_node
+ *
+ * \par Description:
+ * Allocate a trie node for the leading bits of a key.
+ *
+ * \par Inputs:
+ * - key: The key for the node
+ * - plen: The prefix length of the node
+ *
+ * \par Outputs:
+ * - p3rnode *: The new node or NULL if allocation fails
+ */
+
+static p3rnode *p3route_node(const unsigned int *key, int plen)
+{
+	p3rnode *node;
+
+	if ((node = (p3rnode *) p3calloc(sizeof(p3rnode))) != NULL) {
+		node->plen = plen;
+		memcpy(node->key, key, sizeof(node->key));
+		p3route_mask(node->key, plen);
+	}
+	return (node);
+} /* end p3route_node */
+
+/**
+ * \par Function:
+ * p3route_create
+ *
+ * \par Description:
+ * Create an empty P3 route table.
+ *
+ * \par Inputs:
+ * - bits: The address size in bits (32 for IPv4 or 128 for IPv6)
+ *
+ * \par Outputs:
+ * - p3route *: The route table or NULL if allocation fails
+ */
+
+p3route *p3route_create(int bits)
+{
+	p3route *route;
+
+	if ((route = (p3route *) p3calloc(sizeof(p3route))) != NULL) {
+		route->bits = bits;
+		p3lock_init(route->lock);
+	}
+	return (route);
+} /* end p3route_create */
+
+/**
+ * \par Function:
+ * p3route_prefix
+ *
+ * \par Description:
+ * Get the prefix length of an IPv4 network mask.  The mask must be a
+ * contiguous run of leading one bits, since the route table only
+ * stores prefixes.
+ *
+ * \par Inputs:
+ * - mask: The network order network mask
+ *
+ * \par Outputs:
+ * - int: The prefix length or -1 if the mask is not contiguous
+ */
+
+int p3route_prefix(const struct in_addr *mask)
+{
+	unsigned int host = ~ntohl(mask->s_addr);
+
+	if (host & (host + 1))
+		return (-1);
+	return (32 - hweight32(host));
+} /* end p3route_prefix */
+
+/**
+ * \par Function:
+ * p3route_insert
+ *
+ * \par Description:
+ * Add a network to a P3 route table.  The new nodes are completely built
+ * before they are linked into the trie, so lookups running at the same
+ * time find either the old or the new table.
+ *
+ * \par Inputs:
+ * - route: The route table
+ * - net: The network to be added
+ * - addr: The network order network address
+ * - plen: The prefix length of the network
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0 = OK
+ *   - <0 = Error
+ *   - >0 = Prefix already in table
+ */
+
+int p3route_insert(p3route *route, p3net *net, const unsigned char *addr,
+		int plen)
+{
+	int cpl, stat = 0;
+	unsigned int key[4];
+	p3rnode *node, *glue = NULL, *new, **slot;
+
+	if (plen < 0 || plen > route->bits) {
+		stat = -1;
+		goto out;
+	}
+	memset(key, 0, sizeof(key));
+	p3route_key(addr, route->bits, key);
+	// Allocate before locking since there are at most two new nodes
+	if ((new = p3route_node(key, plen)) == NULL ||
+			(glue = p3route_node(key, plen)) == NULL) {
+		p3free(new);
+		stat = -1;
+		goto out;
+	}
+	new->net = net;
+
+	p3lock(route->lock);
+	slot = &route->root;
+	while ((node = *slot) != NULL) {
+		cpl = p3route_common(node->key, new->key,
+				node->plen < plen ? node->plen : plen);
+		if (cpl < node->plen) {
+			if (cpl == plen) {
+				// New network contains the node prefix
+				new->child[p3RT_BIT(node->key, plen)] = node;
+			} else {
+				// Branch where the prefixes differ
+				glue->plen = cpl;
+				p3route_mask(glue->key, cpl);
+				glue->child[p3RT_BIT(new->key, cpl)] = new;
+				glue->child[p3RT_BIT(node->key, cpl)] = node;
+				new = glue;
+				glue = NULL;
+			}
+			break;
+		}
+		if (node->plen == plen) {
+			// Prefix is in the table
+			if (node->net != NULL) {
+				stat = 1;
+			} else {
+				p3rcu_assign(node->net, net);
+				route->netsz++;
+			}
+			p3free(new);
+			new = NULL;
+			break;
+		}
+		slot = &node->child[p3RT_BIT(new->key, node->plen)];
+	}
+	if (new != NULL) {
+		p3rcu_assign(*slot, new);
+		route->netsz++;
+	}
+	p3unlock(route->lock);
+	p3free(glue);
+
+out:
+	return (stat);
+} /* end p3route_insert */
+
+/**
+ * \par Function:
+ * p3route_delete
+ *
+ * \par Description:
+ * Remove a network from a P3 route table.  Nodes that are no longer
+ * needed are unlinked and released after current lookups finish.
+ *
+ * \par Inputs:
+ * - route: The route table
+ * - net: The network to be removed
+ * - addr: The network order network address
+ * - plen: The prefix length of the network
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0 = OK
+ *   - >0 = Network not in table
+ */
+
+int p3route_delete(p3route *route, p3net *net, const unsigned char *addr,
+		int plen)
+{
+	int stat = 0;
+	unsigned int key[4];
+	p3rnode *node, *parent = NULL, **slot, **pslot = NULL;
+
+	memset(key, 0, sizeof(key));
+	p3route_key(addr, route->bits, key);
+	p3route_mask(key, plen);
+
+	p3lock(route->lock);
+	slot = &route->root;
+	while ((node = *slot) != NULL && node->plen < plen) {
+		if (p3route_common(node->key, key, node->plen) < node->plen)
+			break;
+		pslot = slot;
+		parent = node;
+		slot = &node->child[p3RT_BIT(key, node->plen)];
+	}
+	if (node == NULL || node->plen != plen || node->net != net ||
+			memcmp(node->key, key, sizeof(key)) != 0) {
+		stat = 1;
+		goto unlock;
+	}
+	p3rcu_assign(node->net, NULL);
+	route->netsz--;
+	// Remove nodes that no longer join two branches
+	if (node->child[0] != NULL && node->child[1] != NULL)
+		goto unlock;
+	p3rcu_assign(*slot, node->child[0] != NULL ? node->child[0] : node->child[1]);
+	p3rcu_free(node);
+	if (*slot == NULL && parent != NULL && parent->net == NULL) {
+		p3rcu_assign(*pslot, parent->child[0] != NULL ?
+				parent->child[0] : parent->child[1]);
+		p3rcu_free(parent);
+	}
+
+unlock:
+	p3unlock(route->lock);
+	return (stat);
+} /* end p3route_delete */
+
+/**
+ * \par Function:
+ * p3route_lookup
+ *
+ * \par Description:
+ * Find the network with the longest prefix matching an address.  This
+ * is called from the packet path and does not lock the table.
+ *
+ * The returned network belongs to a remote host structure, which is
+ * released with p3rcu_free, so a network found from the packet path
+ * remains valid until the netfilter hook returns.
+ *
+ * \par Inputs:
+ * - route: The route table
+ * - addr: The network order address
+ *
+ * \par Outputs:
+ * - p3net *: The matching network or NULL if there is no match
+ */
+
+p3net *p3route_lookup(p3route *route, const unsigned char *addr)
+{
+	unsigned int key[4];
+	p3rnode *node;
+	p3net *net, *best = NULL;
+
+	p3route_key(addr, route->bits, key);
+	p3rcu_read_lock();
+	node = p3rcu_deref(route->root);
+	while (node != NULL) {
+		if (p3route_common(node->key, key, node->plen) < node->plen)
+			break;
+		if ((net = p3rcu_deref(node->net)) != NULL)
+			best = net;
+		if (node->plen == route->bits)
+			break;
+		node = p3rcu_deref(node->child[p3RT_BIT(key, node->plen)]);
+	}
+	p3rcu_read_unlock();
+	return (best);
+} /* end p3route_lookup */
+
+/**
+ * \par Function:
+ * p3route_release
+ *
+ * \par Description:
+ * Release a trie node and all of its branches.
+ *
+ * \par Inputs:
+ * - node: The node to be released
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3route_release(p3rnode *node)
+{
+	if (node == NULL)
+		return;
+	p3route_release(node->child[0]);
+	p3route_release(node->child[1]);
+	p3free(node);
+} /* end p3route_release */
+
+/**
+ * \par Function:
+ * p3route_free
+ *
+ * \par Description:
+ * Release a P3 route table.  This must only be called when the packet
+ * path can no longer look up the table.
+ *
+ * \par Inputs:
+ * - route: The route table
+ *
+ * \par Outputs:
+ * - None
+ */
+
+void p3route_free(p3route *route)
+{
+	if (route == NULL)
+		return;
+	p3route_release(route->root);
+	p3free(route);
+} /* end p3route_free */
@@ -66,18 +66,43 @@ out:
  * - message: The array of keys
  * - ksize: The key size
  * - dsize: The number of keys in the array
+ * - mlen: The length of the control message, which has a 9 octet
+ *   header before the array
  * - p3sess: The session structure for the current P3 session.
  *
  * \par Outputs:
  * - int: Status (see the errors for the p3CMSG_ACK_KEY_ARRAY field)
  */
 
-int set_key_array(unsigned char *message, int ksize, int dsize, p3session *p3sess)
+int set_key_array(unsigned char *message, int ksize, int dsize, int mlen,
+		p3session *p3sess)
 {
 	int sstat = 0;
+	unsigned char *list, *old;
 
-	// TODO: Handle set key array message
+	// Keys are sent by 2 octet index, and all must be in the message
+	if (dsize <= 0 || dsize > 0x10000 || (dsize * ksize) > p3MAX_MSG_SZ ||
+			(9 + (dsize * ksize)) > mlen) {
+		sstat = p3CMSG_AKDERR;
+		goto out;
+	}
+	if ((list = (unsigned char *) p3malloc(dsize * ksize)) == NULL) {
+		sstat = p3CMSG_AKKERR;
+		goto out;
+	}
+	memcpy(list, message, dsize * ksize);
+	// Expand the keys now so a rekey by index does not create contexts,
+	// else the contexts are created from the key at the rekey
+	p3_set_keys(list, dsize, &p3sess->keymgmt);
+	p3lock(p3sess->lock);
+	old = p3sess->keylist;
+	p3sess->keylist = list;
+	p3sess->listsize = dsize;
+	p3unlock(p3sess->lock);
+	if (old != NULL)
+		p3free(old);
 
+out:
 	return (sstat);
 } /* end set_key_array */
 
@@ -87,7 +112,8 @@ int set_key_array(unsigned char *message, int ksize, int dsize, p3session *p3ses
  *
  * \par Description:
  * Replace the data and control keys from the primary using
- * the key or index sent in the message.
+ * the key or index sent in the message.  A data key index is refused
+ * for AEAD and CTR data keys, whose nonces would repeat.
  * 
  * \par Inputs:
  * - dkey: The data key contained in the message or NULL
@@ -109,19 +135,17 @@ int replace_key(unsigned char *dkey, int dindex, unsigned char *ckey, int cindex
 	p3ctlmsg *ctlmsg;
 
 	// Set new data key
+	p3sess->keymgmt.dnewidx = -1;
 	if (dkey != NULL) {
 		memcpy(p3sess->keymgmt.dnewkey->key, dkey, dindex);
 	} else {
-		if (p3sess->keylist == NULL || p3sess->listsize <= dindex) {
+		if (p3sess->keylist == NULL || p3sess->listsize <= dindex ||
+				p3KTYPE_NONCE(p3sess->flag & p3PSS_KTYPE)) {
 			stat = -1;
 			flag |= p3CMSG_RKDIERR;
 		} else {
-			if ((p3sess->flag & p3PSS_KTYPE) == p3KTYPE_AES128) {
-				idx = dindex * p3KSIZE_AES128;
-				len = p3KSIZE_AES128;
-			} else if ((p3sess->flag & p3PSS_KTYPE) == p3KTYPE_AES256) {
-				idx = dindex * p3KSIZE_AES256;
-				len = p3KSIZE_AES256;
+			if ((len = p3_get_key_size(p3sess->flag & p3PSS_KTYPE)) > 0) {
+				idx = dindex * len;
 			} else {
 				stat = -1;
 				flag |= p3CMSG_RKDIERR;
@@ -129,36 +153,39 @@ int replace_key(unsigned char *dkey, int dindex, unsigned char *ckey, int cindex
 		}
 		if (!stat) {
 			memcpy(p3sess->keymgmt.dnewkey->key, &p3sess->keylist[idx], len);
+			// The new epoch uses the expanded key of the key array
+			p3sess->keymgmt.dnewidx = dindex;
 		}
 	}
 
 	// Set new control key
+	p3sess->keymgmt.cnewidx = -1;
 	if (ckey != NULL) {
 		memcpy(p3sess->keymgmt.cnewkey->key, ckey, cindex);
 	} else {
-		if (p3sess->keylist == NULL || p3sess->listsize <= dindex) {
+		if (p3sess->keylist == NULL || p3sess->listsize <= cindex) {
 			stat = -1;
 			flag |= p3CMSG_RKCIERR;
 		} else {
-			if ((p3sess->flag & p3PSS_KTYPE) == p3KTYPE_AES128) {
-				idx = dindex * p3KSIZE_AES128;
-				len = p3KSIZE_AES128;
-			} else if ((p3sess->flag & p3PSS_KTYPE) == p3KTYPE_AES256) {
-				idx = dindex * p3KSIZE_AES256;
-				len = p3KSIZE_AES256;
+			if ((len = p3_get_key_size(p3sess->flag & p3PSS_KTYPE)) > 0) {
+				idx = cindex * len;
 			} else {
 				stat = -1;
-				flag |= p3CMSG_RKDIERR;
+				flag |= p3CMSG_RKCIERR;
 			}
 		}
 		if (!stat) {
 			memcpy(p3sess->keymgmt.cnewkey->key, &p3sess->keylist[idx], len);
+			p3sess->keymgmt.cnewidx = cindex;
 		}
 	}
 
-	newseq = p3sess->sseq + 1;
-	if (!newseq)
-		newseq++;
+	// Stop sending data before choosing the sequence for the new key
+	p3lock(p3sess->lock);
+	p3sess->flag |= p3PSS_REKEY;
+	p3unlock(p3sess->lock);
+	// The new key is used after the sequence number of this message
+	newseq = p3sess->sID1 = p3_rekey_seq(p3sess);
 	message[3] = (unsigned char) newseq;
 	newseq >>= 8;
 	message[2] = (unsigned char) newseq;
@@ -170,13 +197,17 @@ int replace_key(unsigned char *dkey, int dindex, unsigned char *ckey, int cindex
 		== NULL) {
 		p3errmsg(p3MSG_ERR, "Error building data rekey response\n");
 		stat = -1;
-		goto out;
+		goto rekey;
 	} else if (p3send_control(p3sess, ctlmsg) < 0) {
 		stat = -1;
-		goto out;
+		goto rekey;
 	}
+	goto out;
+
+rekey:
+	// The primary will not use the new key, so continue sending data
 	p3lock(p3sess->lock);
-	p3sess->flag |= p3PSS_REKEY;
+	p3sess->flag &= ~p3PSS_REKEY;
 	p3unlock(p3sess->lock);
 
 out:
@@ -207,8 +238,8 @@ void rekey_session(int flag, unsigned int key_num, p3session *p3sess)
 	if (flag & p3CMSG_RKERR) {
 		goto out;
 	}
-	// Use new key
-	p3_rekey(&p3sess->keymgmt);
+	// Use new key for data sent after the Rekey message
+	p3_rekey(&p3sess->keymgmt, p3sess->sID1);
 	p3sess->rID0 = p3sess->rID1;
 	p3sess->rID1 = key_num;
 
@@ -175,11 +175,11 @@ out:
 
 int parse_p3data(unsigned char *buffer, int size)
 {
-	int i, j, idx, hdr, stat = 0, ioc_cmd;
+	int i, j, idx, hdr, stat = 0, ioc_cmd, newhost = 0;
 	unsigned long l;
 	unsigned char *net, *mask;
 	p3secondarycfg scfg;
-	p3host *phost;
+	p3host *phost = NULL;
 	p3prihostcfg phcfg;
 	p3net *snet;
 	p3subnetcfg sncfg;
@@ -240,20 +240,8 @@ p3errmsg(p3MSG_DEBUG, "Enter parse P3 data\n");
 			stat = -EINVAL;
 			goto out;
 		}
-		// TODO: Convert to Red Black trees
-		phost = p3hosts;
-		while (phost != NULL) {
-			if (phcfg.flag & p3HST_IPV4 &&
-					memcmp(&phost->addr.v4, &phcfg.addr.v4, sizeof (struct in_addr)) == 0) {
-				break;
-			} else if (phcfg.flag & p3HST_IPV6 &&
-					memcmp(&phost->addr.v6, &phcfg.addr.v6, sizeof (struct in6_addr)) == 0) {
-				break;
-			}
-			phost = phost->hlist;
-		}
-		// Add new host definition to host list.
-		// TODO: Implement lock
+		phost = p3host_find(phcfg.flag & p3HST_IPVER, &phcfg.addr);
+		// Create new host definition, added to host table when complete
 		if (phost == NULL) {
 			if (phcfg.flag & p3HST_IPV4) {
 				hdr = p3SESSION_HDR4;
@@ -266,9 +254,7 @@ p3errmsg(p3MSG_DEBUG, "Enter parse P3 data\n");
 				stat = -ENOMEM;
 				goto out;
 			}
-			// TODO: Convert remote host table to Red Black tree
-			phost->hlist = p3hosts;
-			p3hosts = phost;
+			newhost = 1;
 		}
 		if (phcfg.flag & p3HST_IPV4) {
 			memcpy(&phost->addr.v4, &phcfg.addr.v4, sizeof(struct in_addr));
@@ -297,7 +283,13 @@ p3errmsg(p3MSG_DEBUG, "Enter parse P3 data\n");
 			if (phcfg.flag & p3HST_IPV4) {
 				memcpy(&snet->net.v4, &sncfg.net.v4, sizeof(struct in_addr));
 				memcpy(&snet->mask, &sncfg.mask, sizeof(struct in_addr));
+				if (p3route_prefix(&snet->mask) < 0) {
+					p3errmsg(p3MSG_ERR, "parse_p3data: Subnet mask is not contiguous\n");
+					stat = -1;
+					goto out;
+				}
 				snet->flag |= p3HST_IPV4;
+				snet->host = phost;
 				// Clear host bits to be sure
 				net = (unsigned char *)&snet->net.v4;
 				mask = (unsigned char *)&snet->mask;
@@ -305,20 +297,18 @@ p3errmsg(p3MSG_DEBUG, "Enter parse P3 data\n");
 					net[j] &= mask[j];
 				}
 				if (build_p3table(snet, p3HST_IPV4) < 0) {
-					// TODO: Handle cleanup
 					stat = -1;
 					goto out;
 				}
 			} else if (phcfg.flag & p3HST_IPV6) {
 				memcpy(&snet->net.v6, &sncfg.net.v6, sizeof(struct in6_addr));
 				snet->flag |= p3HST_IPV6;
+				snet->host = phost;
 				if (build_p3table(snet, p3HST_IPV6) < 0) {
-					// TODO: Handle cleanup
 					stat = -1;
 					goto out;
 				}
 			}
-			snet->host = phost;
 			// Set P3 host network information
 			if (phcfg.flag & p3HST_IPV4) {
 				if (memcmp(&phost->addr.v4, &snet->net.v4,
@@ -335,18 +325,30 @@ p3errmsg(p3MSG_DEBUG, "Enter parse P3 data\n");
 /* !!!!! Temporary !!!!! */
 /* !!!!! Temporary !!!!! */
 p3errmsg(p3MSG_DEBUG, "Initialize session for unit testing\n");
-	phost->flag |= p3KTYPE_AES128 << p3HST_KTSHF;
+	if (!(phost->flag & p3HST_KTYPE))
+		phost->flag |= p3KTYPE_AES128 << p3HST_KTSHF;
 	init_session(phost, &secmain->addr.v4);
+	phost->session->keymgmt.dir = p3KMG_SECDIR;
 	for (i=0; i < 16; i++) {
 		phost->session->keymgmt.dnewkey->key[i] = (i + 13) * 53;
 		phost->session->keymgmt.cnewkey->key[i] = (i + 53) * 13;
 	}
-	if (p3_init_crypto(&phost->session->keymgmt) < 0) {
+	if (p3_init_crypto(&phost->session->keymgmt,
+			p3seq_read(phost->session->sseq)) < 0) {
 		stat = -1;
 		goto out;
 	}
 /* !!!!! Temporary !!!!! */
 /* !!!!! Temporary !!!!! */
+		// Make new host visible to the packet path
+		if (newhost) {
+			if (p3host_add(phost) != 0) {
+				p3errmsg(p3MSG_WARN, "parse_p3data: Primary host already defined\n");
+				stat = -EEXIST;
+				goto out;
+			}
+			newhost = 0;
+		}
 		break;
 
 	default:
@@ -357,6 +359,9 @@ p3errmsg(p3MSG_DEBUG, "Initialize session for unit testing\n");
 	}
 
 out:
+	// Release a new host that could not be configured
+	if (newhost)
+		p3host_remove(phost);
 p3errmsg(p3MSG_DEBUG, "Exit parse P3 data\n");
 	return(stat);
 } /* end parse_p3data */
@@ -389,6 +394,13 @@ p3errmsg(p3MSG_DEBUG, "Exit parse P3 data\n");
  * \par Response:
  * Correct the configuration data.
  *
+ * <hr><b>parse_p3data: Subnet mask is not contiguous</b>
+ * \par Description (ERR):
+ * A subnet mask of the P3 host has zero bits between its one bits.
+ * Only network prefixes can be routed.
+ * \par Response:
+ * Correct the configuration data.
+ *
  * <hr><b>parse_p3data: Failed to allocate primary host structure</b>
  * \par Description (CRIT):
  * The P3 primary attempts to allocate a primary host structure for each
@@ -396,5 +408,12 @@ p3errmsg(p3MSG_DEBUG, "Exit parse P3 data\n");
  * \par Response:
  * Troubleshoot the operating system problem.
  *
+ * <hr><b>parse_p3data: Primary host already defined</b>
+ * \par Description (WARN):
+ * A new primary host definition was added by another configuration
+ * command while this one was being processed.
+ * \par Response:
+ * Verify the configuration and correct if appropriate.
+ *
  */
 
@@ -19,6 +19,49 @@
 /** The time_t equivalent of the previous midnight */
 time_t midnight = 0;
 
+#ifndef _p3_SECONDARY
+/** The key server ring of the next session */
+static int p3kring_next = 0;
+#endif
+
+#ifndef _p3_PRIMARY
+/**
+ * \par Function:
+ * set_key_type
+ *
+ * \par Description:
+ * Use the key type chosen by the primary P3 system for the new keys
+ * of a session.  The key type only changes the crypto contexts of key
+ * epochs that are created after this call.
+ *
+ * \par Inputs:
+ * - ktype: The key type from a control message
+ * - p3sess: The session structure for the current P3 session.
+ *
+ * \par Outputs:
+ * - int: The key size, in bytes, or <0 if the key type is not valid
+ */
+
+static int set_key_type(int ktype, p3session *p3sess)
+{
+	int size;
+
+	if ((size = p3_get_key_size(ktype)) < 0)
+		goto out;
+	if ((p3sess->flag & p3PSS_KTYPE) != ktype) {
+		p3lock(p3sess->lock);
+		p3sess->flag = (p3sess->flag & ~p3PSS_KTYPE) | ktype;
+		p3sess->keymgmt.ktype = ktype;
+		p3sess->keymgmt.dnewkey->size = size;
+		p3sess->keymgmt.cnewkey->size = size;
+		p3unlock(p3sess->lock);
+	}
+
+out:
+	return (size);
+} /* end set_key_type */
+#endif
+
 /**
  * \par Function:
  * init_session
@@ -54,23 +97,28 @@ time_t midnight = 0;
 	session->p3hdr = (unsigned char *) l;
 
 	// P3 session sequence starts at 1
-	session->sseq = 1;
+	p3seq_set(session->sseq, 1);
 	p3lock_init(session->lock);
+	p3lock_init(session->keymgmt.lock);
+	p3parq_init(&session->parq);
 #ifndef _p3_SECONDARY
 	session->dikey = now->tv_sec + session->ditime;
 	session->cikey = now->tv_sec + session->citime;
+	// Spread the sessions over the key server rings
+	session->kring = p3kring_next++;
 #endif
 	session->flag = (host->flag & p3HST_IPVER) | ((host->flag & p3HST_KTYPE) >> p3HST_KTSHF);
-	if ((session->flag & p3PSS_KTYPE) == p3KTYPE_AES128) {
-		session->keymgmt.dnewkey->size = p3KSIZE_AES128;
-		session->keymgmt.cnewkey->size = p3KSIZE_AES128;
-	} else if ((session->flag & p3PSS_KTYPE) == p3KTYPE_AES256) {
-		session->keymgmt.dnewkey->size = p3KSIZE_AES256;
-		session->keymgmt.cnewkey->size = p3KSIZE_AES256;
-	} else {
-		session->keymgmt.dnewkey->size = p3KSIZE_AES128;
-		session->keymgmt.cnewkey->size = p3KSIZE_AES128;
+	if ((size = p3_get_key_size(session->flag & p3PSS_KTYPE)) < 0) {
+		session->flag = (session->flag & ~p3PSS_KTYPE) | p3KTYPE_AES128;
+		size = p3KSIZE_AES128;
 	}
+	session->keymgmt.ktype = session->flag & p3PSS_KTYPE;
+	session->keymgmt.dnewkey->size = size;
+	session->keymgmt.cnewkey->size = size;
+	session->keymgmt.dnewidx = -1;
+	session->keymgmt.cnewidx = -1;
+	// AEAD nonces include the direction, the secondary changes it
+	session->keymgmt.dir = p3KMG_PRIDIR;
 
 	// Initialize P3 network header
 	if (host->flag & p3HST_IPV4) {
@@ -97,6 +145,11 @@ out:
  * \par Description:
  * Build a control message that only contains a flag.
  *
+ * New keys that are not key array indexes are the keys of the epoch
+ * prepared ahead, when there is one, so the rekey does not create
+ * the crypto contexts.  AEAD and CTR data keys are always new keys,
+ * since a key array key used again would repeat the packet nonces.
+ *
  * \par Inputs:
  * - flag: The flag settings, note that DINDEX and CINDEX flags are
  *   set automatically
@@ -108,7 +161,7 @@ out:
 
 p3ctlmsg *build_newkey_message(unsigned int flag, p3session *p3sess, p3key_mgr *key_mgr)
 {
-	int msize = 1, didx = -1, cidx = -1, mask = 1;
+	int msize = 1, didx = -1, cidx = -1, mask = 1, nextkey = 1;
 	unsigned int mflag = flag | (p3sess->flag & p3PSS_KTYPE);
 	unsigned char message[(5 + (p3MAX_KSIZE * 2))];
 	p3ctlmsg *ctlmsg = NULL;
@@ -117,7 +170,16 @@ p3ctlmsg *build_newkey_message(unsigned int flag, p3session *p3sess, p3key_mgr *
 	do_gettimeofday(now);
 
 	// Use data key or index
-	if (now->tv_sec > p3sess->dikey) {
+	p3sess->keymgmt.dnewidx = -1;
+	p3sess->keymgmt.cnewidx = -1;
+	// The epoch prepared ahead has both a data and a control key
+	if (p3sess->keylist == NULL || ((now->tv_sec <= p3sess->dikey ||
+			p3KTYPE_NONCE(p3sess->flag & p3PSS_KTYPE)) &&
+			now->tv_sec <= p3sess->cikey))
+		nextkey = p3_next_keys(&p3sess->keymgmt);
+	p3prep_wake();
+	if (now->tv_sec > p3sess->dikey && p3sess->keylist != NULL &&
+			!p3KTYPE_NONCE(p3sess->flag & p3PSS_KTYPE)) {
 		p3sess->dikey += p3sess->ditime;
 		mflag |= p3CMSG_KRDIDX;
 		// Randomize listsize
@@ -125,14 +187,20 @@ p3ctlmsg *build_newkey_message(unsigned int flag, p3session *p3sess, p3key_mgr *
 			mask <<= 1;
 		mask -= 1;
 		didx = now->tv_usec & mask;
-		while (didx > p3sess->listsize)
+		while (didx >= p3sess->listsize)
 			didx -= p3sess->listsize;
+		// The new epoch uses the expanded key of the key array
+		memcpy(p3sess->keymgmt.dnewkey->key,
+			   &p3sess->keylist[didx * p3sess->keymgmt.dnewkey->size],
+			   p3sess->keymgmt.dnewkey->size);
+		p3sess->keymgmt.dnewidx = didx;
 		message[2] = (unsigned char) didx;
 		didx >>= 8;
 		message[1] = (unsigned char) didx;
 		msize += 2;
 	} else {
-		if (p3_get_key(p3sess->keymgmt.dnewkey, key_mgr) < 0)
+		if (nextkey != 0 &&
+				p3_get_key(p3sess->keymgmt.dnewkey, p3sess->kring, key_mgr) < 0)
 			goto out;
 		memcpy(&message[1], p3sess->keymgmt.dnewkey->key,
 			   p3sess->keymgmt.dnewkey->size);
@@ -140,7 +208,7 @@ p3ctlmsg *build_newkey_message(unsigned int flag, p3session *p3sess, p3key_mgr *
 	}
 
 	// Use control key or index
-	if (now->tv_sec > p3sess->cikey) {
+	if (now->tv_sec > p3sess->cikey && p3sess->keylist != NULL) {
 		p3sess->cikey += p3sess->citime;
 		mflag |= p3CMSG_KRCIDX;
 		// Randomize listsize
@@ -148,14 +216,19 @@ p3ctlmsg *build_newkey_message(unsigned int flag, p3session *p3sess, p3key_mgr *
 			mask <<= 1;
 		mask -= 1;
 		cidx = (now->tv_usec >> 1) & mask;
-		while (cidx > p3sess->listsize)
+		while (cidx >= p3sess->listsize)
 			cidx -= p3sess->listsize;
+		memcpy(p3sess->keymgmt.cnewkey->key,
+			   &p3sess->keylist[cidx * p3sess->keymgmt.cnewkey->size],
+			   p3sess->keymgmt.cnewkey->size);
+		p3sess->keymgmt.cnewidx = cidx;
 		message[msize + 1] = (unsigned char) cidx;
 		cidx >>= 8;
 		message[msize] = (unsigned char) cidx;
 		msize += 2;
 	} else {
-		if (p3_get_key(p3sess->keymgmt.cnewkey, key_mgr) < 0)
+		if (nextkey != 0 &&
+				p3_get_key(p3sess->keymgmt.cnewkey, p3sess->kring, key_mgr) < 0)
 			goto out;
 		memcpy(&message[msize], p3sess->keymgmt.cnewkey->key,
 			   p3sess->keymgmt.cnewkey->size);
@@ -460,15 +533,6 @@ int parse_ctl_message(p3ctlmsg *ctlmsg, p3session *p3sess)
 	int didx, cidx;
 	unsigned int pktidx;
 	unsigned char *dkey, *ckey;
-int i;
-sprintf(p3buf, "Control message %d:\n", ctlmsg->message[4]);
-for (i=0; i < ctlmsg->len; i++) {
-	if (!(i & 0x3))
-		sprintf(p3buf, "%s ", p3buf);
-	sprintf(p3buf, "%s%2.2x", p3buf, ctlmsg->message[i]);
-}
-sprintf(p3buf, "%s\n", p3buf);
-p3errmsg(p3MSG_DEBUG, p3buf);
 
 	// Get the command
 	cmd = (unsigned int) ctlmsg->message[4];
@@ -487,14 +551,10 @@ p3errmsg(p3MSG_DEBUG, p3buf);
 			dsize |= (unsigned int) ctlmsg->message[7];
 			dsize <<= 8;
 			dsize |= (unsigned int) ctlmsg->message[8];
-			if ((cflag & p3CMSG_KTYPE) == p3KTYPE_AES128) {
-				ksize = 128 >> 3;
-			} else if ((cflag & p3CMSG_KTYPE) == p3KTYPE_AES256) {
-				ksize = 256 >> 3;
-			} else {
+			if ((ksize = set_key_type(cflag & p3CMSG_KTYPE, p3sess)) < 0)
 				break;
-			}
-			stat = set_key_array(&(ctlmsg->message[9]), ksize, dsize, p3sess);
+			stat = set_key_array(&(ctlmsg->message[9]), ksize, dsize,
+					ctlmsg->len, p3sess);
 			break;
 #endif
 
@@ -523,14 +583,9 @@ p3errmsg(p3MSG_DEBUG, p3buf);
 				didx <<= 8;
 				didx |= (unsigned int) ctlmsg->message[7];
 				idx = 8;
-			} else if ((cflag & p3CMSG_KTYPE) == p3KTYPE_AES128) {
+			} else if ((didx = set_key_type(cflag & p3CMSG_KTYPE, p3sess)) > 0) {
 				dkey = &ctlmsg->message[6];
-				didx = p3KSIZE_AES128;
-				idx = 6 + p3KSIZE_AES128;
-			} else if ((cflag & p3CMSG_KTYPE) == p3KTYPE_AES256) {
-				dkey = &ctlmsg->message[6];
-				didx = p3KSIZE_AES256;
-				idx = 6 + p3KSIZE_AES256;
+				idx = 6 + didx;
 			} else {
 				stat = -1;
 				goto out;
@@ -542,12 +597,8 @@ p3errmsg(p3MSG_DEBUG, p3buf);
 				cidx = (unsigned int) ctlmsg->message[idx++];
 				cidx <<= 8;
 				cidx |= (unsigned int) ctlmsg->message[idx];
-			} else if ((cflag & p3CMSG_KTYPE) == p3KTYPE_AES128) {
-				ckey = &ctlmsg->message[idx];
-				cidx = p3KSIZE_AES128;
-			} else if ((cflag & p3CMSG_KTYPE) == p3KTYPE_AES256) {
+			} else if ((cidx = set_key_type(cflag & p3CMSG_KTYPE, p3sess)) > 0) {
 				ckey = &ctlmsg->message[idx];
-				cidx = p3KSIZE_AES256;
 			} else {
 				stat = -1;
 				goto out;
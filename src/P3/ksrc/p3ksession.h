@@ -79,7 +79,8 @@ extern int rekey_test_pri(unsigned char *message, int size, p3session *p3sess);
 extern void heartbeat_answer(unsigned int time, unsigned int seqnum, p3session *p3sess);
 
 extern int sec_session_manager(void);
-extern int set_key_array(unsigned char *message, int ksize, int dsize, p3session *p3sess);
+extern int set_key_array(unsigned char *message, int ksize, int dsize,
+		int mlen, p3session *p3sess);
 extern int replace_key(unsigned char *dkey, int dindex, unsigned char *ckey, int cindex, p3session *p3sess);
 extern void rekey_session(int flag, unsigned int key_num, p3session *p3sess);
 extern int rekey_test_sec(unsigned char *message, int size, p3session *p3sess);
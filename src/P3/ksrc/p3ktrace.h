@@ -0,0 +1,399 @@
+/**
+ * \file p3ktrace.h
+ * <h3>Protected Point to Point kernel trace events header file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * The P3 trace events replace debugging messages in the packet path.
+ * A trace event costs only a test of the event state when it is not
+ * enabled, and packet data is only captured when the event is enabled.
+ * Events are enabled through the kernel tracing file system, ie.
+ * <pre>
+ *   echo 1 > /sys/kernel/debug/tracing/events/p3/enable
+ * </pre>
+ *
+ * The events are grouped into the debugging categories of p3kbase.h and
+ * are called through the p3trace_<i>category</i> macros, so events for a
+ * category are only compiled when the category is set in p3DEBUG:
+ * <ul>
+ *   <li>p3DEBUG_PRGS: Session lookup, encryption, decryption, keys,
+ *       rekeying and control messages</li>
+ *   <li>p3DEBUG_STRU: Obfuscation block layout and socket buffers</li>
+ *   <li>p3DEBUG_DATA: Packet data</li>
+ * </ul>
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM p3
+
+#if !defined(_p3k_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _p3k_TRACE_H
+
+/*****  INCLUDE FILES *****/
+
+#include <linux/tracepoint.h>
+
+/*****  CONSTANTS  *****/
+
+#define p3TRC_DUMPSZ	96		/**< Maximum packet data captured */
+
+/*****  TRACE EVENTS  *****/
+
+/**
+ * Event:
+ * p3_lookup
+ *
+ * \par Description:
+ * The result of looking up a packet in the P3 host list and route table.
+ */
+
+TRACE_EVENT(p3_lookup,
+	TP_PROTO(const unsigned char *packet, unsigned int flag, const void *net),
+	TP_ARGS(packet, flag, net),
+	TP_STRUCT__entry(
+		__array(unsigned char, saddr, 4)
+		__array(unsigned char, daddr, 4)
+		__field(unsigned int, flag)
+		__field(const void *, net)
+	),
+	TP_fast_assign(
+		memcpy(__entry->saddr, &packet[12], 4);
+		memcpy(__entry->daddr, &packet[16], 4);
+		__entry->flag = flag;
+		__entry->net = net;
+	),
+	TP_printk("src %pI4 dst %pI4 flag %x net %p",
+		__entry->saddr, __entry->daddr, __entry->flag, __entry->net)
+);
+
+/**
+ * Event:
+ * p3_encrypt
+ *
+ * \par Description:
+ * A buffer has been encrypted.
+ */
+
+TRACE_EVENT(p3_encrypt,
+	TP_PROTO(unsigned int id, int size, int key, int stat),
+	TP_ARGS(id, size, key, stat),
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(int, size)
+		__field(int, key)
+		__field(int, stat)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->size = size;
+		__entry->key = key;
+		__entry->stat = stat;
+	),
+	TP_printk("seq %u len %d key %d stat %d",
+		__entry->id, __entry->size, __entry->key, __entry->stat)
+);
+
+/**
+ * Event:
+ * p3_decrypt
+ *
+ * \par Description:
+ * A buffer has been decrypted.
+ */
+
+TRACE_EVENT(p3_decrypt,
+	TP_PROTO(unsigned int id, int size, int key, int stat),
+	TP_ARGS(id, size, key, stat),
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(int, size)
+		__field(int, key)
+		__field(int, stat)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->size = size;
+		__entry->key = key;
+		__entry->stat = stat;
+	),
+	TP_printk("seq %u len %d key %d stat %d",
+		__entry->id, __entry->size, __entry->key, __entry->stat)
+);
+
+/**
+ * Event:
+ * p3_get_key
+ *
+ * \par Description:
+ * Keys have been requested from the key server circular buffer.  The
+ * head and tail are the counts before the keys were taken.
+ */
+
+TRACE_EVENT(p3_get_key,
+	TP_PROTO(unsigned int head, unsigned int tail, int count, int stat),
+	TP_ARGS(head, tail, count, stat),
+	TP_STRUCT__entry(
+		__field(unsigned int, head)
+		__field(unsigned int, tail)
+		__field(int, count)
+		__field(int, stat)
+	),
+	TP_fast_assign(
+		__entry->head = head;
+		__entry->tail = tail;
+		__entry->count = count;
+		__entry->stat = stat;
+	),
+	TP_printk("head %u tail %u count %d stat %d",
+		__entry->head, __entry->tail, __entry->count, __entry->stat)
+);
+
+/**
+ * Event:
+ * p3_rekey
+ *
+ * \par Description:
+ * A new key epoch of a session has been published.  Key data is
+ * never recorded.
+ */
+
+TRACE_EVENT(p3_rekey,
+	TP_PROTO(const void *keys, const void *epoch0, const void *epoch1, int stat),
+	TP_ARGS(keys, epoch0, epoch1, stat),
+	TP_STRUCT__entry(
+		__field(const void *, keys)
+		__field(const void *, epoch0)
+		__field(const void *, epoch1)
+		__field(int, stat)
+	),
+	TP_fast_assign(
+		__entry->keys = keys;
+		__entry->epoch0 = epoch0;
+		__entry->epoch1 = epoch1;
+		__entry->stat = stat;
+	),
+	TP_printk("keys %p epoch0 %p epoch1 %p stat %d",
+		__entry->keys, __entry->epoch0, __entry->epoch1, __entry->stat)
+);
+
+/**
+ * Event:
+ * p3_control
+ *
+ * \par Description:
+ * A control message has been sent to or received from a remote P3 host.
+ * Control message data is never recorded.
+ */
+
+TRACE_EVENT(p3_control,
+	TP_PROTO(int send, unsigned int id, int cmd, int len),
+	TP_ARGS(send, id, cmd, len),
+	TP_STRUCT__entry(
+		__field(int, send)
+		__field(unsigned int, id)
+		__field(int, cmd)
+		__field(int, len)
+	),
+	TP_fast_assign(
+		__entry->send = send;
+		__entry->id = id;
+		__entry->cmd = cmd;
+		__entry->len = len;
+	),
+	TP_printk("%s seq %u cmd %d len %d",
+		__entry->send ? "send" : "recv", __entry->id, __entry->cmd,
+		__entry->len)
+);
+
+/**
+ * Event:
+ * p3_path
+ *
+ * \par Description:
+ * A step of the packet path that is not otherwise traced, usually the
+ * reason a packet was dropped.  The function and note are constant
+ * strings naming the step.
+ */
+
+TRACE_EVENT(p3_path,
+	TP_PROTO(const char *func, const char *note, int stat),
+	TP_ARGS(func, note, stat),
+	TP_STRUCT__entry(
+		__string(func, func)
+		__string(note, note)
+		__field(int, stat)
+	),
+	TP_fast_assign(
+		__assign_str(func, func);
+		__assign_str(note, note);
+		__entry->stat = stat;
+	),
+	TP_printk("%s: %s stat %d", __get_str(func), __get_str(note),
+		__entry->stat)
+);
+
+/**
+ * Event:
+ * p3_obfuscate
+ *
+ * \par Description:
+ * The block layout chosen to obfuscate a packet.
+ */
+
+TRACE_EVENT(p3_obfuscate,
+	TP_PROTO(int blks, int psize, int len, unsigned int usec,
+		const int *bloc, const int *blen),
+	TP_ARGS(blks, psize, len, usec, bloc, blen),
+	TP_STRUCT__entry(
+		__field(int, blks)
+		__field(int, psize)
+		__field(int, len)
+		__field(unsigned int, usec)
+		__array(int, bloc, 8)
+		__array(int, blen, 8)
+	),
+	TP_fast_assign(
+		__entry->blks = blks;
+		__entry->psize = psize;
+		__entry->len = len;
+		__entry->usec = usec;
+		memcpy(__entry->bloc, bloc, sizeof(__entry->bloc));
+		memcpy(__entry->blen, blen, sizeof(__entry->blen));
+	),
+	TP_printk("blks %d pkt %d len %d usec %x loc %d,%d,%d,%d,%d,%d,%d,%d"
+		" blen %d,%d,%d,%d,%d,%d,%d,%d",
+		__entry->blks, __entry->psize, __entry->len, __entry->usec,
+		__entry->bloc[0], __entry->bloc[1], __entry->bloc[2],
+		__entry->bloc[3], __entry->bloc[4], __entry->bloc[5],
+		__entry->bloc[6], __entry->bloc[7],
+		__entry->blen[0], __entry->blen[1], __entry->blen[2],
+		__entry->blen[3], __entry->blen[4], __entry->blen[5],
+		__entry->blen[6], __entry->blen[7])
+);
+
+/**
+ * Event:
+ * p3_deobfuscate
+ *
+ * \par Description:
+ * The block layout found when reassembling an obfuscated packet.
+ */
+
+TRACE_EVENT(p3_deobfuscate,
+	TP_PROTO(int blks, int len, const int *blen),
+	TP_ARGS(blks, len, blen),
+	TP_STRUCT__entry(
+		__field(int, blks)
+		__field(int, len)
+		__array(int, blen, 8)
+	),
+	TP_fast_assign(
+		__entry->blks = blks;
+		__entry->len = len;
+		memcpy(__entry->blen, blen, sizeof(__entry->blen));
+	),
+	TP_printk("blks %d len %d blen %d,%d,%d,%d,%d,%d,%d,%d",
+		__entry->blks, __entry->len,
+		__entry->blen[0], __entry->blen[1], __entry->blen[2],
+		__entry->blen[3], __entry->blen[4], __entry->blen[5],
+		__entry->blen[6], __entry->blen[7])
+);
+
+/**
+ * Event:
+ * p3_skb
+ *
+ * \par Description:
+ * The state of a socket buffer handled by the Linux intercept functions.
+ */
+
+TRACE_EVENT(p3_skb,
+	TP_PROTO(const char *tag, const struct sk_buff *skb),
+	TP_ARGS(tag, skb),
+	TP_STRUCT__entry(
+		__string(tag, tag)
+		__field(const void *, skb)
+		__field(const void *, sk)
+		__field(const void *, dev)
+		__field(unsigned int, len)
+		__field(unsigned int, data_len)
+		__field(unsigned int, mac_len)
+		__field(unsigned int, headroom)
+		__field(unsigned int, tailroom)
+	),
+	TP_fast_assign(
+		__assign_str(tag, tag);
+		__entry->skb = skb;
+		__entry->sk = skb->sk;
+		__entry->dev = skb->dev;
+		__entry->len = skb->len;
+		__entry->data_len = skb->data_len;
+		__entry->mac_len = skb->mac_len;
+		__entry->headroom = skb_headroom(skb);
+		__entry->tailroom = skb_tailroom(skb);
+	),
+	TP_printk("%s skb %p sk %p dev %p len %u dlen %u mlen %u head %u tail %u",
+		__get_str(tag), __entry->skb, __entry->sk, __entry->dev,
+		__entry->len, __entry->data_len, __entry->mac_len,
+		__entry->headroom, __entry->tailroom)
+);
+
+/**
+ * Event:
+ * p3_packet
+ *
+ * \par Description:
+ * The start of a packet, up to p3TRC_DUMPSZ bytes.  The data is only
+ * copied when the event is enabled.
+ */
+
+#if p3LINUXVER < 2638
+/* Packet data is available in the binary trace only */
+TRACE_EVENT(p3_packet,
+	TP_PROTO(const char *tag, const unsigned char *data, int len),
+	TP_ARGS(tag, data, len),
+	TP_STRUCT__entry(
+		__string(tag, tag)
+		__field(int, len)
+		__field(int, dlen)
+		__dynamic_array(unsigned char, data,
+			len < p3TRC_DUMPSZ ? len : p3TRC_DUMPSZ)
+	),
+	TP_fast_assign(
+		__assign_str(tag, tag);
+		__entry->len = len;
+		__entry->dlen = len < p3TRC_DUMPSZ ? len : p3TRC_DUMPSZ;
+		memcpy(__get_dynamic_array(data), data, __entry->dlen);
+	),
+	TP_printk("%s len %d", __get_str(tag), __entry->len)
+);
+#else
+TRACE_EVENT(p3_packet,
+	TP_PROTO(const char *tag, const unsigned char *data, int len),
+	TP_ARGS(tag, data, len),
+	TP_STRUCT__entry(
+		__string(tag, tag)
+		__field(int, len)
+		__field(int, dlen)
+		__dynamic_array(unsigned char, data,
+			len < p3TRC_DUMPSZ ? len : p3TRC_DUMPSZ)
+	),
+	TP_fast_assign(
+		__assign_str(tag, tag);
+		__entry->len = len;
+		__entry->dlen = len < p3TRC_DUMPSZ ? len : p3TRC_DUMPSZ;
+		memcpy(__get_dynamic_array(data), data, __entry->dlen);
+	),
+	TP_printk("%s len %d: %s", __get_str(tag), __entry->len,
+		__print_hex(__get_dynamic_array(data), __entry->dlen))
+);
+#endif
+
+#endif /* _p3k_TRACE_H */
+
+/* This part must be outside the header guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE p3ktrace
+#include <trace/define_trace.h>
@@ -30,13 +30,63 @@
 #include "p3ksecondary.h"
 #endif
 
+#define CREATE_TRACE_POINTS
+#include "p3ktrace.h"
+
 static unsigned char *ramdisk;
 static size_t ramdisk_size = RAMDISK_SZ;
+static int ramdisk_order = 0;
 static unsigned int count = 1;  /* number of dev_t needed */
 static dev_t ramdisk_region;
 static struct device *ramdisk_device = NULL;
 static struct cdev *ramdisk_cdev;
 static struct class *ramdisk_class;
+static struct kmem_cache *p3work_cache = NULL;
+static DEFINE_PER_CPU(p3pool, p3work_pool);
+static DEFINE_PER_CPU(p3gso, p3gso_stat);
+
+static int p3zerocopy = 1;
+module_param(p3zerocopy, int, 0644);
+MODULE_PARM_DESC(p3zerocopy, "Encrypt and decrypt packets in the socket buffer (1 = on)");
+
+static int p3parallel = 0;
+module_param(p3parallel, int, 0644);
+MODULE_PARM_DESC(p3parallel, "Encrypt and decrypt packets on all CPUs (1 = on)");
+
+char *p3crypto = "mocana";
+module_param(p3crypto, charp, 0444);
+MODULE_PARM_DESC(p3crypto, "Crypto provider (mocana, kernel or auto for the fastest)");
+
+int p3key_low = 32;
+module_param(p3key_low, int, 0644);
+MODULE_PARM_DESC(p3key_low, "Keys left in the key server buffer that wake the key server");
+
+static int p3ramdisk_kb = RAMDISK_SZ >> 10;
+module_param(p3ramdisk_kb, int, 0444);
+MODULE_PARM_DESC(p3ramdisk_kb, "Size of the key server buffer in KB (4096 most on x86)");
+
+int p3key_rings = 1;
+module_param(p3key_rings, int, 0444);
+MODULE_PARM_DESC(p3key_rings, "Key server rings that the sessions are spread over");
+
+// Key server processes waiting in poll for the keys to run low, and the
+// count of wakes, so each wake is reported once to each open file
+static DECLARE_WAIT_QUEUE_HEAD(p3key_wait);
+static atomic_t p3key_events = ATOMIC_INIT(0);
+
+#ifndef _p3_SECONDARY
+// Key epoch thread, woken when a session uses its prepared epoch
+#define p3PREP_WAIT		HZ		/* Jiffies between checks of the sessions */
+static struct task_struct *p3prep_task = NULL;
+static DECLARE_WAIT_QUEUE_HEAD(p3prep_wait);
+static int p3prep_kick = 0;
+#endif
+
+// Parallel crypto workers, each session has its own reorder queue
+static struct workqueue_struct *p3par_wq = NULL;
+static int p3par_cpu = -1;
+static atomic_t p3par_pend = ATOMIC_INIT(0);
+static atomic_long_t p3par_jobs = ATOMIC_LONG_INIT(0);
 
 /**
  * \par Function:
@@ -93,6 +143,38 @@ void p3errmsg(int type, char *message)
 	}
 }
 
+/**
+ * \par Function:
+ * p3pkterr
+ *
+ * \par Description:
+ * Handle error messages from the packet path.  The message is formatted
+ * in a local buffer, since the packet path runs on all CPUs at once, and
+ * is rate limited so that a failing network cannot flood the log.
+ * Messages that are only useful for debugging are trace events instead.
+ *
+ * \par Inputs:
+ * - type: The type of the message
+ * - format: The printf format of the message
+ * - ...: The format arguments
+ *
+ * \par Outputs:
+ * - None
+ */
+
+void p3pkterr(int type, const char *format, ...)
+{
+	char buf[128];
+	va_list args;
+
+	if (!net_ratelimit())
+		return;
+	va_start(args, format);
+	vsnprintf(buf, sizeof(buf), format, args);
+	va_end(args);
+	p3errmsg(type, buf);
+} /* end p3pkterr */
+
 /**
  * \par Function:
  * p3ramdisk_open
@@ -100,6 +182,8 @@ void p3errmsg(int type, char *message)
  * \par Description:
  * The handler for opening the RAM disk being used for mmap functions.  This
  * is called by the kernel when the user space application opens the device.
+ * The file keeps the last key wake reported by poll, which is set so the
+ * first poll reports keys that are already low.
  *
  * \par Inputs:
  * - inode: The inode of the RAM disk.
@@ -113,6 +197,8 @@ void p3errmsg(int type, char *message)
 static inline int p3ramdisk_open (struct inode *inode, struct file *file)
 {
 p3errmsg(p3MSG_DEBUG, "Open RAM disk\n");
+	file->private_data = (void *) (unsigned long)
+			(unsigned int) (atomic_read(&p3key_events) - 1);
 	return 0;
 }
 /**
@@ -396,7 +482,106 @@ static int p3mmap (struct file *file, struct vm_area_struct *vma)
 
 /**
  * \par Function:
- * p3pkt_intercept
+ * p3ramdisk_poll
+ *
+ * \par Description:
+ * Handle a poll or select on the P3 RAM disk.  The RAM disk is readable
+ * when the key server should add keys to the circular buffer, so the
+ * key server can wait for the keys to run low instead of checking the
+ * buffer on a timer.
+ *
+ * Readiness is reported once for each wake by p3key_wake, which happens
+ * when the keys drop below the low watermark or are taken while below
+ * it.  Keys that stay low without being used do not make the RAM disk
+ * readable again, so a select loop does not spin while the key server
+ * refills the buffer.
+ *
+ * \par Inputs:
+ * - file: The file structure for the RAM disk.
+ * - wait: The poll table of the caller.
+ *
+ * \par Outputs:
+ * - unsigned int: The poll events, POLLIN if the keys are low
+ */
+
+static unsigned int p3ramdisk_poll (struct file *file, poll_table *wait)
+{
+	unsigned int mask = 0;
+#ifdef _p3_PRIMARY
+	unsigned int events = (unsigned int) atomic_read(&p3key_events);
+#endif
+
+	poll_wait(file, &p3key_wait, wait);
+#ifdef _p3_PRIMARY
+	if (events != (unsigned int) (unsigned long) file->private_data &&
+			primain != NULL && p3_key_low(&primain->key_mgr)) {
+		file->private_data = (void *) (unsigned long) events;
+		mask |= POLLIN | POLLRDNORM;
+	}
+#endif
+	return mask;
+}
+
+/**
+ * \par Function:
+ * p3key_wake
+ *
+ * \par Description:
+ * Wake the key server processes waiting in poll.  This is called when
+ * the keys in the circular buffer are low, and may be called in
+ * interrupt context.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - None
+ */
+
+void p3key_wake(void)
+{
+	atomic_inc(&p3key_events);
+	wake_up_interruptible(&p3key_wait);
+} /* end p3key_wake */
+
+/**
+ * \par Function:
+ * p3skb_inplace
+ *
+ * \par Description:
+ * Complete the socket buffer for a packet that was encrypted or decrypted
+ * in place by the packet handler.  For an encrypted packet, the P3 header
+ * is already at the start of the buffer.  For a decrypted packet, the P3
+ * header is removed and the buffer is trimmed to the original packet.
+ *
+ * \par Inputs:
+ * - skb: Socket buffer structure.
+ * - pkt: The packet structure returned by the packet handler.
+ * - stat: The status returned by the packet handler.
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3skb_inplace(struct sk_buff *skb, p3packet *pkt, int stat)
+{
+	int i;
+
+	if (stat & p3PKTS_RMVHDR) {
+		skb_pull(skb, pkt->packet - skb->data);
+		skb_trim(skb, pkt->flag & p3PKT_SIZE);
+	}
+	skb_reset_network_header(skb);
+	// TODO: Add support for IPv6 in Linux intercept handler
+	i = (skb->data[0] & 0xf) << 2;
+	skb_set_transport_header(skb, i);
+	// Any checksum state of the original buffer is no longer valid
+	skb->ip_summed = CHECKSUM_NONE;
+} /* end p3skb_inplace */
+
+/**
+ * \par Function:
+ * p3pkt_handle
  *
  * \par Description:
  * Handle a packet being sent from a user space application.  This
@@ -408,124 +593,139 @@ static int p3mmap (struct file *file, struct vm_area_struct *vma)
  * unsigned character array.  Therefore, this function must determine how
  * to provide that for the specific operating system being used.
  *
- * The return values are described in the packet_handler function and
- * are handled appropriately for the operating system.
+ * A modified packet is not sent here.  The function that sends it is
+ * returned, so that packets handled in parallel can be sent in order.
+ *
+ * The segments of a GSO packet use the lookup of the original packet,
+ * and their data can be left for the caller to encrypt together.
  *
  * \par Inputs:
- * - hknum: Hook number.
- * - skb: Socket buffer structure.
+ * - skbp: Socket buffer structure pointer, which is replaced if the
+ *   packet needs a larger buffer.
  * - okfn: The function to be called to complete packet handling
+ * - sendfn: Set to the function that sends the modified packet or NULL
+ * - seq: The session sequence number reserved for the packet or 0
+ * - look: The lookup results of the original packet or NULL
+ * - batch: If not NULL, the encryption of the data may be left to the
+ *   caller.  The key fields are then set, else keys is set to NULL.
  *
  * \par Outputs:
  * - int: Kernel stack instruction:
  *   - NF_ACCEPT: Process the packet normally.
  *   - NF_DROP: Drop the packet.
  *   - NF_STOLEN: The packet will be handled by this function.
- *   - NF_QUEUE: Queue packet for userspace.
- *   - NF_REPEAT: Call this hook function again.
  */
 
 static unsigned int
-p3pkt_intercept(unsigned int hknum, struct sk_buff *skb,
-			const struct net_device *in, const struct net_device *out,
-			int (*okfn)(struct sk_buff *))
+p3pkt_handle(struct sk_buff **skbp, int (*okfn)(struct sk_buff *),
+			int (**sendfn)(struct sk_buff *), unsigned int seq,
+			const p3packet *look, p3batch *batch)
 {
 	int i, stat, hd, tl;
+	struct sk_buff *skb = *skbp;
 	const struct iphdr *iph = ip_hdr(skb);
 	struct sk_buff *skb2;
 	p3packet pkt;
 	p3netdata *netdata;
 
-
+	*sendfn = NULL;
 	memset(&pkt, 0, sizeof(p3packet));
 	pkt.packet = (unsigned char *)iph;
 	pkt.flag = skb->len;
+	pkt.seq = seq;
+	if (look != NULL) {
+		pkt.net = look->net;
+		pkt.host = look->host;
+		pkt.flag |= (look->flag & ~p3PKT_SIZE) | p3PKT_LOOKUP;
+	}
+	if (batch != NULL) {
+		batch->keys = NULL;
+		pkt.flag |= p3PKT_DEFER;
+	}
 
 	if ((stat = packet_handler(&pkt, (void *) skb)) < 0) {
-p3errmsg(p3MSG_DEBUG, "Kernel intercept: packet error\n");
+		p3trace_prgs(path, __func__, "Packet error", stat);
 		return NF_DROP;
 	// Control packet handled by P3 processing
 	} else if (stat & p3PKTS_RAWSOCK) {
-p3errmsg(p3MSG_DEBUG, "Kernel intercept: set Raw socket\n");
+		p3trace_prgs(path, __func__, "Set raw socket", stat);
 		if (pkt.work != NULL)
-			p3free(pkt.work);
+			p3work_free(pkt.work);
 		kfree_skb(skb);
 		netdata = (p3netdata *) pkt.net->netdata;
 		netdata->okfn = okfn;
 		return NF_STOLEN;
 	// Packet generated by P3 not returned to stack
 	} else if (stat & p3PKTS_CONTROL) {
-p3errmsg(p3MSG_DEBUG, "Kernel intercept: drop P3 control packet\n");
+		p3trace_prgs(path, __func__, "Drop P3 control packet", stat);
 		if (pkt.work != NULL)
-			p3free(pkt.work);
+			p3work_free(pkt.work);
 		return NF_DROP;
 	// Intercepted packet
 	} else if (stat & (p3PKTS_ADDHDR | p3PKTS_RMVHDR)) {
-p3errmsg(p3MSG_DEBUG, "Kernel intercept: handle P3 data packet\n");
-sprintf(p3buf, "SKB: %p, SK %p, DST %x, DEV %p\n",
-	skb, skb->sk, skb->p3SKB_DST, skb->dev);
-p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  ML %d, DL %d, PL %d, Pr %d, Sz %d, Us %d\n",
-	skb->mac_len, skb->data_len, skb->len,
-	skb->protocol, skb->truesize, skb->users);
-p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  DT %p, MH %p, NH %p, TH %p\n",
-	skb->data, skb->p3SKB_MACHDR, skb->p3SKB_NETHDR, skb->p3SKB_TRANSHDR);
-p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  HD %p, Tail %p, End %p\n", skb->head, skb->tail, skb->end);
-p3errmsg(p3MSG_DEBUG, p3buf);
+		p3trace_stru(skb, "Intercept", skb);
+		// The data after the P3 header is encrypted by the caller
+		if ((pkt.flag & p3PKT_DEFER) && (stat & p3PKTS_ADDHDR)) {
+			batch->id = pkt.seq;
+			batch->key = p3DATENC1;
+			batch->keys = &pkt.net->host->session->keymgmt;
+		}
 		if (pkt.packet == NULL) {
 			if (pkt.work != NULL)
-				p3free(pkt.work);
-			sprintf(p3buf, "%s: Modified packet is NULL\n", P3APP);
-			p3errmsg(p3MSG_DEBUG, p3buf);
+				p3work_free(pkt.work);
+			p3trace_prgs(path, __func__, "Modified packet is NULL", stat);
 			return NF_DROP;
 		}
-		if (stat & p3PKTS_ADDHDR) {
-			i = (pkt.flag & p3PKT_SIZE) - skb->len;
-			if (i > 0) {
-				hd = skb_headroom(skb);
-				tl = skb_tailroom(skb) + i;
-				if ((skb2 = skb_copy_expand(skb, hd, tl, GFP_ATOMIC))
-						== NULL) {
-					sprintf(p3buf, "%s: Modified packet is too large\n", P3APP);
-					p3errmsg(p3MSG_DEBUG, p3buf);
-					if (pkt.work != NULL)
-						p3free(pkt.work);
-					return NF_DROP;
-				}
-				stat |= p3PKTS_NEW;
-				skb2->sk = skb->sk;
+		// Packet was handled in place in the socket buffer
+		if (pkt.flag & p3PKT_INPLACE) {
+			p3skb_inplace(skb, &pkt, stat);
+		} else {
+			if (stat & p3PKTS_ADDHDR) {
+				i = (pkt.flag & p3PKT_SIZE) - skb->len;
+				if (i > 0) {
+					hd = skb_headroom(skb);
+					tl = skb_tailroom(skb) + i;
+					if ((skb2 = skb_copy_expand(skb, hd, tl, GFP_ATOMIC))
+							== NULL) {
+						p3trace_prgs(path, __func__, "Modified packet is too large",
+								stat);
+						if (pkt.work != NULL)
+							p3work_free(pkt.work);
+						return NF_DROP;
+					}
+					stat |= p3PKTS_NEW;
+					skb2->sk = skb->sk;
 #if p3LINUXVER >= 2624
-				skb2->hdr_len = skb->hdr_len;
+					skb2->hdr_len = skb->hdr_len;
 #endif
-				kfree_skb(skb);
-				skb = skb2;
-				skb->ip_summed = CHECKSUM_NONE;
+					kfree_skb(skb);
+					skb = skb2;
+					*skbp = skb;
+					skb->ip_summed = CHECKSUM_NONE;
+				}
 			}
-		}
-		// Copy new packet data
-		skb->len = pkt.flag & p3PKT_SIZE;
-		memcpy(skb->data, pkt.packet, skb->len);
-		skb_set_tail_pointer(skb, skb->len);
+			// Copy new packet data
+			skb->len = pkt.flag & p3PKT_SIZE;
+			memcpy(skb->data, pkt.packet, skb->len);
+			skb_set_tail_pointer(skb, skb->len);
 #if p3LINUXVER >= 2624
-		if (skb->hdr_len) {
-			skb->hdr_len = skb_headroom(skb) + skb->len;
-		}
+			if (skb->hdr_len) {
+				skb->hdr_len = skb_headroom(skb) + skb->len;
+			}
 #endif
-		// TODO: Add support for IPv6 in Linux intercept handler
-		i = (skb->data[0] & 0xf) << 2;
-		skb_set_transport_header(skb, i);
+			// TODO: Add support for IPv6 in Linux intercept handler
+			i = (skb->data[0] & 0xf) << 2;
+			skb_set_transport_header(skb, i);
+		}
 		// TODO: Handle checksum better
 		if (stat & p3PKTS_CHKSUM)
 			skb->ip_summed = CHECKSUM_UNNECESSARY;
 		if (pkt.work != NULL)
-			p3free(pkt.work);
+			p3work_free(pkt.work);
 		if (pkt.flag & p3PKT_DSSUB) {
 			if (p3net_utils(p3SET_FORWARD, (void *)skb, (void *)&pkt) < 0) {
-				sprintf(p3buf, "%s: System network utility failed: %d\n",
+				p3pkterr(p3MSG_ERR, "%s: System network utility failed: %d\n",
 						P3APP, p3SET_FORWARD);
-				p3errmsg(p3MSG_ERR, p3buf);
 				return NF_DROP;
 			}
 		}
@@ -540,213 +740,136 @@ p3errmsg(p3MSG_DEBUG, p3buf);
 		}
 		if (skb->dev == NULL)
 			skb->dev = netdata->p3ndev;
-sprintf(p3buf, "New SKB: %p, SK %p, DST %x\n",
-	skb, skb->sk, skb->p3SKB_DST);
-p3errmsg(p3MSG_DEBUG, p3buf);
-if (skb->dev) {
-  sprintf(p3buf, "  Dev %p Name %s\n", skb->dev, skb->dev->name);
-  p3errmsg(p3MSG_DEBUG, p3buf);
-} else {
-  p3errmsg(p3MSG_DEBUG, "Dev NULL\n");
-}
-sprintf(p3buf, "  ML %d, DL %d, PL %d, Pr %d, Sz %d, Us %d\n",
-	skb->mac_len, skb->data_len, skb->len,
-	skb->protocol, skb->truesize, skb->users);
-p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  DT %p, MH %p, NH %p, TH %p\n",
-	skb->data, skb->p3SKB_MACHDR, skb->p3SKB_NETHDR, skb->p3SKB_TRANSHDR);
-p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  HD %p, Tail %p, End %p\n", skb->head, skb->tail, skb->end);
-p3errmsg(p3MSG_DEBUG, p3buf);
+		p3trace_stru(skb, "New", skb);
 		// Packet from local host
 		if ((stat & p3PKTS_NEW) && skb->sk != NULL)
 			skb_set_owner_w(skb, skb->sk);
 		// Forward packet to stack
 		if (pkt.flag & p3PKT_DSSUB) {
-p3errmsg(p3MSG_DEBUG, "Dest is subnet\n");
+			p3trace_prgs(path, __func__, "Destination is subnet", stat);
 			if (skb->sk == NULL)
 				skb->sk = netdata->p3sk;
 			// Get correct destination
 			if (p3ROUTE_HARDER(skb) != 0) {
-p3errmsg(p3MSG_DEBUG, "Error in route lookup\n");
+				p3trace_prgs(path, __func__, "Error in route lookup", stat);
 				return NF_DROP;
 			}
-if (skb->p3SKB_DST) {
-  sprintf(p3buf, "New Dst %p Dev %p Name %s\n",
-	p3SKB_DST_GET(skb), p3SKB_DST_GET(skb)->dev, p3SKB_DST_GET(skb)->dev->name);
-  p3errmsg(p3MSG_DEBUG, p3buf);
-}
-			if (netdata->okfn(skb)) {
-				sprintf(p3buf, "%s: Failed to queue forwarded data packet\n",
-						P3APP);
-				p3errmsg(p3MSG_DEBUG, p3buf);
-			}
-sprintf(p3buf, "Exit local forwarded packet intercept (%p)\n", netdata->okfn);
-p3errmsg(p3MSG_DEBUG, p3buf);
+			p3trace_stru(skb, "Routed", skb);
+			*sendfn = netdata->okfn;
 			return NF_STOLEN;
-		} else if (okfn(skb)) {
-			sprintf(p3buf, "%s: Failed to queue data packet\n", P3APP);
-			p3errmsg(p3MSG_DEBUG, p3buf);
-// Freed in okfn???		return NF_DROP;
 		}
-sprintf(p3buf, "Exit packet intercept (%p)\n", skb);
-p3errmsg(p3MSG_DEBUG, p3buf);
+		*sendfn = okfn;
 		return NF_STOLEN;
 	}
 	return NF_ACCEPT;
-} /* end p3pkt_intercept */
-
-/**
- * \par Function:
- * p3pkt_intercept_local
- *
- * \par Description:
- * Receive a packet captured for the kernel hook, NF_INET_LOCAL_OUT.
- *
- * \par Inputs:
- * - hknum: Hook number.
- * - SKBP: Socket buffer structure.
- * - in: Input network device.
- * - out: Output network device.
- * - okfn: The function to be called to complete packet handling
- *
- * \par Outputs:
- * - int: Return value from common packet handler, p3pkt_intr.
- */
-
-static unsigned int
-p3pkt_intercept_local(unsigned int hknum, struct sk_buff *SKBP,
-			const struct net_device *in, const struct net_device *out,
-			int (*okfn)(struct sk_buff *))
-{
-	return p3pkt_intercept(hknum, SKBP, in, out, okfn);
-}
-
-/**
- * \par Function:
- * p3pkt_intercept_pre
- *
- * \par Description:
- * Receive a packet captured for the kernel hook, NF_INET_PRE_ROUTING.
- *
- * \par Inputs:
- * - hknum: Hook number.
- * - SKBP: Socket buffer structure.
- * - in: Input network device.
- * - out: Output network device.
- * - okfn: The function to be called to complete packet handling
- *
- * \par Outputs:
- * - int: Return value from common packet handler, p3pkt_intr.
- */
-
-static unsigned int
-p3pkt_intercept_pre(unsigned int hknum, struct sk_buff *SKBP,
-			const struct net_device *in, const struct net_device *out,
-			int (*okfn)(struct sk_buff *))
-{
-	return p3pkt_intercept(hknum, SKBP, in, out, okfn);
-}
+} /* end p3pkt_handle */
 
 /**
  * \par Function:
- * p3pkt_intercept_forward
+ * p3pkt_forward
  *
  * \par Description:
- * Receive a packet captured for the kernel hook, NF_INET_PRE_ROUTING.
+ * Handle a packet being forwarded from the local subnet.  The packet is
+ * processed as in p3pkt_handle, but an encrypted packet is always
+ * routed again to reach the remote P3 host.
  *
  * \par Inputs:
- * - hknum: Hook number.
- * - SKBP: Socket buffer structure.
- * - in: Input network device.
- * - out: Output network device.
+ * - skbp: Socket buffer structure pointer, which is replaced if the
+ *   packet needs a larger buffer.
  * - okfn: The function to be called to complete packet handling
+ * - sendfn: Set to the function that sends the modified packet or NULL
+ * - seq: The session sequence number reserved for the packet or 0
+ * - look: The lookup results of the packet or NULL
  *
  * \par Outputs:
- * - int: Return value from common packet handler, p3pkt_intr.
+ * - int: Kernel stack instruction:
+ *   - NF_ACCEPT: Process the packet normally.
+ *   - NF_DROP: Drop the packet.
+ *   - NF_STOLEN: The packet will be handled by this function.
  */
 
 static unsigned int
-p3pkt_intercept_forward(unsigned int hknum, struct sk_buff *SKBP,
-			const struct net_device *in, const struct net_device *out,
-			int (*okfn)(struct sk_buff *))
+p3pkt_forward(struct sk_buff **skbp, int (*okfn)(struct sk_buff *),
+			int (**sendfn)(struct sk_buff *), unsigned int seq,
+			const p3packet *look)
 {
 	int i, stat, hd, tl;
+	struct sk_buff *SKBP = *skbp;
 	const struct iphdr *iph = ip_hdr(SKBP);
 	struct sk_buff *skb2;
 	p3packet pkt;
 	p3netdata *netdata;
 
+	*sendfn = NULL;
 	memset(&pkt, 0, sizeof(p3packet));
 	pkt.packet = (unsigned char *)iph;
 	// Forward flag is XOR'ed in host lookup
 	// Setting it here allows packet handler to do encryption
 	pkt.flag = SKBP->len | p3PKT_SRSUB;
+	pkt.seq = seq;
+	if (look != NULL) {
+		pkt.net = look->net;
+		pkt.host = look->host;
+		pkt.flag = SKBP->len | (look->flag & ~p3PKT_SIZE) | p3PKT_LOOKUP;
+	}
 	if ((stat = packet_handler(&pkt, (void *) SKBP)) < 0) {
-p3errmsg(p3MSG_DEBUG, "Kernel intercept: forwarded packet error\n");
+		p3trace_prgs(path, __func__, "Packet error", stat);
 		return NF_DROP;
 	// Control packet handled by P3 processing
 	} else if (stat & (p3PKTS_ADDHDR | p3PKTS_RMVHDR)) {
-p3errmsg(p3MSG_DEBUG, "Kernel intercept: handle forwarded P3 data packet\n");
-sprintf(p3buf, "SKB: %p, SK %p, DST %x, DEV %p\n",
-	SKBP, SKBP->sk, SKBP->p3SKB_DST, SKBP->dev);
-p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  ML %d, DL %d, PL %d, Pr %d, Sz %d, Us %d\n",
-	SKBP->mac_len, SKBP->data_len, SKBP->len,
-	SKBP->protocol, SKBP->truesize, SKBP->users);
-p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  DT %p, MH %p, NH %p, TH %p\n",
-	SKBP->data, SKBP->p3SKB_MACHDR, SKBP->p3SKB_NETHDR, SKBP->p3SKB_TRANSHDR);
-p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  HD %p, Tail %p, End %p\n", SKBP->head, SKBP->tail, SKBP->end);
-p3errmsg(p3MSG_DEBUG, p3buf);
+		p3trace_stru(skb, "Intercept", SKBP);
 		if (pkt.packet == NULL) {
 			if (pkt.work != NULL)
-				p3free(pkt.work);
-			sprintf(p3buf, "%s: Modified packet is NULL\n", P3APP);
-			p3errmsg(p3MSG_DEBUG, p3buf);
+				p3work_free(pkt.work);
+			p3trace_prgs(path, __func__, "Modified packet is NULL", stat);
 			return NF_DROP;
 		}
-		if (stat & p3PKTS_ADDHDR) {
-			i = (pkt.flag & p3PKT_SIZE) - SKBP->len;
-			if (i > 0) {
-				hd = skb_headroom(SKBP);
-				tl = skb_tailroom(SKBP) + i;
-				if ((skb2 = skb_copy_expand(SKBP, hd, tl, GFP_ATOMIC))
-						== NULL) {
-					sprintf(p3buf, "%s: Modified packet is too large\n", P3APP);
-					p3errmsg(p3MSG_DEBUG, p3buf);
-					if (pkt.work != NULL)
-						p3free(pkt.work);
-					return NF_DROP;
-				}
-				stat |= p3PKTS_NEW;
-				skb2->sk = SKBP->sk;
+		// Packet was handled in place in the socket buffer
+		if (pkt.flag & p3PKT_INPLACE) {
+			p3skb_inplace(SKBP, &pkt, stat);
+		} else {
+			if (stat & p3PKTS_ADDHDR) {
+				i = (pkt.flag & p3PKT_SIZE) - SKBP->len;
+				if (i > 0) {
+					hd = skb_headroom(SKBP);
+					tl = skb_tailroom(SKBP) + i;
+					if ((skb2 = skb_copy_expand(SKBP, hd, tl, GFP_ATOMIC))
+							== NULL) {
+						p3trace_prgs(path, __func__, "Modified packet is too large",
+								stat);
+						if (pkt.work != NULL)
+							p3work_free(pkt.work);
+						return NF_DROP;
+					}
+					stat |= p3PKTS_NEW;
+					skb2->sk = SKBP->sk;
 #if p3LINUXVER >= 2624
-				skb2->hdr_len = SKBP->hdr_len;
+					skb2->hdr_len = SKBP->hdr_len;
 #endif
-				kfree_skb(SKBP);
-				SKBP = skb2;
-				SKBP->ip_summed = CHECKSUM_NONE;
+					kfree_skb(SKBP);
+					SKBP = skb2;
+					*skbp = SKBP;
+					SKBP->ip_summed = CHECKSUM_NONE;
+				}
 			}
-		}
-		// Copy new packet data
-		SKBP->len = pkt.flag & p3PKT_SIZE;
-		memcpy(SKBP->data, pkt.packet, SKBP->len);
-		skb_set_tail_pointer(SKBP, SKBP->len);
+			// Copy new packet data
+			SKBP->len = pkt.flag & p3PKT_SIZE;
+			memcpy(SKBP->data, pkt.packet, SKBP->len);
+			skb_set_tail_pointer(SKBP, SKBP->len);
 #if p3LINUXVER >= 2624
-		if (SKBP->hdr_len) {
-			SKBP->hdr_len = skb_headroom(SKBP) + SKBP->len;
-		}
+			if (SKBP->hdr_len) {
+				SKBP->hdr_len = skb_headroom(SKBP) + SKBP->len;
+			}
 #endif
-		// TODO: Add support for IPv6 in Linux intercept handler
-		i = (SKBP->data[0] & 0xf) << 2;
-		skb_set_transport_header(SKBP, i);
+			// TODO: Add support for IPv6 in Linux intercept handler
+			i = (SKBP->data[0] & 0xf) << 2;
+			skb_set_transport_header(SKBP, i);
+		}
 		// TODO: Handle checksum better
 		if (stat & p3PKTS_CHKSUM)
 			SKBP->ip_summed = CHECKSUM_UNNECESSARY;
 		if (pkt.work != NULL)
-			p3free(pkt.work);
+			p3work_free(pkt.work);
 		// Get correct destination
 		netdata = (p3netdata *) pkt.net->netdata;
 		if (SKBP->sk == NULL)
@@ -758,107 +881,548 @@ p3errmsg(p3MSG_DEBUG, p3buf);
 		if (SKBP->dev == NULL)
 			SKBP->dev = netdata->p3ndev;
 		if (p3ROUTE_HARDER(SKBP) != 0) {
-p3errmsg(p3MSG_DEBUG, "Error in route lookup\n");
+			p3trace_prgs(path, __func__, "Error in route lookup", stat);
 			return NF_DROP;
 		}
-sprintf(p3buf, "New SKB: %p, SK %p, DST %x\n",
-	SKBP, SKBP->sk, SKBP->p3SKB_DST);
-p3errmsg(p3MSG_DEBUG, p3buf);
-if (SKBP->dev) {
-  sprintf(p3buf, "  Dev %p Name %s\n", SKBP->dev, SKBP->dev->name);
-  p3errmsg(p3MSG_DEBUG, p3buf);
-} else {
-  p3errmsg(p3MSG_DEBUG, "Dev NULL\n");
-}
-sprintf(p3buf, "  ML %d, DL %d, PL %d, Pr %d, Sz %d, Us %d\n",
-	SKBP->mac_len, SKBP->data_len, SKBP->len,
-	SKBP->protocol, SKBP->truesize, SKBP->users);
-p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  DT %p, MH %p, NH %p, TH %p\n",
-	SKBP->data, SKBP->p3SKB_MACHDR, SKBP->p3SKB_NETHDR, SKBP->p3SKB_TRANSHDR);
-p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  HD %p, Tail %p, End %p\n", SKBP->head, SKBP->tail, SKBP->end);
-p3errmsg(p3MSG_DEBUG, p3buf);
+		p3trace_stru(skb, "New", SKBP);
 		// Packet from local host
 		if ((stat & p3PKTS_NEW) && SKBP->sk != NULL)
 			skb_set_owner_w(SKBP, SKBP->sk);
-		// Forward packet to stack
-		if (okfn(SKBP)) {
-			sprintf(p3buf, "%s: Failed to queue data packet\n", P3APP);
-			p3errmsg(p3MSG_DEBUG, p3buf);
-// Freed in okfn???		return NF_DROP;
-		}
-sprintf(p3buf, "Exit forwarded packet intercept (%p)\n", SKBP);
-p3errmsg(p3MSG_DEBUG, p3buf);
+		*sendfn = okfn;
 		return NF_STOLEN;
 	}
 	return NF_ACCEPT;
-} /* end p3pkt_intercept_forward */
+} /* end p3pkt_forward */
 
 /**
  * \par Function:
- * p3pkt_intercept_final
+ * p3pkt_complete
  *
  * \par Description:
- * Receive a packet captured for the kernel hook, NF_INET_PRE_ROUTING.
+ * Complete a packet that was taken from the stack, using the result of
+ * p3pkt_handle or p3pkt_forward.
  *
  * \par Inputs:
- * - hknum: Hook number.
  * - skb: Socket buffer structure.
- * - in: Input network device.
- * - out: Output network device.
  * - okfn: The function to be called to complete packet handling
+ * - sendfn: The function that sends the modified packet or NULL
+ * - verdict: The kernel stack instruction for the packet
  *
  * \par Outputs:
- * - int: Return value from common packet handler, p3pkt_intr.
+ * - None
  */
 
-static unsigned int
-p3pkt_intercept_final(unsigned int hknum, struct sk_buff *SKBP,
-			const struct net_device *in, const struct net_device *out,
-			int (*okfn)(struct sk_buff *))
+static void p3pkt_complete(struct sk_buff *skb, int (*okfn)(struct sk_buff *),
+			int (*sendfn)(struct sk_buff *), unsigned int verdict)
 {
-//	return p3pkt_intercept(hknum, SKBP, in, out, okfn);
-	return NF_ACCEPT;
-}
+	if (sendfn != NULL) {
+		if (sendfn(skb))
+			p3trace_prgs(path, __func__, "Failed to queue data packet",
+					-1);
+	} else if (verdict == NF_ACCEPT) {
+		okfn(skb);
+	} else if (verdict == NF_DROP) {
+		kfree_skb(skb);
+	}
+} /* end p3pkt_complete */
 
 /**
  * \par Function:
- * p3send_packet
+ * p3parq_init
  *
  * \par Description:
- * Send a packet directly from the P3 kernel module.  The entire
- * packet must have been built except for the IP checksum, which
- * is calculated here.
+ * Initialize the reorder queue of a session.
  *
  * \par Inputs:
- * - p3pkt: The packet structure
+ * - queue: The reorder queue
  *
  * \par Outputs:
- * - int: Return value from common packet handler, p3pkt_intr.
+ * - None
  */
 
-int p3send_packet(void *p3pkt)
+void p3parq_init(p3parq *queue)
 {
-	int len, stat = 0;
-	struct sk_buff *skb;
-	struct iphdr *iph;
-	p3packet *pkt = (p3packet *) p3pkt;
-	p3netdata *netdata = (p3netdata *) pkt->host->net->netdata;
-//	struct kiocb iocb;
-//	init_sync_kiocb(&iocb, NULL);
-#if p3LINUXVER < 2624
-	struct timeval skbts;
-#endif
+	INIT_LIST_HEAD(&queue->jobs);
+	spin_lock_init(&queue->lock);
+	queue->busy = 0;
+	rwlock_init(&queue->ctl);
+} /* end p3parq_init */
 
-	if (netdata == NULL) {
-		stat = -1;
-		goto out;
-	}
+/**
+ * \par Function:
+ * p3par_flush
+ *
+ * \par Description:
+ * Mark a parallel job as handled and send the handled packets at the
+ * head of the reorder queue of its session.  Packets are sent in the
+ * order they were queued, so the session keeps its sequence order.
+ * Only one worker sends the packets of a session at a time.  A worker
+ * that finds another worker sending leaves its packet to that worker.
+ *
+ * \par Inputs:
+ * - job: The handled job
+ *
+ * \par Outputs:
+ * - None
+ */
 
-	if (netdata->p3proto == NULL || netdata->p3ndev == NULL) {
-		stat = -1;
-		goto out;
+static void p3par_flush(p3pjob *job)
+{
+	p3parq *queue = job->queue;
+
+	spin_lock_bh(&queue->lock);
+	job->flag |= p3PJB_DONE;
+	if (queue->busy) {
+		spin_unlock_bh(&queue->lock);
+		return;
+	}
+	queue->busy = 1;
+	while (!list_empty(&queue->jobs)) {
+		job = list_first_entry(&queue->jobs, p3pjob, list);
+		if (!(job->flag & p3PJB_DONE))
+			break;
+		list_del(&job->list);
+		spin_unlock_bh(&queue->lock);
+		atomic_dec(&p3par_pend);
+		p3pkt_complete(job->skb, job->okfn, job->sendfn, job->verdict);
+		kfree(job);
+		spin_lock_bh(&queue->lock);
+	}
+	queue->busy = 0;
+	spin_unlock_bh(&queue->lock);
+} /* end p3par_flush */
+
+/**
+ * \par Function:
+ * p3par_work
+ *
+ * \par Description:
+ * Handle a packet on a parallel crypto worker.  The packet is handled
+ * with bottom halves disabled, as it would be in the netfilter hook,
+ * using the lookup done when it was queued.
+ *
+ * \par Inputs:
+ * - work: The worker queue entry of the job
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3par_work(struct work_struct *work)
+{
+	p3pjob *job = container_of(work, p3pjob, work);
+	p3packet look;
+
+	memset(&look, 0, sizeof(p3packet));
+	look.net = job->net;
+	look.host = job->host;
+	look.flag = job->lflag | p3PKT_PARALLEL;
+	local_bh_disable();
+	rcu_read_lock();
+	read_lock(&job->queue->ctl);
+	if (job->flag & p3PJB_FWD)
+		job->verdict = p3pkt_forward(&job->skb, job->okfn, &job->sendfn,
+				job->seq, &look);
+	else
+		job->verdict = p3pkt_handle(&job->skb, job->okfn, &job->sendfn,
+				job->seq, &look, NULL);
+	read_unlock(&job->queue->ctl);
+	p3par_flush(job);
+	rcu_read_unlock();
+	local_bh_enable();
+} /* end p3par_work */
+
+/**
+ * \par Function:
+ * p3par_submit
+ *
+ * \par Description:
+ * Queue a packet to a parallel crypto worker.  Only packets that are
+ * encrypted or decrypted for an active P3 network are queued, to the
+ * reorder queue of their session.  An encrypted packet gets its session
+ * sequence number here, so the sequence numbers follow the order in
+ * which packets are sent.  Workers are chosen in turn from the online
+ * CPUs.
+ *
+ * \par Inputs:
+ * - skb: Socket buffer structure.
+ * - okfn: The function to be called to complete packet handling
+ * - fwd: 1 if the packet is from the forward hook, else 0
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0 = Packet is queued and taken from the stack
+ *   - <0 = Packet must be handled in the hook
+ */
+
+static int p3par_submit(struct sk_buff *skb, int (*okfn)(struct sk_buff *),
+			int fwd)
+{
+	int cpu;
+	p3packet pkt;
+	p3session *session;
+	p3pjob *job;
+
+	memset(&pkt, 0, sizeof(p3packet));
+	pkt.packet = skb_network_header(skb);
+	pkt.flag = (skb->len & p3PKT_SIZE) | (fwd ? p3PKT_SRSUB : 0);
+	p3_lookup(&pkt);
+	if ((pkt.flag & p3PKT_SRSUB) || pkt.net == NULL ||
+			!(pkt.flag & (p3PKT_P3SRC | p3PKT_P3DST)) ||
+			!(pkt.net->flag & p3NET_ACT))
+		return -1;
+	if (pkt.flag & p3PKT_P3DST)
+		session = pkt.net->host != NULL ? pkt.net->host->session : NULL;
+	else
+		session = pkt.host != NULL ? pkt.host->session : NULL;
+	if (session == NULL)
+		return -1;
+	if ((job = (p3pjob *) kmalloc(sizeof(p3pjob), GFP_ATOMIC)) == NULL)
+		return -1;
+	memset(job, 0, sizeof(p3pjob));
+	if ((pkt.flag & p3PKT_P3DST) && p3_next_seq(session, &job->seq) < 0) {
+		kfree(job);
+		return -1;
+	}
+	job->queue = &session->parq;
+	job->skb = skb;
+	job->okfn = okfn;
+	job->net = pkt.net;
+	job->host = pkt.host;
+	job->lflag = pkt.flag & ~p3PKT_SIZE;
+	if (fwd)
+		job->flag |= p3PJB_FWD;
+	INIT_WORK(&job->work, p3par_work);
+
+	// The sequence numbers of a session are queued in order
+	spin_lock_bh(&job->queue->lock);
+	list_add_tail(&job->list, &job->queue->jobs);
+	spin_unlock_bh(&job->queue->lock);
+	atomic_inc(&p3par_pend);
+	atomic_long_inc(&p3par_jobs);
+	cpu = cpumask_next(ACCESS_ONCE(p3par_cpu), cpu_online_mask);
+	if (cpu >= nr_cpu_ids)
+		cpu = cpumask_first(cpu_online_mask);
+	p3par_cpu = cpu;
+	queue_work_on(cpu, p3par_wq, &job->work);
+	return 0;
+} /* end p3par_submit */
+
+/**
+ * \par Function:
+ * p3pkt_intercept
+ *
+ * \par Description:
+ * Handle a packet being sent from a user space application.  This
+ * is the common function for callbacks from kernel hooks.  When parallel
+ * crypto is enabled, the packet is queued to a crypto worker if possible,
+ * else it is handled and sent here.
+ *
+ * The return values are described in the packet_handler function and
+ * are handled appropriately for the operating system.
+ *
+ * \par Inputs:
+ * - hknum: Hook number.
+ * - skb: Socket buffer structure.
+ * - in: Input network device.
+ * - out: Output network device.
+ * - okfn: The function to be called to complete packet handling
+ *
+ * \par Outputs:
+ * - int: Kernel stack instruction:
+ *   - NF_ACCEPT: Process the packet normally.
+ *   - NF_DROP: Drop the packet.
+ *   - NF_STOLEN: The packet will be handled by this function.
+ *   - NF_QUEUE: Queue packet for userspace.
+ *   - NF_REPEAT: Call this hook function again.
+ */
+
+static unsigned int
+p3pkt_intercept(unsigned int hknum, struct sk_buff *skb,
+			const struct net_device *in, const struct net_device *out,
+			int (*okfn)(struct sk_buff *))
+{
+	unsigned int verdict;
+	int (*sendfn)(struct sk_buff *);
+
+	if (p3parallel && p3par_submit(skb, okfn, 0) == 0)
+		return NF_STOLEN;
+	verdict = p3pkt_handle(&skb, okfn, &sendfn, 0, NULL, NULL);
+	if (sendfn != NULL)
+		p3pkt_complete(skb, okfn, sendfn, verdict);
+	return verdict;
+} /* end p3pkt_intercept */
+
+/**
+ * \par Function:
+ * p3pkt_intercept_gso
+ *
+ * \par Description:
+ * Handle a GSO packet being sent to a P3 network.  A GSO packet is
+ * larger than a P3 packet, so it is split into segments here.  This
+ * lets the stack keep building large packets for tunneled flows instead
+ * of requiring segmentation offload to be turned off.
+ *
+ * The segments use the lookup of the original packet.  Up to
+ * p3GSO_BATCH segments are prepared, then encrypted together and sent
+ * in order.
+ *
+ * The segment size is reduced if necessary so that each encrypted
+ * segment fits the P3 packet size.  A TCP packet shares its data and
+ * GSO information with the clone kept in the socket write queue, so the
+ * data is unshared before the segment size is changed.
+ *
+ * \par Inputs:
+ * - hknum: Hook number.
+ * - skb: Socket buffer structure.
+ * - in: Input network device.
+ * - out: Output network device.
+ * - okfn: The function to be called to complete packet handling
+ * - look: The lookup results of the packet
+ *
+ * \par Outputs:
+ * - int: Kernel stack instruction:
+ *   - NF_DROP: Segmentation failed.
+ *   - NF_STOLEN: The segments have been handled.
+ */
+
+static unsigned int
+p3pkt_intercept_gso(unsigned int hknum, struct sk_buff *skb,
+			const struct net_device *in, const struct net_device *out,
+			int (*okfn)(struct sk_buff *), const p3packet *look)
+{
+	int i, n, nb;
+	struct sk_buff *segs, *next;
+	struct sk_buff *seg[p3GSO_BATCH];
+	int (*sendfn[p3GSO_BATCH])(struct sk_buff *);
+	unsigned int verdict[p3GSO_BATCH];
+	int bidx[p3GSO_BATCH];
+	p3batch batch[p3GSO_BATCH];
+	p3gso *gso = &per_cpu(p3gso_stat, smp_processor_id());
+
+	// TODO: Add support for IPv6 in Linux intercept handler
+	if (skb_shinfo(skb)->gso_size > p3MSS_V4) {
+		if (skb_cloned(skb) && pskb_expand_head(skb, 0, 0, GFP_ATOMIC)) {
+			gso->fail++;
+			return NF_DROP;
+		}
+		skb_shinfo(skb)->gso_size = p3MSS_V4;
+		skb_shinfo(skb)->gso_segs = 0;
+		gso->resize++;
+	}
+	// The protocol is not set until after the local out hook
+	skb->protocol = htons(ETH_P_IP);
+	// Get linear segments with checksums complete
+	segs = skb_gso_segment(skb, 0);
+	if (IS_ERR(segs) || segs == NULL) {
+		gso->fail++;
+		return NF_DROP;
+	}
+	gso->pkts++;
+	// Segments are charged to the sending socket like the original
+	for (next = segs; next != NULL; next = next->next) {
+		if (skb->sk != NULL)
+			skb_set_owner_w(next, skb->sk);
+		gso->segs++;
+	}
+	kfree_skb(skb);
+
+	while (segs != NULL) {
+		// Prepare the segments, leaving the data to be encrypted
+		for (n = 0, nb = 0; n < p3GSO_BATCH && segs != NULL; n++) {
+			next = segs->next;
+			segs->next = NULL;
+			verdict[n] = p3pkt_handle(&segs, okfn, &sendfn[n], 0, look,
+					&batch[nb]);
+			seg[n] = segs;
+			bidx[n] = -1;
+			if (verdict[n] == NF_STOLEN && batch[nb].keys != NULL) {
+				batch[nb].buffer = segs->data + p3SESSION_HDR4;
+				batch[nb].size = segs->len - p3SESSION_HDR4;
+				bidx[n] = nb++;
+			}
+			segs = next;
+		}
+		if (nb) {
+			p3_encrypt_batch(batch, nb);
+			gso->batched += nb;
+		}
+		// Send the segments in order
+		for (i = 0; i < n; i++) {
+			if (bidx[i] >= 0 && batch[bidx[i]].stat < 0) {
+				p3trace_prgs(path, __func__, "Encryption error", -1);
+				kfree_skb(seg[i]);
+				continue;
+			}
+			p3pkt_complete(seg[i], okfn, sendfn[i], verdict[i]);
+		}
+	}
+	return NF_STOLEN;
+} /* end p3pkt_intercept_gso */
+
+/**
+ * \par Function:
+ * p3pkt_intercept_local
+ *
+ * \par Description:
+ * Receive a packet captured for the kernel hook, NF_INET_LOCAL_OUT.
+ * A GSO packet for a P3 network is looked up once here and handled as
+ * segments.
+ *
+ * \par Inputs:
+ * - hknum: Hook number.
+ * - SKBP: Socket buffer structure.
+ * - in: Input network device.
+ * - out: Output network device.
+ * - okfn: The function to be called to complete packet handling
+ *
+ * \par Outputs:
+ * - int: Return value from common packet handler, p3pkt_intr.
+ */
+
+static unsigned int
+p3pkt_intercept_local(unsigned int hknum, struct sk_buff *SKBP,
+			const struct net_device *in, const struct net_device *out,
+			int (*okfn)(struct sk_buff *))
+{
+	p3packet pkt;
+
+	// Segment GSO packets that are sent to a P3 network
+	if (skb_is_gso(SKBP)) {
+		memset(&pkt, 0, sizeof(p3packet));
+		pkt.packet = skb_network_header(SKBP);
+		pkt.flag = SKBP->len & p3PKT_SIZE;
+		p3_lookup(&pkt);
+		if (pkt.flag & p3PKT_P3DST)
+			return p3pkt_intercept_gso(hknum, SKBP, in, out, okfn, &pkt);
+	}
+	return p3pkt_intercept(hknum, SKBP, in, out, okfn);
+}
+
+/**
+ * \par Function:
+ * p3pkt_intercept_pre
+ *
+ * \par Description:
+ * Receive a packet captured for the kernel hook, NF_INET_PRE_ROUTING.
+ *
+ * \par Inputs:
+ * - hknum: Hook number.
+ * - SKBP: Socket buffer structure.
+ * - in: Input network device.
+ * - out: Output network device.
+ * - okfn: The function to be called to complete packet handling
+ *
+ * \par Outputs:
+ * - int: Return value from common packet handler, p3pkt_intr.
+ */
+
+static unsigned int
+p3pkt_intercept_pre(unsigned int hknum, struct sk_buff *SKBP,
+			const struct net_device *in, const struct net_device *out,
+			int (*okfn)(struct sk_buff *))
+{
+	return p3pkt_intercept(hknum, SKBP, in, out, okfn);
+}
+
+/**
+ * \par Function:
+ * p3pkt_intercept_forward
+ *
+ * \par Description:
+ * Receive a packet captured for the kernel hook, NF_INET_PRE_ROUTING.
+ *
+ * \par Inputs:
+ * - hknum: Hook number.
+ * - SKBP: Socket buffer structure.
+ * - in: Input network device.
+ * - out: Output network device.
+ * - okfn: The function to be called to complete packet handling
+ *
+ * \par Outputs:
+ * - int: Return value from common packet handler, p3pkt_intr.
+ */
+
+static unsigned int
+p3pkt_intercept_forward(unsigned int hknum, struct sk_buff *SKBP,
+			const struct net_device *in, const struct net_device *out,
+			int (*okfn)(struct sk_buff *))
+{
+	unsigned int verdict;
+	int (*sendfn)(struct sk_buff *);
+
+	if (p3parallel && p3par_submit(SKBP, okfn, 1) == 0)
+		return NF_STOLEN;
+	verdict = p3pkt_forward(&SKBP, okfn, &sendfn, 0, NULL);
+	if (sendfn != NULL)
+		p3pkt_complete(SKBP, okfn, sendfn, verdict);
+	return verdict;
+} /* end p3pkt_intercept_forward */
+
+/**
+ * \par Function:
+ * p3pkt_intercept_final
+ *
+ * \par Description:
+ * Receive a packet captured for the kernel hook, NF_INET_PRE_ROUTING.
+ *
+ * \par Inputs:
+ * - hknum: Hook number.
+ * - skb: Socket buffer structure.
+ * - in: Input network device.
+ * - out: Output network device.
+ * - okfn: The function to be called to complete packet handling
+ *
+ * \par Outputs:
+ * - int: Return value from common packet handler, p3pkt_intr.
+ */
+
+static unsigned int
+p3pkt_intercept_final(unsigned int hknum, struct sk_buff *SKBP,
+			const struct net_device *in, const struct net_device *out,
+			int (*okfn)(struct sk_buff *))
+{
+//	return p3pkt_intercept(hknum, SKBP, in, out, okfn);
+	return NF_ACCEPT;
+}
+
+/**
+ * \par Function:
+ * p3send_packet
+ *
+ * \par Description:
+ * Send a packet directly from the P3 kernel module.  The entire
+ * packet must have been built except for the IP checksum, which
+ * is calculated here.
+ *
+ * \par Inputs:
+ * - p3pkt: The packet structure
+ *
+ * \par Outputs:
+ * - int: Return value from common packet handler, p3pkt_intr.
+ */
+
+int p3send_packet(void *p3pkt)
+{
+	int len, stat = 0;
+	struct sk_buff *skb;
+	struct iphdr *iph;
+	p3packet *pkt = (p3packet *) p3pkt;
+	p3netdata *netdata = (p3netdata *) pkt->host->net->netdata;
+//	struct kiocb iocb;
+//	init_sync_kiocb(&iocb, NULL);
+#if p3LINUXVER < 2624
+	struct timeval skbts;
+#endif
+
+	if (netdata == NULL) {
+		stat = -1;
+		goto out;
+	}
+
+	if (netdata->p3proto == NULL || netdata->p3ndev == NULL) {
+		stat = -1;
+		goto out;
 	} else if (netdata->p3sk == NULL) {
 #if p3LINUXVER < 2624
 		if ((netdata->p3sk = sk_alloc(PF_INET, GFP_ATOMIC,
@@ -880,7 +1444,7 @@ int p3send_packet(void *p3pkt)
 	// Allocate skb with data field on 32 byte boundary
 	len = ((pkt->flag & p3PKT_SIZE) + 0x1f) & ~0x1f;
 	if (!(netdata->p3ndev->flags & IFF_UP)) {
-p3errmsg(p3MSG_DEBUG, "Network is down\n");
+		p3trace_prgs(path, __func__, "Network is down", -ENETDOWN);
 		stat = -ENETDOWN;
 		goto out;
 	}
@@ -888,8 +1452,6 @@ p3errmsg(p3MSG_DEBUG, "Network is down\n");
 		stat = -EMSGSIZE;
 		goto out;
 	}
-sprintf(p3buf, "Ctl pkt SKB: SK %p, Len %d\n", netdata->p3sk, len);
-p3errmsg(p3MSG_DEBUG, p3buf);
 	if ((skb = alloc_skb(len + LL_RESERVED_SPACE(netdata->p3ndev),
 				GFP_ATOMIC)) == NULL) {
 		stat = -ENOBUFS;
@@ -897,9 +1459,6 @@ p3errmsg(p3MSG_DEBUG, p3buf);
 	}
 	skb_set_owner_w(skb, netdata->p3sk);
 
-sprintf(p3buf, "Netdata: Prot %x Sk %p Dst %p Dev %p\n",
-	netdata->p3prot, netdata->p3sk, netdata->p3dst, netdata->p3ndev);
-p3errmsg(p3MSG_DEBUG, p3buf);
 	skb_reserve(skb, LL_RESERVED_SPACE(netdata->p3ndev));
 	skb_reset_network_header(skb);
 	/* Try to align data correctly */
@@ -920,12 +1479,6 @@ p3errmsg(p3MSG_DEBUG, p3buf);
 	dst_clone(netdata->p3dst);
 	skb->priority = netdata->p3sk->sk_priority;
 	if (!(pkt->flag & p3PKT_CFWD)) {
-sprintf(p3buf, "MAC: Loc %2.2x%2.2x:%2.2x%2.2x:%2.2x%2.2x Rem %2.2x%2.2x:%2.2x%2.2x:%2.2x%2.2x\n",
-	netdata->p3locadr[0], netdata->p3locadr[1], netdata->p3locadr[2],
-	netdata->p3locadr[3], netdata->p3locadr[4], netdata->p3locadr[5],
-	netdata->p3remadr[0], netdata->p3remadr[1], netdata->p3remadr[2],
-	netdata->p3remadr[3], netdata->p3remadr[4], netdata->p3remadr[5]);
-p3errmsg(p3MSG_DEBUG, p3buf);
 		p3MAC_HEADER_SET(skb)(skb, netdata->p3ndev, netdata->p3ptype,
 				netdata->p3remadr, netdata->p3locadr, skb->len);
 //	dev_hard_header(skb, netdata->p3ndev, netdata->p3ptype,
@@ -940,270 +1493,783 @@ p3errmsg(p3MSG_DEBUG, p3buf);
 #endif
 	}
 
-sprintf(p3buf, "Control SKB %p: SK %p PL %d ML %d\n",
-	skb, skb->sk, skb->len, skb->mac_len);
+	p3trace_stru(skb, "Control", skb);
+	p3trace_data(packet, "Control", skb->data, skb->len);
+
+	if (pkt->flag & p3PKT_CFWD)
+		stat = netdata->okfn(skb);
+	else
+		stat = dev_queue_xmit(skb);
+
+out:
+	if (stat)
+		p3trace_prgs(path, __func__, "Failed to send control packet",
+				stat);
+	return (stat);
+} /* end p3send_packet */
+
+/**
+ * \par Function:
+ * p3net_utils
+ *
+ * \par Description:
+ * Handle network utility functions.  These include:
+ * - Set a TCP checksum
+ * - Get the MTU size for an interface
+ * - Prepare the socket buffer for in place packet handling
+ * - Serialize control messages with the data packets of the session
+ *
+ * \par Inputs:
+ * - type: Utility function type:
+ *   - p3TCP_CHECK
+ *   - p3TCP_CHECK_ADD
+ *   - p3GET_MTU
+ *   - p3SET_DEVIN
+ *   - p3SET_DEVOUT
+ *   - p3SET_RAW
+ *   - p3SET_FORWARD
+ *   - p3SET_INPLACE
+ *   - p3CTL_BEGIN
+ *   - p3CTL_END
+ * - p3skb: Socket buffer structure which is cast to the platform
+ *   specific structure.
+ * - p3pkt: The packet structure, which is cast to a p3packet struture,
+ *   may be used to pass or return data.
+ *
+ * \par Outputs:
+ * - Status
+ */
+
+int p3net_utils(int type, void *p3skb, void *p3pkt)
+{
+	int i, hd, tl, stat = 0;
+	short int s1, s2;
+	unsigned char *hdr;
+	p3packet *pkt = (p3packet *) p3pkt;
+	p3netdata *netdata;
+	struct sk_buff *skb = (struct sk_buff *) p3skb;
+	struct iphdr *iph;
+	struct tcphdr *th;
+
+	switch(type) {
+	case p3TCP_CHECK:
+		if (pkt->work == NULL) {
+			p3errmsg(p3MSG_DEBUG, "p3net_utils: No packet work data\n");
+			stat = -1;
+			goto out;
+		}
+		th = pkt->work->tcph;
+		s1 = pkt->netdata & 0xffff;
+		s2 = (pkt->netdata >> 16) & 0xffff;
+#if p3LINUXVER < 2624
+		iph = (struct iphdr *) pkt->packet;
+		th->check = 0;
+		i = th->doff << 2;
+		th->check = tcp_v4_check(th, i, iph->saddr, iph->daddr,
+					csum_partial((char *)th, th->doff << 2, skb->csum));
+#else
+		inet_proto_csum_replace2(&th->check, skb, htons(s1), htons(s2), 0);
+#endif
+		break;
+
+	case p3TCP_CHECK_ADD:
+		// Packet: packet = IP packet with added MSS option
+		// The packet may not be in the socket buffer, so the checksum
+		// is calculated on the packet data
+		iph = (struct iphdr *) pkt->packet;
+		th = (struct tcphdr *) &pkt->packet[iph->ihl << 2];
+		i = ntohs(iph->tot_len) - (iph->ihl << 2);
+		th->check = 0;
+#if p3LINUXVER < 2624
+		th->check = tcp_v4_check(th, i, iph->saddr, iph->daddr,
+					csum_partial((char *)th, i, 0));
+#else
+		th->check = tcp_v4_check(i, iph->saddr, iph->daddr,
+					csum_partial((char *)th, i, 0));
+#endif
+		break;
+
+	case p3GET_MTU:
+		if (skb->dev == NULL) {
+// TODO: Get legitimate MTU
+			pkt->netdata = 1500;
+		} else
+			pkt->netdata = skb->dev->mtu;
+		break;
+
+	// Set skb information for packets forwarded to local subnet
+	case p3SET_FORWARD:
+		if ((netdata = (p3netdata *) pkt->net->netdata) == NULL) {
+			stat = -1;
+			goto out;
+		}
+		p3trace_prgs(path, __func__, "Set forward", 0);
+		dst_clone(netdata->p3dst);
+		p3SKB_DST_SET(skb, netdata->p3dst);
+		skb->dev = netdata->p3ndev;
+	break;
+
+	// Get session information for control packets
+	case p3SET_DEVIN:
+		if (pkt->net->netdata == NULL && (pkt->net->netdata = (void *)
+				p3calloc(sizeof(p3netdata))) == NULL) {
+			stat = -1;
+			goto out;
+		}
+		netdata = (p3netdata *) pkt->net->netdata;
+		netdata->p3ndev = skb->dev;
+		netdata->p3prot = ntohs(skb->protocol);
+		hdr = (unsigned char *) skb_mac_header(skb);
+		memcpy(netdata->p3locadr, hdr, 6);
+		memcpy(netdata->p3remadr, &hdr[6], 6);
+		i = hdr[12];
+		i <<= 8;
+		i |= hdr[13];
+		if (i < 0x600)
+			netdata->p3ptype = ETH_P_802_3;
+		else
+			netdata->p3ptype = netdata->p3prot;
+sprintf(p3buf, "Set dev in: %p Proto %p Dev %p\n",
+	netdata, netdata->p3proto, netdata->p3ndev);
 p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  DST %x, DEV %p, Name %s\n",
-	skb->p3SKB_DST, skb->dev, skb->dev->name);
+sprintf(p3buf, "  Prot %d Type %d\n", netdata->p3prot, netdata->p3ptype);
 p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  HD %p, Tail %p, End %p\n", skb->head, skb->tail, skb->end);
+sprintf(p3buf, "  Loc %2.2x%2.2x:%2.2x%2.2x:%2.2x%2.2x Rem %2.2x%2.2x:%2.2x%2.2x:%2.2x%2.2x\n",
+	netdata->p3locadr[0], netdata->p3locadr[1], netdata->p3locadr[2],
+	netdata->p3locadr[3], netdata->p3locadr[4], netdata->p3locadr[5],
+	netdata->p3remadr[0], netdata->p3remadr[1], netdata->p3remadr[2],
+	netdata->p3remadr[3], netdata->p3remadr[4], netdata->p3remadr[5]);
 p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  DT %p, MH %p, NH %p, TH %p\n",
-	skb->data, skb->p3SKB_MACHDR, skb->p3SKB_NETHDR, skb->p3SKB_TRANSHDR);
+	break;
+
+	case p3SET_DEVOUT:
+		if (pkt->net->netdata == NULL && (pkt->net->netdata = (void *)
+				p3calloc(sizeof(p3netdata))) == NULL) {
+			stat = -1;
+			goto out;
+		}
+		netdata = (p3netdata *) pkt->net->netdata;
+		// Get session information for control packets
+		if (skb->sk != NULL) {
+#if p3LINUXVER >= 2624
+			netdata->p3knet = sock_net(skb->sk);
+#endif
+			netdata->p3proto = skb->sk->sk_prot;
+		}
+		if (skb->dev == NULL)
+			skb->dev = netdata->p3ndev;
+		if (!p3SKB_DST_GET(skb))
+			p3SKB_DST_SET(skb, netdata->p3dst);
+#if p3LINUXVER < 2624
+sprintf(p3buf, "Set dev out: %p Proto %p Dev %p\n",
+	netdata, netdata->p3proto, netdata->p3ndev);
+#else
+sprintf(p3buf, "Set dev out: %p Proto %p Net %p Dev %p\n",
+	netdata, netdata->p3proto, netdata->p3knet, netdata->p3ndev);
+#endif
 p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  Dev adr: ");
-for (len=0; len < 6; len++) {
-	sprintf(p3buf, "%s %2.2x", p3buf, skb->dev->dev_addr[len]);
-}
-sprintf(p3buf, "%s\n", p3buf);
+sprintf(p3buf, "  Prot %d Type %d\n", netdata->p3prot, netdata->p3ptype);
+p3errmsg(p3MSG_DEBUG, p3buf);
+sprintf(p3buf, "  Loc %2.2x%2.2x:%2.2x%2.2x:%2.2x%2.2x Rem %2.2x%2.2x:%2.2x%2.2x:%2.2x%2.2x\n",
+	netdata->p3locadr[0], netdata->p3locadr[1], netdata->p3locadr[2],
+	netdata->p3locadr[3], netdata->p3locadr[4], netdata->p3locadr[5],
+	netdata->p3remadr[0], netdata->p3remadr[1], netdata->p3remadr[2],
+	netdata->p3remadr[3], netdata->p3remadr[4], netdata->p3remadr[5]);
 p3errmsg(p3MSG_DEBUG, p3buf);
+	break;
 
-sprintf(p3buf, "  MAC HDR:");
-for (len=0; len < 64; len++) {
-	if (!(len & 0xf))
-		sprintf(p3buf, "%s\n  ", p3buf);
-	else if (!(len & 0x3))
-		sprintf(p3buf, "%s ", p3buf);
-	sprintf(p3buf, "%s%2.2x", p3buf, skb->data[len]);
-}
-sprintf(p3buf, "%s\n", p3buf);
+	case p3SET_RAW:
+		if (pkt->net->netdata == NULL && (pkt->net->netdata = (void *)
+				p3calloc(sizeof(p3netdata))) == NULL) {
+			stat = -1;
+			goto out;
+		}
+		netdata = (p3netdata *) pkt->net->netdata;
+		netdata->p3sk = skb->sk;
+		netdata->p3dst = p3SKB_DST_GET(skb);
+		dst_clone(netdata->p3dst);
+		if (netdata->p3dst != NULL) {
+			netdata->p3ndev = netdata->p3dst->dev;
+sprintf(p3buf, "Set raw: SK %p Dst %p Dev %p Name %s\n",
+	netdata->p3sk, netdata->p3dst, netdata->p3ndev, netdata->p3ndev->name);
+p3errmsg(p3MSG_DEBUG, p3buf);
+		} else {
+sprintf(p3buf, "Set raw: SK %p Dst %p Dev %p\n",
+	netdata->p3sk, netdata->p3dst, netdata->p3ndev);
 p3errmsg(p3MSG_DEBUG, p3buf);
-if (pkt->flag & p3PKT_CFWD)
-	p3errmsg(p3MSG_DEBUG, "Call okfn\n");
-else
-	p3errmsg(p3MSG_DEBUG, "Call dev_queue_xmit\n");
+		}
+	break;
+
+	// Prepare the socket buffer for in place encryption or decryption
+	// Wait for the workers handling packets of the session
+	case p3CTL_BEGIN:
+		if (pkt->flag & p3PKT_PARALLEL)
+			read_unlock(&pkt->host->session->parq.ctl);
+		write_lock(&pkt->host->session->parq.ctl);
+	break;
+
+	case p3CTL_END:
+		write_unlock(&pkt->host->session->parq.ctl);
+		if (pkt->flag & p3PKT_PARALLEL)
+			read_lock(&pkt->host->session->parq.ctl);
+	break;
+
+	case p3SET_INPLACE:
+		if (!p3zerocopy || skb_is_gso(skb)) {
+			stat = -1;
+			goto out;
+		}
+		// Complete a deferred checksum before the packet is encrypted
+		if (!(pkt->flag & p3PKT_P3SRC) && skb->ip_summed == CHECKSUM_PARTIAL &&
+				skb_checksum_help(skb)) {
+			stat = -1;
+			goto out;
+		}
+		if (skb_linearize(skb)) {
+			stat = -1;
+			goto out;
+		}
+		pkt->packet = skb->data;
+		// Encrypted packet needs room for the P3 header and padding
+		hd = 0;
+		tl = 0;
+		i = 0;
+		if (!(pkt->flag & p3PKT_P3SRC)) {
+			if (skb_headroom(skb) < p3SESSION_HDR4)
+				hd = SKB_DATA_ALIGN(p3SESSION_HDR4);
+			tl = ((pkt->flag & p3PKT_SIZE) - p3SESSION_HDR4) - skb->len;
+			if (tl < 0)
+				tl = 0;
+			if (skb_tailroom(skb) < tl)
+				i = tl - skb_tailroom(skb);
+		}
+		if ((hd || i || skb_cloned(skb)) &&
+				pskb_expand_head(skb, hd, i, GFP_ATOMIC)) {
+			stat = -1;
+			goto out;
+		}
+		if (!(pkt->flag & p3PKT_P3SRC)) {
+			skb_push(skb, p3SESSION_HDR4);
+			skb_put(skb, tl);
+		}
+		pkt->packet = skb->data;
+		pkt->flag |= p3PKT_INPLACE;
+	break;
 
-	if ((pkt->flag & p3PKT_CFWD) && (stat = netdata->okfn(skb)) < 0) {
-		sprintf(p3buf, "%s: Failed to queue control packet\n", P3APP);
-		p3errmsg(p3MSG_DEBUG, p3buf);
-	} else if (!(pkt->flag & p3PKT_CFWD) &&
-			(stat = dev_queue_xmit(skb)) < 0) {
-		sprintf(p3buf, "%s: Failed to queue control packet\n", P3APP);
-		p3errmsg(p3MSG_DEBUG, p3buf);
+	default:
+		break;
 	}
 
 out:
-	if (stat) {
-sprintf(p3buf, "  Error status = %d\n", stat);
-p3errmsg(p3MSG_DEBUG, p3buf);
+	return(stat);
+}
+
+
+/**
+ * \par Function:
+ * p3work_alloc
+ *
+ * \par Description:
+ * Get a packet work area from the per-CPU work area pool.  If the pool
+ * for this CPU is empty, the work area is allocated from the work area
+ * cache and returned to the pool when freed.  Requests larger than the
+ * pooled buffers are allocated directly.  The p3work structure at the
+ * start of the work area is cleared.
+ *
+ * \par Inputs:
+ * - size: The size of the work area, including the p3work structure
+ *
+ * \par Outputs:
+ * - void *: The work area, or NULL if allocation fails
+ */
+
+void *p3work_alloc(int size)
+{
+	unsigned long flags;
+	unsigned int wflag = 0;
+	p3pool *pool;
+	p3work *work = NULL;
+
+	local_irq_save(flags);
+	pool = &per_cpu(p3work_pool, smp_processor_id());
+	if (size > p3WORK_SIZE) {
+		pool->large++;
+		local_irq_restore(flags);
+		work = (p3work *) p3malloc(size);
+	} else if (pool->count > 0) {
+		pool->hits++;
+		work = (p3work *) pool->free[--pool->count];
+		local_irq_restore(flags);
+		wflag = p3WRK_POOL;
+	} else {
+		pool->empty++;
+		local_irq_restore(flags);
+		work = (p3work *) kmem_cache_alloc(p3work_cache, GFP_ATOMIC);
+		wflag = p3WRK_POOL;
+	}
+
+	if (work == NULL) {
+		local_irq_save(flags);
+		per_cpu(p3work_pool, smp_processor_id()).fail++;
+		local_irq_restore(flags);
+	} else {
+		memset(work, 0, sizeof(p3work));
+		work->wflag = wflag;
+	}
+	return((void *) work);
+} /* end p3work_alloc */
+
+/**
+ * \par Function:
+ * p3work_free
+ *
+ * \par Description:
+ * Return a packet work area to the work area pool of the current CPU.
+ * Work areas allocated outside the pool, and pool work areas in excess
+ * of the pool depth, are released to the system.
+ *
+ * \par Inputs:
+ * - work: The work area returned by p3work_alloc
+ *
+ * \par Outputs:
+ * - None
+ */
+
+void p3work_free(void *work)
+{
+	unsigned long flags;
+	p3pool *pool;
+
+	if (work == NULL)
+		return;
+	if (!(((p3work *) work)->wflag & p3WRK_POOL)) {
+		p3free(work);
+		return;
+	}
+
+	local_irq_save(flags);
+	pool = &per_cpu(p3work_pool, smp_processor_id());
+	if (pool->count < p3POOL_DEPTH) {
+		pool->free[pool->count++] = work;
+		work = NULL;
+	}
+	local_irq_restore(flags);
+	if (work != NULL)
+		kmem_cache_free(p3work_cache, work);
+} /* end p3work_free */
+
+/**
+ * \par Function:
+ * p3rcu_kfree
+ *
+ * \par Description:
+ * The RCU callback that releases a buffer after all readers are done.
+ *
+ * \par Inputs:
+ * - head: The RCU head at the start of the buffer
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3rcu_kfree(struct rcu_head *head)
+{
+	kfree(head);
+} /* end p3rcu_kfree */
+
+/**
+ * \par Function:
+ * p3rcu_free
+ *
+ * \par Description:
+ * Release a buffer that was unlinked from an RCU protected table once
+ * all current readers have finished.  The buffer must start with a
+ * p3rcu structure.  This does not sleep, so it may be called while
+ * holding the table lock.
+ *
+ * \par Inputs:
+ * - buf: The buffer to be released
+ *
+ * \par Outputs:
+ * - None
+ */
+
+void p3rcu_free(void *buf)
+{
+	if (buf == NULL)
+		return;
+	call_rcu((struct rcu_head *) buf, p3rcu_kfree);
+} /* end p3rcu_free */
+
+#ifdef p3SEQ_LOCKED
+static DEFINE_SPINLOCK(p3seq_lock);
+
+/**
+ * \par Function:
+ * p3seq_update
+ *
+ * \par Description:
+ * Set or add to a sequence counter on a system without 64 bit atomics.
+ * All counters share one lock, which is taken with interrupts disabled
+ * since the counters are updated from the packet path.  The update is a
+ * full memory barrier, as atomic64_add_return is.
+ *
+ * \par Inputs:
+ * - seq: The sequence counter
+ * - val: The value to set or add
+ * - set: 1 to set the counter to the value, 0 to add the value
+ *
+ * \par Outputs:
+ * - unsigned int: The low 32 bits of the new counter value
+ */
+
+unsigned int p3seq_update(p3seq *seq, int val, int set)
+{
+	unsigned long flags;
+	u64 count;
+
+	smp_mb();
+	spin_lock_irqsave(&p3seq_lock, flags);
+	count = set ? (u64) val : seq->counter + val;
+	seq->counter = count;
+	spin_unlock_irqrestore(&p3seq_lock, flags);
+	smp_mb();
+	return ((unsigned int) count);
+} /* end p3seq_update */
+#endif
+
+/**
+ * \par Function:
+ * p3pool_init
+ *
+ * \par Description:
+ * Create the packet work area cache and preallocate the work area pool
+ * for each CPU.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0 = OK
+ *   - <0 = Error
+ */
+
+static int p3pool_init(void)
+{
+	int cpu, stat = 0;
+	p3pool *pool;
+	p3work *work;
+
+	if ((p3work_cache = kmem_cache_create("p3work", p3WORK_SIZE, 0,
+			SLAB_HWCACHE_ALIGN, NULL)) == NULL) {
+		stat = -1;
+		goto out;
+	}
+	for_each_possible_cpu(cpu) {
+		pool = &per_cpu(p3work_pool, cpu);
+		memset(pool, 0, sizeof(p3pool));
+		while (pool->count < p3POOL_FILL) {
+			if ((work = (p3work *) kmem_cache_alloc(p3work_cache,
+					GFP_KERNEL)) == NULL) {
+				stat = -1;
+				goto out;
+			}
+			work->wflag = p3WRK_POOL;
+			pool->free[pool->count++] = work;
+		}
+	}
+
+out:
+	return(stat);
+} /* end p3pool_init */
+
+/**
+ * \par Function:
+ * p3pool_cleanup
+ *
+ * \par Description:
+ * Release the work areas held in each CPU pool and destroy the
+ * packet work area cache.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3pool_cleanup(void)
+{
+	int cpu;
+	p3pool *pool;
+
+	if (p3work_cache == NULL)
+		return;
+	for_each_possible_cpu(cpu) {
+		pool = &per_cpu(p3work_pool, cpu);
+		while (pool->count > 0)
+			kmem_cache_free(p3work_cache, pool->free[--pool->count]);
+	}
+	kmem_cache_destroy(p3work_cache);
+	p3work_cache = NULL;
+} /* end p3pool_cleanup */
+
+/**
+ * \par Function:
+ * p3par_init
+ *
+ * \par Description:
+ * Start the parallel crypto workers, one bound to each CPU.  The
+ * workers are always started, so parallel crypto can be turned on
+ * while the module is running.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0 = OK
+ *   - <0 = Error
+ */
+
+static int p3par_init(void)
+{
+	if ((p3par_wq = create_workqueue("p3crypt")) == NULL)
+		return -1;
+	return 0;
+} /* end p3par_init */
+
+/**
+ * \par Function:
+ * p3par_cleanup
+ *
+ * \par Description:
+ * Stop the parallel crypto workers.  Queued packets are handled and
+ * sent before the workers stop.  This must be called after the
+ * netfilter hooks are removed.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void p3par_cleanup(void)
+{
+	if (p3par_wq == NULL)
+		return;
+	destroy_workqueue(p3par_wq);
+	p3par_wq = NULL;
+} /* end p3par_cleanup */
+
+#ifndef _p3_SECONDARY
+/**
+ * \par Function:
+ * p3prep_wake
+ *
+ * \par Description:
+ * Wake the key epoch thread to prepare the next epoch of the sessions.
+ * This is called when a session uses its prepared epoch, and may be
+ * called in interrupt context.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - None
+ */
+
+void p3prep_wake(void)
+{
+	p3prep_kick = 1;
+	wake_up_interruptible(&p3prep_wait);
+} /* end p3prep_wake */
+#endif
+
+#ifdef _p3_PRIMARY
+/**
+ * \par Function:
+ * p3prep_thread
+ *
+ * \par Description:
+ * The key epoch thread.  It takes keys from the key server for each
+ * session and creates their crypto contexts ahead of the next rekey.
+ * The sessions are checked when a session uses its prepared epoch,
+ * and every p3PREP_WAIT jiffies for new sessions and for key rings
+ * that were empty.
+ *
+ * \par Inputs:
+ * - data: Not used
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0 = OK
+ */
+
+static int p3prep_thread(void *data)
+{
+	while (!kthread_should_stop()) {
+		wait_event_interruptible_timeout(p3prep_wait,
+				p3prep_kick || kthread_should_stop(), p3PREP_WAIT);
+		p3prep_kick = 0;
+		prepare_epochs();
 	}
-	return (stat);
-} /* end p3send_packet */
+	return 0;
+} /* end p3prep_thread */
 
 /**
  * \par Function:
- * p3net_utils
+ * p3prep_init
  *
  * \par Description:
- * Handle network utility functions.  These include:
- * - Set a TCP checksum
- * - Get the MTU size for an interface
+ * Start the key epoch thread.  Without the thread, a rekey creates the
+ * crypto contexts of the new keys itself.
  *
  * \par Inputs:
- * - type: Utility function type:
- *   - p3TCP_CHECK
- *   - p3TCP_CHECK_ADD
- *   - p3GET_MTU
- *   - p3SET_DEVIN
- *   - p3SET_DEVOUT
- *   - p3SET_RAW
- * - p3skb: Socket buffer structure which is cast to the platform
- *   specific structure.
- * - p3pkt: The packet structure, which is cast to a p3packet struture,
- *   may be used to pass or return data.
+ * - None
  *
  * \par Outputs:
- * - Status
+ * - int: Status
+ *   - 0 = OK
+ *   - <0 = Error
  */
 
-int p3net_utils(int type, void *p3skb, void *p3pkt)
+static int p3prep_init(void)
 {
-	int i, stat = 0;
-	short int s1, s2;
-	unsigned char *hdr;
-	p3packet *pkt = (p3packet *) p3pkt;
-	p3netdata *netdata;
-	struct sk_buff *skb = (struct sk_buff *) p3skb;
-	struct iphdr *iph;
-	struct tcphdr *th;
-
-	switch(type) {
-	case p3TCP_CHECK:
-		if (pkt->work == NULL) {
-			p3errmsg(p3MSG_DEBUG, "p3net_utils: No packet work data\n");
-			stat = -1;
-			goto out;
-		}
-		th = pkt->work->tcph;
-		s1 = pkt->netdata & 0xffff;
-		s2 = (pkt->netdata >> 16) & 0xffff;
-#if p3LINUXVER < 2624
-		iph = (struct iphdr *) pkt->packet;
-		th->check = 0;
-		i = th->doff << 2;
-		th->check = tcp_v4_check(th, i, iph->saddr, iph->daddr,
-					csum_partial((char *)th, th->doff << 2, skb->csum));
-#else
-		inet_proto_csum_replace2(&th->check, skb, htons(s1), htons(s2), 0);
-#endif
-		break;
-
-	case p3TCP_CHECK_ADD:
-		if (skb->sk == NULL) {
-			stat = -1;
-			goto out;
-		}
-		// Packet: packet = added data, netdata = new TCP header size
-		if (skb_tailroom(skb) < 6) {
-			stat = -1;
-			goto out;
-		}
-		skb->len = pkt->flag & p3PKT_SIZE;
-		memcpy(skb->data, pkt->packet, skb->len);
-		skb_set_tail_pointer(skb, skb->len);
-		iph = ip_hdr(skb);
-		iph->check = 0;
-		ip_fast_csum(skb_network_header(skb), iph->ihl);
-		th = tcp_hdr(skb);
-		th->check = 0;
-// TODO: Use skb_checksum_complete(skb)???
-//		skb->ip_summed = CHECKSUM_NONE;
-		th->check = __skb_checksum_complete(skb);
-//		if (skb->ip_summed == CHECKSUM_PARTIAL) {
-//			th->check = ~tcp_v4_check(skb->len, iph->saddr, iph->daddr, 0);
-//			skb->csum_start = skb_transport_header(skb) - skb->head;
-//			skb->csum_offset = offsetof(struct tcphdr, check);
-//		} else {
-//			th->check = tcp_v4_check(skb->len, iph->saddr, iph->daddr,
-//						csum_partial(th, th->doff << 2, skb->csum));
-//		}
-		break;
-
-	case p3GET_MTU:
-		if (skb->dev == NULL) {
-// TODO: Get legitimate MTU
-			pkt->netdata = 1500;
-		} else
-			pkt->netdata = skb->dev->mtu;
-		break;
+	struct task_struct *task;
 
-	// Set skb information for packets forwarded to local subnet
-	case p3SET_FORWARD:
-		if ((netdata = (p3netdata *) pkt->net->netdata) == NULL) {
-			stat = -1;
-			goto out;
-		}
-p3errmsg(p3MSG_DEBUG, "Set Forward\n");
-		dst_clone(netdata->p3dst);
-		p3SKB_DST_SET(skb, netdata->p3dst);
-		skb->dev = netdata->p3ndev;
-	break;
+	task = kthread_run(p3prep_thread, NULL, "p3kprep");
+	if (IS_ERR(task))
+		return -1;
+	p3prep_task = task;
+	return 0;
+} /* end p3prep_init */
 
-	// Get session information for control packets
-	case p3SET_DEVIN:
-		if (pkt->net->netdata == NULL && (pkt->net->netdata = (void *)
-				p3calloc(sizeof(p3netdata))) == NULL) {
-			stat = -1;
-			goto out;
-		}
-		netdata = (p3netdata *) pkt->net->netdata;
-		netdata->p3ndev = skb->dev;
-		netdata->p3prot = ntohs(skb->protocol);
-		hdr = (unsigned char *) skb_mac_header(skb);
-		memcpy(netdata->p3locadr, hdr, 6);
-		memcpy(netdata->p3remadr, &hdr[6], 6);
-		i = hdr[12];
-		i <<= 8;
-		i |= hdr[13];
-		if (i < 0x600)
-			netdata->p3ptype = ETH_P_802_3;
-		else
-			netdata->p3ptype = netdata->p3prot;
-sprintf(p3buf, "Set dev in: %p Proto %p Dev %p\n",
-	netdata, netdata->p3proto, netdata->p3ndev);
-p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  Prot %d Type %d\n", netdata->p3prot, netdata->p3ptype);
-p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  Loc %2.2x%2.2x:%2.2x%2.2x:%2.2x%2.2x Rem %2.2x%2.2x:%2.2x%2.2x:%2.2x%2.2x\n",
-	netdata->p3locadr[0], netdata->p3locadr[1], netdata->p3locadr[2],
-	netdata->p3locadr[3], netdata->p3locadr[4], netdata->p3locadr[5],
-	netdata->p3remadr[0], netdata->p3remadr[1], netdata->p3remadr[2],
-	netdata->p3remadr[3], netdata->p3remadr[4], netdata->p3remadr[5]);
-p3errmsg(p3MSG_DEBUG, p3buf);
-	break;
+/**
+ * \par Function:
+ * p3prep_cleanup
+ *
+ * \par Description:
+ * Stop the key epoch thread.  This must be called before the primary
+ * data structure and the host table are released.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - None
+ */
 
-	case p3SET_DEVOUT:
-		if (pkt->net->netdata == NULL && (pkt->net->netdata = (void *)
-				p3calloc(sizeof(p3netdata))) == NULL) {
-			stat = -1;
-			goto out;
-		}
-		netdata = (p3netdata *) pkt->net->netdata;
-		// Get session information for control packets
-		if (skb->sk != NULL) {
-#if p3LINUXVER >= 2624
-			netdata->p3knet = sock_net(skb->sk);
-#endif
-			netdata->p3proto = skb->sk->sk_prot;
-		}
-		if (skb->dev == NULL)
-			skb->dev = netdata->p3ndev;
-		if (!p3SKB_DST_GET(skb))
-			p3SKB_DST_SET(skb, netdata->p3dst);
-#if p3LINUXVER < 2624
-sprintf(p3buf, "Set dev out: %p Proto %p Dev %p\n",
-	netdata, netdata->p3proto, netdata->p3ndev);
-#else
-sprintf(p3buf, "Set dev out: %p Proto %p Net %p Dev %p\n",
-	netdata, netdata->p3proto, netdata->p3knet, netdata->p3ndev);
+static void p3prep_cleanup(void)
+{
+	if (p3prep_task == NULL)
+		return;
+	kthread_stop(p3prep_task);
+	p3prep_task = NULL;
+} /* end p3prep_cleanup */
 #endif
-p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  Prot %d Type %d\n", netdata->p3prot, netdata->p3ptype);
-p3errmsg(p3MSG_DEBUG, p3buf);
-sprintf(p3buf, "  Loc %2.2x%2.2x:%2.2x%2.2x:%2.2x%2.2x Rem %2.2x%2.2x:%2.2x%2.2x:%2.2x%2.2x\n",
-	netdata->p3locadr[0], netdata->p3locadr[1], netdata->p3locadr[2],
-	netdata->p3locadr[3], netdata->p3locadr[4], netdata->p3locadr[5],
-	netdata->p3remadr[0], netdata->p3remadr[1], netdata->p3remadr[2],
-	netdata->p3remadr[3], netdata->p3remadr[4], netdata->p3remadr[5]);
-p3errmsg(p3MSG_DEBUG, p3buf);
-	break;
 
-	case p3SET_RAW:
-		if (pkt->net->netdata == NULL && (pkt->net->netdata = (void *)
-				p3calloc(sizeof(p3netdata))) == NULL) {
-			stat = -1;
-			goto out;
-		}
-		netdata = (p3netdata *) pkt->net->netdata;
-		netdata->p3sk = skb->sk;
-		netdata->p3dst = p3SKB_DST_GET(skb);
-		dst_clone(netdata->p3dst);
-		if (netdata->p3dst != NULL) {
-			netdata->p3ndev = netdata->p3dst->dev;
-sprintf(p3buf, "Set raw: SK %p Dst %p Dev %p Name %s\n",
-	netdata->p3sk, netdata->p3dst, netdata->p3ndev, netdata->p3ndev->name);
-p3errmsg(p3MSG_DEBUG, p3buf);
-		} else {
-sprintf(p3buf, "Set raw: SK %p Dst %p Dev %p\n",
-	netdata->p3sk, netdata->p3dst, netdata->p3ndev);
-p3errmsg(p3MSG_DEBUG, p3buf);
-		}
-	break;
+/**
+ * \par Function:
+ * p3stats_show
+ *
+ * \par Description:
+ * Report the P3 kernel module statistics through the proc file system.
+ * Each statistic is reported on a separate line as a name and value.
+ * The crypto lines give the AES engine in use and the MB/s measured
+ * for each engine and packet size when the module was loaded.  The key
+ * lines give the keys in the key server buffer, the times they dropped
+ * below p3key_low and the requests that found too few keys.
+ *
+ * \par Inputs:
+ * - m: The sequence file for the report
+ * - v: Not used
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0 = OK
+ */
 
-	default:
-		break;
+static int p3stats_show(struct seq_file *m, void *v)
+{
+	int i, n, used, cpu, avail = 0;
+	int size[p3BENCH_SIZES], mbs[p3BENCH_SIZES];
+	const char *name;
+	unsigned long hits = 0, empty = 0, large = 0, fail = 0;
+	unsigned long gpkts = 0, gsegs = 0, gresize = 0, gbatch = 0, gfail = 0;
+	p3pool *pool;
+	p3gso *gso;
+
+	for_each_possible_cpu(cpu) {
+		pool = &per_cpu(p3work_pool, cpu);
+		avail += pool->count;
+		hits += pool->hits;
+		empty += pool->empty;
+		large += pool->large;
+		fail += pool->fail;
+		gso = &per_cpu(p3gso_stat, cpu);
+		gpkts += gso->pkts;
+		gsegs += gso->segs;
+		gresize += gso->resize;
+		gbatch += gso->batched;
+		gfail += gso->fail;
+	}
+	seq_printf(m, "pool_avail: %d\n", avail);
+	seq_printf(m, "pool_hits: %lu\n", hits);
+	seq_printf(m, "pool_empty: %lu\n", empty);
+	seq_printf(m, "pool_large: %lu\n", large);
+	seq_printf(m, "pool_fail: %lu\n", fail);
+	seq_printf(m, "gso_pkts: %lu\n", gpkts);
+	seq_printf(m, "gso_segs: %lu\n", gsegs);
+	seq_printf(m, "gso_resize: %lu\n", gresize);
+	seq_printf(m, "gso_batched: %lu\n", gbatch);
+	seq_printf(m, "gso_fail: %lu\n", gfail);
+	seq_printf(m, "parallel: %d\n", p3parallel);
+	seq_printf(m, "par_jobs: %lu\n", atomic_long_read(&p3par_jobs));
+	seq_printf(m, "par_pend: %d\n", atomic_read(&p3par_pend));
+	for (i=0; (used = p3_crypto_bench(i, &name, size, mbs)) >= 0; i++) {
+		if (used)
+			seq_printf(m, "crypto_engine: %s\n", name);
+		for (n=0; n < p3BENCH_SIZES; n++)
+			seq_printf(m, "crypto_%s_%d: %d\n", name, size[n], mbs[n]);
 	}
+#ifdef _p3_PRIMARY
+	if (primain != NULL) {
+		seq_printf(m, "key_avail: %d\n", p3_key_avail(&primain->key_mgr));
+		seq_printf(m, "key_low: %u\n", p3seq_read(primain->key_mgr.low));
+		seq_printf(m, "key_starved: %u\n", p3seq_read(primain->key_mgr.starved));
+	}
+#endif
+	seq_printf(m, "hosts: %d\n", p3hostsz);
+	if (ipv4route != NULL)
+		seq_printf(m, "routes_v4: %d\n", ipv4route->netsz);
+	if (ipv6route != NULL)
+		seq_printf(m, "routes_v6: %d\n", ipv6route->netsz);
+	return 0;
+} /* end p3stats_show */
 
-out:
-	return(stat);
+static int p3stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, p3stats_show, NULL);
 }
 
+static const struct file_operations p3stats_fops = {
+	.open    = p3stats_open,
+	.read    = seq_read,
+	.llseek  = seq_lseek,
+	.release = single_release,
+	.owner   = THIS_MODULE
+};
 
 static const struct file_operations ramdisk_fops = {
 	.open  = p3ramdisk_open,
 	.read  = p3ramdisk_read,
 	.write = p3ramdisk_write,
+	.llseek = p3ramdisk_lseek,
 	.mmap  = p3mmap,
+	.poll  = p3ramdisk_poll,
 	.unlocked_ioctl = p3ioctl,
 	.owner = THIS_MODULE
 };
@@ -1282,7 +2348,15 @@ static int __init p3primaryplus_init (void)
 	}
 	cdev_init (ramdisk_cdev, &ramdisk_fops);
 
-	if ((ramdisk = kmalloc (ramdisk_size, GFP_ATOMIC)) == NULL) {
+	// The ramdisk is physically contiguous for remap_pfn_range.  Page
+	// blocks are aligned to their size, so a 2 MB or larger ramdisk is
+	// covered by huge pages in the kernel linear mapping.
+	if (p3ramdisk_kb > (RAMDISK_SZ >> 10))
+		ramdisk_size = PAGE_ALIGN(min_t(size_t, p3ramdisk_kb,
+				(PAGE_SIZE << (MAX_ORDER - 1)) >> 10) << 10);
+	ramdisk_order = get_order(ramdisk_size);
+	if ((ramdisk = (unsigned char *) __get_free_pages(GFP_KERNEL | __GFP_ZERO |
+			__GFP_NOWARN, ramdisk_order)) == NULL) {
 		sprintf(p3buf, "%s: Error allocating ramdisk\n", P3APP);
 		p3errmsg(p3MSG_ERR, p3buf);
 		stat = -3;
@@ -1317,10 +2391,31 @@ static int __init p3primaryplus_init (void)
 		goto out;
 	}
 
+	if (p3pool_init() < 0) {
+		sprintf(p3buf, "%s: Error allocating packet work area pool\n", P3APP);
+		p3errmsg(p3MSG_ERR, p3buf);
+		stat = -6;
+		goto out;
+	}
+
+	if (p3par_init() < 0) {
+		sprintf(p3buf, "%s: Error starting parallel crypto workers\n", P3APP);
+		p3errmsg(p3MSG_ERR, p3buf);
+		stat = -6;
+		goto out;
+	}
+
+	if (proc_create(P3STATNAME, 0444, NULL, &p3stats_fops) == NULL) {
+		sprintf(p3buf, "%s: Error creating statistics file\n", P3APP);
+		p3errmsg(p3MSG_ERR, p3buf);
+		stat = -7;
+		goto out;
+	}
+
 	if (nf_register_hooks(netmod_reg, ARRAY_SIZE(netmod_reg))) {
 		sprintf(p3buf, "%s: Error registering netfilter hook\n", P3APP);
 		p3errmsg(p3MSG_ERR, p3buf);
-		stat = -6;
+		stat = -8;
 		goto out;
 	}
 
@@ -1329,37 +2424,49 @@ p3errmsg(p3MSG_DEBUG, p3buf);
 
 	// TODO: Start timer thread
 #ifdef _p3_PRIMARY
-	if (init_primary(ramdisk) < 0) {
-		stat = -8;
+	if (init_primary(ramdisk, ramdisk_size) < 0) {
+		stat = -9;
 		goto out;
 	}
 #endif
 #ifdef _p3_SECONDARY
 	if (init_secondary() < 0) {
-		stat = -8;
+		stat = -9;
 		goto out;
 	}
 #endif
 #ifdef _p3_PRIMARY_PLUS
 	if (init_primaryplus() < 0) {
-		stat = -8;
+		stat = -9;
 		goto out;
 	}
 #endif
 	// Initialize P3 networking
 	if (init_p3net() < 0) {
-		stat = -8;
+		stat = -9;
 		goto out;
 	}
+#ifdef _p3_PRIMARY
+	// Rekeys create the contexts themselves if the thread is not running
+	if (p3prep_init() < 0) {
+		sprintf(p3buf, "%s: Error starting key epoch thread\n", P3APP);
+		p3errmsg(p3MSG_WARN, p3buf);
+	}
+#endif
 
 	sprintf(p3buf, "%s: Initialization complete\n", P3APP);
 	p3errmsg(p3MSG_NOTICE, p3buf);
 
 out:
-	if (stat < -6) {
+	if (stat < -8) {
 		nf_unregister_hooks(netmod_reg, ARRAY_SIZE(netmod_reg));
 	}
+	if (stat < -7) {
+		remove_proc_entry(P3STATNAME, NULL);
+	}
 	if (stat < -5) {
+		p3par_cleanup();
+		p3pool_cleanup();
 		device_destroy (ramdisk_class, ramdisk_region);
 	}
 	if (stat < -4) {
@@ -1369,7 +2476,7 @@ out:
 		cdev_del (ramdisk_cdev);
 	}
 	if (stat < -2) {
-		kfree (ramdisk);
+		free_pages ((unsigned long) ramdisk, ramdisk_order);
 	}
 	if (stat < -1) {
 		unregister_chrdev_region (ramdisk_region, count);
@@ -1396,9 +2503,11 @@ out:
  * <hr><b>Error allocating ramdisk</b>
  * \par Description (CRIT):
  * While initializing the P3 kernel module, the RAM disk space
- * could not be allocated.
+ * could not be allocated.  The RAM disk is contiguous memory, so
+ * a large p3ramdisk_kb may fail when memory is fragmented.
  * \par Response:
- * Troubleshoot the system memory problem.
+ * Troubleshoot the system memory problem, or load the module with a
+ * smaller p3ramdisk_kb.
  *
  * <hr><b>Error adding character device</b>
  * \par Description (CRIT):
@@ -1419,6 +2528,26 @@ out:
  * \par Response:
  * Troubleshoot the system device problem.
  *
+ * <hr><b>Error allocating packet work area pool</b>
+ * \par Description (CRIT):
+ * While initializing the P3 kernel module, the preallocated packet
+ * work areas could not be allocated.
+ * \par Response:
+ * Troubleshoot the system memory problem.
+ *
+ * <hr><b>Error starting parallel crypto workers</b>
+ * \par Description (CRIT):
+ * While initializing the P3 kernel module, the worker threads for
+ * parallel encryption and decryption could not be started.
+ * \par Response:
+ * Troubleshoot the system memory problem.
+ *
+ * <hr><b>Error creating statistics file</b>
+ * \par Description (CRIT):
+ * The P3 statistics file could not be added to the proc file system.
+ * \par Response:
+ * Troubleshoot the system device problem.
+ *
  * <hr><b>Error registering netfilter hook</b>
  * \par Description (CRIT):
  * The P3 netfilter hook for intercepting packets could
@@ -1426,6 +2555,15 @@ out:
  * \par Response:
  * Troubleshoot the system network problem.
  *
+ * <hr><b>Error starting key epoch thread</b>
+ * \par Description (WARN):
+ * The P3 primary prepares the keys of the next rekey of each session
+ * in a kernel thread.  The thread could not be started, so each rekey
+ * creates the crypto contexts of its keys when it is done.  Processing
+ * continues.
+ * \par Response:
+ * Troubleshoot the system resource problem.
+ *
  * <hr><b>Initialization complete</b>
  * \par Description (NOTICE):
  * The P3 kernel module is successfully initialized.
@@ -1465,34 +2603,38 @@ static void __exit p3primaryplus_exit (void)
 #endif
 {
 	// TODO: Shutdown timer thread
+#ifdef _p3_PRIMARY
+	p3prep_cleanup();
+#endif
 	// TODO: Release all dst structures
 //	if (p3dst != NULL) {
 //		dst_release(p3dst);
 //	}
+	nf_unregister_hooks(netmod_reg, ARRAY_SIZE(netmod_reg));
+	// Send packets queued to the parallel crypto workers, which use the
+	// main data structure, before it is released
+	p3par_cleanup();
 #ifdef _p3_PRIMARY
 	kfree(primain);
-	if (ipv4route != NULL)
-		kfree(ipv4route);
-	if (ipv6route != NULL)
-		kfree(ipv6route);
 #endif
 #ifdef _p3_SECONDARY
 	kfree(secmain);
 #endif
 #ifdef _p3_PRIMARYPLUS
 	kfree(primain);
-	if (ipv4route != NULL)
-		kfree(ipv4route);
-	if (ipv6route != NULL)
-		kfree(ipv6route);
 #endif
-	nf_unregister_hooks(netmod_reg, ARRAY_SIZE(netmod_reg));
+	cleanup_p3net();
+	// Wait for released route table entries and session keys
+	rcu_barrier();
+	p3_crypto_cleanup();
+	remove_proc_entry(P3STATNAME, NULL);
+	p3pool_cleanup();
 	device_destroy (ramdisk_class, ramdisk_region);
 	class_destroy (ramdisk_class);
 	if (ramdisk_cdev)
 		cdev_del (ramdisk_cdev);
 	unregister_chrdev_region (ramdisk_region, count);
-	kfree (ramdisk);
+	free_pages ((unsigned long) ramdisk, ramdisk_order);
 
 	sprintf(p3buf, "%s: Exit\n", P3APP);
 	p3errmsg(p3MSG_INFO, p3buf);
@@ -20,7 +20,18 @@
 #include <linux/major.h>
 #include <linux/mm.h>
 #include <linux/spinlock.h>
+#include <linux/rcupdate.h>
+#include <asm/atomic.h>
 #include <linux/time.h>
+#include <linux/percpu.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/list.h>
+#include <linux/cpumask.h>
+#include <linux/kthread.h>
 
 #include <net/ip.h>
 #include <net/ipv6.h>
@@ -32,7 +43,9 @@
 #include <net/route.h>
 
 #define P3DEVNAME "p3dev"
+#define P3STATNAME "p3stats"
 #define P3IOC_TYPE 'p'
+#define p3GSO_BATCH	8	/* GSO segments encrypted together */
 
 /**
  * The Linux kernel changes frequently, so the support for these changes
@@ -110,7 +123,20 @@
 /*****  DATA DEFINITIONS  *****/
 
 typedef spinlock_t	p3lock;		/* The system dependent lock type */
+typedef struct rcu_head	p3rcu;	/* The system dependent RCU callback head */
+#if defined(ATOMIC64_INIT) || defined(CONFIG_GENERIC_ATOMIC64)
+typedef atomic64_t	p3seq;		/* The system dependent sequence counter */
+#else
+/* Older ARM and Android kernels have no 64 bit atomics */
+#define p3SEQ_LOCKED
+typedef struct { u64 counter; } p3seq;	/* Updated under p3seq_lock */
+#endif
+typedef atomic_t	p3ref;		/* The system dependent reference count */
 typedef struct _p3netdata p3netdata;
+typedef struct _p3pool p3pool;
+typedef struct _p3gso p3gso;
+typedef struct _p3parq p3parq;
+typedef struct _p3pjob p3pjob;
 
 /**
  * Structure:
@@ -136,6 +162,93 @@ struct _p3netdata {
 	unsigned char		p3remadr[MAX_ADDR_LEN];
 };
 
+/**
+ * Structure:
+ * p3pool
+ *
+ * \par Description:
+ * The per-CPU pool of preallocated packet work areas.  Each work area
+ * holds a p3work structure followed by two packet buffers of
+ * p3PKT_MAXSZ bytes, so the packet path does not allocate memory for
+ * each intercepted packet.
+ */
+
+struct _p3pool {
+#define p3POOL_DEPTH	64			/* Maximum work areas kept per CPU */
+#define p3POOL_FILL		16			/* Work areas preallocated per CPU */
+	void			*free[p3POOL_DEPTH];	/**< Work areas available on this CPU */
+	int				count;		/**< Number of available work areas */
+	unsigned long	hits;		/**< Work areas taken from the pool */
+	unsigned long	empty;		/**< Pool empty, allocated from cache */
+	unsigned long	large;		/**< Request too large for pool buffers */
+	unsigned long	fail;		/**< Allocation failures */
+};
+
+/**
+ * Structure:
+ * p3gso
+ *
+ * \par Description:
+ * The per-CPU counters for locally sent GSO packets, which are split
+ * into segments before encryption.
+ */
+
+struct _p3gso {
+	unsigned long	pkts;		/**< GSO packets segmented */
+	unsigned long	segs;		/**< Segments produced */
+	unsigned long	resize;		/**< Segment size reduced for the P3 header */
+	unsigned long	batched;	/**< Segments encrypted together */
+	unsigned long	fail;		/**< Segmentation failures */
+};
+
+/**
+ * Structure:
+ * p3parq
+ *
+ * \par Description:
+ * The reorder queue of the parallel crypto jobs of one session.  The
+ * jobs of a session are sent in the order they were queued, and do not
+ * wait for the jobs of other sessions.  Workers handle the packets of
+ * the session with the control lock held for read, and a control
+ * message of the session is handled with it held for write, so a rekey
+ * does not change the session while its packets are handled.
+ */
+
+struct _p3parq {
+	struct list_head	jobs;	/**< Jobs in the order they were queued */
+	spinlock_t			lock;	/**< Protects the jobs and the busy flag */
+	int					busy;	/**< A worker is sending handled jobs */
+	rwlock_t			ctl;	/**< Control message lock */
+};
+
+/**
+ * Structure:
+ * p3pjob
+ *
+ * \par Description:
+ * A packet queued to a parallel crypto worker.  Jobs are kept in the
+ * reorder queue of their session in the order they were taken from the
+ * stack, and are sent in that order when the workers finish them.  The
+ * lookup done when the job was queued is used by the worker.
+ */
+
+struct _p3pjob {
+	struct work_struct	work;	/**< Worker queue entry */
+	struct list_head	list;	/**< Reorder queue entry */
+	p3parq			*queue;		/**< Reorder queue of the session */
+	struct sk_buff		*skb;	/**< The packet */
+	int (*okfn)(struct sk_buff *);		/**< Hook completion function */
+	int (*sendfn)(struct sk_buff *);	/**< Function sending the new packet */
+	struct _p3net	*net;		/**< Network found by the lookup */
+	struct _p3host	*host;		/**< Source P3 host found by the lookup */
+	unsigned int	lflag;		/**< Packet flags set by the lookup */
+	unsigned int	seq;		/**< Reserved session sequence number */
+	unsigned int	verdict;	/**< Kernel stack instruction for the packet */
+	int				flag;
+#define p3PJB_FWD		0x01		/* Packet from the forward hook */
+#define p3PJB_DONE		0x02		/* Packet handled by the worker */
+};
+
 /*****  MACROS  *****/
 
 /* IP Macros */
@@ -152,13 +265,90 @@ struct _p3netdata {
 #define p3unlock(lock) \
 	spin_unlock(&lock)
 
+/* RCU Macros
+ * Readers of RCU protected tables run without locks between
+ * p3rcu_read_lock and p3rcu_read_unlock.  Writers hold the table p3lock,
+ * publish with p3rcu_assign and release with p3rcu_free.
+ */
+#define p3rcu_read_lock() \
+	rcu_read_lock()
+
+#define p3rcu_read_unlock() \
+	rcu_read_unlock()
+
+#define p3rcu_deref(ptr) \
+	rcu_dereference(ptr)
+
+#define p3rcu_assign(ptr, val) \
+	rcu_assign_pointer(ptr, val)
+
+#define p3rcu_call(head, func) \
+	call_rcu(head, func)
+
+/* Sequence Counter Macros
+ * Session sequence counters are 64 bits and are incremented without
+ * locks.  The low 32 bits are the sequence number sent in the P3 header.
+ * p3seq_add returns the counter value after the addition and is a full
+ * memory barrier.  Without 64 bit atomics the counters are updated
+ * under a lock by p3seq_update.
+ */
+#ifndef p3SEQ_LOCKED
+#define p3seq_set(seq, val) \
+	atomic64_set(&(seq), val)
+
+#define p3seq_read(seq) \
+	((unsigned int) atomic64_read(&(seq)))
+
+#define p3seq_add(seq, val) \
+	((unsigned int) atomic64_add_return(val, &(seq)))
+#else
+#define p3seq_set(seq, val) \
+	((void) p3seq_update(&(seq), val, 1))
+
+#define p3seq_read(seq) \
+	((unsigned int) ACCESS_ONCE((seq).counter))
+
+#define p3seq_add(seq, val) \
+	p3seq_update(&(seq), val, 0)
+#endif
+
+/* Reference Count Macros
+ * Structures shared by several owners are released by the owner that
+ * drops the last reference, p3ref_put is true for that owner.
+ */
+#define p3ref_set(ref, val) \
+	atomic_set(&(ref), val)
+
+#define p3ref_get(ref) \
+	atomic_inc(&(ref))
+
+#define p3ref_put(ref) \
+	atomic_dec_and_test(&(ref))
+
 MODULE_AUTHOR ("Velocite Systems");
 MODULE_DESCRIPTION ("Velocite Systems P3 kernel module");
 MODULE_LICENSE ("GPL");
 MODULE_ALIAS (P3APP);
 
 extern void p3errmsg(int type, char *message);
+extern void p3pkterr(int type, const char *format, ...);
 extern int p3send_packet(void *pkt);
 extern int p3net_utils(int type, void *p3skb, void *pkt);
+extern void *p3work_alloc(int size);
+extern void p3work_free(void *work);
+extern void p3rcu_free(void *buf);
+extern void p3parq_init(p3parq *queue);
+#ifdef p3SEQ_LOCKED
+extern unsigned int p3seq_update(p3seq *seq, int val, int set);
+#endif
+extern char *p3crypto;
+extern int p3key_low;
+extern int p3key_rings;
+extern void p3key_wake(void);
+extern void p3prep_wake(void);
+
+/*****  TRACE EVENTS  *****/
+
+#include "p3ktrace.h"
 
 #endif /* _p3k_LINUX_H */
@@ -22,6 +22,11 @@
 #define p3KSIZE_AES128	16
 #define p3KTYPE_AES256	2
 #define p3KSIZE_AES256	32
+#define p3KTYPE_AESGCM128	3	/* AES-GCM data, AES-CBC control with 128 bit keys */
+#define p3KTYPE_AESGCM256	4	/* AES-GCM data, AES-CBC control with 256 bit keys */
+#define p3KTYPE_AESCTR128	5	/* AES-CTR data, AES-CBC control with 128 bit keys */
+#define p3KTYPE_AESCTR256	6	/* AES-CTR data, AES-CBC control with 256 bit keys */
+#define p3KTYPE_CHACHA20	7	/* ChaCha20-Poly1305 data, AES-CBC control with 256 bit keys */
 #define p3MAX_KSIZE		p3KSIZE_AES256
 
 /*****  DATA DEFINITIONS  *****/
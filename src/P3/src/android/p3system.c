@@ -709,6 +709,16 @@ p3errmsg(p3MSG_DEBUG, " ==> Get key type\n");
 					shcfg.flag |= p3KTYPE_AES128 << p3HST_KTSHF;
 				} else if (!strcmp(datapos, "AES256")) {
 				   	shcfg.flag |= p3KTYPE_AES256 << p3HST_KTSHF;
+				} else if (!strcmp(datapos, "AESGCM128")) {
+					shcfg.flag |= p3KTYPE_AESGCM128 << p3HST_KTSHF;
+				} else if (!strcmp(datapos, "AESGCM256")) {
+					shcfg.flag |= p3KTYPE_AESGCM256 << p3HST_KTSHF;
+				} else if (!strcmp(datapos, "AESCTR128")) {
+					shcfg.flag |= p3KTYPE_AESCTR128 << p3HST_KTSHF;
+				} else if (!strcmp(datapos, "AESCTR256")) {
+					shcfg.flag |= p3KTYPE_AESCTR256 << p3HST_KTSHF;
+				} else if (!strcmp(datapos, "CHACHA20")) {
+					shcfg.flag |= p3KTYPE_CHACHA20 << p3HST_KTSHF;
 				} else {
 					sprintf(p3buf, "parse_config: %s:%d Invalid key_type value\n",
 							p3main->config, line);
@@ -106,6 +106,9 @@ out:
 int init_kernel_comm()
 {
 	int stat = 0, fd;
+#ifndef _p3_SECONDARY
+	off_t size;
+#endif
 
 	if ((fd = open (P3DEVNAME, O_RDWR)) < 0) {
 		sprintf (p3buf, "init_kernel_comm: Failed to open ramdisk:  %s\n",
@@ -118,7 +121,12 @@ int init_kernel_comm()
 	p3utils->anchor->pid = getpid();
 
 #ifndef _p3_SECONDARY
-	p3utils->anchor->kserv = (p3key_serv *) mmap (NULL, RAMDISK_SZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	// The kernel module sets the size of the RAM disk
+	if ((size = lseek (fd, 0, SEEK_END)) <= 0)
+		size = RAMDISK_SZ;
+	lseek (fd, 0, SEEK_SET);
+	p3utils->anchor->kserv = (p3key_serv *) mmap (NULL, size,
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 	if (p3utils->anchor->kserv == (p3key_serv *) MAP_FAILED) {
 		sprintf(p3buf, "init_kernel_comm: Failed to allocate p3 key server structure: %s\n",
 				strerror(errno));
@@ -128,9 +136,7 @@ int init_kernel_comm()
 		goto out;
 	}
 	// Initialize key server data structure and circular buffer
-	p3utils->anchor->kserv->cbuf_sz = RAMDISK_SZ;
-	p3utils->anchor->kserv->head = p3utils->anchor->kserv->tail = 0;
-	init_key_serv(p3utils->anchor->kserv);
+	init_key_serv(p3utils->anchor->kserv, (int) size);
 #endif
 
 out:
@@ -4,9 +4,14 @@
  *
  * Copyright (C) Velocite 2010
  *
- * The cryptography module provides true random keys for encryption and
+ * The cryptography module provides random keys for encryption and
  * handles the encryption and decryption of buffers.  It is only used by
  * the primary P3 host.
+ *
+ * The keys come from an AES-256 CTR_DRBG (NIST SP 800-90A) without a
+ * derivation function.  The DRBG is seeded once at start up from the
+ * operating system entropy pool, mixed with RDSEED on CPUs that have it,
+ * and is reseeded after p3RNG_RESEED generate requests.
  */
 
 #ifndef _p3_SECONDARY
@@ -47,39 +52,295 @@ FILE *InFile = NULL;
  */
 int p3_get_key(p3key *key)
 {
-	int i, stat = 0;
+	return (p3_get_keys(key->key, key->size));
+} /* end p3_get_key */
 
-	// Get an encryption key
+/**
+ * \par Function:
+ * p3_get_keys
+ *
+ * \par Description:
+ * Get a buffer of key material.  The key server fills a run of key
+ * slots with one call, so the keys are generated in bulk.
+ *
+ * \par Inputs:
+ * - keys: The buffer for the key material.
+ * - len: The number of bytes of key material.
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Error
+ *   - >0: Keys not obtained, retry later
+ */
+int p3_get_keys(unsigned char *keys, int len)
+{
+	int stat = 0;
 #ifdef p3FIXED_KEYS
+	int i;
+
+	// Get the encryption keys
 	if (InFile == NULL && (InFile = fopen(p3KEY_FILE,"r")) == NULL) {
 		p3errmsg(p3MSG_CRIT, "Error opening encryption key file\n");
 		stat = -1;
 		goto out;
 	}
-	if ((i = fread(key->key, 1, key->size, InFile)) < key->size) {
-sprintf(p3buf, "Read error: Req %d, Actual %d\n", key->size, i);
+	if ((i = fread(keys, 1, len, InFile)) < len) {
+sprintf(p3buf, "Read error: Req %d, Actual %d\n", len, i);
 p3errmsg(p3MSG_DEBUG, p3buf);
 		stat = 1;
 		goto out;
 	}
+out:
 #else
-	rng->rlen = key->size;
-	if ((stat = p3_genrand(rng)) < 0)
+	stat = p3_genrand(keys, len);
+#endif
+	return (stat);
+} /* end p3_get_keys */
+
+/**
+ * \par Function:
+ * p3_rdseed
+ *
+ * \par Description:
+ * Check for, or read from, the x86 RDSEED instruction.  The instruction
+ * is emitted as bytes since older assemblers do not know it.
+ *
+ * \par Inputs:
+ * - val: The location for the seed word, or NULL to check if the
+ *   CPU has the instruction.
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 1: The CPU has RDSEED, or a seed word was returned
+ *   - 0: No RDSEED, or no seed word was ready
+ */
+static int p3_rdseed(unsigned long *val)
+{
+	int ok = 0;
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int a, b, c, d, i;
+
+	if (val == NULL) {
+		// RDSEED is leaf 7, EBX bit 18.  EBX is saved for PIC.
+		__asm__ volatile ("xchg %%ebx, %1; cpuid; xchg %%ebx, %1"
+			: "=a" (a), "=&r" (b), "=c" (c), "=d" (d) : "0" (0), "2" (0));
+		if (a >= 7) {
+			__asm__ volatile ("xchg %%ebx, %1; cpuid; xchg %%ebx, %1"
+				: "=a" (a), "=&r" (b), "=c" (c), "=d" (d) : "0" (7), "2" (0));
+			ok = (b >> 18) & 1;
+		}
 		goto out;
-	memcpy(rng->rbuf, &key->key, key->size);
+	}
+	for (i=0; i < 10 && !ok; i++) {
+#ifdef __x86_64__
+		__asm__ volatile (".byte 0x48, 0x0f, 0xc7, 0xf8; setc %b1"
+			: "=a" (*val), "=q" (ok) : : "cc");
+#else
+		__asm__ volatile (".byte 0x0f, 0xc7, 0xf8; setc %b1"
+			: "=a" (*val), "=q" (ok) : : "cc");
+#endif
+		ok &= 1;
+	}
+out:
 #endif
+	return (ok);
+} /* end p3_rdseed */
+
+/**
+ * \par Function:
+ * get_entropy
+ *
+ * \par Description:
+ * Get entropy input for seeding the random number generator.  The
+ * input comes from getrandom, or /dev/urandom on kernels without it,
+ * and RDSEED words are mixed in when the CPU has the instruction.
+ *
+ * \par Inputs:
+ * - buf: The buffer for the entropy.
+ * - len: The number of bytes of entropy.
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Error
+ */
+int get_entropy(unsigned char *buf, int len)
+{
+	int stat = 0, fd, i, n = 0;
+	unsigned long word;
+
+#ifdef SYS_getrandom
+	while (n < len) {
+		if ((i = syscall(SYS_getrandom, buf + n, len - n, 0)) > 0)
+			n += i;
+		else if (errno != EINTR)
+			break;
+	}
+#endif
+	if (n < len) {
+		if ((fd = open("/dev/urandom", O_RDONLY)) < 0) {
+			sprintf(p3buf, "get_entropy: Failed to read the entropy pool: %s\n",
+					strerror(errno));
+			p3errmsg(p3MSG_CRIT, p3buf);
+			stat = -1;
+			goto out;
+		}
+		while (n < len) {
+			if ((i = read(fd, buf + n, len - n)) > 0)
+				n += i;
+			else if (i == 0 || errno != EINTR)
+				break;
+		}
+		close(fd);
+		if (n < len) {
+			sprintf(p3buf, "get_entropy: Failed to read the entropy pool: %s\n",
+					i < 0 ? strerror(errno) : "End of file");
+			p3errmsg(p3MSG_CRIT, p3buf);
+			stat = -1;
+			goto out;
+		}
+	}
+
+	// Mix in the CPU entropy source
+	for (n=0; rng->rdseed && n < len; n += sizeof(word)) {
+		if (!p3_rdseed(&word))
+			break;
+		for (i=0; i < sizeof(word) && (n + i) < len; i++)
+			buf[n + i] ^= (unsigned char) (word >> (i * 8));
+	}
 
 out:
 	return (stat);
-} /* end p3_get_key */
+} /* end get_entropy */
 
+/**
+ * \page P3SYSTEM_MSGS Protected Point to Point System Messages
+ * <hr><b>get_entropy: Failed to read the entropy pool: <i>error reason</i></b>
+ * \par Description (CRIT):
+ * The random number generator is seeded from the operating system
+ * entropy pool.  If the pool cannot be read, no keys can be made.
+ * \par Response:
+ * Troubleshoot the operating system problem based on the error reason.
+ *
+ */
 
 /**
  * \par Function:
- * p3init_rng
+ * p3_drbg_update
  *
  * \par Description:
- * Initialize the random number generator context.
+ * The CTR_DRBG update function.  The next three counter blocks are
+ * encrypted, combined with the provided data, and become the new key
+ * and counter.  The AES context is rebuilt with the new key.
+ *
+ * \par Inputs:
+ * - data: p3RNG_SEEDLEN bytes of provided data, or NULL for none.
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Error
+ */
+static int p3_drbg_update(unsigned char *data)
+{
+	int stat = 0, i, j;
+	unsigned char temp[p3RNG_SEEDLEN];
+
+	for (i=0; i < p3RNG_SEEDLEN; i += p3RNG_BLOCK) {
+		for (j=p3RNG_BLOCK-1; j >= 0 && ++rng->v[j] == 0; j--)
+			;
+		memcpy(&temp[i], rng->v, p3RNG_BLOCK);
+	}
+	if (DoAESECB(MOC_SYM(rng->hwAccelCtx) rng->ctx, temp, p3RNG_SEEDLEN,
+			TRUE, NULL) < OK) {
+		stat = -1;
+		goto out;
+	}
+	for (i=0; data != NULL && i < p3RNG_SEEDLEN; i++)
+		temp[i] ^= data[i];
+	memcpy(rng->key, temp, p3RNG_KEYLEN);
+	memcpy(rng->v, &temp[p3RNG_KEYLEN], p3RNG_BLOCK);
+
+	DeleteAESECBCtx(MOC_SYM(rng->hwAccelCtx) &rng->ctx);
+	if ((rng->ctx = CreateAESECBCtx(MOC_SYM(rng->hwAccelCtx) rng->key,
+			p3RNG_KEYLEN, TRUE)) == NULL)
+		stat = -1;
+
+out:
+	memset(temp, 0, sizeof(temp));
+	return (stat);
+} /* end p3_drbg_update */
+
+/**
+ * \par Function:
+ * p3_rng_seed
+ *
+ * \par Description:
+ * Seed or reseed the random number generator with new entropy input.
+ * The process ID and time are mixed into the first seed so that two
+ * key servers never share a DRBG state.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Error
+ */
+int p3_rng_seed(void)
+{
+	int stat = 0, i;
+	unsigned char seed[p3RNG_SEEDLEN];
+	struct timeval tv;
+	pid_t pid;
+
+	if ((stat = get_entropy(seed, p3RNG_SEEDLEN)) < 0)
+		goto out;
+	if (rng->ctx == NULL) {
+		gettimeofday(&tv, NULL);
+		pid = getpid();
+		for (i=0; i < sizeof(tv); i++)
+			seed[i] ^= ((unsigned char *) &tv)[i];
+		for (i=0; i < sizeof(pid); i++)
+			seed[sizeof(tv) + i] ^= ((unsigned char *) &pid)[i];
+		if ((rng->ctx = CreateAESECBCtx(MOC_SYM(rng->hwAccelCtx) rng->key,
+				p3RNG_KEYLEN, TRUE)) == NULL) {
+			stat = -1;
+			goto out;
+		}
+	}
+	if ((stat = p3_drbg_update(seed)) < 0)
+		goto out;
+	rng->reseed = 0;
+
+out:
+	memset(seed, 0, sizeof(seed));
+	if (stat < 0)
+		p3errmsg(p3MSG_ERR, "p3_rng_seed: Failed to seed the random number generator\n");
+	return (stat);
+} /* end p3_rng_seed */
+
+/**
+ * \page P3SYSTEM_MSGS Protected Point to Point System Messages
+ * <hr><b>p3_rng_seed: Failed to seed the random number generator</b>
+ * \par Description (ERR):
+ * The random number generator is seeded at start up and reseeded
+ * after p3RNG_RESEED requests.  The entropy could not be read or the
+ * AES context could not be created, so no keys are made.
+ * \par Response:
+ * Report the problem to Velocite Systems support.
+ *
+ */
+
+/**
+ * \par Function:
+ * init_rng
+ *
+ * \par Description:
+ * Initialize the random number generator context, seed it, and time
+ * it so the key generation rate is reported at start up.
  *
  * \par Inputs:
  * - None
@@ -92,11 +353,9 @@ out:
 
 int init_rng(void)
 {
-	int i, stat = 0;
-	unsigned long l;
+	int stat = 0;
 
-	i = sizeof(p3rng) + p3RNG_EBITS + 1;
-	if ((rng = (p3rng *) p3calloc(i)) == NULL) {
+	if ((rng = (p3rng *) p3calloc(sizeof(p3rng))) == NULL) {
 		sprintf(p3buf, "init_rng: Failed to allocate p3 random number\
  generator structure: %s\n", strerror(errno));
 		p3errmsg(p3MSG_CRIT, p3buf);
@@ -113,41 +372,64 @@ int init_rng(void)
 		stat = -1;
 		goto out;
 	}
-	l = (unsigned long) rng + sizeof(p3rng);
-	rng->rbuf = (unsigned char *) l;
-	l += p3RNG_RBUF_MIN;
-	rng->seed = (unsigned char *) l;
-	l += p3RNG_SEED_MIN;
-	rng->xkey = (unsigned char *) l;
-	l += p3RNG_XKEY_MIN;
-	rng->ebits = (unsigned char *) l;
-	rng->rlen = p3MAX_KSIZE;
-	rng->slen = p3RNG_SEED_SZ;
-	rng->xklen = p3RNG_XKEY_SZ;
-	rng->index = p3RNG_RBUF_MIN;
-
-	// Initialize entropy
-	for (i=p3RNG_RBUF_MIN; i < (p3RNG_EBITS + 1); i++) {
-		get_entropy();
+	rng->rdseed = p3_rdseed(NULL);
+
+	// Instantiate the DRBG with a zero key and counter
+	if ((stat = p3_rng_seed()) < 0) {
+		p3errmsg(p3MSG_CRIT,
+			"init_rng: Failed to initialize p3 random number generator\n");
+		goto out;
 	}
-//	HARDWARE_ACCEL_CLOSE_CHANNEL(MOCANA_SSL, &rng->hwAccelCtx);
+
+	sprintf(p3buf, "init_rng: Key generator rate %d keys/sec%s\n",
+			p3_rng_bench(p3RNG_BENCH), rng->rdseed ? ", RDSEED" : "");
+	p3errmsg(p3MSG_INFO, p3buf);
 
 out:
 	return (stat);
 
 } /* end init_rng */
 
+/**
+ * \page P3SYSTEM_MSGS Protected Point to Point System Messages
+ * <hr><b>init_rng: Failed to allocate p3 random number generator structure:
+ * <i>error reason</i></b>
+ * \par Description (CRIT):
+ * The random number generator structure could not be allocated.
+ * \par Response:
+ * Troubleshoot the system memory problem based on the error reason.
+ *
+ * <hr><b>init_rng: Failed to initialize p3 random number generator</b>
+ * \par Description (CRIT):
+ * The random number generator could not be set up or seeded, so no
+ * keys can be made.
+ * \par Response:
+ * Report the problem to Velocite Systems support.
+ *
+ * <hr><b>init_rng: Key generator rate <i>rate</i> keys/sec</b>
+ * \par Description (INFO):
+ * The random number generator is timed at start up.  The rate is the
+ * number of 32 byte keys it makes each second.  RDSEED is shown when
+ * the CPU entropy source is mixed into the seeds.
+ * \par Response:
+ * None required.
+ *
+ */
+
 /**
  * \par Function:
  * p3_genrand
  *
  * \par Description:
- * Generate a random number.  The P3 Random Number Generator structure
- * contains information about the random number, including the random
- * number itself, see p3crypto.h for the description of the fields.
+ * Generate random bytes with the CTR_DRBG.  The counter blocks are
+ * written into the output buffer and encrypted in place, so a large
+ * request is one pass of AES.  Requests larger than p3RNG_MAX_REQ are
+ * split, and the DRBG state is updated after each part so earlier
+ * output cannot be recovered from the state.
  *
  * \par Inputs:
- * - None
+ * - buf: The buffer for the random bytes.
+ * - len: The number of random bytes.
  *
  * \par Outputs:
  * - int: Status
@@ -155,122 +437,103 @@ out:
  *   - <0: Error
  */
 
-int p3_genrand()
+int p3_genrand(unsigned char *buf, int len)
 {
-	int stat = OK;
-	randomContext* pRandomContext = NULL;
-
-	if ((stat = RANDOM_newFIPS186Context(&pRandomContext, rng->xklen,
-			rng->xkey, rng->slen, rng->seed)) < OK) {
-		p3errmsg(p3MSG_ERR, "p3_genrand: RANDOM_newFIPS186Context failed\n");
-		stat = -1;
-		goto out;
-	}
-
-#ifndef __DISABLE_MOCANA_ADD_ENTROPY__
-	// Add 32 bits more rentropy
-	if ((stat = RANDOM_addEntropyBit(pRandomContext, rng->ebits[0])) < OK) {
-		p3errmsg(p3MSG_ERR, "p3_genrand: RANDOM_addEntropyBit failed\n");
-		stat = -1;
-		goto out;
-	}
-#endif
-
-	// Generates random number
-	if ((stat = RANDOM_numberGenerator(pRandomContext, rng->rbuf, rng->rlen))
-			< OK) {
-		p3errmsg(p3MSG_ERR, "p3_genrand: RANDOM_numberGenerator failed\n");
-		stat = -1;
-		goto out;
-	}
-
-	// Destroy RNG context to prevent memory leak
-	if ((stat = RANDOM_releaseContext(&pRandomContext)) < OK) {
-		p3errmsg(p3MSG_ERR, "p3_genrand: RANDOM_releaseContext failed\n");
-		stat = -1;
-		goto out;
+	int stat = 0, n, i, j;
+	unsigned char last[p3RNG_BLOCK];
+
+	while (len > 0) {
+		if (rng->reseed >= p3RNG_RESEED && (stat = p3_rng_seed()) < 0)
+			goto out;
+		n = len < p3RNG_MAX_REQ ? len : p3RNG_MAX_REQ;
+
+		// Fill the whole blocks with counters and encrypt them
+		for (i=0; i + p3RNG_BLOCK <= n; i += p3RNG_BLOCK) {
+			for (j=p3RNG_BLOCK-1; j >= 0 && ++rng->v[j] == 0; j--)
+				;
+			memcpy(&buf[i], rng->v, p3RNG_BLOCK);
+		}
+		if (i > 0 && DoAESECB(MOC_SYM(rng->hwAccelCtx) rng->ctx, buf, i,
+				TRUE, NULL) < OK) {
+			stat = -1;
+			goto out;
+		}
+		if (i < n) {
+			for (j=p3RNG_BLOCK-1; j >= 0 && ++rng->v[j] == 0; j--)
+				;
+			memcpy(last, rng->v, p3RNG_BLOCK);
+			if (DoAESECB(MOC_SYM(rng->hwAccelCtx) rng->ctx, last, p3RNG_BLOCK,
+					TRUE, NULL) < OK) {
+				stat = -1;
+				goto out;
+			}
+			memcpy(&buf[i], last, n - i);
+			memset(last, 0, sizeof(last));
+		}
+		if ((stat = p3_drbg_update(NULL)) < 0)
+			goto out;
+		rng->reseed++;
+		buf += n;
+		len -= n;
 	}
 
 out:
-	return stat;
+	if (stat < 0)
+		p3errmsg(p3MSG_ERR, "p3_genrand: Random number generator failed\n");
+	return (stat);
 
 } /* p3_genrand */
 
+/**
+ * \page P3SYSTEM_MSGS Protected Point to Point System Messages
+ * <hr><b>p3_genrand: Random number generator failed</b>
+ * \par Description (ERR):
+ * The AES engine of the random number generator returned an error,
+ * so no keys were made.
+ * \par Response:
+ * Report the problem to Velocite Systems support.
+ *
+ */
+
 /**
  * \par Function:
- * get_entropy
+ * p3_rng_bench
  *
  * \par Description:
- * Get one byte of entropy from microsecond clock and add
- * to the Random Number Generator structure array.
+ * Time the random number generator making keys the way the key server
+ * does, a batch of key slots in each request.
  *
  * \par Inputs:
- * - None
+ * - msec: The number of milliseconds to run.
  *
  * \par Outputs:
- * - None
+ * - int: Keys made per second, or 0 on error
  */
 
-// TODO: Run as a thread
-void get_entropy()
+int p3_rng_bench(int msec)
 {
-	int stat = 0;
-	unsigned int t1, t2, t3;
-	unsigned char byte;
-	struct timeval ts;
-	struct timezone tz;
-
-	gettimeofday(&ts, &tz);
-	t1 = ts.tv_usec;
-	usleep(231);
-	gettimeofday(&ts, &tz);
-	t2 = ts.tv_usec;
-	usleep(187);
-	gettimeofday(&ts, &tz);
-	t3 = ts.tv_usec;
-	usleep(23);
-
-	switch (t3 & 7) {
-	case 0:
-		byte = ((t1 >> 1) ^ t2) & 0xff;
-		break;
-
-	case 1:
-		byte = (t1 ^ (t2 >> 1)) & 0xff;
-		break;
-
-	case 2:
-		byte = ((t1 >>1) ^ (t2 >> 1)) & 0xff;
-		break;
-
-	case 3:
-		byte = ((t1 >> 2) ^ t2) & 0xff;
-		break;
-
-	case 4:
-		byte = ((t1 >> 2) ^ (t2 >> 1)) & 0xff;
-		break;
-
-	case 5:
-		byte = (t1 ^ (t2 >> 2)) & 0xff;
-		break;
-
-	case 6:
-		byte = ((t1 >> 1) ^ (t2 >> 2)) & 0xff;
-		break;
-
-	case 7:
-		byte = (t1 ^ t2) & 0xff;
-		break;
-
+	int keys = 0;
+	long usec = 0;
+	struct timeval start, now;
+	unsigned char buf[p3KSERV_BATCH * p3KSERV_SLOT];
+
+	gettimeofday(&start, NULL);
+	while (usec < msec * 1000L) {
+		if (p3_genrand(buf, sizeof(buf)) < 0) {
+			keys = 0;
+			goto out;
+		}
+		keys += p3KSERV_BATCH;
+		gettimeofday(&now, NULL);
+		usec = (now.tv_sec - start.tv_sec) * 1000000L +
+				(now.tv_usec - start.tv_usec);
 	}
+	keys = (int) ((keys * 1000000LL) / usec);
 
-	rng->rbuf[rng->index++] = byte;
-	if (rng->index >= (p3RNG_EBITS + 1))
-		rng->index = p3RNG_RBUF_MIN;
-
-	return;
-} /* end get_entropy */
+out:
+	memset(buf, 0, sizeof(buf));
+	return (keys);
+} /* end p3_rng_bench */
 
 #endif /* _p3_SECONDARY */
 
@@ -48,6 +48,7 @@
 #include "crypto/primeec.h"
 
 #include <sys/time.h>
+#include <sys/syscall.h>
 #include <time.h>
 
 #endif /* _p3_SECONDARY */
@@ -65,11 +66,23 @@
 #define p3KSIZE_AES128	16
 #define p3KTYPE_AES256	2
 #define p3KSIZE_AES256	32
+#define p3KTYPE_AESGCM128	3	/* AES-GCM data, AES-CBC control with 128 bit keys */
+#define p3KTYPE_AESGCM256	4	/* AES-GCM data, AES-CBC control with 256 bit keys */
+#define p3KTYPE_AESCTR128	5	/* AES-CTR data, AES-CBC control with 128 bit keys */
+#define p3KTYPE_AESCTR256	6	/* AES-CTR data, AES-CBC control with 256 bit keys */
+#define p3KTYPE_CHACHA20	7	/* ChaCha20-Poly1305 data, AES-CBC control with 256 bit keys */
 #define p3MAX_KSIZE		p3KSIZE_AES256
 
 #ifndef _p3_SECONDARY
 /*****  DATA DEFINITIONS  *****/
 
+#define p3RNG_KEYLEN	32		/* AES-256 DRBG key */
+#define p3RNG_BLOCK		16		/* AES block and DRBG counter */
+#define p3RNG_SEEDLEN	(p3RNG_KEYLEN + p3RNG_BLOCK)
+#define p3RNG_RESEED	(1 << 16)	/* Generate requests between reseeds */
+#define p3RNG_MAX_REQ	(1 << 16)	/* Most bytes in a generate request (2^19 bits) */
+#define p3RNG_BENCH		50		/* Milliseconds to time the generator at start */
+
 typedef struct _p3key p3key;
 typedef struct _p3rng p3rng;
 
@@ -91,36 +104,20 @@ struct _p3key {
  * p3rng
  * 
  * \par Description:
- * The structure to pass requirements to the random number generator.
- *
- * When the structure is allocated, it is immediately followed by an
- * unsigned array which contains the following fields:
- *   Name  Len
- *   ----  ---
- *   rbuf   64
- *   seed   64
- *   xkey   64
- *   ebits   1
+ * The state of the random number generator, an AES-256 CTR_DRBG
+ * without a derivation function (NIST SP 800-90A).  The state is kept
+ * for the life of the key server and is reseeded from the operating
+ * system entropy pool, and RDSEED when the CPU has it, after
+ * p3RNG_RESEED generate requests.
  */
 
 struct _p3rng {
 	hwAccelDescr	hwAccelCtx;
-	unsigned char	*rbuf;		/*<< Random number */
-	int				rlen;		/*<< Random number length */
-#define p3RNG_RBUF_MIN	p3MAX_KSIZE
-	unsigned char	*seed;		/*<< Seed for RNG */
-	int				slen;		/*<< Seed length */
-#define p3RNG_SEED		p3RNG_RBUF_MIN
-#define p3RNG_SEED_MIN	32		/* Mininum seed field */
-#define p3RNG_SEED_SZ	16
-	unsigned char	*xkey;		 /*<< Entropy added to the seed */
-	int				xklen;		 /*<< xKey length (20 - 64) */
-#define p3RNG_XKEY		(p3RNG_SEED + p3RNG_SEED_MIN)
-#define p3RNG_XKEY_MIN	32
-#define p3RNG_XKEY_SZ	30
-	unsigned char	*ebits;		/*<< Entropy bits (1 byte) */
-#define p3RNG_EBITS		(p3RNG_XKEY + p3RNG_XKEY_MIN)
-	int 			index;		/*<< Entropy generator index */
+	BulkCtx			ctx;		/*<< AES context for the DRBG key */
+	unsigned char	key[p3RNG_KEYLEN];	/*<< DRBG key */
+	unsigned char	v[p3RNG_BLOCK];		/*<< DRBG counter block */
+	unsigned int	reseed;		/*<< Generate requests since the last reseed */
+	int				rdseed;		/*<< CPU has the RDSEED instruction */
 };
 
 /*****  MACROS  *****/
@@ -128,10 +125,13 @@ struct _p3rng {
 /*****  PROTOTYPES  *****/
 
 int p3_get_key(p3key *key);
+int p3_get_keys(unsigned char *keys, int len);
 p3key **p3_get_key_array(int size, int number);
-int p3_genrand();
+int p3_genrand(unsigned char *buf, int len);
 int init_rng(void);
-void get_entropy(void);
+int p3_rng_seed(void);
+int p3_rng_bench(int msec);
+int get_entropy(unsigned char *buf, int len);
 
 
 /*****  EXTERNAL DEFINITIONS  *****/
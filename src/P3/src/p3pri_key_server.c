@@ -24,8 +24,6 @@
 
 /** The main key server data structure */
 p3key_serv *key_serv = NULL;
-/** The key server uses a single key structure */
-p3key keysrv_key, *ks_key = &keysrv_key;
 
 /**
  * \par Function:
@@ -36,12 +34,14 @@ p3key keysrv_key, *ks_key = &keysrv_key;
  * shared with the kernel module.  This memory includes the key server
  * data structure at the beginning, followed by the circular buffer.
  *
- * The circular buffer is an array of pointers to keys, because the
- * keys used by different sessions can be different sizes.  The kernel
- * module can use a key if the head and tail indexes are not equal.
+ * The circular buffer is an array of fixed size key slots, each large
+ * enough for the largest key, and the number of slots is a power of 2.
+ * The kernel module uses the start of a slot for a smaller key.  The
+ * kernel module can use a key if the head and tail counts are not equal.
  * 
  * \par Inputs:
  * - kserv: The location of the key server structure in the mmap'ed buffer.
+ * - size: The size of the mmap'ed buffer, in bytes
  *
  * \par Outputs:
  * - int: Status
@@ -49,32 +49,41 @@ p3key keysrv_key, *ks_key = &keysrv_key;
  *   - <0 = Error
  */
 
-int init_key_serv(p3key_serv *kserv)
+int init_key_serv(p3key_serv *kserv, int size)
 {
-	int stat = 0;
-	unsigned long l;
-	unsigned char *cbuf;
+	int stat = 0, slots, rings, n, r;
+	p3key_ring *kring;
 
 	if (kserv == NULL) {
 		p3errmsg(p3MSG_ERR, "init_key_serv: Key server structure location NULL\n");
 		stat = -1;
 		goto out;
 	}
-
-	// Initialize keys for the kernel module
-	key_serv = kserv;
-	ks_key->size = p3MIN_KSIZE;
-	stat = buffer_handler();
-	if ((stat = p3_get_key(ks_key)) < 0) {
+	// The kernel module sets the number of rings
+	if ((rings = kserv->rings) < 1 || rings > p3KSERV_RINGS) {
+		sprintf(p3buf, "init_key_serv: Invalid number of key rings: %d\n", rings);
+		p3errmsg(p3MSG_ERR, p3buf);
 		stat = -1;
 		goto out;
-	} else if (stat > 0) {
+	}
+	if ((slots = (size - (int) sizeof(p3key_serv) -
+			(rings * (int) sizeof(p3key_ring))) / p3KSERV_SLOT / rings) < 1) {
+		p3errmsg(p3MSG_ERR, "init_key_serv: No room for keys in the mmap'ed buffer\n");
+		stat = -1;
 		goto out;
 	}
-	l = (unsigned long) key_serv + sizeof(p3key_serv);
-	cbuf = (unsigned char *) l;
-	memcpy(&cbuf[key_serv->tail], ks_key->key, ks_key->size);
-	key_serv->tail += ks_key->size;
+
+	// The counts can wrap because the number of slots is a power of 2
+	for (n=1; (n << 1) <= slots; n <<= 1)
+		;
+	kring = (p3key_ring *) (kserv + 1);
+	for (r=0; r < rings; r++)
+		kring[r].head = kring[r].tail = 0;
+	kserv->cbuf_sz = n;
+
+	// Initialize keys for the kernel module
+	key_serv = kserv;
+	stat = buffer_handler();
 
 out:
 	return (stat);
@@ -91,6 +100,23 @@ out:
  * \par Response:
  * Report the problem to Velocite Systems support.
  *
+ * <hr><b>init_key_serv: Invalid number of key rings: <i>rings</i></b>
+ * \par Description (ERR):
+ * The kernel module sets the number of key rings in the mmap'ed buffer
+ * from its p3key_rings parameter.  The number is not between 1 and 256,
+ * so the buffer was not set up by a matching kernel module.  No keys are
+ * given to the kernel module.
+ * \par Response:
+ * Make sure the kernel module and P3 primary are the same version.
+ *
+ * <hr><b>init_key_serv: No room for keys in the mmap'ed buffer</b>
+ * \par Description (ERR):
+ * The buffer shared with the kernel module is too small for the key
+ * server data structures and one key slot in each ring.  No keys are
+ * given to the kernel module.
+ * \par Response:
+ * Load the kernel module with a larger p3ramdisk_kb or fewer p3key_rings.
+ *
  */
 
 /**
@@ -98,11 +124,15 @@ out:
  * buffer_handler
  *
  * \par Description:
- * Handle the circular buffer shared with the kernel module.
- * This is done when the tail index is not equal to the head index.
- * In this case, a new key is created in the current head slot
- * and the head pointer is incremented to indicate that the key
- * is available.
+ * Handle the circular buffers shared with the kernel module.
+ * Each ring is filled in turn.  The free slots of a ring are the ones
+ * between its tail and its head, since the kernel module is finished
+ * with a slot before it moves the head past it.  Each batch of keys is
+ * made in place in the free slots with one generator request, and the
+ * tail is moved after the batch to make the keys available.  The
+ * barriers make sure the kernel module sees a key before the tail that
+ * covers it, and that the kernel module has read a key before its slot
+ * is reused.
  *
  * \par Inputs:
  * - None
@@ -115,31 +145,43 @@ out:
 
 int buffer_handler()
 {
-	int stat = 0;
-	unsigned long l;
+	int stat = 0, free, n, r;
+	unsigned int head, tail, mask;
 	unsigned char *cbuf;
+	p3key_ring *kring;
 
 	if (key_serv == NULL)
 		goto out;
-	l = (unsigned long) key_serv + sizeof(p3key_serv);
-	cbuf = (unsigned char *) l;
-
-	// Add new keys and update tail pointer
-	while ((key_serv->head < key_serv->tail &&
-			key_serv->tail <= (key_serv->cbuf_sz - ks_key->size)) ||
-			(0 < key_serv->head && key_serv->tail <
-			(key_serv->head - ks_key->size))) {
-		if ((stat = p3_get_key(ks_key)) < 0) {
-			stat = -1;
-			goto out;
-		} else if (stat > 0) {
-			goto out;
-		}
-		memcpy(&cbuf[key_serv->tail], ks_key->key, ks_key->size);
-		key_serv->tail += ks_key->size;
-		if (key_serv->tail > (key_serv->cbuf_sz - ks_key->size)) {
-p3errmsg(p3MSG_DEBUG, "Cbuf tail wrapped\n");
-			key_serv->tail = 0;
+	mask = key_serv->cbuf_sz - 1;
+	kring = (p3key_ring *) (key_serv + 1);
+	cbuf = (unsigned char *) (kring + key_serv->rings);
+
+	for (r=0; r < key_serv->rings && stat == 0;
+			r++, kring++, cbuf += key_serv->cbuf_sz * p3KSERV_SLOT) {
+		tail = kring->tail;
+
+		// Reserve the free slots
+		head = kring->head;
+		p3KSERV_BARRIER();
+		free = key_serv->cbuf_sz - (int) (tail - head);
+
+		// Make a batch of keys in place and update tail count
+		while (free > 0) {
+			n = p3KSERV_BATCH - (int) (tail & (p3KSERV_BATCH - 1));
+			n = n < free ? n : free;
+			if (n > key_serv->cbuf_sz - (int) (tail & mask))
+				n = key_serv->cbuf_sz - (int) (tail & mask);
+			if ((stat = p3_get_keys(&cbuf[(tail & mask) * p3KSERV_SLOT],
+					n * p3KSERV_SLOT)) < 0) {
+				stat = -1;
+				break;
+			} else if (stat > 0) {
+				break;
+			}
+			tail += n;
+			free -= n;
+			p3KSERV_BARRIER();
+			kring->tail = tail;
 		}
 	}
 
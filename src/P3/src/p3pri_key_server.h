@@ -14,9 +14,15 @@
 
 /*****  CONSTANTS  *****/
 
+#define p3KSERV_LINE	64		/* Cache line size, the head and tail are on separate lines */
+#define p3KSERV_SLOT	32		/* Bytes in each key slot, which holds the largest key */
+#define p3KSERV_BATCH	64		/* Keys made in one generator request and published together */
+#define p3KSERV_RINGS	256		/* Most key rings in the buffer */
+
 /*****  DATA DEFINITIONS  *****/
 
 typedef struct _p3key_serv p3key_serv;
+typedef struct _p3key_ring p3key_ring;
 
 /**
  * Structure:
@@ -24,19 +30,45 @@ typedef struct _p3key_serv p3key_serv;
  * 
  * \par Description:
  * The key server structure to maintain information about encyrption keys.
+ * The structure is at the start of the buffer shared with the kernel
+ * module.  It is followed by a p3key_ring for each key ring, then the
+ * key slots of each ring in turn.  The kernel module sets the number of
+ * rings and the key server sets the number of slots in each ring.
  */
 
 struct _p3key_serv {
-	int				head;		/**< Head pointer index for the circular buffer */
-	int				tail;		/**< Tail pointer index for the circular buffer */
-	int				cbuf_sz;	/**< Number of slots in the circular buffer */
+	int				cbuf_sz;	/**< Number of key slots in each ring (power of 2) */
+	int				rings;		/**< Number of rings, set by the kernel module */
+	unsigned char	pad0[p3KSERV_LINE - (2 * sizeof(int))];
+};
+
+/**
+ * Structure:
+ * p3key_ring
+ *
+ * \par Description:
+ * The counts of a key ring.  The head and tail count the keys taken and
+ * added, and a key is in slot (count & (cbuf_sz - 1)) of the ring.  The
+ * key server only writes the tail and the kernel module only writes the
+ * head, so neither side takes a lock.
+ */
+
+struct _p3key_ring {
+	volatile unsigned int	head;	/**< Keys taken by the kernel module */
+	unsigned char	pad0[p3KSERV_LINE - sizeof(int)];
+	volatile unsigned int	tail;	/**< Keys added by the key server */
+	unsigned char	pad1[p3KSERV_LINE - sizeof(int)];
 };
 
 /*****  MACROS  *****/
 
+/* Full memory barrier between the key slots and the head or tail */
+#define p3KSERV_BARRIER() \
+	__sync_synchronize()
+
 /*****  PROTOTYPES  *****/
 
-int init_key_serv(p3key_serv *kserv);
+int init_key_serv(p3key_serv *kserv, int size);
 int buffer_handler();
 
 /*****  EXTERNAL DEFINITIONS  *****/
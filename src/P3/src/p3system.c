@@ -1073,6 +1073,16 @@ p3errmsg(p3MSG_DEBUG, " ==> Get key type\n");
 					shcfg.flag |= p3KTYPE_AES128 << p3HST_KTSHF;
 				} else if (!strcmp(datapos, "AES256")) {
 				   	shcfg.flag |= p3KTYPE_AES256 << p3HST_KTSHF;
+				} else if (!strcmp(datapos, "AESGCM128")) {
+					shcfg.flag |= p3KTYPE_AESGCM128 << p3HST_KTSHF;
+				} else if (!strcmp(datapos, "AESGCM256")) {
+					shcfg.flag |= p3KTYPE_AESGCM256 << p3HST_KTSHF;
+				} else if (!strcmp(datapos, "AESCTR128")) {
+					shcfg.flag |= p3KTYPE_AESCTR128 << p3HST_KTSHF;
+				} else if (!strcmp(datapos, "AESCTR256")) {
+					shcfg.flag |= p3KTYPE_AESCTR256 << p3HST_KTSHF;
+				} else if (!strcmp(datapos, "CHACHA20")) {
+					shcfg.flag |= p3KTYPE_CHACHA20 << p3HST_KTSHF;
 				} else {
 					sprintf(p3buf, "parse_config: %s:%d Invalid key_type value\n",
 							p3main->config, line);
@@ -1326,7 +1336,8 @@ out:
  * each loop, check for the following:
  * - User Interface requests through a FIFO
  * - Secondary connection requests
- * - Key management requirements
+ * - Key management requirements, signalled by the kernel module through
+ *   the RAM disk when its keys are low
  *
  * \par Inputs:
  * - None
@@ -1366,6 +1377,13 @@ int system_handler()
 //			snet = snet->next;
 //		}
 
+		// Monitor the kernel module for low keys
+		if (p3utils->anchor->fd > 0) {
+			FD_SET(p3utils->anchor->fd, &fdset);
+			if (numfds <= p3utils->anchor->fd)
+				numfds = p3utils->anchor->fd + 1;
+		}
+
 		// Monitor FIFOs
 		FD_SET(admin->fifo1_in, &fdset);
 		if (numfds <= admin->fifo1_in)
@@ -1463,13 +1481,9 @@ p3errmsg(p3MSG_DEBUG, "Init secondary\n");
 			}
 		}
 
-		// Perform key management
-		// TODO: Call buffer handler more efficiently
+		// Perform key management, the kernel module wakes the select
+		// when the keys it has left drop below its low watermark
 		buffer_handler();
-
-		// Build entropy
-		// TODO: Run get entropy as thread
-		get_entropy();
 	}
 
 out:
@@ -124,6 +124,9 @@ out:
 int init_kernel_comm()
 {
 	int stat = 0, fd;
+#ifndef _p3_SECONDARY
+	off_t size;
+#endif
 
 p3errmsg (p3MSG_DEBUG, "Open RAM disk\n");
 	if ((fd = open (P3DEVNAME, O_RDWR)) < 0) {
@@ -138,7 +141,11 @@ p3errmsg (p3MSG_DEBUG, "Open RAM disk\n");
 
 #ifndef _p3_SECONDARY
 p3errmsg (p3MSG_DEBUG, "MMap RAM disk\n");
-	p3utils->anchor->kserv = (p3key_serv *) mmap (NULL, RAMDISK_SZ,
+	// The kernel module sets the size of the RAM disk
+	if ((size = lseek (fd, 0, SEEK_END)) <= 0)
+		size = RAMDISK_SZ;
+	lseek (fd, 0, SEEK_SET);
+	p3utils->anchor->kserv = (p3key_serv *) mmap (NULL, size,
 			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 	if (p3utils->anchor->kserv == (p3key_serv *) MAP_FAILED) {
 		sprintf(p3buf, "init_kernel_comm: Failed to allocate p3 key server\
@@ -149,11 +156,8 @@ p3errmsg (p3MSG_DEBUG, "MMap RAM disk\n");
 		goto out;
 	}
 	// Initialize key server data structure and circular buffer
-p3errmsg (p3MSG_DEBUG, "Init circular buffer\n");
-	p3utils->anchor->kserv->cbuf_sz = RAMDISK_SZ - sizeof(p3key_serv);
-	p3utils->anchor->kserv->head = p3utils->anchor->kserv->tail = 0;
 p3errmsg (p3MSG_DEBUG, "Init key server\n");
-	init_key_serv(p3utils->anchor->kserv);
+	init_key_serv(p3utils->anchor->kserv, (int) size);
 #endif
 
 out:
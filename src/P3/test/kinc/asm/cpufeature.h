@@ -0,0 +1 @@
+/* User space stand-in for <asm/cpufeature.h>, see p3ktest.h */
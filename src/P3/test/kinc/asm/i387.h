@@ -0,0 +1 @@
+/* User space stand-in for <asm/i387.h>, see p3ktest.h */
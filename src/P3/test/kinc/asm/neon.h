@@ -0,0 +1 @@
+/* User space stand-in for <asm/neon.h>, see p3ktest.h */
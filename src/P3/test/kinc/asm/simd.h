@@ -0,0 +1 @@
+/* User space stand-in for <asm/simd.h>, see p3ktest.h */
@@ -0,0 +1 @@
+/* User space stand-in for <linux/cpufeature.h>, see p3ktest.h */
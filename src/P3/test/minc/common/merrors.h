@@ -0,0 +1,2 @@
+/* User space stand-in for the Mocana <common/merrors.h>, see p3drbg_test.c */
+#include "moc_src/merrors.h"
@@ -0,0 +1,2 @@
+/* User space stand-in for the Mocana <common/mstdlib.h>, see p3drbg_test.c */
+#include "moc_src/mstdlib.h"
@@ -0,0 +1,2 @@
+/* User space stand-in for the Mocana <common/mtypes.h>, see p3drbg_test.c */
+#include "moc_src/mtypes.h"
@@ -0,0 +1 @@
+/* User space stand-in for the Mocana <common/vlong.h>, see p3drbg_test.c */
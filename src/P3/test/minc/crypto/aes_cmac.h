@@ -0,0 +1,2 @@
+/* User space stand-in for the Mocana <crypto/aes_cmac.h>, see p3drbg_test.c */
+#include "moc_src/aes_cmac.h"
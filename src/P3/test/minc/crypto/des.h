@@ -0,0 +1 @@
+/* User space stand-in for the Mocana <crypto/des.h>, see p3drbg_test.c */
@@ -0,0 +1 @@
+/* User space stand-in for the Mocana <crypto/dsa.h>, see p3drbg_test.c */
@@ -0,0 +1 @@
+/* User space stand-in for the Mocana <crypto/hmac.h>, see p3drbg_test.c */
@@ -0,0 +1 @@
+/* User space stand-in for the Mocana <crypto/md5.h>, see p3drbg_test.c */
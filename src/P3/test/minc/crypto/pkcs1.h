@@ -0,0 +1 @@
+/* User space stand-in for the Mocana <crypto/pkcs1.h>, see p3drbg_test.c */
@@ -0,0 +1 @@
+/* User space stand-in for the Mocana <crypto/primefld.h>, see p3drbg_test.c */
@@ -0,0 +1 @@
+/* User space stand-in for the Mocana <crypto/sha512.h>, see p3drbg_test.c */
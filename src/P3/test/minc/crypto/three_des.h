@@ -0,0 +1 @@
+/* User space stand-in for the Mocana <crypto/three_des.h>, see p3drbg_test.c */
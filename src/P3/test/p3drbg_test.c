@@ -0,0 +1,316 @@
+/**
+ * \file p3drbg_test.c
+ * <h3>Protected Point to Point key generator test file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * Check the AES-256 CTR_DRBG of the primary key server (src/p3crypto.c)
+ * against known answers, and measure the key generation rate.  The
+ * known answers were made with the OpenSSL CTR-DRBG (AES-256-CTR, no
+ * derivation function, empty personalization string) from the same
+ * entropy input.  They cover a reseed, a partial last block and a
+ * request that is split at p3RNG_MAX_REQ.
+ *
+ * The first seed of p3_rng_seed mixes in the time and process ID, so
+ * the known answer tests instantiate the DRBG from the entropy input
+ * themselves.  p3crypto.c is included so its static functions can be
+ * called.  The seeding and reseeding from the operating system are
+ * checked separately.
+ *
+ * The Mocana headers used by p3crypto.c are taken from the kernel
+ * module copy (minc), and the Mocana AES-ECB functions are built here
+ * on the AES table code.
+ *
+ * Usage: p3drbg_test [-b] [-n count]
+ */
+
+/*****  INCLUDE FILES *****/
+
+/* The DRBG functions under test are static */
+#include "p3crypto.c"
+
+#include "p3ktest.h"
+#include "moc_src/aesalgo.h"
+
+/*****  CONSTANTS  *****/
+
+#define DRBG_TESTS		1000	/**< Default number of seeding checks */
+#define DRBG_BENCH		20000	/**< Benchmark requests of each size */
+#define DRBG_MAXOUT		(p3RNG_MAX_REQ + 64)	/**< Largest known answer */
+
+/*****  DATA DEFINITIONS  *****/
+
+/**
+ * Structure:
+ * drbgvec
+ *
+ * \par Description:
+ * A CTR_DRBG known answer test vector.  The DRBG is instantiated with
+ * the entropy input, optionally reseeded, and then two requests are
+ * made.  The expected bytes start at the given offset of the output.
+ */
+
+typedef struct _drbgvec {
+	const char		*name;
+	const char		*entropy;	/**< Instantiate entropy input */
+	const char		*reseed;	/**< Reseed entropy input or "" */
+	int				req[2];		/**< Sizes of the generate requests */
+	int				offset;		/**< Offset of the expected bytes */
+	const char		*expect;	/**< Expected output */
+} drbgvec;
+
+static const drbgvec drbgvecs[] = {
+	{ "Reseed",
+	  "01080f161d242b323940474e555c636a71787f868d949ba2a9b0b7bec5ccd3da"
+	  "e1e8eff6fd040b121920272e353c434a",
+	  "fffaf5f0ebe6e1dcd7d2cdc8c3beb9b4afaaa5a09b96918c87827d78736e6964"
+	  "5f5a55504b46413c37322d28231e1914",
+	  { 64, 64 }, 64,
+	  "0dad3fdf888c6d8b0702d3918a89d3d9a0e95efe9902d9fe43f3cb4d28363c11"
+	  "54e7106bc550f1d9b5fbf78d10ac947a1c066b9924a3e9621bfc85b321a74f4f" },
+	{ "Partial block",
+	  "0e151c232a31383f464d545b626970777e858c939aa1a8afb6bdc4cbd2d9e0e7"
+	  "eef5fc030a11181f262d343b42495057",
+	  "",
+	  { 20, 16 }, 0,
+	  "9ed309d71730142223e4332db5f4531f4d575fb12859660c92ac695db867f5fd"
+	  "8825e42e" },
+	{ "Split request",
+	  "1b222930373e454c535a61686f767d848b9299a0a7aeb5bcc3cad1d8dfe6edf4"
+	  "fb020910171e252c333a41484f565d64",
+	  "",
+	  { p3RNG_MAX_REQ + 40, 0 }, p3RNG_MAX_REQ - 24,
+	  "2dbdc7d88c379264807ec0d38f0ad167c186544e66c6c7ca1fd7b09ef0f4c855"
+	  "58f91be1462e4f588834e89f07b7a6b56d97332d48af61aaf729d3f59c6a9e76" },
+};
+
+/* Defined by the key server (p3system.c) */
+p3rng *rng = NULL;
+static char drbgbuf[1024];
+char *p3buf = drbgbuf;
+
+/*****  PROTOTYPES  *****/
+
+/*****  EXTERNAL DEFINITIONS  *****/
+
+/**
+ * \par Function:
+ * CreateAESECBCtx, DoAESECB, DeleteAESECBCtx
+ *
+ * \par Description:
+ * The Mocana AES-ECB encryption functions used by the DRBG, built on
+ * the AES table code.
+ */
+
+BulkCtx CreateAESECBCtx(MOC_SYM(hwAccelDescr hwAccelCtx) ubyte *keyMaterial,
+		sbyte4 keyLength, sbyte4 encrypt)
+{
+	aesCipherContext *ctx;
+
+	if (!encrypt || (ctx = calloc(1, sizeof(aesCipherContext))) == NULL)
+		return (NULL);
+	ctx->encrypt = encrypt;
+	ctx->keyLen = keyLength;
+	ctx->Nr = aesKeySetupEnc(ctx->rk, keyMaterial, keyLength << 3);
+	return ((BulkCtx) ctx);
+} /* end CreateAESECBCtx */
+
+MSTATUS DoAESECB(MOC_SYM(hwAccelDescr hwAccelCtx) BulkCtx ctx, ubyte *data,
+		sbyte4 dataLength, sbyte4 encrypt, ubyte *iv)
+{
+	aesCipherContext *aes = (aesCipherContext *) ctx;
+	int i;
+
+	if (!encrypt || !aes->encrypt)
+		return (ERR_AES_BAD_OPERATION);
+	if (dataLength % p3RNG_BLOCK)
+		return (ERR_AES_BAD_LENGTH);
+	for (i=0; i < dataLength; i += p3RNG_BLOCK)
+		aesEncrypt(aes->rk, aes->Nr, &data[i], &data[i]);
+	return (OK);
+} /* end DoAESECB */
+
+MSTATUS DeleteAESECBCtx(MOC_SYM(hwAccelDescr hwAccelCtx) BulkCtx *ctx)
+{
+	if (*ctx != NULL) {
+		memset(*ctx, 0, sizeof(aesCipherContext));
+		free(*ctx);
+		*ctx = NULL;
+	}
+	return (OK);
+} /* end DeleteAESECBCtx */
+
+/**
+ * \par Function:
+ * drbg_instantiate
+ *
+ * \par Description:
+ * Instantiate the DRBG from an entropy input, as p3_rng_seed does
+ * without the time and process ID.
+ *
+ * \par Inputs:
+ * - entropy: p3RNG_SEEDLEN bytes of entropy input
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Error
+ */
+
+static int drbg_instantiate(unsigned char *entropy)
+{
+	DeleteAESECBCtx(MOC_SYM(rng->hwAccelCtx) &rng->ctx);
+	memset(rng->key, 0, sizeof(rng->key));
+	memset(rng->v, 0, sizeof(rng->v));
+	rng->reseed = 0;
+	if ((rng->ctx = CreateAESECBCtx(MOC_SYM(rng->hwAccelCtx) rng->key,
+			p3RNG_KEYLEN, TRUE)) == NULL)
+		return (-1);
+	return (p3_drbg_update(entropy));
+} /* end drbg_instantiate */
+
+/**
+ * \par Function:
+ * drbg_vectors
+ *
+ * \par Description:
+ * Check the known answer vectors.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void drbg_vectors(void)
+{
+	static unsigned char out[DRBG_MAXOUT], expect[DRBG_MAXOUT];
+	unsigned char entropy[p3RNG_SEEDLEN];
+	int i, len, stat;
+
+	for (i=0; i < (int) (sizeof(drbgvecs) / sizeof(drbgvec)); i++) {
+		p3test_hex(drbgvecs[i].entropy, entropy, sizeof(entropy));
+		len = p3test_hex(drbgvecs[i].expect, expect, sizeof(expect));
+		stat = drbg_instantiate(entropy);
+		if (stat == 0 && drbgvecs[i].reseed[0] != '\0') {
+			p3test_hex(drbgvecs[i].reseed, entropy, sizeof(entropy));
+			stat = p3_drbg_update(entropy);
+		}
+		if (stat == 0)
+			stat = p3_genrand(out, drbgvecs[i].req[0]);
+		if (stat == 0 && drbgvecs[i].req[1] > 0)
+			stat = p3_genrand(&out[drbgvecs[i].req[0]], drbgvecs[i].req[1]);
+		if (stat < 0)
+			p3test_check(drbgvecs[i].name, (unsigned char *) "",
+					(unsigned char *) "x", 1);
+		else
+			p3test_check(drbgvecs[i].name, &out[drbgvecs[i].offset], expect,
+					len);
+	}
+} /* end drbg_vectors */
+
+/**
+ * \par Function:
+ * drbg_seed
+ *
+ * \par Description:
+ * Seed the DRBG from the operating system as the key server does, and
+ * check that the output changes and that it is reseeded after
+ * p3RNG_RESEED requests.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void drbg_seed(void)
+{
+	unsigned char a[p3KSERV_SLOT], b[p3KSERV_SLOT];
+	int i;
+
+	if (p3_rng_seed() < 0 || p3_genrand(a, sizeof(a)) < 0) {
+		p3test_check("Seed", (unsigned char *) "", (unsigned char *) "x", 1);
+		return;
+	}
+	for (i=0; i < p3test_count; i++) {
+		if (p3_genrand(b, sizeof(b)) < 0 || memcmp(a, b, sizeof(a)) == 0) {
+			p3test_check("Repeated output", (unsigned char *) "",
+					(unsigned char *) "x", 1);
+			return;
+		}
+		memcpy(a, b, sizeof(a));
+	}
+
+	// The next request reseeds and restarts the count
+	rng->reseed = p3RNG_RESEED;
+	if (p3_genrand(b, sizeof(b)) < 0 || rng->reseed != 1)
+		p3test_check("Reseed", (unsigned char *) "", (unsigned char *) "x", 1);
+} /* end drbg_seed */
+
+/**
+ * \par Function:
+ * drbg_bench
+ *
+ * \par Description:
+ * Measure the rate of the DRBG for a single key and for a key server
+ * batch, and the key rate reported at start up.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void drbg_bench(void)
+{
+	static const int sizes[] = { p3KSERV_SLOT, p3KSERV_BATCH * p3KSERV_SLOT };
+	static unsigned char buf[p3KSERV_BATCH * p3KSERV_SLOT];
+	double start;
+	int i, j;
+
+	for (i=0; i < (int) (sizeof(sizes) / sizeof(int)); i++) {
+		start = p3test_time();
+		for (j=0; j < p3test_count; j++)
+			p3_genrand(buf, sizes[i]);
+		p3test_rate("CTR_DRBG", sizes[i], p3test_count, p3test_time() - start);
+	}
+	printf("p3_rng_bench: %d keys/sec\n", p3_rng_bench(1000));
+} /* end drbg_bench */
+
+/**
+ * \par Function:
+ * main
+ *
+ * \par Description:
+ * Run the key generator tests or benchmark.
+ *
+ * \par Inputs:
+ * - argc: The number of arguments
+ * - argv: The arguments
+ *
+ * \par Outputs:
+ * - int: 0 if all checks passed, else 1
+ */
+
+int main(int argc, char **argv)
+{
+	p3test_args(argc, argv, DRBG_TESTS);
+	if (init_rng() < 0) {
+		printf("%s: init_rng failed\n", argv[0]);
+		return (1);
+	}
+	if (p3test_bench) {
+		if (p3test_count == DRBG_TESTS)
+			p3test_count = DRBG_BENCH;
+		drbg_bench();
+		return (p3test_done(argv[0]));
+	}
+
+	drbg_vectors();
+	drbg_seed();
+	return (p3test_done(argv[0]));
+} /* end main */
@@ -0,0 +1,378 @@
+/**
+ * \file p3kaes_test.c
+ * <h3>Protected Point to Point AES instruction test file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * Check the CBC mode of DoAES with the AES instructions (p3kaesni.c)
+ * and the bitsliced AES code (p3kbsaes.c) against the NIST SP 800-38A
+ * CBC vectors and the AES table code, and measure the throughput of
+ * each.  Random buffers of every size are encrypted and decrypted by
+ * each implementation, and the several buffer function is checked with
+ * streams of different keys and sizes.
+ *
+ * On a CPU without the AES instructions they are not checked.  On ARM
+ * the AES instruction functions use the ARMv8 Crypto Extensions
+ * (p3karm.c), and 'make cross' builds the tests for aarch64.
+ *
+ * Usage: p3kaes_test [-b] [-n count]
+ */
+
+/*****  INCLUDE FILES *****/
+
+#include "p3kbase.h"
+
+#include "moc_src/moptions.h"
+#include "moc_src/mtypes.h"
+#include "moc_src/mdefs.h"
+#include "moc_src/merrors.h"
+#include "moc_src/hw_accel.h"
+#include "moc_src/aesalgo.h"
+#include "moc_src/aes.h"
+
+#include "p3kaesni.h"
+#include "p3kbsaes.h"
+
+/*****  CONSTANTS  *****/
+
+#define AES_TESTS		20000	/**< Default number of random buffers */
+#define AES_BENCH		200000	/**< Benchmark buffers of each size */
+#define AES_STREAMS		(2 * p3AESNI_WAYS + 1)	/**< Most buffers encrypted together */
+
+#define AES_TABLE		0		/**< AES table code */
+#define AES_AESNI		1		/**< AES instructions */
+#define AES_BSAES		2		/**< Bitsliced AES code */
+#define AES_IMPLS		3		/**< Number of implementations */
+
+/*****  DATA DEFINITIONS  *****/
+
+/**
+ * Structure:
+ * aesvec
+ *
+ * \par Description:
+ * A CBC known answer test vector.
+ */
+
+typedef struct _aesvec {
+	const char		*name;
+	const char		*key;
+	const char		*iv;
+	const char		*pt;
+	const char		*ct;
+} aesvec;
+
+/* NIST SP 800-38A F.2.1 and F.2.5 */
+static const aesvec aesvecs[] = {
+	{ "CBC-AES128",
+	  "2b7e151628aed2a6abf7158809cf4f3c",
+	  "000102030405060708090a0b0c0d0e0f",
+	  "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+	  "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+	  "7649abac8119b246cee98e9b12e9197d5086cb9b507219ee95db113a917678b2"
+	  "73bed6b8e3c1743b7116e69e222295163ff1caa1681fac09120eca307586e1a7" },
+	{ "CBC-AES256",
+	  "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+	  "000102030405060708090a0b0c0d0e0f",
+	  "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+	  "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+	  "f58c4c04d6e5f1ba779eabfb5f7bfbd69cfc4e967edb808d679f777bc6702c7d"
+	  "39f23369a9d9bacfa530e26304231461b2eb05e2c39be9fcda6c19078c6a9d1b" },
+};
+
+/* Names of the implementations */
+static const char *aesimpls[AES_IMPLS] = {
+	"Table", "AES instructions", "Bitsliced"
+};
+
+/*****  PROTOTYPES  *****/
+
+/*****  EXTERNAL DEFINITIONS  *****/
+
+/**
+ * \par Function:
+ * aes_use
+ *
+ * \par Description:
+ * Choose the implementation used by DoAES.
+ *
+ * \par Inputs:
+ * - impl: The implementation (AES_*)
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void aes_use(int impl)
+{
+	p3aesni_on = (impl == AES_AESNI);
+	p3bsaes_on = (impl == AES_BSAES);
+} /* end aes_use */
+
+/**
+ * \par Function:
+ * aes_cbc
+ *
+ * \par Description:
+ * Encrypt or decrypt a buffer in CBC mode with a new key context.
+ *
+ * \par Inputs:
+ * - key: The key
+ * - klen: The size of the key
+ * - data: The buffer, encrypted or decrypted in place
+ * - len: The size of the buffer (multiple of 16)
+ * - encrypt: 1 to encrypt, 0 to decrypt
+ * - iv: The 16 byte IV, which is not changed
+ *
+ * \par Outputs:
+ * - int: Status
+ *   - 0: OK
+ *   - <0: Error
+ */
+
+static int aes_cbc(const unsigned char *key, int klen, unsigned char *data,
+		int len, int encrypt, const unsigned char *iv)
+{
+	BulkCtx ctx;
+	unsigned char civ[16];
+	int stat;
+
+	if ((ctx = CreateAESCtx((ubyte *) key, klen, encrypt)) == NULL)
+		return (-1);
+	memcpy(civ, iv, 16);
+	stat = (DoAES(ctx, data, len, encrypt, civ) < OK) ? -1 : 0;
+	DeleteAESCtx(ctx);
+	return (stat);
+} /* end aes_cbc */
+
+/**
+ * \par Function:
+ * aes_vectors
+ *
+ * \par Description:
+ * Check the known answer vectors with an implementation.
+ *
+ * \par Inputs:
+ * - impl: The implementation (AES_*)
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void aes_vectors(int impl)
+{
+	unsigned char key[32], iv[16], pt[64], ct[64], buf[64];
+	char name[64];
+	int i, klen, len;
+
+	aes_use(impl);
+	for (i=0; i < (int) (sizeof(aesvecs) / sizeof(aesvec)); i++) {
+		klen = p3test_hex(aesvecs[i].key, key, sizeof(key));
+		p3test_hex(aesvecs[i].iv, iv, sizeof(iv));
+		len = p3test_hex(aesvecs[i].pt, pt, sizeof(pt));
+		p3test_hex(aesvecs[i].ct, ct, sizeof(ct));
+		memcpy(buf, pt, len);
+		snprintf(name, sizeof(name), "%s %s encrypt", aesimpls[impl], aesvecs[i].name);
+		if (aes_cbc(key, klen, buf, len, 1, iv) < 0)
+			p3test_check(name, (unsigned char *) "", (unsigned char *) "x", 1);
+		else
+			p3test_check(name, buf, ct, len);
+		snprintf(name, sizeof(name), "%s %s decrypt", aesimpls[impl], aesvecs[i].name);
+		if (aes_cbc(key, klen, buf, len, 0, iv) < 0)
+			p3test_check(name, (unsigned char *) "", (unsigned char *) "x", 1);
+		else
+			p3test_check(name, buf, pt, len);
+	}
+} /* end aes_vectors */
+
+/**
+ * \par Function:
+ * aes_random
+ *
+ * \par Description:
+ * Encrypt and decrypt random buffers with an implementation and the
+ * table code, and compare the results.
+ *
+ * \par Inputs:
+ * - impl: The implementation (AES_*)
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void aes_random(int impl)
+{
+	unsigned char key[32], iv[16], pt[p3TEST_MAXBUF], ref[p3TEST_MAXBUF],
+			buf[p3TEST_MAXBUF];
+	char ename[64], dname[64];
+	int i, klen, len;
+
+	snprintf(ename, sizeof(ename), "Random %s encrypt", aesimpls[impl]);
+	snprintf(dname, sizeof(dname), "Random %s decrypt", aesimpls[impl]);
+	for (i=0; i < p3test_count; i++) {
+		klen = (i & 1) ? 32 : 16;
+		len = ((i % (p3TEST_MAXBUF / 16)) + 1) * 16;
+		p3test_rand(key, klen);
+		p3test_rand(iv, 16);
+		p3test_rand(pt, len);
+		memcpy(ref, pt, len);
+		memcpy(buf, pt, len);
+		aes_use(AES_TABLE);
+		aes_cbc(key, klen, ref, len, 1, iv);
+		aes_use(impl);
+		aes_cbc(key, klen, buf, len, 1, iv);
+		if (p3test_check(ename, buf, ref, len) < 0)
+			break;
+		if (aes_cbc(key, klen, buf, len, 0, iv) < 0 ||
+				p3test_check(dname, buf, pt, len) < 0)
+			break;
+	}
+} /* end aes_random */
+
+#ifdef CONFIG_X86
+/**
+ * \par Function:
+ * aes_multi
+ *
+ * \par Description:
+ * Encrypt several random buffers with different keys together, and
+ * compare each buffer with the table code.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void aes_multi(void)
+{
+	static unsigned char pt[AES_STREAMS][p3TEST_MAXBUF],
+			buf[AES_STREAMS][p3TEST_MAXBUF];
+	unsigned char key[AES_STREAMS][32], iv[AES_STREAMS][16], siv[AES_STREAMS][16];
+	p3aesni_stream streams[AES_STREAMS];
+	BulkCtx ctx[AES_STREAMS];
+	aesCipherContext *actx;
+	int i, j, n, klen, len[AES_STREAMS];
+
+	for (i=0; i < p3test_count / 16; i++) {
+		n = (i % AES_STREAMS) + 1;
+		for (j=0; j < n; j++) {
+			klen = ((i + j) & 1) ? 32 : 16;
+			p3test_rand(key[j], klen);
+			p3test_rand(iv[j], 16);
+			memcpy(siv[j], iv[j], 16);
+			len[j] = ((rand() % (p3TEST_MAXBUF / 16)) + 1) * 16;
+			p3test_rand(pt[j], len[j]);
+			memcpy(buf[j], pt[j], len[j]);
+			ctx[j] = CreateAESCtx(key[j], klen, 1);
+			actx = (aesCipherContext *) ctx[j];
+			streams[j].nk = actx->nk;
+			streams[j].nr = actx->Nr;
+			streams[j].data = buf[j];
+			streams[j].len = len[j];
+			streams[j].iv = siv[j];
+		}
+		if (p3aesni_cbc_multi(streams, n) < 0) {
+			p3test_check("AES instruction several buffers", (unsigned char *) "",
+					(unsigned char *) "x", 1);
+			n = 0;
+		}
+		// The stream sizes are used up, so the saved sizes are compared
+		aes_use(AES_TABLE);
+		for (j=0; j < n; j++) {
+			DoAES(ctx[j], pt[j], len[j], 1, iv[j]);
+			p3test_check("AES instruction several buffers", buf[j], pt[j], len[j]);
+			p3test_check("AES instruction several buffers IV", siv[j], iv[j], 16);
+		}
+		for (j=0; j < (i % AES_STREAMS) + 1; j++)
+			DeleteAESCtx(ctx[j]);
+	}
+} /* end aes_multi */
+#endif
+
+/**
+ * \par Function:
+ * aes_bench
+ *
+ * \par Description:
+ * Measure the CBC throughput of an implementation.
+ *
+ * \par Inputs:
+ * - impl: The implementation (AES_*)
+ * - encrypt: 1 to encrypt, 0 to decrypt
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void aes_bench(int impl, int encrypt)
+{
+	static const int sizes[] = { 64, 576, 1424 };
+	unsigned char key[16], iv[16], buf[p3TEST_MAXBUF];
+	char name[64];
+	BulkCtx ctx;
+	double start;
+	int i, j;
+
+	aes_use(impl);
+	p3test_rand(key, sizeof(key));
+	p3test_rand(buf, sizeof(buf));
+	ctx = CreateAESCtx(key, sizeof(key), encrypt);
+	snprintf(name, sizeof(name), "%s %s", aesimpls[impl],
+			encrypt ? "encrypt" : "decrypt");
+	for (i=0; i < (int) (sizeof(sizes) / sizeof(int)); i++) {
+		start = p3test_time();
+		for (j=0; j < p3test_count; j++) {
+			memset(iv, j, sizeof(iv));
+			DoAES(ctx, buf, sizes[i], encrypt, iv);
+		}
+		p3test_rate(name, sizes[i], p3test_count, p3test_time() - start);
+	}
+	DeleteAESCtx(ctx);
+} /* end aes_bench */
+
+/**
+ * \par Function:
+ * main
+ *
+ * \par Description:
+ * Run the AES tests or benchmark.  The AES instructions are skipped
+ * when the CPU does not have them.
+ *
+ * \par Inputs:
+ * - argc: The number of arguments
+ * - argv: The arguments
+ *
+ * \par Outputs:
+ * - int: 0 if all checks passed, else 1
+ */
+
+int main(int argc, char **argv)
+{
+	int impl, aesni = p3aesni_detect();
+
+	p3test_args(argc, argv, AES_TESTS);
+	if (p3test_bench && p3test_count == AES_TESTS)
+		p3test_count = AES_BENCH;
+	for (impl=0; impl < AES_IMPLS; impl++) {
+		if (impl == AES_AESNI && !aesni) {
+			printf("%s: no AES instructions, they are not checked\n", argv[0]);
+			continue;
+		}
+		if (p3test_bench) {
+			aes_bench(impl, 1);
+			aes_bench(impl, 0);
+			continue;
+		}
+		aes_vectors(impl);
+		if (impl != AES_TABLE)
+			aes_random(impl);
+#ifdef CONFIG_X86
+		// The several buffer function is only built for x86
+		if (impl == AES_AESNI)
+			aes_multi();
+#endif
+	}
+	return (p3test_done(argv[0]));
+} /* end main */
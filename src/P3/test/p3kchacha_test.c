@@ -0,0 +1,251 @@
+/**
+ * \file p3kchacha_test.c
+ * <h3>Protected Point to Point ChaCha20-Poly1305 test file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * Check the ChaCha20-Poly1305 functions (p3kchacha.c) against the
+ * RFC 8439 AEAD test vector, with the C code and with the SIMD
+ * instructions, and measure the throughput of both.  Random buffers of
+ * every size are encrypted by each and the results compared, and a
+ * changed buffer must fail the tag check.
+ *
+ * Usage: p3kchacha_test [-b] [-n count]
+ */
+
+/*****  INCLUDE FILES *****/
+
+#include "p3kbase.h"
+#include "p3kchacha.h"
+
+/*****  CONSTANTS  *****/
+
+#define CC_TESTS		20000	/**< Default number of random buffers */
+#define CC_BENCH		200000	/**< Benchmark buffers of each size */
+#define CC_AADSZ		8		/**< Associated data size of the P3 header */
+
+/*****  DATA DEFINITIONS  *****/
+
+/**
+ * Structure:
+ * ccvec
+ *
+ * \par Description:
+ * A ChaCha20-Poly1305 known answer test vector.
+ */
+
+typedef struct _ccvec {
+	const char		*name;
+	const char		*key;
+	const char		*nonce;
+	const char		*aad;
+	const char		*pt;
+	const char		*ct;
+	const char		*tag;
+} ccvec;
+
+/* RFC 8439 2.8.2 */
+static const ccvec ccvecs[] = {
+	{ "RFC 8439 2.8.2",
+	  "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f",
+	  "070000004041424344454647",
+	  "50515253c0c1c2c3c4c5c6c7",
+	  "4c616469657320616e642047656e746c656d656e206f662074686520636c6173"
+	  "73206f66202739393a204966204920636f756c64206f6666657220796f75206f"
+	  "6e6c79206f6e652074697020666f7220746865206675747572652c2073756e73"
+	  "637265656e20776f756c642062652069742e",
+	  "d31a8d34648e60db7b86afbc53ef7ec2a4aded51296e08fea9e2b5a736ee62d6"
+	  "3dbea45e8ca9671282fafb69da92728b1a71de0a9e060b2905d6a5b67ecd3b36"
+	  "92ddbd7f2d778b8c9803aee328091b58fab324e4fad675945585808b4831d7bc"
+	  "3ff4def08e4b7a9de576d26586cec64b6116",
+	  "1ae10b594f09e26a7e902ecbd0600691" },
+};
+
+/*****  PROTOTYPES  *****/
+
+/*****  EXTERNAL DEFINITIONS  *****/
+
+/**
+ * \par Function:
+ * cc_vectors
+ *
+ * \par Description:
+ * Check the known answer vectors with the current implementation.
+ *
+ * \par Inputs:
+ * - impl: The name of the implementation
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void cc_vectors(const char *impl)
+{
+	unsigned char key[p3CHACHA_KEYSZ], nonce[p3CHACHA_NONCESZ], aad[32],
+			pt[128], ct[128], tag[p3CHACHA_TAGSZ], buf[128 + p3CHACHA_TAGSZ];
+	char name[64];
+	p3chacha cc;
+	int i, klen, alen, len;
+
+	for (i=0; i < (int) (sizeof(ccvecs) / sizeof(ccvec)); i++) {
+		klen = p3test_hex(ccvecs[i].key, key, sizeof(key));
+		p3test_hex(ccvecs[i].nonce, nonce, sizeof(nonce));
+		alen = p3test_hex(ccvecs[i].aad, aad, sizeof(aad));
+		len = p3test_hex(ccvecs[i].pt, pt, sizeof(pt));
+		p3test_hex(ccvecs[i].ct, ct, sizeof(ct));
+		p3test_hex(ccvecs[i].tag, tag, sizeof(tag));
+		p3chacha_key(&cc, key, klen);
+		memcpy(buf, pt, len);
+		p3chacha_crypt(&cc, buf, len, aad, alen, nonce, 1);
+		snprintf(name, sizeof(name), "%s %s encrypt", impl, ccvecs[i].name);
+		p3test_check(name, buf, ct, len);
+		snprintf(name, sizeof(name), "%s %s tag", impl, ccvecs[i].name);
+		p3test_check(name, &buf[len], tag, p3CHACHA_TAGSZ);
+		snprintf(name, sizeof(name), "%s %s decrypt", impl, ccvecs[i].name);
+		if (p3chacha_crypt(&cc, buf, len, aad, alen, nonce, 0) < 0)
+			p3test_check(name, (unsigned char *) "", (unsigned char *) "x", 1);
+		else
+			p3test_check(name, buf, pt, len);
+	}
+} /* end cc_vectors */
+
+/**
+ * \par Function:
+ * cc_random
+ *
+ * \par Description:
+ * Encrypt random buffers with the SIMD instructions and the C code,
+ * and compare the results.  Then decrypt with the SIMD instructions,
+ * and check that a changed buffer or tag is rejected.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void cc_random(void)
+{
+	unsigned char key[p3CHACHA_KEYSZ], nonce[p3CHACHA_NONCESZ], aad[CC_AADSZ],
+			pt[p3TEST_MAXBUF], ref[p3TEST_MAXBUF + p3CHACHA_TAGSZ],
+			buf[p3TEST_MAXBUF + p3CHACHA_TAGSZ];
+	p3chacha cc;
+	int i, len, pos;
+
+	for (i=0; i < p3test_count; i++) {
+		len = (i % p3TEST_MAXBUF) + 1;
+		p3test_rand(key, sizeof(key));
+		p3test_rand(nonce, sizeof(nonce));
+		p3test_rand(aad, sizeof(aad));
+		p3test_rand(pt, len);
+		p3chacha_key(&cc, key, sizeof(key));
+		memcpy(ref, pt, len);
+		memcpy(buf, pt, len);
+		p3chacha_simd_on = 0;
+		p3chacha_crypt(&cc, ref, len, aad, sizeof(aad), nonce, 1);
+		p3chacha_simd_on = 1;
+		p3chacha_crypt(&cc, buf, len, aad, sizeof(aad), nonce, 1);
+		if (p3test_check("Random ChaCha20-Poly1305 encrypt", buf, ref,
+				len + p3CHACHA_TAGSZ) < 0)
+			break;
+		if (p3chacha_crypt(&cc, buf, len, aad, sizeof(aad), nonce, 0) < 0 ||
+				p3test_check("Random ChaCha20-Poly1305 decrypt", buf, pt, len) < 0) {
+			p3test_check("Random ChaCha20-Poly1305 decrypt tag",
+					(unsigned char *) "", (unsigned char *) "x", 1);
+			break;
+		}
+		// Any changed bit of the buffer or the tag must be found
+		pos = rand() % (len + p3CHACHA_TAGSZ);
+		ref[pos] ^= 1 << (rand() & 7);
+		if (p3chacha_crypt(&cc, ref, len, aad, sizeof(aad), nonce, 0) == 0) {
+			p3test_check("Random ChaCha20-Poly1305 changed buffer",
+					(unsigned char *) "", (unsigned char *) "x", 1);
+			break;
+		}
+	}
+} /* end cc_random */
+
+/**
+ * \par Function:
+ * cc_bench
+ *
+ * \par Description:
+ * Measure the ChaCha20-Poly1305 encryption throughput of the current
+ * implementation.
+ *
+ * \par Inputs:
+ * - impl: The name of the implementation
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void cc_bench(const char *impl)
+{
+	static const int sizes[] = { 64, 576, 1424 };
+	unsigned char key[p3CHACHA_KEYSZ], nonce[p3CHACHA_NONCESZ], aad[CC_AADSZ],
+			buf[p3TEST_MAXBUF + p3CHACHA_TAGSZ];
+	p3chacha cc;
+	double start;
+	int i, j;
+
+	p3test_rand(key, sizeof(key));
+	p3test_rand(aad, sizeof(aad));
+	p3test_rand(buf, sizeof(buf));
+	memset(nonce, 0, sizeof(nonce));
+	p3chacha_key(&cc, key, sizeof(key));
+	for (i=0; i < (int) (sizeof(sizes) / sizeof(int)); i++) {
+		start = p3test_time();
+		for (j=0; j < p3test_count; j++) {
+			memcpy(nonce, &j, sizeof(j));
+			p3chacha_crypt(&cc, buf, sizes[i], aad, sizeof(aad), nonce, 1);
+		}
+		p3test_rate(impl, sizes[i], p3test_count, p3test_time() - start);
+	}
+} /* end cc_bench */
+
+/**
+ * \par Function:
+ * main
+ *
+ * \par Description:
+ * Run the ChaCha20-Poly1305 tests or benchmark.
+ *
+ * \par Inputs:
+ * - argc: The number of arguments
+ * - argv: The arguments
+ *
+ * \par Outputs:
+ * - int: 0 if all checks passed, else 1
+ */
+
+int main(int argc, char **argv)
+{
+	int simd = p3chacha_detect();
+
+	p3test_args(argc, argv, CC_TESTS);
+	if (p3test_bench) {
+		if (p3test_count == CC_TESTS)
+			p3test_count = CC_BENCH;
+		p3chacha_simd_on = 0;
+		cc_bench("ChaCha20-Poly1305");
+		if (simd) {
+			p3chacha_simd_on = 1;
+			cc_bench("ChaCha20-Poly1305 SIMD");
+		}
+		return (p3test_done(argv[0]));
+	}
+
+	p3chacha_simd_on = 0;
+	cc_vectors("C code");
+	if (!simd) {
+		printf("%s: no SIMD instructions, only the C code is checked\n",
+				argv[0]);
+		return (p3test_done(argv[0]));
+	}
+	p3chacha_simd_on = 1;
+	cc_vectors("SIMD");
+	cc_random();
+	return (p3test_done(argv[0]));
+} /* end main */
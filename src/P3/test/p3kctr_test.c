@@ -0,0 +1,355 @@
+/**
+ * \file p3kctr_test.c
+ * <h3>Protected Point to Point AES-CTR test file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * Check the AES-CTR functions of the AES instruction code (p3kaesni.c)
+ * and the bitsliced AES code (p3kbsaes.c) against the NIST SP 800-38A
+ * CTR vectors and the AES table code, and measure the throughput of
+ * each.  Random buffers of every size, including partial blocks, are
+ * encrypted with counters near the end of the 32 bit block counter,
+ * which must wrap without changing the nonce in the first 12 bytes.
+ *
+ * Usage: p3kctr_test [-b] [-n count]
+ */
+
+/*****  INCLUDE FILES *****/
+
+#include "p3kbase.h"
+
+#include "moc_src/moptions.h"
+#include "moc_src/mtypes.h"
+#include "moc_src/mdefs.h"
+#include "moc_src/aesalgo.h"
+
+#include "p3kaesni.h"
+#include "p3kbsaes.h"
+
+/*****  CONSTANTS  *****/
+
+#define CTR_TESTS		20000	/**< Default number of random buffers */
+#define CTR_BENCH		200000	/**< Benchmark buffers of each size */
+
+/*****  DATA DEFINITIONS  *****/
+
+/**
+ * Structure:
+ * ctrkey
+ *
+ * \par Description:
+ * An AES key in the forms used by each implementation.
+ */
+
+typedef struct _ctrkey {
+	unsigned int	rk[4 * (p3AESNI_MAXNR + 1)];	/**< Table code key schedule */
+	unsigned char	nk[p3AESNI_KSIZE];	/**< AES instruction key schedule */
+	int				nr;			/**< Number of rounds */
+} ctrkey;
+
+/**
+ * Structure:
+ * ctrimpl
+ *
+ * \par Description:
+ * An AES-CTR implementation.
+ */
+
+typedef struct _ctrimpl {
+	const char		*name;
+	int				(*crypt)(const ctrkey *key, unsigned char *data, int len,
+						unsigned char *ctr);
+} ctrimpl;
+
+/**
+ * Structure:
+ * ctrvec
+ *
+ * \par Description:
+ * An AES-CTR known answer test vector.
+ */
+
+typedef struct _ctrvec {
+	const char		*name;
+	const char		*key;
+	const char		*ctr;
+	const char		*pt;
+	const char		*ct;
+} ctrvec;
+
+/* NIST SP 800-38A F.5.1 and F.5.5 */
+static const ctrvec ctrvecs[] = {
+	{ "CTR-AES128",
+	  "2b7e151628aed2a6abf7158809cf4f3c",
+	  "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff",
+	  "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+	  "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+	  "874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff"
+	  "5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee" },
+	{ "CTR-AES256",
+	  "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+	  "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff",
+	  "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+	  "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+	  "601ec313775789a5b7a7f504bbf3d228f443e3ca4d62b59aca84e990cacaf5c5"
+	  "2b0930daa23de94ce87017ba2d84988ddfc9c58db67aada613c2dd08457941a6" },
+};
+
+/*****  PROTOTYPES  *****/
+
+static int ctr_table(const ctrkey *key, unsigned char *data, int len,
+		unsigned char *ctr);
+static int ctr_aesni(const ctrkey *key, unsigned char *data, int len,
+		unsigned char *ctr);
+static int ctr_bsaes(const ctrkey *key, unsigned char *data, int len,
+		unsigned char *ctr);
+
+static const ctrimpl ctrimpls[] = {
+	{ "Table", ctr_table },
+	{ "AES instructions", ctr_aesni },
+	{ "Bitsliced", ctr_bsaes },
+};
+
+/*****  EXTERNAL DEFINITIONS  *****/
+
+/**
+ * \par Function:
+ * ctr_key
+ *
+ * \par Description:
+ * Set up a key for each implementation.
+ *
+ * \par Inputs:
+ * - key: The key to be set
+ * - raw: The key bytes
+ * - size: The size of the key
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void ctr_key(ctrkey *key, const unsigned char *raw, int size)
+{
+	memset(key, 0, sizeof(ctrkey));
+	key->nr = aesKeySetupEnc(key->rk, raw, size << 3);
+	p3aesni_key(key->rk, key->nr, key->nk);
+} /* end ctr_key */
+
+/**
+ * \par Function:
+ * ctr_table
+ *
+ * \par Description:
+ * Encrypt a buffer in CTR mode with the AES table code, as done by
+ * p3moc_ctr_crypt when no other code can be used.
+ *
+ * \par Inputs:
+ * - key: The key
+ * - data: The buffer, encrypted in place
+ * - len: The size of the buffer
+ * - ctr: The 16 byte counter block, set to the next counter
+ *
+ * \par Outputs:
+ * - int: 0
+ */
+
+static int ctr_table(const ctrkey *key, unsigned char *data, int len,
+		unsigned char *ctr)
+{
+	unsigned char ks[16];
+	int i, n;
+
+	for ( ; len > 0; len -= n, data += n) {
+		aesEncrypt((ubyte4 *) key->rk, key->nr, ctr, ks);
+		n = (len < 16) ? len : 16;
+		for (i=0; i < n; i++)
+			data[i] ^= ks[i];
+		for (i=15; i >= 12 && ++ctr[i] == 0; i--)
+			;
+	}
+	return (0);
+} /* end ctr_table */
+
+/* The AES instruction and bitsliced functions */
+static int ctr_aesni(const ctrkey *key, unsigned char *data, int len,
+		unsigned char *ctr)
+{
+	return (p3aesni_ctr(key->nk, key->nr, data, len, ctr));
+}
+
+static int ctr_bsaes(const ctrkey *key, unsigned char *data, int len,
+		unsigned char *ctr)
+{
+	return (p3bsaes_ctr(key->nk, key->nr, data, len, ctr));
+}
+
+/**
+ * \par Function:
+ * ctr_vectors
+ *
+ * \par Description:
+ * Check the known answer vectors with an implementation, in one call
+ * and one byte at a time.
+ *
+ * \par Inputs:
+ * - impl: The implementation
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void ctr_vectors(const ctrimpl *impl)
+{
+	unsigned char raw[32], ctr[16], pt[64], ct[64], buf[64];
+	char name[64];
+	ctrkey key;
+	int i, j, klen, len, stat;
+
+	for (i=0; i < (int) (sizeof(ctrvecs) / sizeof(ctrvec)); i++) {
+		klen = p3test_hex(ctrvecs[i].key, raw, sizeof(raw));
+		len = p3test_hex(ctrvecs[i].pt, pt, sizeof(pt));
+		p3test_hex(ctrvecs[i].ct, ct, sizeof(ct));
+		ctr_key(&key, raw, klen);
+
+		snprintf(name, sizeof(name), "%s %s", impl->name, ctrvecs[i].name);
+		p3test_hex(ctrvecs[i].ctr, ctr, sizeof(ctr));
+		memcpy(buf, pt, len);
+		if (impl->crypt(&key, buf, len, ctr) < 0)
+			p3test_check(name, (unsigned char *) "", (unsigned char *) "x", 1);
+		else
+			p3test_check(name, buf, ct, len);
+
+		// Whole blocks must leave the counter at the next block
+		snprintf(name, sizeof(name), "%s %s by block", impl->name,
+				ctrvecs[i].name);
+		p3test_hex(ctrvecs[i].ctr, ctr, sizeof(ctr));
+		memcpy(buf, pt, len);
+		for (j=0, stat=0; j < len && stat == 0; j += 16)
+			stat = impl->crypt(&key, &buf[j], 16, ctr);
+		if (stat < 0)
+			p3test_check(name, (unsigned char *) "", (unsigned char *) "x", 1);
+		else
+			p3test_check(name, buf, ct, len);
+	}
+} /* end ctr_vectors */
+
+/**
+ * \par Function:
+ * ctr_random
+ *
+ * \par Description:
+ * Encrypt random buffers with an implementation and the table code,
+ * and compare the results and the next counters.
+ *
+ * \par Inputs:
+ * - impl: The implementation
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void ctr_random(const ctrimpl *impl)
+{
+	unsigned char raw[32], ctr[16], rctr[16], ref[p3TEST_MAXBUF],
+			buf[p3TEST_MAXBUF];
+	char name[64];
+	ctrkey key;
+	int i, klen, len;
+
+	snprintf(name, sizeof(name), "Random %s", impl->name);
+	for (i=0; i < p3test_count; i++) {
+		klen = (i & 1) ? 32 : 16;
+		len = (i % p3TEST_MAXBUF) + 1;
+		p3test_rand(raw, klen);
+		p3test_rand(ctr, sizeof(ctr));
+		// Every few buffers cross the end of the block counter
+		if ((i & 3) == 0)
+			ctr[12] = ctr[13] = ctr[14] = 0xff;
+		memcpy(rctr, ctr, sizeof(ctr));
+		p3test_rand(ref, len);
+		memcpy(buf, ref, len);
+		ctr_key(&key, raw, klen);
+		ctr_table(&key, ref, len, rctr);
+		if (impl->crypt(&key, buf, len, ctr) < 0) {
+			p3test_check(name, (unsigned char *) "", (unsigned char *) "x", 1);
+			break;
+		}
+		if (p3test_check(name, buf, ref, len) < 0 ||
+				p3test_check(name, ctr, rctr, sizeof(ctr)) < 0)
+			break;
+	}
+} /* end ctr_random */
+
+/**
+ * \par Function:
+ * ctr_bench
+ *
+ * \par Description:
+ * Measure the throughput of an implementation.
+ *
+ * \par Inputs:
+ * - impl: The implementation
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void ctr_bench(const ctrimpl *impl)
+{
+	static const int sizes[] = { 64, 576, 1424 };
+	unsigned char raw[16], ctr[16], buf[p3TEST_MAXBUF];
+	ctrkey key;
+	double start;
+	int i, j;
+
+	p3test_rand(raw, sizeof(raw));
+	p3test_rand(buf, sizeof(buf));
+	memset(ctr, 0, sizeof(ctr));
+	ctr_key(&key, raw, sizeof(raw));
+	for (i=0; i < (int) (sizeof(sizes) / sizeof(int)); i++) {
+		start = p3test_time();
+		for (j=0; j < p3test_count; j++)
+			impl->crypt(&key, buf, sizes[i], ctr);
+		p3test_rate(impl->name, sizes[i], p3test_count, p3test_time() - start);
+	}
+} /* end ctr_bench */
+
+/**
+ * \par Function:
+ * main
+ *
+ * \par Description:
+ * Run the AES-CTR tests or benchmark.  The AES instruction functions
+ * are skipped when the CPU does not have the instructions.
+ *
+ * \par Inputs:
+ * - argc: The number of arguments
+ * - argv: The arguments
+ *
+ * \par Outputs:
+ * - int: 0 if all checks passed, else 1
+ */
+
+int main(int argc, char **argv)
+{
+	int i, aesni = p3aesni_detect();
+
+	p3test_args(argc, argv, CTR_TESTS);
+	if (p3test_bench && p3test_count == CTR_TESTS)
+		p3test_count = CTR_BENCH;
+	for (i=0; i < (int) (sizeof(ctrimpls) / sizeof(ctrimpl)); i++) {
+		if (ctrimpls[i].crypt == ctr_aesni && !aesni) {
+			printf("%s: no AES instructions, %s is not checked\n", argv[0],
+					ctrimpls[i].name);
+			continue;
+		}
+		if (p3test_bench) {
+			ctr_bench(&ctrimpls[i]);
+			continue;
+		}
+		ctr_vectors(&ctrimpls[i]);
+		if (ctrimpls[i].crypt != ctr_table)
+			ctr_random(&ctrimpls[i]);
+	}
+	return (p3test_done(argv[0]));
+} /* end main */
@@ -0,0 +1,283 @@
+/**
+ * \file p3kgcm_test.c
+ * <h3>Protected Point to Point AES-GCM test file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * Check the AES-GCM functions (p3kgcm.c) against the test cases of the
+ * GCM specification, with the table code and with the AES and PCLMULQDQ
+ * instructions, and measure the throughput of both.  Random buffers of
+ * every size, including partial blocks, are encrypted by each and the
+ * results compared, and a changed buffer must fail the tag check.
+ *
+ * Usage: p3kgcm_test [-b] [-n count]
+ */
+
+/*****  INCLUDE FILES *****/
+
+#include "p3kbase.h"
+#include "p3kgcm.h"
+
+/*****  CONSTANTS  *****/
+
+#define GCM_TESTS		20000	/**< Default number of random buffers */
+#define GCM_BENCH		200000	/**< Benchmark buffers of each size */
+#define GCM_AADSZ		8		/**< Associated data size of the P3 header */
+
+/*****  DATA DEFINITIONS  *****/
+
+/**
+ * Structure:
+ * gcmvec
+ *
+ * \par Description:
+ * An AES-GCM known answer test vector.
+ */
+
+typedef struct _gcmvec {
+	const char		*name;
+	const char		*key;
+	const char		*nonce;
+	const char		*aad;
+	const char		*pt;
+	const char		*ct;
+	const char		*tag;
+} gcmvec;
+
+/* The GCM specification (McGrew and Viega) test cases */
+#define GCM_K3	"feffe9928665731c6d6a8f9467308308"
+#define GCM_N3	"cafebabefacedbaddecaf888"
+#define GCM_A4	"feedfacedeadbeeffeedfacedeadbeefabaddad2"
+#define GCM_P3	"d9313225f88406e5a55909c5aff5269a86a7a9531534f7da2e4c303d8a318a72" \
+				"1c3c0c95956809532fcf0e2449a6b525b16aedf5aa0de657ba637b39"
+static const gcmvec gcmvecs[] = {
+	{ "Test case 1",
+	  "00000000000000000000000000000000", "000000000000000000000000", "",
+	  "", "",
+	  "58e2fccefa7e3061367f1d57a4e7455a" },
+	{ "Test case 2",
+	  "00000000000000000000000000000000", "000000000000000000000000", "",
+	  "00000000000000000000000000000000",
+	  "0388dace60b6a392f328c2b971b2fe78",
+	  "ab6e47d42cec13bdf53a67b21257bddf" },
+	{ "Test case 3",
+	  GCM_K3, GCM_N3, "",
+	  GCM_P3 "1aafd255",
+	  "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+	  "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091473f5985",
+	  "4d5c2af327cd64a62cf35abd2ba6fab4" },
+	{ "Test case 4",
+	  GCM_K3, GCM_N3, GCM_A4,
+	  GCM_P3,
+	  "42831ec2217774244b7221b784d0d49ce3aa212f2c02a4e035c17e2329aca12e"
+	  "21d514b25466931c7d8f6a5aac84aa051ba30b396a0aac973d58e091",
+	  "5bc94fbc3221a5db94fae95ae7121a47" },
+	{ "Test case 14",
+	  "00000000000000000000000000000000"
+	  "00000000000000000000000000000000", "000000000000000000000000", "",
+	  "00000000000000000000000000000000",
+	  "cea7403d4d606b6e074ec5d3baf39d18",
+	  "d0d1c8a799996bf0265b98b5d48ab919" },
+	{ "Test case 15",
+	  GCM_K3 GCM_K3, GCM_N3, "",
+	  GCM_P3 "1aafd255",
+	  "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+	  "8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662898015ad",
+	  "b094dac5d93471bdec1a502270e3cc6c" },
+	{ "Test case 16",
+	  GCM_K3 GCM_K3, GCM_N3, GCM_A4,
+	  GCM_P3,
+	  "522dc1f099567d07f47f37a32a84427d643a8cdcbfe5c0c97598a2bd2555d1aa"
+	  "8cb08e48590dbb3da7b08b1056828838c5f61e6393ba7a0abcc9f662",
+	  "76fc6ece0f4e1768cddf8853bb2d551b" },
+};
+
+/*****  PROTOTYPES  *****/
+
+/*****  EXTERNAL DEFINITIONS  *****/
+
+/**
+ * \par Function:
+ * gcm_vectors
+ *
+ * \par Description:
+ * Check the known answer vectors with the current implementation.
+ *
+ * \par Inputs:
+ * - impl: The name of the implementation
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void gcm_vectors(const char *impl)
+{
+	unsigned char key[32], nonce[p3GCM_NONCESZ], aad[32], pt[64], ct[64],
+			tag[p3GCM_TAGSZ], buf[64 + p3GCM_TAGSZ];
+	char name[64];
+	p3gcm gcm;
+	int i, klen, alen, len;
+
+	for (i=0; i < (int) (sizeof(gcmvecs) / sizeof(gcmvec)); i++) {
+		klen = p3test_hex(gcmvecs[i].key, key, sizeof(key));
+		p3test_hex(gcmvecs[i].nonce, nonce, sizeof(nonce));
+		alen = p3test_hex(gcmvecs[i].aad, aad, sizeof(aad));
+		len = p3test_hex(gcmvecs[i].pt, pt, sizeof(pt));
+		p3test_hex(gcmvecs[i].ct, ct, sizeof(ct));
+		p3test_hex(gcmvecs[i].tag, tag, sizeof(tag));
+		p3gcm_key(&gcm, key, klen);
+		memcpy(buf, pt, len);
+		p3gcm_crypt(&gcm, buf, len, aad, alen, nonce, 1);
+		snprintf(name, sizeof(name), "%s %s encrypt", impl, gcmvecs[i].name);
+		p3test_check(name, buf, ct, len);
+		snprintf(name, sizeof(name), "%s %s tag", impl, gcmvecs[i].name);
+		p3test_check(name, &buf[len], tag, p3GCM_TAGSZ);
+		snprintf(name, sizeof(name), "%s %s decrypt", impl, gcmvecs[i].name);
+		if (p3gcm_crypt(&gcm, buf, len, aad, alen, nonce, 0) < 0)
+			p3test_check(name, (unsigned char *) "", (unsigned char *) "x", 1);
+		else
+			p3test_check(name, buf, pt, len);
+	}
+} /* end gcm_vectors */
+
+/**
+ * \par Function:
+ * gcm_random
+ *
+ * \par Description:
+ * Encrypt random buffers with the AES-GCM instructions and the table
+ * code, and compare the results.  Then decrypt with the instructions,
+ * and check that a changed buffer or tag is rejected.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void gcm_random(void)
+{
+	unsigned char key[32], nonce[p3GCM_NONCESZ], aad[GCM_AADSZ],
+			pt[p3TEST_MAXBUF], ref[p3TEST_MAXBUF + p3GCM_TAGSZ],
+			buf[p3TEST_MAXBUF + p3GCM_TAGSZ];
+	p3gcm gcm;
+	int i, klen, len, pos;
+
+	for (i=0; i < p3test_count; i++) {
+		klen = (i & 1) ? 32 : 16;
+		len = (i % p3TEST_MAXBUF) + 1;
+		p3test_rand(key, klen);
+		p3test_rand(nonce, sizeof(nonce));
+		p3test_rand(aad, sizeof(aad));
+		p3test_rand(pt, len);
+		p3gcm_key(&gcm, key, klen);
+		memcpy(ref, pt, len);
+		memcpy(buf, pt, len);
+		p3aesni_gcm_on = 0;
+		p3gcm_crypt(&gcm, ref, len, aad, sizeof(aad), nonce, 1);
+		p3aesni_gcm_on = 1;
+		p3gcm_crypt(&gcm, buf, len, aad, sizeof(aad), nonce, 1);
+		if (p3test_check("Random AES-GCM encrypt", buf, ref,
+				len + p3GCM_TAGSZ) < 0)
+			break;
+		if (p3gcm_crypt(&gcm, buf, len, aad, sizeof(aad), nonce, 0) < 0 ||
+				p3test_check("Random AES-GCM decrypt", buf, pt, len) < 0) {
+			p3test_check("Random AES-GCM decrypt tag", (unsigned char *) "",
+					(unsigned char *) "x", 1);
+			break;
+		}
+		// Any changed bit of the buffer or the tag must be found
+		pos = rand() % (len + p3GCM_TAGSZ);
+		ref[pos] ^= 1 << (rand() & 7);
+		if (p3gcm_crypt(&gcm, ref, len, aad, sizeof(aad), nonce, 0) == 0) {
+			p3test_check("Random AES-GCM changed buffer", (unsigned char *) "",
+					(unsigned char *) "x", 1);
+			break;
+		}
+	}
+} /* end gcm_random */
+
+/**
+ * \par Function:
+ * gcm_bench
+ *
+ * \par Description:
+ * Measure the AES-GCM encryption throughput of the current
+ * implementation.
+ *
+ * \par Inputs:
+ * - impl: The name of the implementation
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void gcm_bench(const char *impl)
+{
+	static const int sizes[] = { 64, 576, 1424 };
+	unsigned char key[16], nonce[p3GCM_NONCESZ], aad[GCM_AADSZ],
+			buf[p3TEST_MAXBUF + p3GCM_TAGSZ];
+	p3gcm gcm;
+	double start;
+	int i, j;
+
+	p3test_rand(key, sizeof(key));
+	p3test_rand(aad, sizeof(aad));
+	p3test_rand(buf, sizeof(buf));
+	memset(nonce, 0, sizeof(nonce));
+	p3gcm_key(&gcm, key, sizeof(key));
+	for (i=0; i < (int) (sizeof(sizes) / sizeof(int)); i++) {
+		start = p3test_time();
+		for (j=0; j < p3test_count; j++) {
+			memcpy(nonce, &j, sizeof(j));
+			p3gcm_crypt(&gcm, buf, sizes[i], aad, sizeof(aad), nonce, 1);
+		}
+		p3test_rate(impl, sizes[i], p3test_count, p3test_time() - start);
+	}
+} /* end gcm_bench */
+
+/**
+ * \par Function:
+ * main
+ *
+ * \par Description:
+ * Run the AES-GCM tests or benchmark.
+ *
+ * \par Inputs:
+ * - argc: The number of arguments
+ * - argv: The arguments
+ *
+ * \par Outputs:
+ * - int: 0 if all checks passed, else 1
+ */
+
+int main(int argc, char **argv)
+{
+	int clmul = p3aesni_clmul();
+
+	p3test_args(argc, argv, GCM_TESTS);
+	if (p3test_bench) {
+		if (p3test_count == GCM_TESTS)
+			p3test_count = GCM_BENCH;
+		p3aesni_gcm_on = 0;
+		gcm_bench("Table AES-GCM");
+		if (clmul) {
+			p3aesni_gcm_on = 1;
+			gcm_bench("AES-GCM instructions");
+		}
+		return (p3test_done(argv[0]));
+	}
+
+	p3aesni_gcm_on = 0;
+	gcm_vectors("Table");
+	if (!clmul) {
+		printf("%s: no AES-GCM instructions, only the table code is checked\n",
+				argv[0]);
+		return (p3test_done(argv[0]));
+	}
+	p3aesni_gcm_on = 1;
+	gcm_vectors("AES-GCM instructions");
+	gcm_random();
+	return (p3test_done(argv[0]));
+} /* end main */
@@ -0,0 +1,486 @@
+/**
+ * \file p3kobf_test.c
+ * <h3>Protected Point to Point obfuscation test file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * Check that the planned obfuscation (p3kobf.c) stays wire compatible
+ * with the original obfuscate() and deobfuscate() functions, and measure
+ * the throughput of both.  The original functions are kept here, working
+ * on a plain buffer instead of a P3 packet and work area.
+ *
+ * The original pad source for TCP packets was taken from the wrong byte
+ * of the TCP header, so only the pad bytes of TCP packets may differ.
+ * The original pad could also be taken from the bytes before a small
+ * packet (the P3 header), where the new pad restarts at the packet.
+ * The receiver never reads the pad bytes.
+ *
+ * Usage: p3kobf_test [-b] [-n count]
+ */
+
+/*****  INCLUDE FILES *****/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../ksrc/p3kobf.h"
+
+/*****  CONSTANTS  *****/
+
+#define OBF_MAXPKT		1500	/**< Largest test packet */
+#define OBF_MAXLEN		(OBF_MAXPKT + 256)	/**< Largest obfuscated data */
+#define OBF_TESTS		200000	/**< Default number of random packets */
+#define OBF_BENCH		2000000	/**< Default number of benchmark packets */
+
+/*****  DATA DEFINITIONS  *****/
+
+/**
+ * Structure:
+ * oldwork
+ *
+ * \par Description:
+ * The part of the original packet work area used for obfuscation.
+ */
+
+typedef struct _oldwork {
+	int				bloc[8];
+	int				blen[8];
+	unsigned char	*dloc[8];
+	int				under;		/*<< Pad was taken from before the packet */
+	unsigned char	buf[OBF_MAXLEN];
+} oldwork;
+
+/*****  PROTOTYPES  *****/
+
+/*****  EXTERNAL DEFINITIONS  *****/
+
+/**
+ * \par Function:
+ * old_obfuscate
+ *
+ * \par Description:
+ * The original packet obfuscation, with the debug checks removed.
+ *
+ * \par Inputs:
+ * - pktdata: The packet, replaced by the obfuscated data
+ * - len: The size of the obfuscated data
+ * - usec: The current time in microseconds
+ * - pw: The work area
+ *
+ * \par Outputs:
+ * - int: Status:
+ *   - 0: OK
+ *   - <0: Error
+ */
+
+static int old_obfuscate(unsigned char *pktdata, int len, unsigned int usec,
+		oldwork *pw)
+{
+	int stat = 0, bct, psize, dloc, blks, idx1, idx2, i1, i2, i3;
+
+	pw->under = 0;
+	psize = (pktdata[2] << 8) | pktdata[3];
+	if (psize < 640) {
+		if (psize < 40)
+			blks = 2;
+		else if (usec & 2)
+			blks = 2;
+		else
+			blks = 3;
+	} else {
+		blks = usec & 7;
+		if (blks == 0)
+			blks = 4;
+		else if (blks == 1)
+			blks = 6;
+	}
+	if ((blks * 3) > (len - psize))
+		blks = (len - psize) / 3;
+	if (blks <= 0) {
+		stat = -1;
+		goto out;
+	}
+
+	i1 = psize / blks;
+	i2 = psize - 1;
+	if (i1 < 16)
+		dloc = 0x3;
+	else if (i1 < 32)
+		dloc = 0x7;
+	else if (i1 < 64)
+		dloc = 0xf;
+	else
+		dloc = 0x1f;
+	pw->bloc[0] = 0;
+	bct = i1;
+	for (idx1=1; idx1 < blks; idx1++) {
+		pw->bloc[idx1] = bct;
+		bct += i1;
+		if (pktdata[i2] & 2)
+			pw->bloc[idx1] -= pktdata[i2] & dloc;
+		else
+			pw->bloc[idx1] += pktdata[i2] & dloc;
+		i2--;
+	}
+	for (idx1=0; idx1 < (blks - 1); idx1++)
+		pw->blen[idx1] = pw->bloc[idx1 + 1] - pw->bloc[idx1];
+	pw->blen[idx1] = psize - pw->bloc[idx1];
+
+	if (blks < 3)
+		idx2 = 1;
+	else
+		idx2 = blks - 1;
+	bct = 1;
+	idx1 = 0;
+	while (idx1 < len) {
+		if (idx1 > 0) {
+			while (pw->blen[idx2] == 0) {
+				if (++idx2 == blks)
+					idx2 = 0;
+			}
+			if ((unsigned int) (bct <<= 1) > usec)
+				bct = 1;
+			if (!(bct & usec)) {
+				if (++idx2 == blks)
+					idx2 = 0;
+				while (pw->blen[idx2] == 0) {
+					if (++idx2 == blks)
+						idx2 = 0;
+				}
+			}
+		}
+		pw->buf[idx1++] = (unsigned char) idx2;
+		if (idx2 == (blks - 1))
+			i2 = pw->blen[idx2] + (len - (psize + (blks * 3)));
+		else
+			i2 = pw->blen[idx2];
+		pw->buf[idx1++] = (unsigned char) ((i2 & 0xff00) >> 8);
+		pw->buf[idx1++] = (unsigned char) (i2 & 0xff);
+		if (pw->blen[idx2] <= 0) {
+			stat = -1;
+			goto out;
+		}
+		memcpy(&pw->buf[idx1], &pktdata[pw->bloc[idx2]], pw->blen[idx2]);
+		idx1 += pw->blen[idx2];
+		if (idx2 == (blks - 1)) {
+			i2 = (pktdata[0] & 0xf) << 2;
+			if (pktdata[9] == 6) {
+				dloc = (pktdata[(i2 + 9)] & 0xf0) >> 2;
+				dloc += i2;
+				if ((psize - dloc) < 0x30)
+					dloc = 0;
+			} else {
+				dloc = i2;
+				if ((psize - dloc) < 0x30)
+					dloc = 0;
+			}
+			i1 = len - (psize + (blks * 3));
+			i2 = (usec & 0x7) + 7;
+			i3 = (usec & 0x3) + 1;
+			while (i1 > 0) {
+				if (i1 < i3)
+					i3 = i1;
+				if ((pw->bloc[idx2] + i3) > psize)
+					pw->bloc[idx2] = dloc + (pw->bloc[idx2] - psize);
+				if (pw->bloc[idx2] < 0)
+					pw->under = 1;
+				memcpy(&pw->buf[idx1], &pktdata[pw->bloc[idx2]], i3);
+				idx1 += i3;
+				pw->bloc[idx2] += i2 + i3;
+				i1 -= i3;
+			}
+		}
+		pw->blen[idx2] = 0;
+	}
+	memcpy(pktdata, pw->buf, len);
+
+out:
+	return (stat);
+} /* end old_obfuscate */
+
+/**
+ * \par Function:
+ * old_deobfuscate
+ *
+ * \par Description:
+ * The original packet reassembly.
+ *
+ * \par Inputs:
+ * - pktdata: The obfuscated data, replaced by the packet
+ * - len: The size of the obfuscated data
+ * - pw: The work area
+ *
+ * \par Outputs:
+ * - int: The size of the packet
+ */
+
+static int old_deobfuscate(unsigned char *pktdata, int len, oldwork *pw)
+{
+	int idx1 = 0, i1;
+	unsigned int ui1, ui2;
+
+	for (i1=0; i1 < 8; i1++) {
+		ui1 = pktdata[idx1++];
+		ui2 = pktdata[idx1++];
+		ui2 <<= 8;
+		ui2 |= pktdata[idx1++];
+		pw->dloc[ui1 & 7] = &pktdata[idx1];
+		pw->blen[ui1 & 7] = ui2;
+		idx1 += ui2;
+		if (idx1 >= len) {
+			i1++;
+			break;
+		}
+	}
+	if (i1 < 8)
+		pw->dloc[i1] = NULL;
+
+	idx1 = 0;
+	for (i1=0; i1 < 8; i1++) {
+		if (pw->dloc[i1] == NULL)
+			break;
+		memcpy(&pw->buf[idx1], pw->dloc[i1], pw->blen[i1]);
+		idx1 += pw->blen[i1];
+	}
+	memcpy(pktdata, pw->buf, len);
+	return ((pw->buf[2] << 8) | pw->buf[3]);
+} /* end old_deobfuscate */
+
+/**
+ * \par Function:
+ * make_packet
+ *
+ * \par Description:
+ * Fill a random IPv4 packet with a valid header length, total length
+ * and protocol.  TCP packets get a random TCP data offset.
+ *
+ * \par Inputs:
+ * - pkt: The packet buffer
+ * - psize: The packet size
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void make_packet(unsigned char *pkt, int psize)
+{
+	static const unsigned char proto[] = { 6, 6, 17, 1, 50 };
+	int i, ihl;
+
+	for (i=0; i < psize; i++)
+		pkt[i] = rand() & 0xff;
+	ihl = 5 + (rand() % 3);
+	if ((ihl << 2) > psize)
+		ihl = 5;
+	pkt[0] = 0x40 | ihl;
+	pkt[2] = (psize >> 8) & 0xff;
+	pkt[3] = psize & 0xff;
+	pkt[9] = proto[rand() % sizeof(proto)];
+	if (pkt[9] == 6 && ((ihl << 2) + 20) <= psize)
+		pkt[(ihl << 2) + 12] = (5 + (rand() % 11)) << 4;
+} /* end make_packet */
+
+/**
+ * \par Function:
+ * check_packet
+ *
+ * \par Description:
+ * Obfuscate one packet with both implementations, compare the results
+ * and check that each side reassembles the data of the other.
+ *
+ * \par Inputs:
+ * - pkt: The packet
+ * - psize: The packet size
+ * - len: The size of the obfuscated data
+ * - usec: The time value used to vary the layout
+ * - pw: The work area for the original functions
+ *
+ * \par Outputs:
+ * - int: Status:
+ *   - 0: OK
+ *   - <0: Failed
+ */
+
+static int check_packet(const unsigned char *pkt, int psize, int len,
+		unsigned int usec, oldwork *pw)
+{
+	int stat = 0, i, j, hdr, size;
+	p3obf obf, rcv;
+	unsigned char hdr_old[16 + OBF_MAXLEN], *old = &hdr_old[16];
+	unsigned char new[OBF_MAXLEN], out[OBF_MAXLEN], pad[OBF_MAXLEN];
+
+	// The original may read pad data from the P3 header before the packet
+	memset(hdr_old, 0, 16);
+	memcpy(old, pkt, psize);
+	if (old_obfuscate(old, len, usec, pw) < 0) {
+		printf("old_obfuscate failed: size %d len %d usec %x\n",
+			psize, len, usec);
+		stat = -1;
+		goto out;
+	}
+	if (p3obf_plan(&obf, pkt, psize, len, usec) < 0) {
+		printf("p3obf_plan failed: size %d len %d usec %x\n",
+			psize, len, usec);
+		stat = -1;
+		goto out;
+	}
+	if ((size = p3obf_emit(&obf, pkt, new)) != len) {
+		printf("p3obf_emit size %d, expected %d\n", size, len);
+		stat = -1;
+		goto out;
+	}
+
+	// Mark the pad bytes, which follow the data of the last block
+	memset(pad, 0, len);
+	hdr = 0;
+	for (i=0; i < obf.blks; i++) {
+		j = obf.order[i];
+		hdr += p3OBF_BLKHDR + obf.blen[j];
+		if (j == (obf.blks - 1)) {
+			memset(&pad[hdr], 1, obf.pad);
+			hdr += obf.pad;
+		}
+	}
+	for (i=0; i < len; i++) {
+		if (old[i] == new[i] || (pad[i] && (pkt[9] == 6 || pw->under)))
+			continue;
+		printf("Obfuscated data differs at %d (%s): size %d len %d "
+			"usec %x proto %d\n", i, pad[i] ? "pad" : "data",
+			psize, len, usec, pkt[9]);
+		stat = -1;
+		goto out;
+	}
+
+	// The new receiver reads the original obfuscated data
+	if (p3obf_parse(&rcv, old, len) < 0 || rcv.psize != psize ||
+			p3obf_gather(&rcv, old, out) != psize ||
+			memcmp(out, pkt, psize)) {
+		printf("p3obf_parse/gather failed on original data: size %d "
+			"len %d usec %x\n", psize, len, usec);
+		stat = -1;
+		goto out;
+	}
+	// The original receiver reads the new obfuscated data
+	if (old_deobfuscate(new, len, pw) != psize || memcmp(new, pkt, psize)) {
+		printf("old_deobfuscate failed on new data: size %d len %d "
+			"usec %x\n", psize, len, usec);
+		stat = -1;
+		goto out;
+	}
+
+out:
+	return (stat);
+} /* end check_packet */
+
+/**
+ * \par Function:
+ * now_sec
+ *
+ * \par Description:
+ * Get the current time in seconds.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - double: The time
+ */
+
+static double now_sec(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + (tv.tv_usec / 1000000.0));
+} /* end now_sec */
+
+/**
+ * \par Function:
+ * bench
+ *
+ * \par Description:
+ * Measure obfuscation and reassembly throughput for full size packets.
+ *
+ * \par Inputs:
+ * - count: The number of packets
+ * - pw: The work area for the original functions
+ *
+ * \par Outputs:
+ * - None
+ */
+
+static void bench(int count, oldwork *pw)
+{
+	int i, psize = 1400, len = 1440;
+	unsigned int sink = 0;
+	double start, t;
+	p3obf obf;
+	unsigned char pkt[OBF_MAXLEN], work[OBF_MAXLEN], out[OBF_MAXLEN];
+
+	make_packet(pkt, psize);
+
+	start = now_sec();
+	for (i=0; i < count; i++) {
+		memcpy(work, pkt, psize);
+		old_obfuscate(work, len, i, pw);
+		old_deobfuscate(work, len, pw);
+		sink += work[i & 0xff];
+	}
+	t = now_sec() - start;
+	printf("original:  %8.1f MB/s  %6.0f ns/packet\n",
+		(count * (double) psize) / (t * 1e6), (t * 1e9) / count);
+
+	start = now_sec();
+	for (i=0; i < count; i++) {
+		p3obf_plan(&obf, pkt, psize, len, i);
+		p3obf_emit(&obf, pkt, work);
+		p3obf_parse(&obf, work, len);
+		p3obf_gather(&obf, work, out);
+		sink += out[i & 0xff];
+	}
+	t = now_sec() - start;
+	printf("p3kobf:    %8.1f MB/s  %6.0f ns/packet\n",
+		(count * (double) psize) / (t * 1e6), (t * 1e9) / count);
+	if (sink == 0xffffffff)
+		printf("\n");
+} /* end bench */
+
+int main(int argc, char **argv)
+{
+	int stat = 0, i, psize, len, blks, opt_bench = 0, count = 0, fail = 0;
+	unsigned int usec;
+	unsigned char pkt[OBF_MAXLEN];
+	static oldwork pw;
+
+	for (i=1; i < argc; i++) {
+		if (strcmp(argv[i], "-b") == 0)
+			opt_bench = 1;
+		else if (strcmp(argv[i], "-n") == 0 && (i + 1) < argc)
+			count = atoi(argv[++i]);
+	}
+	srand(0x3310);
+
+	if (opt_bench) {
+		bench(count ? count : OBF_BENCH, &pw);
+		goto out;
+	}
+
+	for (i=0; i < (count ? count : OBF_TESTS); i++) {
+		psize = 20 + (rand() % (OBF_MAXPKT - 20));
+		// Room for 2 to 8 block headers and up to 64 pad bytes
+		blks = 2 + (rand() % 7);
+		len = psize + (blks * p3OBF_BLKHDR) + (rand() % 65);
+		usec = rand() % 1000000;
+		make_packet(pkt, psize);
+		if (check_packet(pkt, psize, len, usec, &pw) < 0 && ++fail == 10)
+			break;
+	}
+	printf("p3kobf: %d packets, %d failed\n", i, fail);
+	if (fail)
+		stat = 1;
+
+out:
+	return (stat);
+}
@@ -0,0 +1,315 @@
+/**
+ * \file p3ktest.c
+ * <h3>Protected Point to Point kernel module test support file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * The kernel services used by the cryptography code when it is built in
+ * user space, and the functions shared by the known answer tests.
+ */
+
+/*****  INCLUDE FILES *****/
+
+#include <sys/time.h>
+#if defined(__aarch64__) || defined(__arm__)
+#include <sys/auxv.h>
+#endif
+#if defined(__aarch64__) && !defined(HWCAP_AES)
+#define HWCAP_AES	(1 << 3)
+#endif
+#if defined(__arm__) && !defined(HWCAP2_AES)
+#define HWCAP2_AES	(1 << 0)
+#endif
+
+#include "p3kbase.h"
+
+/*****  CONSTANTS  *****/
+
+/*****  DATA DEFINITIONS  *****/
+
+int p3test_bench = 0;
+int p3test_count = 0;
+int p3test_fail = 0;
+
+/*****  PROTOTYPES  *****/
+
+/*****  EXTERNAL DEFINITIONS  *****/
+
+/**
+ * \par Function:
+ * p3errmsg
+ *
+ * \par Description:
+ * Print a kernel module message.
+ *
+ * \par Inputs:
+ * - type: The message type (p3MSG_*)
+ * - message: The message, ending with a new line
+ *
+ * \par Outputs:
+ * - None
+ */
+
+void p3errmsg(int type, char *message)
+{
+	if (type <= p3MSG_WARN)
+		fprintf(stderr, "%s: %s", P3APP, message);
+} /* end p3errmsg */
+
+/**
+ * \par Function:
+ * boot_cpu_has
+ *
+ * \par Description:
+ * Determine if the CPU has an x86 feature.
+ *
+ * \par Inputs:
+ * - feature: The feature (X86_FEATURE_*)
+ *
+ * \par Outputs:
+ * - int: 1 if the CPU has the feature, else 0
+ */
+
+int boot_cpu_has(int feature)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	switch (feature) {
+	case X86_FEATURE_AES:
+		return (__builtin_cpu_supports("aes"));
+	case X86_FEATURE_PCLMULQDQ:
+		return (__builtin_cpu_supports("pclmul"));
+	case X86_FEATURE_XMM2:
+		return (__builtin_cpu_supports("sse2"));
+	}
+#endif
+	return (0);
+} /* end boot_cpu_has */
+
+/**
+ * \par Function:
+ * p3test_cpu_aes
+ *
+ * \par Description:
+ * Determine if an ARM CPU has the ARMv8 AES instructions.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - int: 1 if the CPU has the instructions, else 0
+ */
+
+int p3test_cpu_aes(void)
+{
+#if defined(__aarch64__)
+	return ((getauxval(AT_HWCAP) & HWCAP_AES) != 0);
+#elif defined(__arm__)
+	return ((getauxval(AT_HWCAP2) & HWCAP2_AES) != 0);
+#else
+	return (0);
+#endif
+} /* end p3test_cpu_aes */
+
+/* The SIMD registers are always usable by a user space process */
+int irq_fpu_usable(void) { return (1); }
+void kernel_fpu_begin(void) { }
+void kernel_fpu_end(void) { }
+int cpu_has_neon(void) { return (1); }
+int may_use_simd(void) { return (1); }
+void kernel_neon_begin(void) { }
+void kernel_neon_end(void) { }
+
+/**
+ * \par Function:
+ * p3test_args
+ *
+ * \par Description:
+ * Handle the common test arguments:
+ * - -b: Measure the throughput instead of running the tests
+ * - -n count: The number of random buffers or benchmark rounds
+ *
+ * \par Inputs:
+ * - argc: The number of arguments
+ * - argv: The arguments
+ * - count: The default number of random buffers
+ *
+ * \par Outputs:
+ * - None, the program exits if an argument is not valid
+ */
+
+void p3test_args(int argc, char **argv, int count)
+{
+	int i;
+
+	p3test_count = count;
+	for (i=1; i < argc; i++) {
+		if (strcmp(argv[i], "-b") == 0) {
+			p3test_bench = 1;
+		} else if (strcmp(argv[i], "-n") == 0 && (i + 1) < argc &&
+				(p3test_count = atoi(argv[++i])) > 0) {
+			continue;
+		} else {
+			fprintf(stderr, "Usage: %s [-b] [-n count]\n", argv[0]);
+			exit(2);
+		}
+	}
+	srand(1);
+} /* end p3test_args */
+
+/**
+ * \par Function:
+ * p3test_hex
+ *
+ * \par Description:
+ * Convert a hex string of a test vector to bytes.
+ *
+ * \par Inputs:
+ * - hex: The hex string
+ * - buf: The buffer to be set
+ * - size: The size of the buffer
+ *
+ * \par Outputs:
+ * - int: The number of bytes set
+ */
+
+int p3test_hex(const char *hex, unsigned char *buf, int size)
+{
+	int i;
+	unsigned int b;
+
+	for (i=0; i < size && hex[0] != '\0' && hex[1] != '\0'; i++, hex += 2) {
+		if (sscanf(hex, "%2x", &b) != 1)
+			break;
+		buf[i] = (unsigned char) b;
+	}
+	return (i);
+} /* end p3test_hex */
+
+/**
+ * \par Function:
+ * p3test_check
+ *
+ * \par Description:
+ * Compare a result with the expected value, and count and report a
+ * difference.
+ *
+ * \par Inputs:
+ * - name: The name of the check
+ * - out: The result
+ * - expect: The expected value
+ * - len: The size of the values
+ *
+ * \par Outputs:
+ * - int: 0 if the values are the same, else -1
+ */
+
+int p3test_check(const char *name, const unsigned char *out,
+		const unsigned char *expect, int len)
+{
+	int i;
+
+	if (memcmp(out, expect, len) == 0)
+		return (0);
+	for (i=0; i < len && out[i] == expect[i]; i++)
+		;
+	printf("FAIL %s: byte %d of %d is %02x, expected %02x\n", name, i, len,
+			out[i], expect[i]);
+	p3test_fail++;
+	return (-1);
+} /* end p3test_check */
+
+/**
+ * \par Function:
+ * p3test_rand
+ *
+ * \par Description:
+ * Fill a buffer with reproducible random bytes.
+ *
+ * \par Inputs:
+ * - buf: The buffer
+ * - len: The size of the buffer
+ *
+ * \par Outputs:
+ * - None
+ */
+
+void p3test_rand(unsigned char *buf, int len)
+{
+	int i;
+
+	for (i=0; i < len; i++)
+		buf[i] = (unsigned char) (rand() >> 7);
+} /* end p3test_rand */
+
+/**
+ * \par Function:
+ * p3test_time
+ *
+ * \par Description:
+ * Get the current time for a benchmark.
+ *
+ * \par Inputs:
+ * - None
+ *
+ * \par Outputs:
+ * - double: The time in seconds
+ */
+
+double p3test_time(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + (tv.tv_usec / 1000000.0));
+} /* end p3test_time */
+
+/**
+ * \par Function:
+ * p3test_rate
+ *
+ * \par Description:
+ * Print the throughput of a benchmark.
+ *
+ * \par Inputs:
+ * - name: The name of the implementation
+ * - size: The size of each buffer
+ * - count: The number of buffers handled
+ * - secs: The time taken in seconds
+ *
+ * \par Outputs:
+ * - None
+ */
+
+void p3test_rate(const char *name, int size, int count, double secs)
+{
+	if (secs <= 0)
+		secs = 1e-6;
+	printf("%-24s %5d bytes: %8.1f MB/s\n", name, size,
+			((double) size * count) / (secs * 1000000.0));
+} /* end p3test_rate */
+
+/**
+ * \par Function:
+ * p3test_done
+ *
+ * \par Description:
+ * Report the result of a test program.
+ *
+ * \par Inputs:
+ * - name: The name of the test program
+ *
+ * \par Outputs:
+ * - int: The program exit status, 0 if all checks passed, else 1
+ */
+
+int p3test_done(const char *name)
+{
+	if (p3test_bench)
+		return (0);
+	if (p3test_fail) {
+		printf("%s: %d checks failed\n", name, p3test_fail);
+		return (1);
+	}
+	printf("%s: all checks passed\n", name);
+	return (0);
+} /* end p3test_done */
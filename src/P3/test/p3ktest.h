@@ -0,0 +1,96 @@
+/**
+ * \file p3ktest.h
+ * <h3>Protected Point to Point kernel module test header file</h3>
+ *
+ * Copyright (C) Velocite 2010
+ *
+ * The kernel module cryptography code is built in user space for the
+ * known answer tests and benchmarks.  p3kbase.h includes this file
+ * instead of the Linux system header when p3TEST is defined, and it
+ * provides the few kernel services used by that code.  The kinc
+ * directory holds empty stand-ins for the kernel headers it includes.
+ *
+ * The AES and SIMD instructions are used if the CPU has them, since the
+ * kernel only needs to save the FPU state around them.
+ */
+
+#ifndef _p3k_TEST_H
+#define _p3k_TEST_H
+
+/*****  INCLUDE FILES *****/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+/*****  CONSTANTS  *****/
+
+#ifndef P3APP
+#define P3APP	"p3test"
+#endif
+
+#define GFP_ATOMIC		0
+#define GFP_KERNEL		0
+
+#define X86_FEATURE_AES			1
+#define X86_FEATURE_PCLMULQDQ	2
+#define X86_FEATURE_XMM2		3
+
+#define p3TEST_MAXBUF	2048	/**< Largest test buffer */
+
+/*****  MACROS  *****/
+
+#define MODULE_PARM_DESC(name, desc)
+#define module_param(name, type, perm)
+
+#define likely(x)		__builtin_expect(!!(x), 1)
+#define unlikely(x)		__builtin_expect(!!(x), 0)
+
+#define kmalloc(size, flags)	malloc(size)
+#define kzalloc(size, flags)	calloc(1, size)
+#define kfree(buffer)			free((void *)(buffer))
+
+/* ARM CPU features, only AES is tested */
+#define cpu_feature(name)		0
+#define cpu_have_feature(num)	p3test_cpu_aes()
+
+/*****  DATA DEFINITIONS  *****/
+
+typedef unsigned char		u8;
+typedef unsigned short		u16;
+typedef unsigned int		u32;
+typedef unsigned long long	u64;
+
+/*****  PROTOTYPES  *****/
+
+extern void p3errmsg(int type, char *message);
+
+/* CPU features and SIMD state (p3ktest.c) */
+extern int boot_cpu_has(int feature);
+extern int irq_fpu_usable(void);
+extern void kernel_fpu_begin(void);
+extern void kernel_fpu_end(void);
+extern int cpu_has_neon(void);
+extern int may_use_simd(void);
+extern void kernel_neon_begin(void);
+extern void kernel_neon_end(void);
+extern int p3test_cpu_aes(void);
+
+/* Test support (p3ktest.c) */
+extern void p3test_args(int argc, char **argv, int count);
+extern int p3test_hex(const char *hex, unsigned char *buf, int size);
+extern int p3test_check(const char *name, const unsigned char *out,
+		const unsigned char *expect, int len);
+extern void p3test_rand(unsigned char *buf, int len);
+extern double p3test_time(void);
+extern void p3test_rate(const char *name, int size, int count, double secs);
+extern int p3test_done(const char *name);
+
+/*****  EXTERNAL DEFINITIONS  *****/
+
+extern int p3test_bench;		/**< Set by -b, measure the throughput */
+extern int p3test_count;		/**< Set by -n, random buffers or benchmark rounds */
+extern int p3test_fail;			/**< Number of failed checks */
+
+#endif /* _p3k_TEST_H */